@@ -524,18 +524,44 @@ typedef struct castle_mstore_key {
 typedef struct castle_mstore {
     c_mstore_id_t              store_id;             /* Id of the store, ptr in fs_sb    */
     size_t                     entry_size;           /* Size of the entries stored       */
-    struct semaphore           mutex;                /* Mutex which protects the         */
-                                                     /*  last_node_* variables           */
-    c_ext_pos_t                last_node_cep;        /* Tail of the list, has at least   */
-                                                     /* one unused entry in it           */
-    int                        last_node_unused;     /* Number of unused entries in the  */
-                                                     /* last node                        */
+    struct semaphore           mutex;                /* Mutex which protects the index   */
+                                                     /*  and page_* variables            */
+    c_ext_pos_t                index_cep;            /* Where the index gets written     */
+    struct castle_mstore_index *index;               /* In-memory index, NULL for stores */
+                                                     /* opened for reading               */
+    c_ext_pos_t                index_tail_cep;       /* Index page runs get added to     */
+    struct castle_mstore_index *index_tail;          /* That page, if not the first one  */
+    int                        run_unused;           /* Unused pages in the last run     */
+    c_ext_pos_t                page_cep;             /* Page being filled                */
+    int                        page_unused;          /* Unused entries in that page      */
+    struct castle_cache_block *page_c2b;             /* Page being filled, if its write  */
+                                                     /* is deferred until it's complete  */
+    void                      *page_old;             /* On-disk copy of that page, NULL  */
+                                                     /* if writes can't be elided        */
 } c_mstore_t;
 
+#define MSTORE_ITER_BATCH          (64)              /* Pages read by the iterator at once */
+struct castle_mstore_iter_batch {
+    struct castle_cache_block *c2bs[MSTORE_ITER_BATCH];  /* Pages of the batch           */
+    int                        nr;                       /* Number of pages              */
+    struct castle_cache_block *io[MSTORE_ITER_BATCH];    /* Pages being read (locked)    */
+    int                        nr_io;                    /* Number of pages being read   */
+};
+
 typedef struct castle_mstore_iter {
     struct castle_mstore      *store;                /* Store we are iterating over      */
     struct castle_cache_block *node_c2b;             /* Currently accessed node (locked) */
     int                        node_idx;             /* Next entry index in current node */
+    /* Indexed stores only. */
+    struct castle_mstore_index *index;               /* Copy of the index                */
+    uint64_t                   entries_left;         /* Entries from the current one on  */
+    uint64_t                   pages_left;           /* Pages not read (ahead) yet       */
+    int                        run;                  /* Run of the next page to read     */
+    int                        run_page;             /* Next page to read in that run    */
+    struct castle_mstore_iter_batch batch[2];        /* Current and read-ahead batch     */
+    int                        cur;                  /* Current batch                    */
+    int                        page;                 /* Current page in current batch    */
+    int                        idx;                  /* Current entry in that page       */
 } c_mstore_iter_t;
 
 enum {
@@ -548,6 +574,7 @@ enum {
     MSTORE_LARGE_OBJECTS,
     MSTORE_DA_MERGE,
     MSTORE_STATS,
+    MSTORE_WARM_CACHE,
 };
 
 
@@ -596,6 +623,23 @@ typedef struct castle_var_length_btree_key {
     /* Dimension header is followed by individual dimensions. */
 } PACKED c_vl_bkey_t;
 
+/**
+ * Normalised btree key. Byte-wise (memcmp) comparable encoding of c_vl_bkey_t, including
+ * infinities and NEXT flags.
+ *
+ * @also castle_object_btree_key_normalise()
+ */
+typedef struct castle_var_length_normalised_key {
+    /* align:   4 */
+    /* offset:  0 */ uint32_t length;   /**< Length of the encoding, excludes length field. */
+    /*          4 */ uint8_t  key[0];
+    /*          4 */
+} PACKED c_vl_nkey_t;
+
+#define NKEY_MAX_LENGTH           (sizeof(uint32_t) + 2 * VLBA_TREE_MAX_KEY_SIZE)
+                                            /**< Bound on c_vl_nkey_t length, for max sized
+                                                 c_vl_bkey_t keys.                          */
+
 /* Below encapsulates the internal btree node structure, different type of
    nodes may be used for different trees */
 struct castle_component_tree;
@@ -656,6 +700,18 @@ struct castle_btree_type {
                               /* Drop all entries between idx_start and
                                  idx_stop. Inclusive                    */
     void     (*node_print)    (struct castle_btree_node *node);
+    void     (*node_finalise) (struct castle_btree_node *node);
+                              /* Optional. Called once a read-only tree
+                                 node is complete, may build search aids
+                                 in the node                            */
+    int      (*lub_bounds)    (struct castle_btree_node *node,
+                               void                     *key,
+                               int                      *low_p,
+                               int                      *high_p);
+                              /* Optional. Narrows LUB search without full
+                                 key compares: keys at <= low are smaller
+                                 than key, keys at >= high greater.
+                                 Returns 0 if node has no search aids   */
 #ifdef CASTLE_DEBUG
     void     (*node_validate) (struct castle_btree_node *node);
 #endif
@@ -696,6 +752,45 @@ struct castle_bbp_entry
     /*         70 */
 } PACKED;
 
+#define CASTLE_FENCE_INDEX_RESTART      (16)    /**< Fences between full (restart) keys.       */
+
+/**
+ * Pinned in-memory index of the leaf nodes of a RO component tree.
+ *
+ * Holds the fence of every leaf node, i.e. the (key, version, cep) entry its parent keeps
+ * for it, in tree order.  Gets search the fences like they would search the internal nodes
+ * just above the leaves, and go straight to the right leaf c2b.
+ *
+ * Fences are varint encoded into buf.  Keys are normalised (c_vl_nkey_t) and prefix
+ * compressed against the previous fence, every CASTLE_FENCE_INDEX_RESTART-th fence
+ * stores its key in full (restarts[] point at those).
+ *
+ * The right-most leaf has no fence: castle_da_max_path_complete() turns its parent entry
+ * into (max_key, 0), which can't be normalised.  It is kept as the tail instead, and
+ * catches every key past the last fence.
+ *
+ * @also castle_btree_fence_index_add()
+ */
+typedef struct castle_fence_index {
+    c_ext_id_t          ext_id;            /**< Extent holding all the leaf nodes.              */
+    uint32_t            nr_fences;
+    uint32_t            used;              /**< Bytes used in buf.                              */
+    uint32_t            size;              /**< Bytes allocated for buf.                        */
+    uint8_t            *buf;
+    uint32_t           *restarts;          /**< Offsets in buf of the restart fences.           */
+    uint32_t            restarts_size;     /**< Bytes allocated for restarts.                   */
+    uint32_t            bytes;             /**< Memory used by buf and restarts.                */
+    uint32_t            max_bytes;         /**< Bound on bytes, adds fail beyond it.            */
+    uint8_t             tail;              /**< Set if the right-most leaf follows the fences.  */
+    c_byte_off_t        tail_offset;       /**< Offset of the right-most leaf, its parent entry
+                                                is (max_key, 0) and gets no fence.              */
+    /* Build state, dropped by castle_btree_fence_index_finish(). */
+    c_vl_nkey_t        *last_nkey;         /**< Key of the last fence added.                    */
+    c_vl_nkey_t        *nkey;              /**< Scratch space for the fence being added.        */
+    c_byte_off_t        last_offset;       /**< Offset of the last leaf added.                  */
+    uint32_t            last_used;         /**< Offset in buf of the last fence added.          */
+} c_fence_index_t;
+
 struct castle_component_tree {
     tree_seq_t          seq;               /**< Unique ID identifying this tree.                */
     atomic_t            ref_count;
@@ -731,6 +826,8 @@ struct castle_component_tree {
     atomic64_t          large_ext_chk_cnt;
     uint8_t             bloom_exists;
     castle_bloom_t      bloom;
+    c_fence_index_t    *fence_index;       /**< Pinned leaf index, NULL if the CT has none.     */
+    uint8_t             fence_index_load;  /**< Rebuild fence index when the DA activates.      */
 #ifdef CASTLE_PERF_DEBUG
     u64                 bt_c2bsync_ns;
     u64                 data_c2bsync_ns;
@@ -749,7 +846,8 @@ struct castle_dlist_entry {
     /* align:   4 */
     /* offset:  0 */ c_da_t      id;
     /*          4 */ c_ver_t     root_version;
-    /*          8 */ uint8_t     _unused[248];
+    /*          8 */ uint64_t    accesses;
+    /*         16 */ uint8_t     _unused[240];
     /*        256 */
 } PACKED;
 
@@ -776,7 +874,8 @@ struct castle_clist_entry {
     /*        268 */ uint8_t         bloom_exists;
     /*        269 */ uint8_t         bloom_num_hashes;
     /*        270 */ uint16_t        node_sizes[MAX_BTREE_DEPTH];
-    /*        290 */ uint8_t         _unused[222];
+    /*        290 */ uint8_t         fence_index;   /**< Rebuild the fence index on load.   */
+    /*        291 */ uint8_t         _unused[221];
     /*        512 */
 } PACKED;
 
@@ -891,6 +990,34 @@ struct castle_mlist_node {
     /*         64 */
 } PACKED;
 
+#define MSTORE_INDEX_MAGIC  0x0001baca
+struct castle_mstore_run {
+    /* align:   8 */
+    /* offset:  0 */ uint64_t    offset;
+    /*          8 */ uint32_t    nr_pages;
+    /*         12 */ uint8_t     _unused[4];
+    /*         16 */
+} PACKED;
+
+/* Index of an mstore, lists the runs of contiguous pages entries are packed into. Stores
+   with more runs than fit in a page chain further index pages through next. nr_entries is
+   only kept in the first page. */
+struct castle_mstore_index {
+    /* align:   8 */
+    /* offset:  0 */ uint32_t    magic;
+    /*          4 */ uint32_t    entry_size;
+    /*          8 */ uint64_t    nr_entries;
+    /*         16 */ c_ext_id_t  ext_id;
+    /*         24 */ uint32_t    nr_runs;
+    /*         28 */ uint8_t     _pad[4];
+    /*         32 */ c_ext_pos_t next;
+    /*         48 */ uint8_t     _unused[16];
+    /*         64 */ struct castle_mstore_run runs[0];
+    /*         64 */
+} PACKED;
+#define MSTORE_INDEX_RUNS   ((C_BLK_SIZE - sizeof(struct castle_mstore_index))             \
+                                / sizeof(struct castle_mstore_run))
+
 struct castle_lolist_entry {
     /* align:   8 */
     /* offset:  0 */ c_ext_id_t  ext_id;
@@ -914,6 +1041,16 @@ struct castle_slist_entry {
     /*        64 */
 } PACKED;
 
+/* Hot cache block, recorded at checkpoint and prefetched on the next mount. */
+struct castle_wlist_entry {
+    /* align:  8 */
+    /* offset: 0 */ c_ext_pos_t cep;
+    /*        16 */ uint32_t    nr_pages;
+    /*        20 */ uint32_t    heat;
+    /*        24 */ uint8_t     _unused[8];
+    /*        32 */
+} PACKED;
+
 /* IO related structures */
 struct castle_bio_vec;
 struct castle_object_replace;
@@ -950,6 +1087,8 @@ struct castle_request_timeline;
 #define CBV_CHILD_WRITE_LOCKED        (4)
 /* Temporary variable used to set the above correctly, at the right point in time */
 #define CBV_C2B_WRITE_LOCKED          (5)
+/* Get missed in the DA row cache, fill it on completion */
+#define CBV_ROW_CACHE_FILL            (6)
 
 typedef struct castle_bio_vec {
     c_bio_t                      *c_bio;        /**< Where this IO originated                   */
@@ -976,8 +1115,11 @@ typedef struct castle_bio_vec {
 #ifdef CASTLE_BLOOM_FP_STATS
     int bloom_positive;
 #endif
+    struct castle_da_bloom_get   *bloom_get;    /**< Parallel bloom probe get state, or NULL    */
+    uint32_t                      row_cache_gen; /**< DA row cache bucket generation at lookup */
 
     struct work_struct               work;      /**< Used to thread this bvec onto a workqueue  */
+    struct timespec                  submit_ts; /**< When the bvec was submitted to the DA      */
     union {
         /* Castle Value Tuple allocation callback for writes */
         int                        (*cvt_get)    (struct castle_bio_vec *,
@@ -1238,6 +1380,8 @@ typedef struct castle_merged_iterator {
             c_ver_t                  v;
             c_val_tup_t              cvt;
         } cached_entry;
+        c_vl_nkey_t                 *cached_nkey;   /**< Normalised cached_entry.k, length 0
+                                                         if not valid. NULL if unused.  */
         struct rb_node               rb_node;
     } *iterators;
     struct rb_root                   rb_root;
@@ -1421,6 +1565,7 @@ void                  castle_fs_superblock_slaves_update
                                                    (struct castle_fs_superblock *fs_sb);
 
 int                   castle_fs_init               (void);
+ssize_t               castle_fs_phases_print       (char *buf);
 
 void                  castle_ext_freespace_init    (c_ext_free_t     *ext_free,
                                                     c_ext_id_t        ext_id);
@@ -1660,6 +1805,7 @@ typedef enum {
 #define DOUBLE_ARRAY_DELETED_BIT            (1)
 #define DOUBLE_ARRAY_NEED_COMPACTION_BIT    (2)
 #define DOUBLE_ARRAY_COMPACTING_BIT         (3)
+#define DOUBLE_ARRAY_INACTIVE_BIT           (4) /* restored, but not yet activated */
 
 /* Merge level flags. */
 #define DA_MERGE_RUNNING_BIT                (0)
@@ -1673,6 +1819,7 @@ struct castle_double_array {
     struct kobject              kobj;
     unsigned long               flags;
     int                         nr_trees;           /**< Total number of CTs in the da          */
+    int                         nr_bloom_trees;     /**< CTs in the da with bloom filters       */
     struct {
         int                     nr_trees;           /**< Number of CTs at level                 */
         int                     nr_compac_trees;    /**< #trees that need to be merged          */
@@ -1796,6 +1943,14 @@ struct castle_double_array {
     int                         top_level;          /**< Levels in the doubling array.          */
     atomic_t                    nr_del_versions;    /**< Versions deleted since last compaction.*/
 
+    /* Lazy activation. */
+    atomic64_t                  accesses;           /**< Requests submitted since DA creation,
+                                                         orders background activation.         */
+    struct work_struct          activate_work;      /**< Activates DA on its first request.    */
+
+    atomic64_t                  fence_index_bytes;  /**< Memory pinned by CT fence indices.     */
+    struct castle_da_row_cache *row_cache;          /**< Point get results, NULL if disabled.   */
+
     /* General purpose structure for placing DA on a workqueue.
      * @TODO Currently used only by castle_da_levle0_modified_promote(), hence
      * there is no locking. */
@@ -198,6 +198,8 @@ static void castle_bloom_complete_btree_node(castle_bloom_t *bf)
 
     BUG_ON(bf_bp->cur_node == NULL);
 
+    if (bf->btree->node_finalise)
+        bf->btree->node_finalise(bf_bp->cur_node);
     dirty_c2b(bf_bp->node_c2b);
     write_unlock_c2b(bf_bp->node_c2b);
     put_c2b(bf_bp->node_c2b);
@@ -553,7 +555,7 @@ static int castle_bloom_get_chunk_id(castle_bloom_t *bf, void *key,
  *         \    /
  *          \  /
  *           \/
- * castle_bloom_index_process
+ * _castle_bloom_submit (castle_bloom_get_chunk_id)
  *   |                   |
  *   | found chunk ID    | not in any chunk
  *   |                   |
@@ -701,6 +703,51 @@ static void castle_bloom_block_process(c_bvec_t *c_bvec)
     castle_btree_submit(c_bvec);
 }
 
+/**
+ * Gets the Bloom filter block for key in the given chunk, scheduling I/O if required.
+ *
+ * @param   end_io      Completion for the block read, called with private in c2b->private
+ * @param   c2b_out     Set to the (referenced) block
+ *
+ * @return  1           Block is up to date, caller should process it directly
+ * @return  0           I/O has been scheduled, end_io will be called on completion
+ */
+static int castle_bloom_block_get(castle_bloom_t *bf, void *key, uint32_t chunk_id,
+                                  void (*end_io)(c2_block_t *c2b), void *private, c2_block_t **c2b_out)
+{
+    c_ext_pos_t chunk_cep;
+    c2_block_t *chunk_c2b;
+
+    chunk_cep.ext_id = bf->ext_id;
+    chunk_cep.offset = bf->chunks_offset + chunk_id * BLOOM_CHUNK_SIZE +
+            castle_bloom_get_block_id(bf, key, BLOCKS_IN_CHUNK(bf, chunk_id)) * BLOOM_BLOCK_SIZE(bf);
+    chunk_c2b = castle_cache_block_get(chunk_cep, bf->block_size_pages);
+
+    *c2b_out = chunk_c2b;
+
+    if (c2b_uptodate(chunk_c2b))
+        return 1;
+
+    write_lock_c2b(chunk_c2b);
+    /* now we have the lock, it might be up to date */
+    if (c2b_uptodate(chunk_c2b))
+    {
+        write_unlock_c2b(chunk_c2b);
+        return 1;
+    }
+    if (bf->num_chunks <= BLOOM_MAX_SOFTPIN_CHUNKS)
+        castle_cache_advise(chunk_c2b->cep, C2_ADV_SOFTPIN, -1, -1, 0);
+    chunk_c2b->end_io = end_io;
+    chunk_c2b->private = private;
+
+    debug("Bloom filter block not in cache, scheduling I/O at offset %llu for bf %p.\n",
+            chunk_c2b->cep.offset, bf);
+
+    BUG_ON(submit_c2b(READ, chunk_c2b));
+
+    return 0;
+}
+
 /**
  * Callback when the block has been retrieved
  */
@@ -732,97 +779,48 @@ static void castle_bloom_end_block_io(c2_block_t *c2b)
  */
 static void castle_bloom_chunk_read(c_bvec_t *c_bvec, uint32_t chunk_id)
 {
-    castle_bloom_t *bf;
-    c_ext_pos_t chunk_cep;
-    c2_block_t *chunk_c2b;
-    void *key = c_bvec->key;
-
-    bf = &c_bvec->tree->bloom;
-    chunk_cep.ext_id = bf->ext_id;
-    chunk_cep.offset = bf->chunks_offset + chunk_id * BLOOM_CHUNK_SIZE +
-            castle_bloom_get_block_id(bf, key, BLOCKS_IN_CHUNK(bf, chunk_id)) * BLOOM_BLOCK_SIZE(bf);
-    chunk_c2b = castle_cache_block_get(chunk_cep, bf->block_size_pages);
-
-    c_bvec->bloom_c2b = chunk_c2b;
-
-    if (!c2b_uptodate(chunk_c2b))
-    {
-        write_lock_c2b(chunk_c2b);
-        /* now we have the lock, it might be up to date */
-        if (c2b_uptodate(chunk_c2b))
-        {
-            write_unlock_c2b(chunk_c2b);
-            castle_bloom_block_process(c_bvec);
-            return;
-        }
-        if (bf->num_chunks <= BLOOM_MAX_SOFTPIN_CHUNKS)
-            castle_cache_advise(chunk_c2b->cep, C2_ADV_SOFTPIN, -1, -1, 0);
-        chunk_c2b->end_io = castle_bloom_end_block_io;
-        chunk_c2b->private = c_bvec;
-
-        debug("Bloom filter block not in cache, scheduling I/O at offset %llu for bf %p.\n",
-                chunk_c2b->cep.offset, bf);
-
-        BUG_ON(submit_c2b(READ, chunk_c2b));
-    } else
+    if (castle_bloom_block_get(&c_bvec->tree->bloom, c_bvec->key, chunk_id,
+                               castle_bloom_end_block_io, c_bvec, &c_bvec->bloom_c2b))
         castle_bloom_block_process(c_bvec);
 }
 
 /**
- * Process the bloom filter index to find the chunk
- */
-static void castle_bloom_index_process(c_bvec_t *c_bvec, c2_block_t **btree_nodes_c2bs)
-{
-    uint32_t chunk_id = 0;
-    castle_bloom_t *bf;
-    void *key = c_bvec->key;
-    int found;
-
-    bf = &c_bvec->tree->bloom;
-
-    found = castle_bloom_get_chunk_id(bf, key, btree_nodes_c2bs, NULL, &chunk_id);
-
-    if (!found)
-        castle_bloom_lookup_next_ct(c_bvec);
-    else
-        castle_bloom_chunk_read(c_bvec, chunk_id);
-}
-
-/**
- * Reads the btree node from cache/disk. Does it synchronously since the index will
- * nearly always be in cache.
+ * Reads the btree nodes of the Bloom filter index from cache/disk and finds the chunk
+ * which may contain key. Does it synchronously since the index will nearly always be
+ * in cache.  Nodes which aren't get read with a single batched I/O.
+ *
+ * @param   chunk_id_out    Is set to the chunk_id if found
+ *
+ * @return  1           Key falls into chunk *chunk_id_out
+ * @return  0           Key is off the end of the index, so trivially not in the filter
+ * @return -ENOMEM      Failed to allocate the index c2b array
  */
-static void castle_bloom_index_read(c_bvec_t *c_bvec)
+static int castle_bloom_index_read(castle_bloom_t *bf, void *key, uint32_t *chunk_id_out)
 {
-    castle_bloom_t *bf;
     c_ext_pos_t btree_nodes_cep;
-    c2_block_t **btree_nodes_c2bs;
+    c2_block_t **btree_nodes_c2bs, **read_c2bs;
     uint32_t i;
-    uint32_t num_btree_nodes;
+    int nr_reads, found;
 
-    bf = &c_bvec->tree->bloom;
     BUG_ON(bf->num_btree_nodes == 0);
 
     btree_nodes_cep.ext_id = bf->ext_id;
     btree_nodes_cep.offset = 0;
 
-    /* We need a local copy of this because at the end we've put the ct
-     * so bf may have been freed.
-     */
-    num_btree_nodes = bf->num_btree_nodes;
-
-    btree_nodes_c2bs = castle_malloc(sizeof(c2_block_t*) * num_btree_nodes, GFP_KERNEL);
+    /* Second half of the array holds the c2bs which need reading. */
+    btree_nodes_c2bs = castle_malloc(2 * sizeof(c2_block_t*) * bf->num_btree_nodes, GFP_KERNEL);
     if (!btree_nodes_c2bs)
     {
         castle_printk(LOG_WARN, "Failed to alloc btree_nodes_c2bs.\n");
-        c_bvec->submit_complete(c_bvec, -ENOMEM, INVAL_VAL_TUP);
-        return;
+        return -ENOMEM;
     }
+    read_c2bs = btree_nodes_c2bs + bf->num_btree_nodes;
+    nr_reads = 0;
 
-    for (i = 0; i < num_btree_nodes; i++)
+    for (i = 0; i < bf->num_btree_nodes; i++)
     {
         btree_nodes_c2bs[i] = castle_cache_block_get(btree_nodes_cep,
-                num_btree_nodes * BLOOM_INDEX_NODE_SIZE_PAGES);
+                BLOOM_INDEX_NODE_SIZE_PAGES);
 
         if (!c2b_uptodate(btree_nodes_c2bs[i]))
         {
@@ -833,25 +831,32 @@ static void castle_bloom_index_read(c_bvec_t *c_bvec)
             if (!c2b_uptodate(btree_nodes_c2bs[i]))
             {
                 castle_cache_advise(btree_nodes_c2bs[i]->cep, C2_ADV_SOFTPIN, -1, -1, 0);
-
-                castle_printk(LOG_INFO, "Bloom filter partition index not in cache, scheduling I/O "
-                        "at offset %llu for bf %p.\n", btree_nodes_c2bs[i]->cep.offset, bf);
-
-                BUG_ON(submit_c2b_sync(READ, btree_nodes_c2bs[i]));
+                read_c2bs[nr_reads++] = btree_nodes_c2bs[i];
             }
-            write_unlock_c2b(btree_nodes_c2bs[i]);
+            else
+                write_unlock_c2b(btree_nodes_c2bs[i]);
         }
         btree_nodes_cep.offset += BLOOM_INDEX_NODE_SIZE;
     }
 
-    castle_bloom_index_process(c_bvec, btree_nodes_c2bs);
+    if (nr_reads)
+    {
+        castle_printk(LOG_INFO, "Bloom filter partition index not in cache, scheduling I/O "
+                "for %d/%u nodes for bf %p.\n", nr_reads, bf->num_btree_nodes, bf);
 
-    /* now the ct may have been put so accessing bf is unsafe */
+        BUG_ON(submit_c2bs_sync(READ, read_c2bs, nr_reads));
+        while (nr_reads > 0)
+            write_unlock_c2b(read_c2bs[--nr_reads]);
+    }
+
+    found = castle_bloom_get_chunk_id(bf, key, btree_nodes_c2bs, NULL, chunk_id_out);
 
-    for (i = 0; i < num_btree_nodes; i++)
+    for (i = 0; i < bf->num_btree_nodes; i++)
         put_c2b(btree_nodes_c2bs[i]);
 
     castle_free(btree_nodes_c2bs);
+
+    return found;
 }
 
 /**
@@ -859,7 +864,17 @@ static void castle_bloom_index_read(c_bvec_t *c_bvec)
  */
 static void _castle_bloom_submit(void *data)
 {
-    castle_bloom_index_read(data);
+    c_bvec_t *c_bvec = data;
+    uint32_t chunk_id = 0;
+    int ret;
+
+    ret = castle_bloom_index_read(&c_bvec->tree->bloom, c_bvec->key, &chunk_id);
+    if (ret < 0)
+        c_bvec->submit_complete(c_bvec, ret, INVAL_VAL_TUP);
+    else if (ret == 0)
+        castle_bloom_lookup_next_ct(c_bvec);
+    else
+        castle_bloom_chunk_read(c_bvec, chunk_id);
 }
 
 /**
@@ -879,6 +894,115 @@ void castle_bloom_submit(c_bvec_t *c_bvec)
     }
 }
 
+/**** Standalone probes ****/
+
+/**
+ * Call graph.
+ *
+ * Unlike castle_bloom_submit() a probe only answers whether the key may be in probe->ct,
+ * it never goes on to the btree or to the next CT.  Many probes may be in flight for
+ * the same key, which lets the DA probe all CTs of a get in parallel.
+ *
+ * castle_bloom_probe
+ *   |
+ *   | schedule on workqueue a
+ *   v
+ * _castle_bloom_probe -> castle_bloom_index_read
+ *   |            |                         |
+ *   | in cache   | not in cache            | not in any chunk / error
+ *   |            v                         v
+ *   |          castle_bloom_probe_end_io  probe->end
+ *   |            |
+ *   |            | schedule on workqueue b
+ *   |            v
+ *   |          _castle_bloom_probe_end_io
+ *    \          /
+ *     \        /
+ *      \      /
+ *       \    /
+ *        \  /
+ *         \/
+ * castle_bloom_probe_process -> probe->end
+ */
+
+/**
+ * Performs the bloom lookup on the probe's block and reports the result.
+ */
+static void castle_bloom_probe_process(c_bloom_probe_t *probe)
+{
+    struct castle_component_tree *ct = probe->ct;
+    c2_block_t *c2b = probe->c2b;
+    int found;
+
+    probe->c2b = NULL;
+    BUG_ON(!c2b_uptodate(c2b));
+    found = castle_bloom_lookup(&ct->bloom, c2b, castle_btree_type_get(ct->btree_type), probe->key);
+    put_c2b(c2b);
+
+    probe->end(probe, found);
+}
+
+static void _castle_bloom_probe_end_io(void *data)
+{
+    c_bloom_probe_t *probe = data;
+
+    write_unlock_c2b(probe->c2b);
+    castle_bloom_probe_process(probe);
+}
+
+/**
+ * Callback from doing I/O to get the probe's block. Could be in the interrupt context.
+ */
+static void castle_bloom_probe_end_io(c2_block_t *c2b)
+{
+    c_bloom_probe_t *probe = c2b->private;
+
+    INIT_WORK(&probe->work, _castle_bloom_probe_end_io, probe);
+    queue_work(castle_da_wqs[0], &probe->work);
+}
+
+static void _castle_bloom_probe(void *data)
+{
+    c_bloom_probe_t *probe = data;
+    castle_bloom_t *bf = &probe->ct->bloom;
+    uint32_t chunk_id = 0;
+    int ret;
+
+    ret = castle_bloom_index_read(bf, probe->key, &chunk_id);
+    if (ret <= 0)
+    {
+        /* On error report a positive, the btree walk will give the definite answer. */
+        probe->end(probe, ret < 0);
+        return;
+    }
+
+    if (castle_bloom_block_get(bf, probe->key, chunk_id,
+                               castle_bloom_probe_end_io, probe, &probe->c2b))
+        castle_bloom_probe_process(probe);
+}
+
+/**
+ * Asynchronously checks whether probe->key may be present in probe->ct.
+ *
+ * probe->end() is called exactly once, with positive set unless the Bloom filter
+ * rules the key out.  CTs without a Bloom filter (e.g. T0s) are always positive.
+ * The caller must hold a reference on probe->ct until probe->end() is called.
+ *
+ * @param   probe       Initialised ct, key, cpu, end and private fields
+ */
+void castle_bloom_probe(c_bloom_probe_t *probe)
+{
+    probe->c2b = NULL;
+    if (!castle_bloom_use || !probe->ct->bloom_exists)
+    {
+        probe->end(probe, 1);
+        return;
+    }
+
+    INIT_WORK(&probe->work, _castle_bloom_probe, probe);
+    queue_work_on(probe->cpu, castle_wqs[19], &probe->work);
+}
+
 /**** Marshalling ****/
 
 void castle_bloom_marshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
@@ -895,8 +1019,7 @@ void castle_bloom_marshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
 /**
  * Read an existing bloom filter from disk.
  *
- * - Prefetch bloom filter extent where the total number of chunks satisfies our
- *   cache requirements
+ * @also castle_bloom_prefetch()
  */
 void castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
 {
@@ -916,7 +1039,20 @@ void castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
 
     bf->private = NULL;
 
-    /* Pre-warm cache for bloom filters. */
+#ifdef CASTLE_BLOOM_FP_STATS
+    atomic64_set(&bf->queries, 0);
+    atomic64_set(&bf->false_positives, 0);
+#endif
+}
+
+/**
+ * Pre-warm cache for an unmarshalled bloom filter.
+ *
+ * - Prefetch bloom filter extent where the total number of chunks satisfies our
+ *   cache requirements
+ */
+void castle_bloom_prefetch(castle_bloom_t *bf)
+{
     if (bf->num_chunks <= BLOOM_MAX_SOFTPIN_CHUNKS)
     {
         /* A bf chunk is not the same as a c2b chunk.
@@ -926,11 +1062,6 @@ void castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm)
         castle_cache_advise((c_ext_pos_t){bf->ext_id, 0},
                 C2_ADV_EXTENT|C2_ADV_PREFETCH|C2_ADV_SOFTPIN, chunks, -1, 0);
     }
-
-#ifdef CASTLE_BLOOM_FP_STATS
-    atomic64_set(&bf->queries, 0);
-    atomic64_set(&bf->false_positives, 0);
-#endif
 }
 
 /* Marshalling/unmarshalling of bloom_build_params handled seperately because they are only needed
@@ -24,14 +24,32 @@ struct castle_bloom_build_params
 #endif
 };
 
+/**** Standalone probes ****/
+
+/**
+ * State for one asynchronous Bloom filter probe, see castle_bloom_probe().
+ */
+typedef struct castle_bloom_probe
+{
+    struct castle_component_tree   *ct;       /**< CT to probe, ref held by the caller.    */
+    void                           *key;      /**< Key to look for.                        */
+    int                             cpu;      /**< CPU to schedule the probe on.           */
+    c2_block_t                     *c2b;      /**< Bloom filter block being read.          */
+    struct work_struct              work;
+    void                          (*end)(struct castle_bloom_probe *probe, int positive);
+    void                           *private;  /**< Caller's private data.                  */
+} c_bloom_probe_t;
+
 int castle_bloom_create(castle_bloom_t *bf, c_da_t da_id, uint64_t num_elements);
 void castle_bloom_complete(castle_bloom_t *bf);
 void castle_bloom_abort(castle_bloom_t *bf);
 void castle_bloom_destroy(castle_bloom_t *bf);
 void castle_bloom_add(castle_bloom_t *bf, struct castle_btree_type *btree, void *key);
 void castle_bloom_submit(c_bvec_t *c_bvec);
+void castle_bloom_probe(c_bloom_probe_t *probe);
 void castle_bloom_marshall(castle_bloom_t *bf, struct castle_clist_entry *ctm);
 void castle_bloom_unmarshall(castle_bloom_t *bf, struct castle_clist_entry *ctm);
+void castle_bloom_prefetch(castle_bloom_t *bf);
 void castle_bloom_build_param_marshall(struct castle_bbp_entry *bbpm,
                                        struct castle_bloom_build_params *bbp);
 void castle_bloom_build_param_unmarshall(castle_bloom_t *bf,
@@ -708,11 +708,26 @@ struct castle_vlba_tree_node {
     /* align:   4 */
     /* offset:  0 */ uint32_t    dead_bytes;
     /*          4 */ uint32_t    free_bytes;
-    /*          8 */ uint8_t     _unused[56];
+    /*          8 */ uint32_t    prefix_magic;  /**< VLBA_NODE_PREFIX_MAGIC if prefixes valid.  */
+    /*         12 */ uint32_t    prefix_nr;     /**< node->used when prefixes were built.      */
+    /*         16 */ uint32_t    prefix_ref;    /**< Entry whose key is the prefix reference.  */
+    /*         20 */ uint32_t    prefix_skip;   /**< Leading dim 0 bytes shared by all keys.   */
+    /*         24 */ uint8_t     _unused[40];
     /*         64 */ uint32_t    key_idx[0];
     /*         64 */
 } PACKED;
 
+/* Key prefixes of RO nodes are stored in the free space, just past the index table. */
+#define VLBA_NODE_PREFIX_MAGIC              (0x70726678)
+#define VLBA_NODE_PREFIXES_LENGTH(_nr)      ((_nr) * sizeof(uint64_t) + sizeof(uint32_t))
+#define VLBA_NODE_PREFIXES(_vlba_node, _nr)                                 \
+                ((uint64_t *)ALIGN((unsigned long)&(_vlba_node)->key_idx[_nr], sizeof(uint64_t)))
+
+static int castle_btree_node_prefixes = 1;
+module_param(castle_btree_node_prefixes, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_btree_node_prefixes, "Store key prefixes in read-only btree nodes "
+                                             "to narrow searches");
+
 #define VLBA_TREE_NODE_SIZE(_node)          ((_node)->size)
 #define VLBA_TREE_NODE_LENGTH(_node)        ({int _ns = VLBA_TREE_NODE_SIZE(_node);       \
                                               BUG_ON(_ns == 0 || _ns > 256);              \
@@ -931,6 +946,28 @@ static int castle_vlba_tree_need_split(struct castle_btree_node *node,
     return -1;
 }
 
+/**
+ * Need split for RO tree nodes, also reserves space for the key prefixes built by
+ * castle_vlba_tree_node_finalise() once the node is complete.
+ */
+static int castle_vlba_ro_tree_need_split(struct castle_btree_node *node,
+                                          int ver_or_key_split)
+{
+    struct castle_vlba_tree_node *vlba_node =
+                (struct castle_vlba_tree_node *) BTREE_NODE_PAYLOAD(node);
+    uint32_t reserve;
+
+    if ((ver_or_key_split == 0) && castle_btree_node_prefixes && (node->used > 0))
+    {
+        reserve = (node->is_leaf ? 1 : 2) * MAX_VLBA_ENTRY_LENGTH;
+        if (vlba_node->free_bytes + vlba_node->dead_bytes <
+                reserve + VLBA_NODE_PREFIXES_LENGTH(node->used + 1))
+            return 1;
+    }
+
+    return castle_vlba_tree_need_split(node, ver_or_key_split);
+}
+
 static int castle_vlba_tree_key_compare(void *keyv1, void *keyv2)
 {
     vlba_key_t *key1 = (vlba_key_t *)keyv1;
@@ -1081,6 +1118,8 @@ static void castle_vlba_tree_entry_add(struct castle_btree_node *node,
     new_entry.val_len    = cvt.length;
     new_entry.key.length = key_length;
     req_space = VLBA_ENTRY_LENGTH((&new_entry)) + sizeof(uint32_t);
+    /* Key prefixes live in the free space. */
+    vlba_node->prefix_magic = 0;
 
     /* Initialization of node free space structures */
     if (node->used == 0)
@@ -1142,6 +1181,7 @@ static void castle_vlba_tree_entries_drop(struct castle_btree_node *node,
     BUG_ON(idx_start < 0 || idx_start > node->used);
     BUG_ON(idx_end   < 0 || idx_end   > node->used);
     BUG_ON(idx_start > idx_end);
+    vlba_node->prefix_magic = 0;
 
     /* Calculate space taken by the entries getting dropped */
     for(i=idx_start; i <= idx_end; i++)
@@ -1179,6 +1219,7 @@ static void castle_vlba_tree_entry_replace(struct castle_btree_node *node,
     BUG_ON(node->is_leaf && CVT_NODE(cvt));
 #endif
     BUG_ON(((uint8_t *)entry) >= EOF_VLBA_NODE(node));
+    vlba_node->prefix_magic = 0;
 
     new_entry.version    = version;
     new_entry.type       = cvt.type;
@@ -1220,6 +1261,152 @@ static void castle_vlba_tree_entry_disable(struct castle_btree_node *node,
     entry->type |= VLBA_TREE_ENTRY_DISABLED;
 }
 
+static inline vlba_key_t *castle_vlba_tree_node_key(struct castle_btree_node *node,
+                                                    struct castle_vlba_tree_node *vlba_node,
+                                                    int idx)
+{
+    return &((struct castle_vlba_tree_entry *)VLBA_ENTRY_PTR(node, vlba_node, idx))->key;
+}
+
+static inline int castle_vlba_tree_key_special(vlba_key_t *key)
+{
+    return VLBA_TREE_KEY_MIN(key) || VLBA_TREE_KEY_MAX(key) || VLBA_TREE_KEY_INVAL(key);
+}
+
+/**
+ * Order-preserving prefix of a key, relative to the keys of a node.
+ *
+ * @also castle_object_btree_key_prefix()
+ */
+static uint64_t castle_vlba_tree_key_prefix(vlba_key_t *key, vlba_key_t *ref, uint32_t skip)
+{
+    BUG_ON(VLBA_TREE_KEY_INVAL(key));
+    if (VLBA_TREE_KEY_MIN(key))
+        return 0;
+    if (VLBA_TREE_KEY_MAX(key))
+        return ~0ULL;
+
+    return castle_object_btree_key_prefix((c_vl_bkey_t *)key, (c_vl_bkey_t *)ref, skip);
+}
+
+/**
+ * Builds the key prefix array of a complete RO tree node.
+ *
+ * Prefixes are 64-bit integers, non-decreasing across the node, stored in the free
+ * space following the index table.  The first dimension bytes shared by all keys in the
+ * node are skipped, so that the prefixes discriminate between keys as much as possible.
+ * Nothing is built if the node lacks the space (castle_vlba_ro_tree_need_split() reserves
+ * it for nodes filled by merges).
+ */
+static void __castle_vlba_tree_node_finalise(struct castle_btree_node *node)
+{
+    struct castle_vlba_tree_node *vlba_node =
+                (struct castle_vlba_tree_node *) BTREE_NODE_PAYLOAD(node);
+    vlba_key_t *first, *last;
+    uint64_t *prefixes;
+    uint32_t skip;
+    int i, ref_idx, last_idx;
+
+    vlba_node->prefix_magic = 0;
+    if (node->used == 0)
+        return;
+
+    prefixes = VLBA_NODE_PREFIXES(vlba_node, node->used);
+    if ((uint8_t *)(prefixes + node->used) >
+            (uint8_t *)&vlba_node->key_idx[node->used] + vlba_node->free_bytes)
+        return;
+
+    /* Min/max keys don't take part in working out the common first dimension bytes. */
+    for (ref_idx = 0; ref_idx < node->used; ref_idx++)
+        if (!castle_vlba_tree_key_special(castle_vlba_tree_node_key(node, vlba_node, ref_idx)))
+            break;
+    if (ref_idx == node->used)
+        return;
+    for (last_idx = node->used - 1; last_idx > ref_idx; last_idx--)
+        if (!castle_vlba_tree_key_special(castle_vlba_tree_node_key(node, vlba_node, last_idx)))
+            break;
+
+    /* Keys are sorted, so bytes shared by the first and last key are shared by all. */
+    first = castle_vlba_tree_node_key(node, vlba_node, ref_idx);
+    last  = castle_vlba_tree_node_key(node, vlba_node, last_idx);
+    skip  = 0;
+    if (((c_vl_bkey_t *)first)->nr_dims == ((c_vl_bkey_t *)last)->nr_dims)
+        skip = castle_object_btree_key_dim0_common((c_vl_bkey_t *)first, (c_vl_bkey_t *)last);
+
+    for (i = 0; i < node->used; i++)
+        prefixes[i] = castle_vlba_tree_key_prefix(castle_vlba_tree_node_key(node, vlba_node, i),
+                                                  first,
+                                                  skip);
+
+    vlba_node->prefix_nr    = node->used;
+    vlba_node->prefix_ref   = ref_idx;
+    vlba_node->prefix_skip  = skip;
+    vlba_node->prefix_magic = VLBA_NODE_PREFIX_MAGIC;
+}
+
+static void castle_vlba_tree_node_finalise(struct castle_btree_node *node)
+{
+    if (castle_btree_node_prefixes)
+        __castle_vlba_tree_node_finalise(node);
+}
+
+/**
+ * Narrows LUB search to entries whose key prefix equals the prefix of key.
+ *
+ * Both bounds are found by binary searches over the prefix array, which touch only a
+ * few cachelines and use integer compares instead of key_compare().
+ *
+ * @return 1 if bounds were narrowed, 0 if the node has no (valid) prefixes
+ */
+static int castle_vlba_tree_lub_bounds(struct castle_btree_node *node,
+                                       void                     *key,
+                                       int                      *low_p,
+                                       int                      *high_p)
+{
+    struct castle_vlba_tree_node *vlba_node =
+                (struct castle_vlba_tree_node *) BTREE_NODE_PAYLOAD(node);
+    uint64_t *prefixes, prefix;
+    int low, high, mid;
+
+    if ((vlba_node->prefix_magic != VLBA_NODE_PREFIX_MAGIC) ||
+        (vlba_node->prefix_nr != node->used))
+        return 0;
+
+    prefixes = VLBA_NODE_PREFIXES(vlba_node, node->used);
+    prefix   = castle_vlba_tree_key_prefix(key,
+                                           castle_vlba_tree_node_key(node,
+                                                                     vlba_node,
+                                                                     vlba_node->prefix_ref),
+                                           vlba_node->prefix_skip);
+
+    /* Last entry with a smaller prefix. */
+    low  = -1;
+    high = node->used;
+    while (low != high - 1)
+    {
+        mid = (low + high) / 2;
+        if (prefixes[mid] < prefix)
+            low = mid;
+        else
+            high = mid;
+    }
+    *low_p = low;
+
+    /* First entry with a greater prefix. */
+    high = node->used;
+    while (low != high - 1)
+    {
+        mid = (low + high) / 2;
+        if (prefixes[mid] <= prefix)
+            low = mid;
+        else
+            high = mid;
+    }
+    *high_p = high;
+
+    return 1;
+}
+
 
 #ifdef CASTLE_DEBUG
 static void castle_vlba_tree_node_validate(struct castle_btree_node *node)
@@ -1417,7 +1604,7 @@ struct castle_btree_type castle_ro_tree = {
     .max_key        = (void *)&VLBA_TREE_MAX_KEY,
     .inv_key        = (void *)&VLBA_TREE_INVAL_KEY,
     .node_size      = castle_vlba_ro_tree_node_size,
-    .need_split     = castle_vlba_tree_need_split,
+    .need_split     = castle_vlba_ro_tree_need_split,
     .key_compare    = castle_vlba_tree_key_compare,
     .key_duplicate  = castle_vlba_tree_key_duplicate,
     .key_next       = castle_vlba_tree_key_next,
@@ -1429,6 +1616,8 @@ struct castle_btree_type castle_ro_tree = {
     .entry_disable  = castle_vlba_tree_entry_disable,
     .entries_drop   = castle_vlba_tree_entries_drop,
     .node_print     = castle_vlba_tree_node_print,
+    .node_finalise  = castle_vlba_tree_node_finalise,
+    .lub_bounds     = castle_vlba_tree_lub_bounds,
 #ifdef CASTLE_DEBUG
     .node_validate  = castle_vlba_tree_node_validate,
 #endif
@@ -1457,6 +1646,479 @@ struct castle_btree_type *castle_btree_type_get(btree_t type)
     return castle_btrees[type];
 }
 
+/**********************************************************************************************/
+/* Fence index */
+
+#define CASTLE_FENCE_INDEX_SEARCH_KEY_MAX   (256)   /**< Longer normalised keys walk the tree. */
+#define CASTLE_FENCE_INDEX_VARINT_MAX_LENGTH (10)   /**< 64 bits in 7 bit groups.              */
+
+static inline uint8_t *castle_fence_index_varint_put(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+
+    return p;
+}
+
+static inline uint8_t *castle_fence_index_varint_get(uint8_t *p, uint64_t *v_p)
+{
+    uint64_t v = 0;
+    int shift = 0;
+
+    do {
+        BUG_ON(shift >= 7 * CASTLE_FENCE_INDEX_VARINT_MAX_LENGTH);
+        v |= ((uint64_t)(*p & 0x7f)) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    *v_p = v;
+
+    return p;
+}
+
+/**
+ * Allocates an empty fence index, ready to have fences added to it.
+ *
+ * @param ext_id    Extent holding the leaf nodes of the CT
+ * @param max_bytes Bound on memory the index may grow to
+ */
+c_fence_index_t* castle_btree_fence_index_alloc(c_ext_id_t ext_id, uint32_t max_bytes)
+{
+    c_fence_index_t *fi;
+
+    fi = castle_zalloc(sizeof(c_fence_index_t), GFP_KERNEL);
+    if (!fi)
+        return NULL;
+    fi->ext_id    = ext_id;
+    fi->max_bytes = max_bytes;
+    fi->last_nkey = castle_malloc(sizeof(c_vl_nkey_t) + NKEY_MAX_LENGTH, GFP_KERNEL);
+    fi->nkey      = castle_malloc(sizeof(c_vl_nkey_t) + NKEY_MAX_LENGTH, GFP_KERNEL);
+    if (!fi->last_nkey || !fi->nkey)
+    {
+        castle_btree_fence_index_free(fi);
+        return NULL;
+    }
+
+    return fi;
+}
+
+/**
+ * Drops the build state, index must not be added to afterwards.
+ */
+void castle_btree_fence_index_finish(c_fence_index_t *fi)
+{
+    castle_free(fi->last_nkey);
+    fi->last_nkey = NULL;
+    castle_free(fi->nkey);
+    fi->nkey = NULL;
+}
+
+void castle_btree_fence_index_free(c_fence_index_t *fi)
+{
+    castle_btree_fence_index_finish(fi);
+    if (fi->buf)
+        castle_vfree(fi->buf);
+    if (fi->restarts)
+        castle_vfree(fi->restarts);
+    castle_free(fi);
+}
+
+/**
+ * Grows a vmalloced buffer to at least min_size bytes (doubling it).
+ *
+ * @return 0 on success, -ENOSPC if the index would grow beyond max_bytes, -ENOMEM
+ */
+static int castle_btree_fence_index_grow(c_fence_index_t *fi,
+                                         void **buf_p,
+                                         uint32_t *size_p,
+                                         uint32_t min_size)
+{
+    uint32_t size;
+    void *buf;
+
+    size = max_t(uint32_t, PAGE_SIZE, 2 * (*size_p));
+    while (size < min_size)
+        size *= 2;
+    if ((uint64_t)fi->bytes - *size_p + size > fi->max_bytes)
+        return -ENOSPC;
+    buf = castle_vmalloc(size);
+    if (!buf)
+        return -ENOMEM;
+    if (*buf_p)
+    {
+        memcpy(buf, *buf_p, *size_p);
+        castle_vfree(*buf_p);
+    }
+    fi->bytes += size - *size_p;
+    *buf_p  = buf;
+    *size_p = size;
+
+    return 0;
+}
+
+/**
+ * Appends the fence of the next leaf node.
+ *
+ * Fence encoding: varint shared key prefix length, varint key suffix length, key suffix,
+ * varint version, varint leaf offset (in blocks, relative to the previous leaf unless this
+ * is a restart fence).
+ *
+ * @param key       Btree key the parent keeps for the leaf (its last key)
+ * @param version   Version the parent keeps for the leaf
+ * @param cep       Leaf node position
+ *
+ * @return 0 on success, negative if the fence couldn't be added (the index is then unusable)
+ */
+int castle_btree_fence_index_add(c_fence_index_t *fi,
+                                 void *key,
+                                 c_ver_t version,
+                                 c_ext_pos_t cep)
+{
+    int restart = ((fi->nr_fences % CASTLE_FENCE_INDEX_RESTART) == 0);
+    uint32_t shared, restart_idx;
+    uint64_t blocks;
+    c_vl_nkey_t *tmp;
+    uint8_t *p;
+    int ret;
+
+    BUG_ON(!fi->nkey);
+    if (fi->tail || (cep.ext_id != fi->ext_id) ||
+            (!restart && (cep.offset <= fi->last_offset)))
+        return -EINVAL;
+    ret = castle_object_btree_key_normalise_buf(key, fi->nkey, NKEY_MAX_LENGTH);
+    if (ret)
+        return ret;
+
+    shared = 0;
+    if (!restart)
+        while ((shared < fi->nkey->length) && (shared < fi->last_nkey->length) &&
+               (fi->nkey->key[shared] == fi->last_nkey->key[shared]))
+            shared++;
+    blocks = BLOCK(cep.offset) - (restart ? 0 : BLOCK(fi->last_offset));
+
+    /* Make room for the fence, and the restart offset. */
+    if (fi->used + 4 * CASTLE_FENCE_INDEX_VARINT_MAX_LENGTH + fi->nkey->length - shared > fi->size)
+    {
+        ret = castle_btree_fence_index_grow(fi, (void **)&fi->buf, &fi->size,
+                    fi->used + 4 * CASTLE_FENCE_INDEX_VARINT_MAX_LENGTH + fi->nkey->length - shared);
+        if (ret)
+            return ret;
+    }
+    restart_idx = fi->nr_fences / CASTLE_FENCE_INDEX_RESTART;
+    if (restart && ((restart_idx + 1) * sizeof(uint32_t) > fi->restarts_size))
+    {
+        ret = castle_btree_fence_index_grow(fi, (void **)&fi->restarts, &fi->restarts_size,
+                                            (restart_idx + 1) * sizeof(uint32_t));
+        if (ret)
+            return ret;
+    }
+    if (restart)
+        fi->restarts[restart_idx] = fi->used;
+
+    fi->last_used = fi->used;
+    p = fi->buf + fi->used;
+    p = castle_fence_index_varint_put(p, shared);
+    p = castle_fence_index_varint_put(p, fi->nkey->length - shared);
+    memcpy(p, fi->nkey->key + shared, fi->nkey->length - shared);
+    p += fi->nkey->length - shared;
+    p = castle_fence_index_varint_put(p, version);
+    p = castle_fence_index_varint_put(p, blocks);
+    fi->used = p - fi->buf;
+
+    /* The fence just added is the base for the next one. */
+    tmp           = fi->last_nkey;
+    fi->last_nkey = fi->nkey;
+    fi->nkey      = tmp;
+    fi->last_offset = cep.offset;
+    fi->nr_fences++;
+
+    return 0;
+}
+
+/**
+ * Sets the right-most leaf, whose parent entry is (max_key, 0).  Must come after all the
+ * fences.
+ *
+ * @return 0 on success, -EINVAL if the leaf is out of order
+ */
+int castle_btree_fence_index_tail_set(c_fence_index_t *fi, c_ext_pos_t cep)
+{
+    if (fi->tail || (cep.ext_id != fi->ext_id) ||
+            ((fi->nr_fences > 0) && (cep.offset <= fi->last_offset)))
+        return -EINVAL;
+    fi->tail        = 1;
+    fi->tail_offset = cep.offset;
+
+    return 0;
+}
+
+/**
+ * Turns the last fence added into the tail, the same way castle_da_max_path_complete()
+ * replaces the parent entry of the right-most leaf with (max_key, 0).
+ *
+ * The index then matches the one castle_btree_fence_index_build() makes from the tree.
+ */
+void castle_btree_fence_index_maxify(c_fence_index_t *fi)
+{
+    BUG_ON(fi->tail || (fi->nr_fences == 0));
+    fi->used = fi->last_used;
+    fi->nr_fences--;
+    fi->tail        = 1;
+    fi->tail_offset = fi->last_offset;
+}
+
+/**
+ * Checks whether two fence indices describe the same leaves.
+ */
+int castle_btree_fence_index_equal(c_fence_index_t *fi1, c_fence_index_t *fi2)
+{
+    uint32_t nr_restarts;
+
+    nr_restarts = (fi1->nr_fences + CASTLE_FENCE_INDEX_RESTART - 1) / CASTLE_FENCE_INDEX_RESTART;
+
+    return (fi1->ext_id == fi2->ext_id) &&
+           (fi1->nr_fences == fi2->nr_fences) &&
+           (fi1->used == fi2->used) &&
+           (fi1->tail == fi2->tail) &&
+           (!fi1->tail || (fi1->tail_offset == fi2->tail_offset)) &&
+           (memcmp(fi1->buf, fi2->buf, fi1->used) == 0) &&
+           (memcmp(fi1->restarts, fi2->restarts, nr_restarts * sizeof(uint32_t)) == 0);
+}
+
+/**
+ * Compares a (prefix compressed) fence key with the searched key.
+ *
+ * The fence key is the first shared bytes of the previous fence key, followed by suffix.
+ * match_p holds the length of the common prefix of the previous fence key and the searched
+ * key on entry, and gets updated for the new fence.
+ *
+ * @param cmp   Result of the comparison with the previous fence key
+ *
+ * @return Negative if the fence key is smaller than the searched key, zero if equal,
+ *         positive otherwise
+ */
+static inline int castle_btree_fence_key_compare(c_vl_nkey_t *nkey,
+                                                 uint32_t *match_p,
+                                                 int cmp,
+                                                 uint32_t shared,
+                                                 uint8_t *suffix,
+                                                 uint32_t suffix_len)
+{
+    uint32_t m, i;
+
+    /* Fence shares the byte that decided the previous comparison. */
+    if (shared > *match_p)
+        return cmp;
+
+    m = shared;
+    for (i = 0; (i < suffix_len) && (m + i < nkey->length); i++)
+        if (suffix[i] != nkey->key[m + i])
+            break;
+    *match_p = m + i;
+    if (i < suffix_len && (m + i < nkey->length))
+        return (suffix[i] < nkey->key[m + i]) ? -1 : 1;
+    if (i < suffix_len)
+        return 1;
+    if (m + i < nkey->length)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * Decodes a fence.
+ */
+static inline uint8_t* castle_btree_fence_get(uint8_t *p,
+                                              uint32_t *shared_p,
+                                              uint8_t **suffix_p,
+                                              uint32_t *suffix_len_p,
+                                              c_ver_t *version_p,
+                                              uint64_t *blocks_p)
+{
+    uint64_t v;
+
+    p = castle_fence_index_varint_get(p, &v);
+    *shared_p = v;
+    p = castle_fence_index_varint_get(p, &v);
+    *suffix_len_p = v;
+    *suffix_p = p;
+    p += v;
+    p = castle_fence_index_varint_get(p, &v);
+    *version_p = v;
+    p = castle_fence_index_varint_get(p, blocks_p);
+
+    return p;
+}
+
+/**
+ * Finds the leaf node that may hold (key, version), the same way as castle_btree_lub_find()
+ * would on the internal nodes just above the leaves.
+ *
+ * @param cep_p [out] Leaf node to search
+ *
+ * @return 1 if the leaf was found, 0 if there is no upper bound for (key, version) in
+ *         the tree, negative if the index can't be used for the key
+ */
+static int castle_btree_fence_index_find(c_fence_index_t *fi,
+                                         void *key,
+                                         c_ver_t version,
+                                         c_ext_pos_t *cep_p)
+{
+    uint8_t nkey_buf[sizeof(c_vl_nkey_t) + CASTLE_FENCE_INDEX_SEARCH_KEY_MAX];
+    c_vl_nkey_t *nkey = (c_vl_nkey_t *)nkey_buf;
+    uint32_t nr_restarts, shared, suffix_len, match, idx;
+    int low, high, mid, cmp, ret;
+    uint64_t blocks, block;
+    c_ver_t fence_version;
+    uint8_t *p, *suffix;
+
+    if (fi->nr_fences == 0)
+        goto tail;
+    ret = castle_object_btree_key_normalise_buf(key, nkey, CASTLE_FENCE_INDEX_SEARCH_KEY_MAX);
+    if (ret)
+        return ret;
+
+    /* Binary search on restart keys for the last one smaller than the key. */
+    nr_restarts = (fi->nr_fences + CASTLE_FENCE_INDEX_RESTART - 1) / CASTLE_FENCE_INDEX_RESTART;
+    low  = -1;
+    high = nr_restarts;
+    while (low != high - 1)
+    {
+        mid = (low + high) / 2;
+        castle_btree_fence_get(fi->buf + fi->restarts[mid],
+                               &shared, &suffix, &suffix_len, &fence_version, &blocks);
+        BUG_ON(shared != 0);
+        match = 0;
+        if (castle_btree_fence_key_compare(nkey, &match, 0, 0, suffix, suffix_len) < 0)
+            low = mid;
+        else
+            high = mid;
+    }
+
+    /* Scan forward for the first fence that is an upper bound. */
+    idx   = max(low, 0) * CASTLE_FENCE_INDEX_RESTART;
+    p     = fi->buf + fi->restarts[max(low, 0)];
+    match = 0;
+    cmp   = -1;
+    block = 0;
+    for (; idx < fi->nr_fences; idx++)
+    {
+        p = castle_btree_fence_get(p, &shared, &suffix, &suffix_len, &fence_version, &blocks);
+        if ((idx % CASTLE_FENCE_INDEX_RESTART) == 0)
+        {
+            BUG_ON(shared != 0);
+            block = blocks;
+        }
+        else
+            block += blocks;
+        cmp = castle_btree_fence_key_compare(nkey, &match, cmp, shared, suffix, suffix_len);
+        if ((cmp >= 0) && castle_version_is_ancestor(fence_version, version))
+        {
+            cep_p->ext_id = fi->ext_id;
+            cep_p->offset = block << C_BLK_SHIFT;
+            return 1;
+        }
+    }
+
+tail:
+    /* Past the last fence, (max_key, 0) is the upper bound. */
+    if (fi->tail)
+    {
+        cep_p->ext_id = fi->ext_id;
+        cep_p->offset = fi->tail_offset;
+        return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads a node of a RO CT synchronously.
+ */
+static c2_block_t* castle_btree_ro_node_read(struct castle_component_tree *ct,
+                                             c_ext_pos_t cep,
+                                             uint8_t rev_level)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    c2_block_t *c2b;
+
+    c2b = castle_cache_block_get(cep, btree->node_size(ct, rev_level));
+    write_lock_c2b(c2b);
+    if (!c2b_uptodate(c2b) && submit_c2b_sync(READ, c2b))
+    {
+        write_unlock_c2b(c2b);
+        put_c2b(c2b);
+        return NULL;
+    }
+    write_unlock_c2b(c2b);
+
+    return c2b;
+}
+
+/**
+ * Rebuilds the fence index of a RO CT from its internal nodes just above the leaves.
+ *
+ * Used for CTs loaded from disk, merges build the index as they complete leaf nodes.
+ * The (max_key, 0) entry of the right-most path becomes the tail.
+ *
+ * @return 0 on success, negative on I/O error or if the index couldn't be built
+ */
+int castle_btree_fence_index_build(struct castle_component_tree *ct, c_fence_index_t *fi)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    c2_block_t *c2bs[MAX_BTREE_DEPTH];
+    int idxs[MAX_BTREE_DEPTH];
+    struct castle_btree_node *node;
+    c_val_tup_t cvt;
+    c_ver_t version;
+    int depth, ret;
+    void *key;
+
+    BUG_ON(ct->dynamic || (ct->tree_depth < 2));
+    depth   = 0;
+    idxs[0] = 0;
+    c2bs[0] = castle_btree_ro_node_read(ct, ct->root_node, ct->tree_depth - 1);
+    if (!c2bs[0])
+        return -EIO;
+
+    ret = 0;
+    while (depth >= 0)
+    {
+        node = c2b_bnode(c2bs[depth]);
+        if (ret || (idxs[depth] >= node->used))
+        {
+            put_c2b(c2bs[depth]);
+            depth--;
+            continue;
+        }
+        btree->entry_get(node, idxs[depth]++, &key, &version, &cvt);
+        if (!CVT_NODE(cvt) || node->is_leaf)
+            ret = -EINVAL;
+        else if (ct->tree_depth - 1 - depth == 1)
+        {
+            /* Node above the leaves, its entries are the fences.  The right-most leaf
+               got (max_key, 0), see castle_da_max_path_complete(). */
+            if (btree->key_compare(key, btree->max_key) == 0)
+                ret = castle_btree_fence_index_tail_set(fi, cvt.cep);
+            else
+                ret = castle_btree_fence_index_add(fi, key, version, cvt.cep);
+        }
+        else
+        {
+            c2bs[depth+1] = castle_btree_ro_node_read(ct, cvt.cep, ct->tree_depth - 2 - depth);
+            if (!c2bs[depth+1])
+                ret = -EIO;
+            else
+                idxs[++depth] = 0;
+        }
+    }
+
+    return ret;
+}
+
 
 /**********************************************************************************************/
 /* Common modlist btree code */
@@ -1564,28 +2226,30 @@ static void USED castle_btree_node_print(struct castle_btree_type *t, struct cas
     t->node_print(node);
 }
 
-void castle_btree_lub_find(struct castle_btree_node *node,
-                                  void *key,
-                                  c_ver_t version,
-                                  int *lub_idx_p,
-                                  int *insert_idx_p)
+/**
+ * Finds the left-most entry in the node with key greater or equal to key.
+ *
+ * @param greater_p [out] Entries at this index and beyond are known to have keys
+ *                        strictly greater than key
+ *
+ * @return Index of the entry, node->used if there is none
+ */
+static int castle_btree_lub_key_find(struct castle_btree_type *btree,
+                                     struct castle_btree_node *node,
+                                     void *key,
+                                     int *greater_p)
 {
-    struct castle_btree_type *btree = castle_btree_type_get(node->type);
-    c_ver_t version_lub;
     void *key_lub;
-    int lub_idx, insert_idx, low, high, mid;
-
-#define insert_candidate(_x)    if(insert_idx < 0) insert_idx=(_x)
-    debug("Looking for (k,v) = (%p, 0x%x), node->used=%d\n",
-            key, version, node->used);
-    /* We should not search for an invalid key */
-    BUG_ON(btree->key_compare(key, btree->inv_key) == 0);
+    int low, high, mid;
 
-    /* Binary search on the keys to find LUB key */
     low = -1;           /* Key in entry pointed to by low is guaranteed
                            to be less than 'key' */
     high = node->used;  /* Key in entry pointed to be high is guaranteed
                            to be higher or equal to the 'key' */
+    *greater_p = node->used;
+    /* Key prefixes in the node may narrow the search without any key compares. */
+    if (btree->lub_bounds && btree->lub_bounds(node, key, &low, &high))
+        *greater_p = high;
     debug(" (lo,hi) = (%d, %d)\n", low, high);
     while(low != high-1)
     {
@@ -1602,6 +2266,29 @@ void castle_btree_lub_find(struct castle_btree_node *node,
             high = mid;
         debug(" (lo,hi) = (%d, %d)\n", low, high);
     }
+
+    return high;
+}
+
+void castle_btree_lub_find(struct castle_btree_node *node,
+                                  void *key,
+                                  c_ver_t version,
+                                  int *lub_idx_p,
+                                  int *insert_idx_p)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(node->type);
+    c_ver_t version_lub;
+    void *key_lub;
+    int lub_idx, insert_idx, high, greater;
+
+#define insert_candidate(_x)    if(insert_idx < 0) insert_idx=(_x)
+    debug("Looking for (k,v) = (%p, 0x%x), node->used=%d\n",
+            key, version, node->used);
+    /* We should not search for an invalid key */
+    BUG_ON(btree->key_compare(key, btree->inv_key) == 0);
+
+    /* Binary search on the keys to find LUB key */
+    high = castle_btree_lub_key_find(btree, node, key, &greater);
     /* 'high' is now pointing to the LUB key (left-most copy if there are a few instances
         of it in the node), or past the end of the node.
         We should start scanning to the right starting with the entry pointed by high (if
@@ -1621,7 +2308,7 @@ void castle_btree_lub_find(struct castle_btree_node *node,
 
         /* First (k,v) that's an upper bound is guaranteed to be the correct lub,
            because versions are arranged from newest to oldest */
-        cmp = btree->key_compare(key_lub, key);
+        cmp = (lub_idx >= greater) ? 1 : btree->key_compare(key_lub, key);
         BUG_ON(cmp < 0);
         if(cmp > 0)
             insert_candidate(lub_idx);
@@ -2635,6 +3322,60 @@ static void castle_btree_submit_io_end(c2_block_t *c2b)
     castle_btree_bvec_queue(c_bvec);
 }
 
+/**
+ * Search an up-to-date internal node of a read-only CT without locking it.
+ *
+ * RO CT nodes are never modified once the CT is live, so read_lock_c2b() only
+ * generates shared-write traffic on the c2p semaphores of the (hot) upper levels.
+ * Instead, search the node on the strength of the c2b reference alone and use
+ * the c2b write sequence to detect a racing writer.  Only the child pointer is
+ * copied out, which is all that is needed to descend.
+ *
+ * @param c_bvec    Read request
+ * @param c2b       Referenced, unlocked node c2b
+ * @param child_cep [out] Child node to descend into
+ *
+ * @return 1 if child_cep is valid
+ * @return 0 if the caller must fall back to locked access (leaf node, node not
+ *         up-to-date, or concurrent writer)
+ *
+ * @also castle_btree_read_process()
+ */
+static int castle_btree_node_optimistic_search(c_bvec_t *c_bvec,
+                                               c2_block_t *c2b,
+                                               c_ext_pos_t *child_cep)
+{
+    struct castle_btree_node *node = c2b_bnode(c2b);
+    struct castle_btree_type *btree;
+    void *lub_key;
+    c_ver_t lub_version;
+    c_val_tup_t lub_cvt;
+    unsigned int seq;
+    int lub_idx;
+
+    seq = c2b_read_seq_begin(c2b);
+    if (seq & 1)
+        return 0;
+    if (!c2b_uptodate(c2b))
+        return 0;
+    /* Don't trust anything until the header checks out, the searches below
+       index the node based on it. */
+    if ((node->magic != BTREE_NODE_MAGIC) || node->is_leaf || (node->used == 0)
+            || (node->type != c_bvec->tree->btree_type))
+        return 0;
+
+    btree = castle_btree_type_get(node->type);
+    castle_btree_lub_find(node, c_bvec->key, c_bvec->version, &lub_idx, NULL);
+    if (lub_idx < 0)
+        return 0;
+    btree->entry_get(node, lub_idx, &lub_key, &lub_version, &lub_cvt);
+    if (!CVT_NODE(lub_cvt))
+        return 0;
+    *child_cep = lub_cvt.cep;
+
+    return !c2b_read_seq_retry(c2b, seq);
+}
+
 static void __castle_btree_submit(c_bvec_t *c_bvec,
                                   c_ext_pos_t node_cep,
                                   void *parent_key)
@@ -2668,6 +3409,21 @@ static void __castle_btree_submit(c_bvec_t *c_bvec,
     c2b = castle_cache_block_get(node_cep,
                                  btree->node_size(ct,
                                                   c_bvec->btree_levels - c_bvec->btree_depth));
+    /* Walk the internal nodes of RO trees without locking them, for as long as
+       they are cached and no writer gets in the way. */
+    if (!write && !ct->dynamic)
+    {
+        while (castle_btree_node_optimistic_search(c_bvec, c2b, &node_cep))
+        {
+            put_c2b(c2b);
+            c_bvec->btree_depth++;
+            BUG_ON(c_bvec->btree_depth > c_bvec->btree_levels);
+            castle_debug_bvec_btree_walk(c_bvec);
+            c2b = castle_cache_block_get(node_cep,
+                                         btree->node_size(ct,
+                                                          c_bvec->btree_levels - c_bvec->btree_depth));
+        }
+    }
     castle_btree_c2b_lock(c_bvec, c2b);
     if(!c2b_uptodate(c2b))
     {
@@ -2688,6 +3444,46 @@ static void __castle_btree_submit(c_bvec_t *c_bvec,
     }
 }
 
+#ifdef CASTLE_DEBUG
+/**
+ * Checks that the fence index picked the leaf a walk from the root would have.
+ *
+ * @param found     What castle_btree_fence_index_find() returned (0 or 1)
+ * @param leaf_cep  Leaf it picked, if found
+ */
+static void castle_btree_fence_index_check(struct castle_component_tree *ct,
+                                           void *key,
+                                           c_ver_t version,
+                                           int found,
+                                           c_ext_pos_t leaf_cep)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(ct->btree_type);
+    c_ext_pos_t cep = ct->root_node;
+    c_val_tup_t cvt;
+    c2_block_t *c2b;
+    int depth, lub_idx;
+
+    for (depth = 0; depth < ct->tree_depth - 1; depth++)
+    {
+        c2b = castle_btree_ro_node_read(ct, cep, ct->tree_depth - 1 - depth);
+        /* Nothing to compare against on I/O errors. */
+        if (!c2b)
+            return;
+        castle_btree_lub_find(c2b_bnode(c2b), key, version, &lub_idx, NULL);
+        if (lub_idx >= 0)
+            btree->entry_get(c2b_bnode(c2b), lub_idx, NULL, NULL, &cvt);
+        put_c2b(c2b);
+        if (lub_idx < 0)
+        {
+            BUG_ON(found);
+            return;
+        }
+        cep = cvt.cep;
+    }
+    BUG_ON(!found || !EXT_POS_EQUAL(cep, leaf_cep));
+}
+#endif
+
 /**
  * Submit request to btree (workqueue function).
  *
@@ -2700,8 +3496,10 @@ static void _castle_btree_submit(struct work_struct *work)
 {
     struct castle_component_tree *ct;
     struct castle_btree_type *btree;
-    c_ext_pos_t root_cep;
+    c_ext_pos_t root_cep, leaf_cep;
+    c_fence_index_t *fi;
     c_bvec_t *c_bvec;
+    int ret;
 
     /* Work out various request details. */
     c_bvec = container_of(work, c_bvec_t, work);
@@ -2719,6 +3517,28 @@ static void _castle_btree_submit(struct work_struct *work)
     c_bvec->btree_levels = ct->tree_depth;
     BUG_ON(EXT_POS_INVAL(root_cep));
     castle_debug_bvec_update(c_bvec, C_BVEC_VERSION_FOUND);
+    /* Go straight to the leaf, if the CT has a fence index. */
+    fi = ct->fence_index;
+    smp_read_barrier_depends();
+    if (fi && (c_bvec_data_dir(c_bvec) == READ))
+    {
+        ret = castle_btree_fence_index_find(fi, c_bvec->key, c_bvec->version, &leaf_cep);
+#ifdef CASTLE_DEBUG
+        if (ret >= 0)
+            castle_btree_fence_index_check(ct, c_bvec->key, c_bvec->version, ret, leaf_cep);
+#endif
+        if (ret == 0)
+        {
+            castle_btree_io_end(c_bvec, INVAL_VAL_TUP, 0);
+            return;
+        }
+        if (ret > 0)
+        {
+            c_bvec->btree_depth = c_bvec->btree_levels - 1;
+            __castle_btree_submit(c_bvec, leaf_cep, btree->inv_key);
+            return;
+        }
+    }
     __castle_btree_submit(c_bvec, root_cep, btree->max_key);
 }
 
@@ -3587,6 +4407,95 @@ void castle_btree_iter_init(c_iter_t *c_iter, c_ver_t version, int type)
     }
 }
 
+#ifdef CASTLE_PERF_DEBUG
+static unsigned long castle_btree_bench_compares;
+
+static int castle_btree_bench_key_compare(void *keyv1, void *keyv2)
+{
+    castle_btree_bench_compares++;
+    return castle_vlba_tree_key_compare(keyv1, keyv2);
+}
+
+static c_vl_bkey_t *castle_btree_bench_key(c_vl_okey_t *okey, int i)
+{
+    okey->dims[0]->length = sprintf((char *)okey->dims[0]->key, "user:%010d", i);
+
+    return castle_object_key_convert(okey);
+}
+
+/**
+ * Microbenchmark: key compares per castle_btree_lub_find() search in a full HDD RO leaf
+ * node, with and without key prefixes.  Half of the lookups miss.
+ */
+static void castle_btree_lub_bench(void)
+{
+    struct castle_btree_type btree = castle_ro_tree;
+    struct castle_btree_node *node;
+    c_vl_okey_t *okey;
+    c_vl_bkey_t *bkey;
+    c_val_tup_t cvt;
+    unsigned long per_lookup;
+    int i, nr, prefixes, greater;
+
+    node = castle_vmalloc(VLBA_HDD_RO_TREE_NODE_SIZE * C_BLK_SIZE);
+    okey = castle_malloc(sizeof(c_vl_okey_t) + sizeof(c_vl_key_t *), GFP_KERNEL);
+    if (okey)
+        okey->dims[0] = castle_malloc(sizeof(c_vl_key_t) + 16, GFP_KERNEL);
+    if (!node || !okey || !okey->dims[0])
+        goto out;
+    okey->nr_dims = 1;
+
+    node->magic   = BTREE_NODE_MAGIC;
+    node->type    = btree.magic;
+    node->version = 0;
+    node->used    = 0;
+    node->is_leaf = 1;
+    node->size    = VLBA_HDD_RO_TREE_NODE_SIZE;
+    cvt.type      = CVT_TYPE_TOMB_STONE;
+    cvt.length    = 0;
+    cvt.val       = NULL;
+    for (nr = 0; !btree.need_split(node, 0); nr++)
+    {
+        if (!(bkey = castle_btree_bench_key(okey, 2 * nr)))
+            goto out;
+        btree.entry_add(node, nr, bkey, 0, cvt);
+        castle_object_bkey_free(bkey);
+    }
+
+    btree.key_compare = castle_btree_bench_key_compare;
+    for (prefixes = 0; prefixes <= 1; prefixes++)
+    {
+        if (prefixes)
+            __castle_vlba_tree_node_finalise(node);
+        else
+            btree.lub_bounds = NULL;
+        castle_btree_bench_compares = 0;
+        for (i = 0; i < 2 * nr; i++)
+        {
+            if (!(bkey = castle_btree_bench_key(okey, i)))
+                goto out;
+            BUG_ON(castle_btree_lub_key_find(&btree, node, bkey, &greater) != (i + 1) / 2);
+            castle_object_bkey_free(bkey);
+        }
+        btree.lub_bounds = castle_ro_tree.lub_bounds;
+        per_lookup = castle_btree_bench_compares * 100 / (2 * nr);
+        castle_printk(LOG_INIT, "Btree lub_find, %d entries, %s prefixes: "
+                                "%lu.%02lu key compares per lookup.\n",
+                nr, prefixes ? "with" : "without", per_lookup / 100, per_lookup % 100);
+    }
+
+out:
+    if (okey)
+    {
+        if (okey->dims[0])
+            castle_free(okey->dims[0]);
+        castle_free(okey);
+    }
+    if (node)
+        castle_vfree(node);
+}
+#endif
+
 /***** Init/fini functions *****/
 /* We have a static array of btree types indexed by btree_t, don't let it grow too
    large. */
@@ -3596,6 +4505,9 @@ int castle_btree_init(void)
     BUG_ON(RW_TREES_MAX_ENTRIES < MTREE_NODE_ENTRIES);
     BUG_ON(RW_TREES_MAX_ENTRIES < BATREE_NODE_ENTRIES);
     BUG_ON(RW_TREES_MAX_ENTRIES < VLBA_RW_TREE_MAX_ENTRIES);
+#ifdef CASTLE_PERF_DEBUG
+    castle_btree_lub_bench();
+#endif
     return 0;
 }
 
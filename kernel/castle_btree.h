@@ -40,6 +40,27 @@ void        castle_btree_enum_init    (c_enum_t *c_enum);
 void        castle_btree_enum_cancel  (c_enum_t *c_enum);
 extern struct castle_iterator_type castle_btree_enum;
 
+c_fence_index_t*
+            castle_btree_fence_index_alloc
+                                      (c_ext_id_t ext_id, uint32_t max_bytes);
+int         castle_btree_fence_index_add
+                                      (c_fence_index_t *fi,
+                                       void *key,
+                                       c_ver_t version,
+                                       c_ext_pos_t cep);
+int         castle_btree_fence_index_tail_set
+                                      (c_fence_index_t *fi, c_ext_pos_t cep);
+void        castle_btree_fence_index_maxify
+                                      (c_fence_index_t *fi);
+int         castle_btree_fence_index_equal
+                                      (c_fence_index_t *fi1, c_fence_index_t *fi2);
+void        castle_btree_fence_index_finish
+                                      (c_fence_index_t *fi);
+void        castle_btree_fence_index_free
+                                      (c_fence_index_t *fi);
+int         castle_btree_fence_index_build
+                                      (struct castle_component_tree *ct, c_fence_index_t *fi);
+
 int         castle_btree_init         (void);
 void        castle_btree_free         (void);
 
@@ -8,11 +8,15 @@
 #include <linux/delay.h>
 #include <linux/blkdev.h>
 #include <linux/hash.h>
+#include <linux/timex.h>
+#include <linux/sort.h>
+#include <asm/local.h>
 
 #include "castle_public.h"
 #include "castle.h"
 #include "castle_cache.h"
 #include "castle_vmap.h"
+#include "castle_lz.h"
 #include "castle_debug.h"
 #include "castle_trace.h"
 #include "castle_utils.h"
@@ -59,6 +63,9 @@ enum c2b_state_bits {
     C2B_remap,              /**< Block is for a remap.                                            */
     C2B_in_flight,          /**< Block is currently in-flight (un-set in c2b_multi_io_end()).     */
     C2B_barrier,            /**< Block in write IO, and should be used as a barrier write.        */
+    C2B_accessed,           /**< Block was hit in the hash since it was last considered for
+                                 eviction (see castle_cache_block_hash_clean()).                  */
+    C2B_probation,          /**< 2q policy: block lives on the probation list (A1in).             */
 };
 
 #define INIT_C2B_BITS (0)
@@ -102,6 +109,9 @@ C2B_FNS(no_resubmit, no_resubmit)
 C2B_FNS(remap, remap)
 C2B_FNS(in_flight, in_flight)
 C2B_FNS(barrier, barrier)
+C2B_FNS(accessed, accessed)
+C2B_TAS_FNS(accessed, accessed)
+C2B_FNS(probation, probation)
 
 /* c2p encapsulates multiple memory pages (in order to reduce overheads).
    NOTE: In order for this to work, c2bs must necessarily be allocated in
@@ -137,6 +147,7 @@ typedef struct castle_cache_page {
 enum c2p_state_bits {
     C2P_uptodate,
     C2P_dirty,
+    C2P_accessed,           /**< Page was got by a cache consumer (not the prefetcher).           */
 };
 
 struct castle_cache_flush_entry {
@@ -174,6 +185,7 @@ inline int test_clear_c2p_##name(c2_page_t *c2p)                    \
 C2P_FNS(uptodate, uptodate)
 C2P_FNS(dirty, dirty)
 TAS_C2P_FNS(dirty, dirty)
+C2P_FNS(accessed, accessed)
 
 static inline int castle_cache_pages_to_c2ps(int nr_pages)
 {
@@ -268,12 +280,44 @@ static unsigned int            castle_checkpoint_ratelimit;
 module_param(castle_checkpoint_ratelimit, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(castle_checkpoint_ratelimit, "Checkpoint ratelimit in KB/s");
 
+#define                        CASTLE_MAX_CHECKPOINT_RATELIMIT  (1024 * 1024) /* In KB/s */
+static unsigned int            castle_checkpoint_latency_target = 50000;     /* In usecs */
+module_param(castle_checkpoint_latency_target, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_checkpoint_latency_target, "Foreground get/replace p99 latency target "
+                                                   "for checkpoint flushes in usecs, 0 for a "
+                                                   "fixed checkpoint ratelimit");
+
+static char                   *castle_cache_policy = "lru";
+module_param(castle_cache_policy, charp, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(castle_cache_policy, "Cache replacement policy: lru (default) or 2q");
+
+static unsigned int            castle_cache_warm_blocks = 16384;
+module_param(castle_cache_warm_blocks, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_cache_warm_blocks, "Number of hot blocks to record at checkpoint and "
+                                           "prefetch on mount, 0 to disable");
+
+static unsigned int            castle_cache_ztier_size = 0;     /* In MB */
+module_param(castle_cache_ztier_size, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(castle_cache_ztier_size, "Size of the compressed tier for evicted clean blocks "
+                                          "in MB, 0 to disable");
+
+static unsigned int            castle_cache_l2_size = 0;        /* In MB */
+module_param(castle_cache_l2_size, uint, S_IRUSR | S_IRGRP);
+MODULE_PARM_DESC(castle_cache_l2_size, "Size of the SSD victim cache log for blocks of HDD "
+                                       "extents in MB, 0 to disable");
+
+static unsigned int            castle_cache_prefetch_max = 128; /* In MB */
+module_param(castle_cache_prefetch_max, uint, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_cache_prefetch_max, "Largest adaptive prefetch window in MB (capped to "
+                                            "1/8 of the cache)");
+
 
 static c2_block_t             *castle_cache_blks = NULL;
 static c2_page_t              *castle_cache_pgs  = NULL;
 
+#define BLOCK_HASH_LOCK_PERIOD 1024
 static int                     castle_cache_block_hash_buckets;
-static         DEFINE_SPINLOCK(castle_cache_block_hash_lock);
+static spinlock_t             *castle_cache_block_hash_locks = NULL;
 static struct hlist_head      *castle_cache_block_hash = NULL;
 
 #define PAGE_HASH_LOCK_PERIOD  1024
@@ -283,14 +327,41 @@ static struct hlist_head      *castle_cache_page_hash = NULL;
 
 static struct kmem_cache      *castle_io_array_cache = NULL;
 
-/* Following LIST_HEADs are protected by castle_cache_block_hash_lock. */
+/* Following LIST_HEADs (and the c2b clean/dirty union) are protected by
+ * castle_cache_block_lru_lock.  Lock ordering: block hash stripe lock first. */
+static         DEFINE_SPINLOCK(castle_cache_block_lru_lock);
 static               LIST_HEAD(castle_cache_extent_dirtylist);      /**< Extents with dirty c2bs  */
 static               LIST_HEAD(castle_cache_cleanlist);             /**< Clean c2bs               */
 static atomic_t                castle_cache_extent_dirtylist_size;  /**< Number of dirty extents  */
 static atomic_t                castle_cache_cleanlist_size;         /**< Blocks on the cleanlist  */
 static atomic_t                castle_cache_cleanlist_softpin_size; /**< Softpin blks on cleanlist*/
+static               LIST_HEAD(castle_cache_probationlist);         /**< 2q: blocks seen once     */
+static atomic_t                castle_cache_probationlist_size;     /**< Blocks on probationlist  */
 static atomic_t                castle_cache_block_victims;          /**< #clean blocks evicted    */
 static atomic_t                castle_cache_softpin_block_victims;  /**< #softpin blocks evicted  */
+
+/**
+ * Lock hold-time statistics, reported every stats tick.
+ *
+ * Per-CPU so that accounting doesn't add a shared cacheline to every lock hold.  Counters
+ * only grow, each tick reports the difference from the totals seen at the previous tick.
+ */
+typedef struct castle_cache_lock_stats {
+    local_t                    cycles;          /**< Cycles the lock(s) were held for.            */
+    local_t                    acquisitions;    /**< Number of times the lock(s) were taken.      */
+} c2_lock_stats_t;
+static DEFINE_PER_CPU(c2_lock_stats_t, castle_cache_block_hash_lock_stats); /**< Hash stripes    */
+static DEFINE_PER_CPU(c2_lock_stats_t, castle_cache_block_lru_lock_stats);  /**< lru lock        */
+
+/**
+ * Lock statistics totals over all CPUs.
+ */
+typedef struct castle_cache_lock_stats_sum {
+    unsigned long              cycles;
+    unsigned long              acquisitions;
+} c2_lock_stats_sum_t;
+static c2_lock_stats_sum_t     castle_cache_block_hash_lock_last;   /**< Totals at the last tick. */
+static c2_lock_stats_sum_t     castle_cache_block_lru_lock_last;    /**< Totals at the last tick. */
 static atomic_t                castle_cache_dirty_pages;
 static atomic_t                castle_cache_clean_pages;
 static atomic_t                c2_pref_active_window_size;  /**< Number of chunk-sized c2bs that are
@@ -303,10 +374,41 @@ static int                     castle_cache_allow_hardpinning;      /**< Is hard
 
 static         DEFINE_SPINLOCK(castle_cache_freelist_lock);     /**< Lock for page/block freelists*/
 static int                     castle_cache_page_freelist_size; /**< Num c2ps on freelist         */
-static               LIST_HEAD(castle_cache_page_freelist);     /**< Freelist of c2ps             */
+static struct list_head        castle_cache_page_freelists[MAX_NUMNODES];/**< Per-node c2p freelists */
+static int                     castle_cache_page_freelist_node_size[MAX_NUMNODES];
+                                                                /**< Num c2ps on node freelists   */
 static int                     castle_cache_block_freelist_size;/**< Num c2bs on freelist         */
 static               LIST_HEAD(castle_cache_block_freelist);    /**< Freelist of c2bs             */
 
+/* c2p pages are spread across all online NUMA nodes at init and kept on a
+ * freelist per node.  Allocations prefer the node of the CPU they are made on
+ * (request processing is bound to castle_double_array_request_cpu()) and only
+ * fall back to remote nodes when the local freelist is empty. */
+typedef struct castle_cache_node_stats {
+    int                 c2ps;                               /**< c2ps with pages on this node.  */
+    atomic64_t          allocs;                             /**< c2ps allocated from this node. */
+    atomic64_t          remote_allocs;                      /**< Allocs from this node that got
+                                                                 c2ps from another node.        */
+} c2_node_stats_t;
+static c2_node_stats_t         castle_cache_node_stats[MAX_NUMNODES];
+
+/* Per-CPU magazines of free c2ps/c2bs sit in front of the global freelists.
+ * Allocations and frees are satisfied from the local magazine, the global
+ * freelist (and castle_cache_freelist_lock) is only touched to refill an empty
+ * magazine or drain a full one, in batches of C2_MAGAZINE_BATCH.  Each magazine
+ * has a lock, only contended when castle_cache_magazines_drain() empties other
+ * CPUs' magazines before an allocation blocks.  Nests outside the freelist lock. */
+#define C2_MAGAZINE_SIZE        (32)                        /**< Max c2ps/c2bs in a magazine.   */
+#define C2_MAGAZINE_BATCH       (C2_MAGAZINE_SIZE / 2)      /**< Refill/drain batch size.       */
+typedef struct castle_cache_magazine {
+    spinlock_t          lock;                               /**< Protects the magazine.         */
+    int                 nr_c2ps;                            /**< Number of c2ps in magazine.    */
+    c2_page_t          *c2ps[C2_MAGAZINE_SIZE];
+    int                 nr_c2bs;                            /**< Number of c2bs in magazine.    */
+    c2_block_t         *c2bs[C2_MAGAZINE_SIZE];
+} c2_magazine_t;
+static DEFINE_PER_CPU(c2_magazine_t, castle_cache_magazines);
+
 /* The reservelist is an additional list of free c2bs and c2ps that are held
  * for the exclusive use of the flush thread.  The flush thread gets single c2p
  * c2bs and these are used to perform I/O on the metaextent to allow RDA chunk
@@ -333,6 +435,9 @@ static atomic_t                castle_cache_flush_seq;
 
 static atomic_t                castle_cache_read_stats = ATOMIC_INIT(0);
 static atomic_t                castle_cache_write_stats = ATOMIC_INIT(0);
+static atomic_t                castle_cache_wb_segs = ATOMIC_INIT(0);  /**< Writeback segs staged. */
+static atomic_t                castle_cache_wb_bios = ATOMIC_INIT(0);  /**< Coalesced wb bios.     */
+static atomic_t                castle_cache_trickle_pgs = ATOMIC_INIT(0); /**< Trickled pages.   */
 
 struct timer_list              castle_cache_stats_timer;
 
@@ -344,17 +449,89 @@ static               LIST_HEAD(castle_cache_flush_list);
 static atomic_t                castle_cache_logical_ext_pages = ATOMIC_INIT(0);
 
 int                            castle_checkpoint_period = 60;        /* Checkpoint default of once in every 60secs. */
+static unsigned long           castle_checkpoint_next;               /* Jiffies when next checkpoint is due.        */
 
 struct                  task_struct  *checkpoint_thread;
 /**********************************************************************************************
  * Prototypes.
  */
 static void c2_pref_c2b_destroy(c2_block_t *c2b);
+static int castle_cache_l2_read(c2_block_t *c2b);
 
 /**********************************************************************************************
  * Core cache.
  */
 
+/**
+ * Account for a single hold of a cache lock.
+ *
+ * @param _stats    Per-CPU statistics for the lock
+ * @param _start    get_cycles() as sampled just after the lock was taken
+ *
+ * Called after the lock has been dropped, so the accounting doesn't extend the hold.
+ */
+#define castle_cache_lock_stats_update(_stats, _start)                      \
+do {                                                                        \
+    c2_lock_stats_t *_s = &get_cpu_var(_stats);                             \
+    local_add(get_cycles() - (_start), &_s->cycles);                        \
+    local_inc(&_s->acquisitions);                                           \
+    put_cpu_var(_stats);                                                    \
+} while (0)
+
+/**
+ * Sum per-CPU lock statistics.
+ *
+ * Racy, only suitable for statistics.
+ */
+#define castle_cache_lock_stats_sum(_stats, _sum)                           \
+do {                                                                        \
+    int _cpu;                                                               \
+                                                                            \
+    (_sum)->cycles = (_sum)->acquisitions = 0;                              \
+    for_each_possible_cpu(_cpu)                                             \
+    {                                                                       \
+        c2_lock_stats_t *_s = &per_cpu(_stats, _cpu);                       \
+                                                                            \
+        (_sum)->cycles       += local_read(&_s->cycles);                    \
+        (_sum)->acquisitions += local_read(&_s->acquisitions);              \
+    }                                                                       \
+} while (0)
+
+/**
+ * Trace lock hold-time statistics accumulated since the last tick.
+ *
+ * @param sum       Current totals
+ * @param last      [in, out] Totals at the last tick
+ */
+static void castle_cache_lock_stats_trace(c2_lock_stats_sum_t *sum,
+                                          c2_lock_stats_sum_t *last,
+                                          c_trc_cache_var_t cycles_id,
+                                          c_trc_cache_var_t acqs_id)
+{
+    castle_trace_cache(TRACE_VALUE, cycles_id, sum->cycles - last->cycles);
+    castle_trace_cache(TRACE_VALUE, acqs_id, sum->acquisitions - last->acquisitions);
+    *last = *sum;
+}
+
+/**
+ * Count free c2ps and c2bs held in per-CPU magazines.
+ *
+ * Racy, only suitable for statistics and as a hint, see castle_cache_freelists_grow().
+ */
+static void castle_cache_magazines_count(int *nr_c2ps, int *nr_c2bs)
+{
+    c2_magazine_t *mag;
+    int cpu;
+
+    *nr_c2ps = *nr_c2bs = 0;
+    for_each_possible_cpu(cpu)
+    {
+        mag = &per_cpu(castle_cache_magazines, cpu);
+        *nr_c2ps += mag->nr_c2ps;
+        *nr_c2bs += mag->nr_c2bs;
+    }
+}
+
 /**
  * Report various cache statistics.
  *
@@ -362,17 +539,28 @@ static void c2_pref_c2b_destroy(c2_block_t *c2b);
  */
 void castle_cache_stats_print(int verbose)
 {
-    int count;
+    c2_lock_stats_sum_t lock_sum;
+    int count, free_c2ps, free_c2bs;
     int reads = atomic_read(&castle_cache_read_stats);
     int writes = atomic_read(&castle_cache_write_stats);
+    int wb_segs = atomic_read(&castle_cache_wb_segs);
+    int wb_bios = atomic_read(&castle_cache_wb_bios);
+    int trickle_pgs = atomic_read(&castle_cache_trickle_pgs);
     atomic_sub(reads, &castle_cache_read_stats);
     atomic_sub(writes, &castle_cache_write_stats);
+    atomic_sub(wb_segs, &castle_cache_wb_segs);
+    atomic_sub(wb_bios, &castle_cache_wb_bios);
+    atomic_sub(trickle_pgs, &castle_cache_trickle_pgs);
+
+    castle_cache_magazines_count(&free_c2ps, &free_c2bs);
+    free_c2ps += castle_cache_page_freelist_size;
+    free_c2bs += castle_cache_block_freelist_size;
 
     if (verbose)
         castle_printk(LOG_PERF, "castle_cache_stats_timer_tick: %d, %d, %d, %d, %d\n",
             atomic_read(&castle_cache_dirty_pages),
             atomic_read(&castle_cache_clean_pages),
-            castle_cache_page_freelist_size * PAGES_PER_C2P,
+            free_c2ps * PAGES_PER_C2P,
             reads, writes);
     castle_trace_cache(TRACE_VALUE,
                        TRACE_CACHE_CLEAN_PGS_ID,
@@ -382,7 +570,7 @@ void castle_cache_stats_print(int verbose)
                        atomic_read(&castle_cache_dirty_pages));
     castle_trace_cache(TRACE_VALUE,
                        TRACE_CACHE_FREE_PGS_ID,
-                       castle_cache_page_freelist_size * PAGES_PER_C2P);
+                       free_c2ps * PAGES_PER_C2P);
     castle_trace_cache(TRACE_VALUE,
                        TRACE_CACHE_RESERVE_PGS_ID,
                        atomic_read(&castle_cache_page_reservelist_size));
@@ -391,7 +579,7 @@ void castle_cache_stats_print(int verbose)
                        atomic_read(&castle_cache_cleanlist_size));
     castle_trace_cache(TRACE_VALUE,
                        TRACE_CACHE_FREE_BLKS_ID,
-                       castle_cache_block_freelist_size);
+                       free_c2bs);
     castle_trace_cache(TRACE_VALUE,
                        TRACE_CACHE_RESERVE_BLKS_ID,
                        atomic_read(&castle_cache_block_reservelist_size));
@@ -406,6 +594,25 @@ void castle_cache_stats_print(int verbose)
     castle_trace_cache(TRACE_VALUE, TRACE_CACHE_SOFTPIN_VICTIMS_ID, count);
     castle_trace_cache(TRACE_VALUE, TRACE_CACHE_READS_ID, reads);
     castle_trace_cache(TRACE_VALUE, TRACE_CACHE_WRITES_ID, writes);
+    castle_cache_lock_stats_sum(castle_cache_block_hash_lock_stats, &lock_sum);
+    castle_cache_lock_stats_trace(&lock_sum,
+                                  &castle_cache_block_hash_lock_last,
+                                  TRACE_CACHE_BLOCK_HASH_LOCK_CYCLES_ID,
+                                  TRACE_CACHE_BLOCK_HASH_LOCK_ACQS_ID);
+    castle_cache_lock_stats_sum(castle_cache_block_lru_lock_stats, &lock_sum);
+    castle_cache_lock_stats_trace(&lock_sum,
+                                  &castle_cache_block_lru_lock_last,
+                                  TRACE_CACHE_BLOCK_LRU_LOCK_CYCLES_ID,
+                                  TRACE_CACHE_BLOCK_LRU_LOCK_ACQS_ID);
+    castle_trace_cache(TRACE_VALUE,
+                       TRACE_CACHE_WB_SEGS_ID,
+                       wb_segs);
+    castle_trace_cache(TRACE_VALUE,
+                       TRACE_CACHE_WB_BIOS_ID,
+                       wb_bios);
+    castle_trace_cache(TRACE_VALUE,
+                       TRACE_CACHE_TRICKLE_PGS_ID,
+                       trickle_pgs);
 }
 
 EXPORT_SYMBOL(castle_cache_stats_print);
@@ -532,6 +739,9 @@ static inline void lock_c2b_counter(c2_block_t *c2b, int write)
         BUG_ON(atomic_read(&c2b->lock_cnt) != 0);
 #endif
         atomic_dec(&c2b->lock_cnt);
+        /* Make the sequence odd before the writer can touch the buffer. */
+        atomic_inc(&c2b->seq);
+        smp_wmb();
     }
     else
     {
@@ -552,6 +762,9 @@ static inline void unlock_c2b_counter(c2_block_t *c2b, int write)
         /* The counter must be -1. */
         BUG_ON(atomic_read(&c2b->lock_cnt) != -1);
 #endif
+        /* Publish buffer changes before the sequence goes even again. */
+        smp_wmb();
+        atomic_inc(&c2b->seq);
         atomic_inc(&c2b->lock_cnt);
     }
     else
@@ -762,1775 +975,4474 @@ static inline int c2b_softpin(c2_block_t *c2b)
     return c2b->state.softpin_cnt;
 }
 
-/**
- * Remove a c2b from its per-extent dirtytree.
+/**********************************************************************************************
+ * Cleanlist replacement policies.
  *
- * c2b holds a reference to the dirtytree.
+ * A replacement policy decides where clean c2bs are placed and in which order
+ * castle_cache_block_hash_clean() considers them for eviction.  All policy
+ * functions are called with castle_cache_block_lru_lock held.
  *
- * @param c2b   Block to remove
+ * lru: single cleanlist.  Blocks hit in the hash get a second chance when they
+ *      reach the head of the list (CLOCK approximation of LRU).
+ * 2q:  new blocks go onto a FIFO probation list (A1in).  Blocks evicted from it
+ *      are remembered in a ghost table (A1out) and only blocks re-referenced
+ *      after that make it onto the main cleanlist (Am).  A single large scan can
+ *      therefore only flush the probation list, not the hot working set.
+ *
+ * The cleanlist accounting (castle_cache_cleanlist_size etc.) covers all lists
+ * and remains the responsibility of the callers.
  */
-static int c2_dirtytree_remove(c2_block_t *c2b)
+#define C2_POLICY_MAX_LISTS     (2)     /**< Max lists a policy victimises blocks from.           */
+#define C2_2Q_KIN_SHIFT         (2)     /**< 2q: probation list target is 1/4 of clean blocks.    */
+
+typedef struct castle_cache_policy {
+    char       *name;
+    void      (*insert)       (c2_block_t *c2b, int transient);
+                              /**< Place a block new to the cache on the cleanlists.          */
+    void      (*requeue)      (c2_block_t *c2b);
+                              /**< Place a block that has just been cleaned on the cleanlists. */
+    void      (*remove)       (c2_block_t *c2b);
+                              /**< Remove a block from the cleanlists.                        */
+    void      (*demote)       (c2_block_t *c2b);
+                              /**< Move a block so it gets evicted next.                      */
+    int       (*referenced)   (c2_block_t *c2b);
+                              /**< Should the block get a second chance (clears the hint).    */
+    void      (*evicted)      (c2_block_t *c2b);
+                              /**< Block has been victimised (already removed).               */
+    int       (*victim_lists) (struct list_head **lists);
+                              /**< Fill in lists to victimise from, in order, returns count.  */
+} c2_policy_t;
+
+/**
+ * Lookup statistics of the active policy.
+ *
+ * Per-CPU, as every block lookup updates them.  Only the active policy sees lookups, so
+ * comparing policies means running the same workload under each in turn.
+ */
+typedef struct castle_cache_policy_stats {
+    local_t     hits;         /**< Block lookups satisfied from the hash.                     */
+    local_t     misses;       /**< Block lookups that required a new c2b.                     */
+} c2_policy_stats_t;
+static DEFINE_PER_CPU(c2_policy_stats_t, castle_cache_policy_stats);
+
+static uint32_t               *c2_2q_ghosts = NULL;     /**< 2q: tags of blocks recently evicted
+                                                             from the probation list (A1out).    */
+static int                     c2_2q_ghosts_size;       /**< Number of slots in c2_2q_ghosts.    */
+
+static void c2_lru_insert(c2_block_t *c2b, int transient)
 {
-    c_ext_dirtytree_t *dirtytree;
-    unsigned long flags;
+    /* Transient blocks are expected to be used once, make them next to go. */
+    if (transient)
+        list_add(&c2b->clean, &castle_cache_cleanlist);
+    else
+        list_add_tail(&c2b->clean, &castle_cache_cleanlist);
+}
 
-    BUG_ON(atomic_read(&c2b->count) == 0);
+static void c2_lru_requeue(c2_block_t *c2b)
+{
+    list_add_tail(&c2b->clean, &castle_cache_cleanlist);
+}
 
-    /* Get extent dirtytree from c2b. */
-    dirtytree = c2b->dirtytree;
-    BUG_ON(!dirtytree);
-    spin_lock_irqsave(&dirtytree->lock, flags);
+static void c2_lru_remove(c2_block_t *c2b)
+{
+    list_del(&c2b->clean);
+}
 
-    /* Remove c2b from the tree. */
-    spin_lock(&castle_cache_block_hash_lock); /* protects clean/dirty union. */
-    rb_erase(&c2b->rb_dirtytree, &dirtytree->rb_root);
-    if (RB_EMPTY_ROOT(&dirtytree->rb_root))
-    {
-        /* Last dirty c2b for this extent, remove it from the global
-         * list of dirty extents. */
-        list_del_init(&dirtytree->list);
-        BUG_ON(atomic_dec_return(&castle_cache_extent_dirtylist_size) < 0);
-    }
-    spin_unlock(&castle_cache_block_hash_lock);
+static void c2_lru_demote(c2_block_t *c2b)
+{
+    list_move(&c2b->clean, &castle_cache_cleanlist);
+}
 
-    /* Release lock and put reference, potentially freeing the dirtytree if
-     * the extent has already been freed. */
-    c2b->dirtytree = NULL;
-    spin_unlock_irqrestore(&dirtytree->lock, flags);
-    castle_extent_dirtytree_put(dirtytree);
+static int c2_lru_referenced(c2_block_t *c2b)
+{
+    return test_clear_c2b_accessed(c2b);
+}
 
-    return EXIT_SUCCESS;
+static void c2_lru_evicted(c2_block_t *c2b)
+{
+}
+
+static int c2_lru_victim_lists(struct list_head **lists)
+{
+    lists[0] = &castle_cache_cleanlist;
+
+    return 1;
 }
 
 /**
- * Place a c2b onto its per-extent dirtytree.
- *
- * @param c2b   Block to insert
- *
- * In order to dirty a c2b its extent must exist.
- *
- * - Get and hold per-extent dirtytree reference via c2b->cep.ext_id
- * - Lock dirtytree and insert c2b into RB-tree
- * - If RB-tree was previously empty, thread dirtytree onto the global
- *   list of dirty extents (castle_cache_extent_dirtylist)
- * - Don't drop the dirtytree reference (put in c2_dirtytree_remove())
- *
- * @also c2_dirtytree_remove()
+ * Get 2q ghost table tag for a block.  Never returns 0 (marks an empty slot).
  */
-static int c2_dirtytree_insert(c2_block_t *c2b)
+static inline uint32_t c2_2q_ghost_tag(c2_block_t *c2b)
 {
-    struct rb_node **p, *parent = NULL;
-    c_ext_dirtytree_t *dirtytree;
-    c2_block_t *tree_c2b;
-    unsigned long flags;
-    int cmp;
+    return hash_long(c2b->cep.ext_id * 31 + BLOCK(c2b->cep.offset) + c2b->nr_pages, 32) | 1;
+}
 
-    /* Get dirtytree and hold its lock while we manipulate the tree. */
-    dirtytree = castle_extent_dirtytree_by_id_get(c2b->cep.ext_id);
-    BUG_ON(!dirtytree);
-    spin_lock_irqsave(&dirtytree->lock, flags);
+static void c2_2q_insert(c2_block_t *c2b, int transient)
+{
+    uint32_t tag, *ghost;
 
-    /* Find position in tree. */
-    p = &dirtytree->rb_root.rb_node;
-    while (*p)
+    tag   = c2_2q_ghost_tag(c2b);
+    ghost = &c2_2q_ghosts[tag % c2_2q_ghosts_size];
+    if (!transient && (*ghost == tag))
     {
-        parent = *p;
-        tree_c2b = rb_entry(parent, c2_block_t, rb_dirtytree);
+        /* Block was re-referenced shortly after being evicted from the
+         * probation list, it is part of the working set. */
+        *ghost = 0;
+        list_add_tail(&c2b->clean, &castle_cache_cleanlist);
+        return;
+    }
 
-        cmp = EXT_POS_COMP(c2b->cep, tree_c2b->cep);
-        if (cmp < 0)
-            p = &(*p)->rb_left;
-        else if (cmp > 0)
-            p = &(*p)->rb_right;
-        else
-        {
-            /* We found a c2b with the same offset.  Larger to the right. */
-            /** @TODO would it make more sense to have C2B_COMP() above that calls
-             * EXT_POS_COMP and does below if result == 0? */
+    set_c2b_probation(c2b);
+    atomic_inc(&castle_cache_probationlist_size);
+    if (transient)
+        list_add(&c2b->clean, &castle_cache_probationlist);
+    else
+        list_add_tail(&c2b->clean, &castle_cache_probationlist);
+}
 
-            if (c2b->nr_pages < tree_c2b->nr_pages)
-                p = &(*p)->rb_left;
-            else if (c2b->nr_pages > tree_c2b->nr_pages)
-                p = &(*p)->rb_right;
-            else
-            {
-                castle_printk(LOG_ERROR, "c2b with cep "cep_fmt_str_nl" already in tree.\n",
-                        cep2str(c2b->cep));
-                BUG();
-            }
-        }
+static void c2_2q_requeue(c2_block_t *c2b)
+{
+    if (c2b_probation(c2b))
+    {
+        atomic_inc(&castle_cache_probationlist_size);
+        list_add_tail(&c2b->clean, &castle_cache_probationlist);
     }
+    else
+        list_add_tail(&c2b->clean, &castle_cache_cleanlist);
+}
 
-    /* Insert dirty c2b into the tree. */
-    spin_lock(&castle_cache_block_hash_lock); /* protects clean/dirty union. */
-    if (RB_EMPTY_ROOT(&dirtytree->rb_root))
+static void c2_2q_remove(c2_block_t *c2b)
+{
+    list_del(&c2b->clean);
+    if (c2b_probation(c2b))
+        BUG_ON(atomic_dec_return(&castle_cache_probationlist_size) < 0);
+}
+
+static void c2_2q_demote(c2_block_t *c2b)
+{
+    if (c2b_probation(c2b))
+        list_move(&c2b->clean, &castle_cache_probationlist);
+    else
+        list_move(&c2b->clean, &castle_cache_cleanlist);
+}
+
+static int c2_2q_referenced(c2_block_t *c2b)
+{
+    /* Hits on the probation list are deliberately ignored (it is a FIFO). */
+    return test_clear_c2b_accessed(c2b) && !c2b_probation(c2b);
+}
+
+static void c2_2q_evicted(c2_block_t *c2b)
+{
+    uint32_t tag;
+
+    if (!c2b_probation(c2b))
+        return;
+
+    tag = c2_2q_ghost_tag(c2b);
+    c2_2q_ghosts[tag % c2_2q_ghosts_size] = tag;
+}
+
+static int c2_2q_victim_lists(struct list_head **lists)
+{
+    int kin = atomic_read(&castle_cache_cleanlist_size) >> C2_2Q_KIN_SHIFT;
+
+    if (atomic_read(&castle_cache_probationlist_size) > kin)
     {
-        /* First dirty c2b for this extent, place it onto the global
-         * list of dirty extents. */
-        list_add(&dirtytree->list, &castle_cache_extent_dirtylist);
-        atomic_inc(&castle_cache_extent_dirtylist_size);
+        lists[0] = &castle_cache_probationlist;
+        lists[1] = &castle_cache_cleanlist;
+    }
+    else
+    {
+        lists[0] = &castle_cache_cleanlist;
+        lists[1] = &castle_cache_probationlist;
     }
-    rb_link_node(&c2b->rb_dirtytree, parent, p);
-    rb_insert_color(&c2b->rb_dirtytree, &dirtytree->rb_root);
-    spin_unlock(&castle_cache_block_hash_lock);
 
-    /* Keep the reference until the c2b is clean but drop the lock. */
-    c2b->dirtytree = dirtytree;
-    spin_unlock_irqrestore(&dirtytree->lock, flags);
+    return 2;
+}
 
-    return EXIT_SUCCESS;
+static c2_policy_t             castle_cache_policies[] = {
+    {
+        .name         = "lru",
+        .insert       = c2_lru_insert,
+        .requeue      = c2_lru_requeue,
+        .remove       = c2_lru_remove,
+        .demote       = c2_lru_demote,
+        .referenced   = c2_lru_referenced,
+        .evicted      = c2_lru_evicted,
+        .victim_lists = c2_lru_victim_lists,
+    },
+    {
+        .name         = "2q",
+        .insert       = c2_2q_insert,
+        .requeue      = c2_2q_requeue,
+        .remove       = c2_2q_remove,
+        .demote       = c2_2q_demote,
+        .referenced   = c2_2q_referenced,
+        .evicted      = c2_2q_evicted,
+        .victim_lists = c2_2q_victim_lists,
+    },
+};
+static c2_policy_t            *c2_policy = &castle_cache_policies[0];  /**< Active policy.   */
+
+/**
+ * Account a block lookup to the active policy.
+ */
+static inline void c2_policy_lookup(int hit)
+{
+    c2_policy_stats_t *stats = &get_cpu_var(castle_cache_policy_stats);
+
+    local_inc(hit ? &stats->hits : &stats->misses);
+    put_cpu_var(castle_cache_policy_stats);
 }
 
 /**
- * Mark c2b and associated c2ps dirty and place on dirtytree.
- *
- * @param c2b   c2b to mark as dirty.
+ * Get name and hit statistics of the active replacement policy.
  *
- * - Insert c2b into per-extent RB-tree dirtytree
- * - Move c2b from cleanlist to dirtytree
- *   (also occurs when we free blocks in hash_clean())
- * - Update cleanlist accounting.
+ * Inactive policies don't see any lookups, so they are not reported.
  *
- * By maintaining a per-extent list of dirty c2bs we can flush dirty data out
- * in a contiguous fashion to reduce disk seeks.
+ * @param hits      Returns number of lookups that hit in the cache
+ * @param misses    Returns number of lookups that missed
  *
- * @also castle_cache_block_hash_clean()
+ * @return Policy name
  */
-void dirty_c2b(c2_block_t *c2b)
+char* castle_cache_policy_stats_get(uint64_t *hits, uint64_t *misses)
 {
-    unsigned long flags;
-    int i, nr_c2ps;
-
-    BUG_ON(!c2b_write_locked(c2b));
-    /* With overlapping c2bs we cannot rely on this c2b being dirty.
-     * We have to dirty all c2ps. */
-    nr_c2ps = castle_cache_pages_to_c2ps(c2b->nr_pages);
-    for (i = 0; i < nr_c2ps; i++)
-        dirty_c2p(c2b->c2ps[i]);
+    c2_policy_stats_t *stats;
+    int cpu;
 
-    /* Place c2b on per-extent dirtytree if it is not already dirty. */
-    if (!c2b_dirty(c2b))
+    *hits = *misses = 0;
+    for_each_possible_cpu(cpu)
     {
-        spin_lock_irqsave(&castle_cache_block_hash_lock, flags);
-
-        /* Don't continue if we've raced another thread. */
-        if (c2b_dirty(c2b))
-        {
-            spin_unlock_irqrestore(&castle_cache_block_hash_lock, flags);
-            return;
-        }
+        stats = &per_cpu(castle_cache_policy_stats, cpu);
+        *hits   += local_read(&stats->hits);
+        *misses += local_read(&stats->misses);
+    }
 
-        /* Remove from cleanlist and do cachelist accounting. */
-        list_del(&c2b->clean);
-        BUG_ON(atomic_dec_return(&castle_cache_cleanlist_size) < 0);
-        if (c2b_softpin(c2b))
-            BUG_ON(atomic_dec_return(&castle_cache_cleanlist_softpin_size) < 0);
-        set_c2b_dirty(c2b);
-        spin_unlock_irqrestore(&castle_cache_block_hash_lock, flags);
+    return c2_policy->name;
+}
 
-        /* Place dirty c2b onto per-extent dirtytree. */
-        c2_dirtytree_insert(c2b);
-    }
+/**
+ * Get name of the active replacement policy.
+ */
+char* castle_cache_policy_name_get(void)
+{
+    return c2_policy->name;
 }
 
 /**
- * Mark c2b and associated c2ps clean and place on cleanlist.
- *
- * @param c2b   c2b to mark as clean.
+ * Get NUMA page pool statistics for node.
  *
- * - Remove c2b from per-extent RB-tree dirtytree
- * - Place c2b onto cache cleanlist
- *   (also occurs in hash_insert() for new c2bs)
- * - Update cleanlist accounting.
- * - Handles special case of remap c2bs which can have a clean c2b but dirty c2ps
+ * @param node          NUMA node
+ * @param pages         Returns number of cache pages on node
+ * @param free_pages    Returns number of pages on the node freelist (excluding magazines)
+ * @param allocs        Returns number of c2ps allocated on behalf of node
+ * @param remote_allocs Returns how many of those came from another node
  *
- * @also castle_cache_block_hash_insert()
- * @also c2_dirtytree_remove()
- * @also I/O callback handlers (callers)
+ * @return -EINVAL if node is not online
  */
-void clean_c2b(c2_block_t *c2b)
+int castle_cache_node_stats_get(int node,
+                                int *pages,
+                                int *free_pages,
+                                uint64_t *allocs,
+                                uint64_t *remote_allocs)
 {
-    unsigned long flags;
-    int i, nr_c2ps;
-
-    BUG_ON(!c2b_locked(c2b));
-    BUG_ON(!c2b_dirty(c2b) && (!c2b_remap(c2b)));
-
-    /* Clean all c2ps. */
-    nr_c2ps = castle_cache_pages_to_c2ps(c2b->nr_pages);
-    for (i = 0; i < nr_c2ps; i++)
-        clean_c2p(c2b->c2ps[i]);
-
-    if (c2b_remap(c2b) && !c2b_dirty(c2b))
-        return;
+    if (node < 0 || node >= MAX_NUMNODES || !node_online(node))
+        return -EINVAL;
 
-    /* Remove from per-extent dirtytree. */
-    c2_dirtytree_remove(c2b);
+    *pages         = castle_cache_node_stats[node].c2ps * PAGES_PER_C2P;
+    *free_pages    = castle_cache_page_freelist_node_size[node] * PAGES_PER_C2P;
+    *allocs        = atomic64_read(&castle_cache_node_stats[node].allocs);
+    *remote_allocs = atomic64_read(&castle_cache_node_stats[node].remote_allocs);
 
-    /* Insert onto cleanlist and do cache list accounting. */
-    spin_lock_irqsave(&castle_cache_block_hash_lock, flags);
-    list_add_tail(&c2b->clean, &castle_cache_cleanlist);
-    atomic_inc(&castle_cache_cleanlist_size);
-    if (c2b_softpin(c2b))
-        atomic_inc(&castle_cache_cleanlist_softpin_size);
-    clear_c2b_dirty(c2b);
-    spin_unlock_irqrestore(&castle_cache_block_hash_lock, flags);
+    return 0;
 }
 
-void update_c2b(c2_block_t *c2b)
+/**
+ * Select replacement policy according to castle_cache_policy module parameter.
+ */
+static int castle_cache_policy_init(void)
 {
-    int i, nr_c2ps;
-
-    BUG_ON(!c2b_write_locked(c2b));
+    int i;
 
-    /* Update all c2ps. */
-    nr_c2ps = castle_cache_pages_to_c2ps(c2b->nr_pages);
-    for(i=0; i<nr_c2ps; i++)
+    for (i = 0; i < ARRAY_SIZE(castle_cache_policies); i++)
+        if (strcmp(castle_cache_policy, castle_cache_policies[i].name) == 0)
+            break;
+    if (i == ARRAY_SIZE(castle_cache_policies))
     {
-        c2_page_t *c2p = c2b->c2ps[i];
+        castle_printk(LOG_INIT, "Unknown cache replacement policy '%s'.\n", castle_cache_policy);
+        return -EINVAL;
+    }
+    c2_policy = &castle_cache_policies[i];
 
-        BUG_ON(!c2p_write_locked(c2p));
-        set_c2p_uptodate(c2p);
+    if (c2_policy->insert == c2_2q_insert)
+    {
+        /* Remember as many evicted blocks as half the cache holds. */
+        c2_2q_ghosts_size = castle_cache_block_freelist_size / 2 + 1;
+        c2_2q_ghosts = castle_vmalloc(c2_2q_ghosts_size * sizeof(uint32_t));
+        if (!c2_2q_ghosts)
+            return -ENOMEM;
+        memset(c2_2q_ghosts, 0, c2_2q_ghosts_size * sizeof(uint32_t));
     }
-    /* Finally set the entire c2b uptodate. */
-    set_c2b_uptodate(c2b);
-}
+    castle_printk(LOG_INIT, "Cache replacement policy: %s.\n", c2_policy->name);
 
-struct bio_info {
-    int                 rw;
-    struct bio          *bio;
-    c2_block_t          *c2b;
-    uint32_t            nr_pages;
-    struct block_device *bdev;
-};
+    return 0;
+}
 
-static void c2b_remaining_io_sub(int rw, int nr_pages, c2_block_t *c2b)
+static void castle_cache_policy_fini(void)
 {
-    BUG_ON(!c2b_in_flight(c2b));
-    if(!atomic_sub_and_test(nr_pages, &c2b->remaining))
-        return;
+    if (c2_2q_ghosts)
+        castle_vfree(c2_2q_ghosts);
+    c2_2q_ghosts = NULL;
+}
 
-    debug("Completed io on c2b"cep_fmt_str_nl, cep2str(c2b->cep));
+/**********************************************************************************************
+ * Cache partitions.
+ *
+ * Every cached block is accounted to the partition of its extent type (EXT_T_*) and, if
+ * its extent belongs to a DA, to that DA's partition.  Partitions have a minimum and a
+ * maximum share of the cache, in percent of castle_cache_size.  Blocks from a partition
+ * at or below its minimum share are never evicted.  While any partition is above its
+ * maximum share, blocks from over-quota partitions are evicted first.
+ *
+ * DA partitions are allocated when the first block of a DA is cached and freed when the
+ * last one goes, unless shares are configured for them.
+ *
+ * @also castle_cache_block_hash_clean()
+ */
+#define C2_PARTITION_DA_HASH_SIZE   (64)        /**< Buckets in castle_cache_da_parts.        */
+#define C2_PARTITION_MIN_TOTAL      (50)        /**< Max sum of minimum shares, in percent.   */
 
-    /* Release the extent. */
-    castle_extent_put(c2b->cep.ext_id);
+typedef struct castle_cache_partition {
+    atomic_t             pages;         /**< Cache pages held by the partition's blocks.      */
+    unsigned int         min_share;     /**< Minimum share of the cache, in percent.          */
+    unsigned int         max_share;     /**< Maximum share of the cache, in percent.          */
+    atomic64_t           hits;
+    atomic64_t           misses;
+    /* DA partitions only. */
+    c_da_t               da_id;
+    atomic_t             ref_cnt;       /**< One per block, plus one if shares are configured.*/
+    struct hlist_node    hlist;         /**< Position in castle_cache_da_parts.               */
+    unsigned long        over_max;      /**< Bit 0 set if counted in castle_cache_parts_over. */
+} c2_partition_t;
 
-    /* At least one of the bios for this c2b had an error. Handle that first. */
-    if(c2b_bio_error(c2b))
-    {
-        clear_c2b_bio_error(c2b);
-        if (!c2b_no_resubmit(c2b)) /* This c2b can be resubmitted */
-            castle_resubmit_c2b(rw, c2b);
-        else
-        {
-            /*
-             * Caller has set no_resubmit on c2b and is responsible for checking the c2b for
-             * I/O error via !uptodate or dirty flags.
-             */
-            debug("c2b %p had bio error(s) - returning error\n", c2b);
-            clear_c2b_in_flight(c2b);
-            c2b->end_io(c2b);
-        }
-        return;
-    }
+static DEFINE_SPINLOCK(castle_cache_parts_lock);                /**< Protects DA hash, shares.*/
+static c2_partition_t          castle_cache_type_parts[EXT_T_INVALID + 1];
+static struct hlist_head       castle_cache_da_parts[C2_PARTITION_DA_HASH_SIZE];
+static unsigned int            castle_cache_parts_min_total = 0; /**< Sum of all min shares.  */
+static atomic_t                castle_cache_parts_over = ATOMIC_INIT(0);
+                                                /**< Partitions above their maximum share.    */
 
-    /* All bios succeeded for this c2b. On reads, update the c2b, on writes clean it. */
-    if(rw == READ)
-        update_c2b(c2b);
-    else
-        clean_c2b(c2b);
-    clear_c2b_in_flight(c2b);
-    c2b->end_io(c2b);
+static inline int c2_partition_configured(c2_partition_t *part)
+{
+    return part->min_share || (part->max_share < 100);
 }
 
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
-static int c2b_multi_io_end(struct bio *bio, unsigned int completed, int err)
-#else
-static void c2b_multi_io_end(struct bio *bio, int err)
-#endif
+static inline int c2_partition_under_min(c2_partition_t *part)
 {
-    struct bio_info     *bio_info = bio->bi_private;
-    struct castle_slave *slave, *io_slave;
-    c2_block_t          *c2b = bio_info->c2b;
-    struct list_head    *lh;
-#ifdef CASTLE_DEBUG
-    unsigned long flags;
+    return part->min_share &&
+        ((uint64_t)atomic_read(&part->pages) * 100 <=
+         (uint64_t)part->min_share * castle_cache_size);
+}
 
-    /* In debugging mode force the end_io to complete in atomic */
-    local_irq_save(flags);
-#endif
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
-    if (bio->bi_size)
+static inline int c2_partition_over_max(c2_partition_t *part)
+{
+    return (part->max_share < 100) &&
+        ((uint64_t)atomic_read(&part->pages) * 100 >
+         (uint64_t)part->max_share * castle_cache_size);
+}
+
+/**
+ * Update castle_cache_parts_over after the pages or the shares of part changed.
+ *
+ * Concurrent updates may leave the flag stale until the next update of the partition,
+ * which is fine for an eviction heuristic, but the counter always matches the flags.
+ */
+static inline void c2_partition_over_max_update(c2_partition_t *part)
+{
+    if (c2_partition_over_max(part))
     {
-#ifdef CASTLE_DEBUG
-        local_irq_restore(flags);
-#endif
-        return 1;
+        if (!test_and_set_bit(0, &part->over_max))
+            atomic_inc(&castle_cache_parts_over);
     }
+    else if (test_and_clear_bit(0, &part->over_max))
+        atomic_dec(&castle_cache_parts_over);
+}
 
-    /* Check if we always complete the entire BIO. Likely yes, since
-       the interface in >= 2.6.24 removes the completed variable */
-    BUG_ON((!err) && (completed != C_BLK_SIZE * bio_info->nr_pages));
-    BUG_ON(err && test_bit(BIO_UPTODATE, &bio->bi_flags));
-#endif
-    BUG_ON(atomic_read(&c2b->remaining) == 0);
+static c2_partition_t* __c2_partition_da_find(c_da_t da_id)
+{
+    c2_partition_t *part;
+    struct hlist_node *le;
 
-    if (INJECT_ERR(SLAVE_OOS_ERR))
-    {
-        struct castle_slave *oos_slave = castle_slave_find_by_bdev(bio_info->bdev);
-        if (oos_slave->uuid == castle_fault_arg)
-        {
-            castle_printk(LOG_DEVEL, "Injecting bio error on slave 0x%x\n", oos_slave->uuid);
-            castle_fault = castle_fault_arg = 0;
-            clear_bit(BIO_UPTODATE, &bio->bi_flags);
-        }
-    }
+    hlist_for_each_entry(part, le, &castle_cache_da_parts[da_id % C2_PARTITION_DA_HASH_SIZE], hlist)
+        if (part->da_id == da_id)
+            return part;
 
-    io_slave = castle_slave_find_by_bdev(bio_info->bdev);
-    BUG_ON(!io_slave);
+    return NULL;
+}
 
-    if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
+/**
+ * Get a reference to the partition of DA da_id, allocating it if necessary.
+ *
+ * @return NULL if the partition could not be allocated
+ */
+static c2_partition_t* c2_partition_da_get(c_da_t da_id, gfp_t gfp)
+{
+    c2_partition_t *part, *new = NULL;
+
+    for (;;)
     {
-        /* I/O has failed for this bio, or testing has injected fault. */
-        if (!test_and_set_bit(CASTLE_SLAVE_OOS_BIT, &io_slave->flags))
+        spin_lock(&castle_cache_parts_lock);
+        part = __c2_partition_da_find(da_id);
+        if (part)
+            atomic_inc(&part->ref_cnt);
+        else if (new)
         {
-            /*
-             * This is the first time a bio for this slave has failed. If removing this slave
-             * from service would leave us with less than the minimum number of live slaves,
-             * then BUG out. Otherwise, mark the slave as out-of-service and trigger a rebuild.
-             * Note: We only look at non-SSD slaves here, as SSD slaves can be remapped to
-             * non-SSD slaves.
-             */
-            if (!(io_slave->cs_superblock.pub.flags & CASTLE_SLAVE_SSD))
-            {
-                int nr_live_slaves=0;
-
-                rcu_read_lock();
-                list_for_each_rcu(lh, &castle_slaves.slaves)
-                {
-                    slave = list_entry(lh, struct castle_slave, list);
-                    if (!test_bit(CASTLE_SLAVE_EVACUATE_BIT, &slave->flags) &&
-                        !test_bit(CASTLE_SLAVE_OOS_BIT, &slave->flags) &&
-                        !(slave->cs_superblock.pub.flags & CASTLE_SLAVE_SSD))
-                        nr_live_slaves++;
-                }
-                rcu_read_unlock();
-                BUG_ON(nr_live_slaves < MIN_LIVE_SLAVES);
-            }
-            castle_printk(LOG_WARN, "Disabling slave 0x%x [%s], due to IO errors.\n",
-                    io_slave->uuid, io_slave->bdev_name);
-            castle_extents_rebuild_wake();
+            hlist_add_head(&new->hlist, &castle_cache_da_parts[da_id % C2_PARTITION_DA_HASH_SIZE]);
+            part = new;
+            new = NULL;
         }
+        spin_unlock(&castle_cache_parts_lock);
 
-        /* We may need to re-submit I/O for the c2b. Mark this c2b as 'bio_error' */
-        set_c2b_bio_error(((struct bio_info *)bio->bi_private)->c2b);
-    }
+        if (part)
+            break;
 
-    /* Record how many pages we've completed, potentially ending the c2b io. */
-    c2b_remaining_io_sub(bio_info->rw, bio_info->nr_pages, c2b);
-#ifdef CASTLE_DEBUG
-    local_irq_restore(flags);
-#endif
-    castle_free(bio_info);
-    bio_put(bio);
+        /* Allocate outside of the lock and retry, we might race another thread. */
+        new = castle_zalloc(sizeof(c2_partition_t), gfp);
+        if (!new)
+            return NULL;
+        new->max_share = 100;
+        new->da_id = da_id;
+        atomic_set(&new->ref_cnt, 1);
+        INIT_HLIST_NODE(&new->hlist);
+    }
+    if (new)
+        castle_free(new);
 
-    /*
-     * io_in_flight logic. The ordering of the dec and read of io_in_flight and the test
-     * of CASTLE_SLAVE_OOS_BIT is important.
-     * Decrement io_in_flight. If the slave is marked out-of-service, then check if
-     * io_in_flight is zero. If it is, then we know that it cannot now be incremented
-     * in submit_c2b_io because it is only incremented there if the out-of-service flag
-     * is not set. It is therefore safe to queue the device for release.
-     */
-    atomic_dec(&io_slave->io_in_flight);
+    return part;
+}
 
-    /* If slave is out-of-service, and no I/O is outstanding, then queue up bdev release. */
-    if (test_bit(CASTLE_SLAVE_OOS_BIT, &io_slave->flags) &&
-        (atomic_read(&io_slave->io_in_flight) == 0))
+static void c2_partition_da_put(c2_partition_t *part)
+{
+    if (atomic_dec_and_lock(&part->ref_cnt, &castle_cache_parts_lock))
     {
-        CASTLE_INIT_WORK(&io_slave->work, castle_release_oos_slave);
-        queue_work(castle_wq, &io_slave->work);
+        hlist_del(&part->hlist);
+        spin_unlock(&castle_cache_parts_lock);
+        if (test_and_clear_bit(0, &part->over_max))
+            atomic_dec(&castle_cache_parts_over);
+        castle_free(part);
     }
-
-#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
-    return 0;
-#endif
 }
 
-#ifdef CASTLE_DEBUG
-int chk_valid(c_disk_chk_t chk)
+/**
+ * Account a newly initialised c2b to its partitions.
+ */
+static void c2_partitions_add(c2_block_t *c2b)
 {
-    struct castle_slave *cs = castle_slave_find_by_uuid(chk.slave_id);
-    c_chk_t size;
+    c_da_t da_id;
 
-    if (!cs)
+    c2b->type_part = &castle_cache_type_parts[castle_extent_type_get(c2b->cep.ext_id)];
+    atomic_add(c2b->nr_pages, &c2b->type_part->pages);
+    c2_partition_over_max_update(c2b->type_part);
+
+    /* Blocks are allocated on the IO path, don't recurse into the FS. */
+    da_id = castle_extent_da_get(c2b->cep.ext_id);
+    c2b->da_part = DA_INVAL(da_id) ? NULL : c2_partition_da_get(da_id, GFP_NOIO);
+    if (c2b->da_part)
     {
-        castle_printk(LOG_DEBUG, "Couldn't find disk with uuid: %u\n", chk.slave_id);
-        return 0;
+        atomic_add(c2b->nr_pages, &c2b->da_part->pages);
+        c2_partition_over_max_update(c2b->da_part);
     }
+}
 
-    BUG_ON(test_bit(CASTLE_SLAVE_GHOST_BIT, &cs->flags));
-    castle_freespace_summary_get(cs, NULL, &size);
-    if (chk.offset >= size)
+/**
+ * Remove c2b, which is being freed, from its partitions.
+ */
+static void c2_partitions_del(c2_block_t *c2b)
+{
+    atomic_sub(c2b->nr_pages, &c2b->type_part->pages);
+    c2_partition_over_max_update(c2b->type_part);
+    if (c2b->da_part)
     {
-        castle_printk(LOG_DEBUG, "Unexpected chunk "disk_chk_fmt", Disk Size: 0x%x\n",
-                disk_chk2str(chk), size);
-        return 0;
+        atomic_sub(c2b->nr_pages, &c2b->da_part->pages);
+        c2_partition_over_max_update(c2b->da_part);
+        c2_partition_da_put(c2b->da_part);
     }
+    c2b->type_part = c2b->da_part = NULL;
+}
 
-    return 1;
+/**
+ * Account a cache lookup for c2b to its partitions.
+ */
+static inline void c2_partitions_lookup(c2_block_t *c2b, int hit)
+{
+    atomic64_inc(hit ? &c2b->type_part->hits : &c2b->type_part->misses);
+    if (c2b->da_part)
+        atomic64_inc(hit ? &c2b->da_part->hits : &c2b->da_part->misses);
 }
-#endif
 
-#define MAX_BIO_PAGES        128
+/**
+ * Is any partition above its maximum share of the cache.
+ */
+static inline int c2_partitions_over_max(void)
+{
+    return atomic_read(&castle_cache_parts_over) > 0;
+}
 
 /**
- * Allocate bio for pages & hand-off to Linux block layer.
- *
- * @param disk_chk  Chunk to be IOed to
- * @param pages     Array of pages to be used for IO
- * @param nr_pages  Size of @pages array
+ * May c2b be evicted, as far as its partitions are concerned.
  *
- * @return          number of pages remaining un-submitted if slave is,
- *                  or becomes, out-of-service. Otherwise EXIT_SUCCESS.
+ * @param over_max_only Only allow eviction if one of c2b's partitions is above its
+ *                      maximum share
  */
-int submit_c2b_io(int           rw,
-                  c2_block_t   *c2b,
-                  c_ext_pos_t   cep,
-                  c_disk_chk_t  disk_chk,
-                  struct page **pages,
-                  int           nr_pages)
+static int c2_partitions_evictable(c2_block_t *c2b, int over_max_only)
 {
-    struct castle_slave *cs;
-    sector_t sector;
-    struct bio *bio;
-    struct bio_info *bio_info;
-    int i, j, batch;
+    c2_partition_t *parts[2] = {c2b->type_part, c2b->da_part};
+    int i, over = 0;
 
-#ifdef CASTLE_DEBUG
-    /* Check that we are submitting IO to the right ceps. */
-    c_ext_pos_t dcep = cep;
-    c2_page_t *c2p;
+    for (i = 0; i < 2; i++)
+    {
+        if (!parts[i])
+            continue;
+        if (c2_partition_under_min(parts[i]))
+            return 0;
+        over |= c2_partition_over_max(parts[i]);
+    }
 
-    /* This first one could be turned into a valid error. */
-    BUG_ON(DISK_CHK_INVAL(disk_chk));
-    BUG_ON(!SUPER_EXTENT(cep.ext_id) && !chk_valid(disk_chk));
-
-    /* Only works for 1 page c2ps. */
-    BUG_ON(PAGES_PER_C2P != 1);
-    for(i=0; i<nr_pages; i++)
-    {
-        c2p = (c2_page_t *)pages[i]->lru.next;
-        if(!EXT_POS_EQUAL(c2p->cep, dcep))
-        {
-            castle_printk(LOG_DEBUG, "Unmatching ceps "cep_fmt_str", "cep_fmt_str_nl,
-                cep2str(c2p->cep), cep2str(dcep));
-            BUG();
-        }
-        dcep.offset += PAGE_SIZE;
-    }
-#endif
+    return !over_max_only || over;
+}
 
-    /* Work out the slave structure. */
-    cs = castle_slave_find_by_uuid(disk_chk.slave_id);
-    debug("slave_id=%d, cs=%p\n", disk_chk.slave_id, cs);
-    BUG_ON(!cs);
-    BUG_ON(test_bit(CASTLE_SLAVE_GHOST_BIT, &cs->flags));
-    /* Work out the sector on the slave. */
-    sector = ((sector_t)disk_chk.offset << (C_CHK_SHIFT - 9)) +
-              (BLK_IN_CHK(cep.offset) << (C_BLK_SHIFT - 9));
+/**
+ * Set shares of part, checking they're valid.
+ *
+ * @also C2_PARTITION_MIN_TOTAL
+ */
+static int __c2_partition_shares_set(c2_partition_t *part,
+                                     unsigned int min_share,
+                                     unsigned int max_share)
+{
+    BUG_ON(!spin_is_locked(&castle_cache_parts_lock));
 
-    BUG_ON(nr_pages > MAX_BIO_PAGES);
-    j = 0;
-    while (nr_pages > 0) {
+    if ((max_share > 100) || (min_share > max_share))
+        return -EINVAL;
+    /* Minimum shares must leave enough of the cache evictable. */
+    if (castle_cache_parts_min_total - part->min_share + min_share > C2_PARTITION_MIN_TOTAL)
+        return -ENOSPC;
 
-        /*
-         * io_in_flight logic. The ordering of the dec and read of io_in_flight and the test
-         * of CASTLE_SLAVE_OOS_BIT is important.
-         * Pre-increment io_in_flight, then check if the slave is out-of-service. If it is then
-         * decrement it and request device release if required. If it is not out-of-service
-         * then it remains incremented. This means that, effectively, io_in_flight is only
-         * incremented if the slave is not out-of-service.
-         */
-        atomic_inc(&cs->io_in_flight);
-        if (test_bit(CASTLE_SLAVE_OOS_BIT, &cs->flags))
-        {
-            /* Slave is OOS. Return true and release claimed device if no outstanding I/O. */
-            if (atomic_dec_and_test(&cs->io_in_flight) &&
-                (test_bit(CASTLE_SLAVE_BDCLAIMED_BIT, &cs->flags)))
-                castle_release_device(cs);
-            return nr_pages;
-        }
+    castle_cache_parts_min_total = castle_cache_parts_min_total - part->min_share + min_share;
+    part->min_share = min_share;
+    part->max_share = max_share;
+    c2_partition_over_max_update(part);
 
-        /*
-         * We may have more pages than we are allowed to submit in one bio. Each time we submit
-         * we re-calculate what we can send, because bio_get_nr_vecs can change dynamically.
-         */
-        batch = min(nr_pages, bio_get_nr_vecs(cs->bdev));
+    return 0;
+}
 
-        /* Allocate BIO and bio_info struct */
-        bio = bio_alloc(GFP_KERNEL, batch);
-        bio_info = castle_malloc(sizeof(struct bio_info), GFP_KERNEL);
-        BUG_ON(!bio_info);
+/**
+ * Set minimum and maximum cache share of an extent type.
+ *
+ * @return -EINVAL if type or shares are invalid
+ * @return -ENOSPC if the sum of minimum shares would get too large
+ */
+int castle_cache_type_partition_set(c_ext_type_t type,
+                                    unsigned int min_share,
+                                    unsigned int max_share)
+{
+    int ret;
 
-        /* Init BIO and bio_info. */
-        bio_info->rw       = rw;
-        bio_info->bio      = bio;
-        bio_info->c2b      = c2b;
-        bio_info->nr_pages = batch;
-        bio_info->bdev     = cs->bdev;
-        for(i=0; i < batch; i++)
-        {
-            bio->bi_io_vec[i].bv_page   = pages[i + j];
-            bio->bi_io_vec[i].bv_len    = PAGE_SIZE;
-            bio->bi_io_vec[i].bv_offset = 0;
-        }
-        bio->bi_sector  = sector + (sector_t)(j * 8);
-        bio->bi_bdev    = cs->bdev;
-        bio->bi_vcnt    = batch;
-        bio->bi_idx     = 0;
-        bio->bi_size    = batch * C_BLK_SIZE;
-        bio->bi_end_io  = c2b_multi_io_end;
-        bio->bi_private = bio_info;
+    if ((unsigned int)type >= EXT_T_INVALID)
+        return -EINVAL;
 
-        j += batch;
-        nr_pages -= batch;
+    spin_lock(&castle_cache_parts_lock);
+    ret = __c2_partition_shares_set(&castle_cache_type_parts[type], min_share, max_share);
+    spin_unlock(&castle_cache_parts_lock);
 
-        bio_get(bio);
-        /* Hand off to Linux block layer. Deal with barrier writes correctly. */
-        if(unlikely(c2b_barrier(c2b) &&
-                    nr_pages <= 0 &&
-                    test_bit(CASTLE_SLAVE_ORDERED_SUPP_BIT, &cs->flags)))
-        {
-            BUG_ON(rw != WRITE);
-            /* Set the barrier flag, but only if that the last bio. */
-            submit_bio(WRITE_BARRIER, bio);
-        }
-        else
-            submit_bio(rw, bio);
-        if(bio_flagged(bio, BIO_EOPNOTSUPP))
-        {
-            castle_printk(LOG_ERROR, "BIO flagged not supported.\n");
-            WARN_ON(1);
-        }
-        bio_put(bio);
-    }
-    return EXIT_SUCCESS;
+    return ret;
 }
 
-typedef struct castle_io_array {
-    struct page *io_pages[MAX_BIO_PAGES];
-    c_ext_pos_t start_cep;
-    c_chk_t chunk;
-    int next_idx;
-} c_io_array_t;
-
 /**
- * Select the next slave to read from.
+ * Set minimum and maximum cache share of a DA.
  *
- * @param chunks    The chunk for which a slave is to be selected
- * @param k_factor  k_factor for the chunk
- * @param idx       Returns the index in the chunk for the slave to use
+ * @return -EINVAL if shares are invalid
+ * @return -ENOSPC if the sum of minimum shares would get too large
+ * @return -ENOMEM if the partition could not be allocated
  *
- * @return          ENOENT if no slave found, EXIT_SUCCESS if found
- *                  EXIT_SUCCESS if a slave was found
+ * @also castle_cache_da_partition_release()
  */
-static int c_io_next_slave_get(c2_block_t *c2b, c_disk_chk_t *chunks, int k_factor, int *idx)
+int castle_cache_da_partition_set(c_da_t da_id,
+                                  unsigned int min_share,
+                                  unsigned int max_share)
 {
-    struct castle_slave *slave;
-    int i, try_second, disk_idx;
+    c2_partition_t *part;
+    int was_configured, is_configured, ret;
 
-    /*
-     * At some point we'll have a proper read slave scheduler to optimise read I/O as mentioned
-     * above, but for the moment just return the first working slave.
-     *
-     * At the moment, when prefetching, avoid using the first copy, which may be stored on SSDs.
-     */
-    try_second = c2b_prefetch(c2b);
-    /* Loop around, searching for disks in service. */
-    disk_idx = -1;
-    for(i=0; i<k_factor; i++)
-    {
-        slave = castle_slave_find_by_uuid(chunks[i].slave_id);
-        BUG_ON(!slave);
-        if (!test_bit(CASTLE_SLAVE_OOS_BIT, &slave->flags))
-        {
-            disk_idx = i;
-            /* If we are not looking for second copy, or we are already looking past the first
-               copy, terminate. */
-            if(!try_second || i != 0)
-                goto out;
-        }
-    }
-out:
-    if(disk_idx >= 0)
+    if (!(part = c2_partition_da_get(da_id, GFP_KERNEL)))
+        return -ENOMEM;
+
+    /* Configured state must be sampled under the lock, so that concurrent sets agree
+       on who takes or drops the configured reference. */
+    spin_lock(&castle_cache_parts_lock);
+    was_configured = c2_partition_configured(part);
+    ret = __c2_partition_shares_set(part, min_share, max_share);
+    is_configured = c2_partition_configured(part);
+    spin_unlock(&castle_cache_parts_lock);
+
+    /* Configured partitions hold an extra reference, to keep their shares. */
+    if (!was_configured && is_configured)
+        return ret;
+    if (was_configured && !is_configured)
+        c2_partition_da_put(part);
+    c2_partition_da_put(part);
+
+    return ret;
+}
+
+/**
+ * Drop the cache shares of a DA, e.g. when it is destroyed.
+ *
+ * Unlike castle_cache_da_partition_set() never allocates a partition.
+ */
+void castle_cache_da_partition_release(c_da_t da_id)
+{
+    c2_partition_t *part;
+    int last = 0;
+
+    spin_lock(&castle_cache_parts_lock);
+    part = __c2_partition_da_find(da_id);
+    if (part && c2_partition_configured(part))
     {
-        *idx = disk_idx;
-        return EXIT_SUCCESS;
+        BUG_ON(__c2_partition_shares_set(part, 0, 100));
+        /* Drop the configured reference. */
+        if ((last = atomic_dec_and_test(&part->ref_cnt)))
+            hlist_del(&part->hlist);
     }
-    BUG_ON(disk_idx != -1);
-    /* Could not find a slave to read from. */
-    return -ENOENT;
+    spin_unlock(&castle_cache_parts_lock);
+
+    if (last)
+        castle_free(part);
+}
 
+static void c2_partition_stats_get(c2_partition_t *part, c2_partition_stats_t *stats)
+{
+    stats->pages     = atomic_read(&part->pages);
+    stats->min_share = part->min_share;
+    stats->max_share = part->max_share;
+    stats->hits      = atomic64_read(&part->hits);
+    stats->misses    = atomic64_read(&part->misses);
 }
 
 /**
- * Dispatches k copies of the I/O.
+ * Get occupancy, shares and hit statistics of an extent type partition.
+ */
+void castle_cache_type_partition_stats_get(c_ext_type_t type, c2_partition_stats_t *stats)
+{
+    BUG_ON((unsigned int)type > EXT_T_INVALID);
+
+    c2_partition_stats_get(&castle_cache_type_parts[type], stats);
+}
+
+/**
+ * Get occupancy, shares and hit statistics of a DA partition.
  *
- * @see submit_c2b_io()
+ * DAs without cached blocks or configured shares report an empty partition.
  */
-static int c_io_array_submit(int rw,
-                             c2_block_t *c2b,
-                             c_disk_chk_t *chunks,
-                             int k_factor,
-                             c_io_array_t *array,
-                             c_ext_id_t ext_id)
+void castle_cache_da_partition_stats_get(c_da_t da_id, c2_partition_stats_t *stats)
 {
-    int                  i, nr_pages, nr_pages_remaining, read_idx, found;
-    struct castle_slave *slave;
-    int                  ret = 0;
+    c2_partition_t *part;
 
-    nr_pages = array->next_idx;
-    debug("Submitting io_array of %d pages, for cep "cep_fmt_str", k_factor=%d, rw=%s\n",
-        nr_pages,
-        cep2str(array->start_cep),
-        k_factor,
-        (rw == READ) ? "read" : "write");
+    memset(stats, 0, sizeof(c2_partition_stats_t));
+    stats->max_share = 100;
 
-    BUG_ON((nr_pages <= 0) || (nr_pages > MAX_BIO_PAGES));
+    spin_lock(&castle_cache_parts_lock);
+    if ((part = __c2_partition_da_find(da_id)))
+        c2_partition_stats_get(part, stats);
+    spin_unlock(&castle_cache_parts_lock);
+}
 
-    if (rw == READ) /* Read from one slave only */
-    {
-        /* Accounting */
-        atomic_add(nr_pages, &castle_cache_read_stats);
+static void castle_cache_partitions_init(void)
+{
+    int i;
 
-retry:
-        /* Call the slave scheduler to find the next slave to read from */
-        ret = c_io_next_slave_get(c2b, chunks, k_factor, &read_idx);
-        /*
-         * If there is a read failure here (no live slaves found) then we return error.
-         * Callers must check for read failure. For non-superblock extents this will be fatal.
-         * For superblock extents this is non-fatal, but the caller needs to know not to use the
-         * returned buffers.
-         */
-        if (ret)
-            return ret;
+    memset(castle_cache_type_parts, 0, sizeof(castle_cache_type_parts));
+    for (i = 0; i < ARRAY_SIZE(castle_cache_type_parts); i++)
+        castle_cache_type_parts[i].max_share = 100;
+    for (i = 0; i < C2_PARTITION_DA_HASH_SIZE; i++)
+        INIT_HLIST_HEAD(&castle_cache_da_parts[i]);
+    castle_cache_parts_min_total = 0;
+    atomic_set(&castle_cache_parts_over, 0);
+}
 
-        slave = castle_slave_find_by_uuid(chunks[read_idx].slave_id);
-        BUG_ON(!slave);
+/**
+ * Free configured DA partitions.  All blocks must have been freed already.
+ */
+static void castle_cache_partitions_fini(void)
+{
+    c2_partition_t *part;
+    struct hlist_node *le, *te;
+    int i;
 
-        /* Only increment remaining count once we know we'll submit the IO. */
-        atomic_add(nr_pages, &c2b->remaining);
-        /* Submit the IO. */
-        nr_pages_remaining = submit_c2b_io(READ, c2b, array->start_cep, chunks[read_idx],
-                            array->io_pages, nr_pages);
-        if (nr_pages_remaining)
+    for (i = 0; i < C2_PARTITION_DA_HASH_SIZE; i++)
+        hlist_for_each_entry_safe(part, le, te, &castle_cache_da_parts[i], hlist)
         {
-            /*
-             * Failed to read nr_pages_remaining pages from this slave because it has gone
-             * out-of-service. Retry to find another slave to read from.
-             */
-            atomic_sub(nr_pages_remaining, &c2b->remaining);
-            goto retry;
+            BUG_ON(atomic_read(&part->pages));
+            hlist_del(le);
+            castle_free(part);
         }
+}
 
-        /* Return with success. */
-        return EXIT_SUCCESS;
-    }
+/**
+ * Remove a c2b from its per-extent dirtytree.
+ *
+ * c2b holds a reference to the dirtytree.
+ *
+ * @param c2b   Block to remove
+ */
+static int c2_dirtytree_remove(c2_block_t *c2b)
+{
+    c_ext_dirtytree_t *dirtytree;
+    unsigned long flags;
+    cycles_t hold;
 
-    /* Write to all slaves */
-    BUG_ON(rw != WRITE);
-    found = 0;
-    for(i=0; i<k_factor; i++)
-    {
-        slave = castle_slave_find_by_uuid(chunks[i].slave_id);
-        BUG_ON(!slave);
+    BUG_ON(atomic_read(&c2b->count) == 0);
 
-        if (!test_bit(CASTLE_SLAVE_OOS_BIT, &slave->flags))
-        {
-            found = 1;
-            /* Slave is not out-of-sevice - submit the IO */
-            atomic_add(nr_pages, &castle_cache_write_stats);
-            atomic_add(nr_pages, &c2b->remaining);
-            nr_pages_remaining = submit_c2b_io(WRITE, c2b, array->start_cep, chunks[i],
-                                               array->io_pages, nr_pages);
-            if (nr_pages_remaining)
-            {
-                /*
-                 * Failed to write nr_pages_remaining pages to this slave because it has
-                 * gone out-of-service. Skip to next slave.
-                 */
-                atomic_sub(nr_pages_remaining, &castle_cache_write_stats);
-                atomic_sub(nr_pages_remaining, &c2b->remaining);
-                continue;
-            }
-        }
-    }
+    /* Get extent dirtytree from c2b. */
+    dirtytree = c2b->dirtytree;
+    BUG_ON(!dirtytree);
+    spin_lock_irqsave(&dirtytree->lock, flags);
 
-    /*
-     * If no live slave was found , and the extent is for a superblock then we can treat this
-     * as successful because we don't care if writes fail to a to the superblock of a now-dead
-     * disk. We won't have incremented c2b->remaining so doing nothing here is safe.
-     * For all other extent types, if we find no live slave then return EAGAIN so the caller
-     * can retry if it wants.
-     */
-    if (!found && !SUPER_EXTENT(ext_id))
+    /* Remove c2b from the tree. */
+    spin_lock(&castle_cache_block_lru_lock); /* protects clean/dirty union. */
+    hold = get_cycles();
+    rb_erase(&c2b->rb_dirtytree, &dirtytree->rb_root);
+    dirtytree->nr_pages -= c2b->nr_pages;
+    if (RB_EMPTY_ROOT(&dirtytree->rb_root))
     {
-        debug("Could not submit I/O. Only oos slaves specified in disk chunk\n");
-        return -EAGAIN;
+        /* Last dirty c2b for this extent, remove it from the global
+         * list of dirty extents. */
+        list_del_init(&dirtytree->list);
+        BUG_ON(atomic_dec_return(&castle_cache_extent_dirtylist_size) < 0);
     }
+    spin_unlock(&castle_cache_block_lru_lock);
+    castle_cache_lock_stats_update(castle_cache_block_lru_lock_stats, hold);
 
-    return EXIT_SUCCESS;
-}
+    /* Release lock and put reference, potentially freeing the dirtytree if
+     * the extent has already been freed. */
+    c2b->dirtytree = NULL;
+    spin_unlock_irqrestore(&dirtytree->lock, flags);
+    castle_extent_dirtytree_put(dirtytree);
 
-static inline void c_io_array_init(c_io_array_t *array)
-{
-    array->start_cep = INVAL_EXT_POS;
-    array->chunk = INVAL_CHK;
-    array->next_idx = 0;
+    return EXIT_SUCCESS;
 }
 
 /**
- * Add page to I/O array.
+ * Place a c2b onto its per-extent dirtytree.
+ *
+ * @param c2b   Block to insert
+ *
+ * In order to dirty a c2b its extent must exist.
+ *
+ * - Get and hold per-extent dirtytree reference via c2b->cep.ext_id
+ * - Lock dirtytree and insert c2b into RB-tree
+ * - If RB-tree was previously empty, thread dirtytree onto the global
+ *   list of dirty extents (castle_cache_extent_dirtylist)
+ * - Don't drop the dirtytree reference (put in c2_dirtytree_remove())
+ *
+ * @also c2_dirtytree_remove()
  */
-static inline int c_io_array_page_add(c_io_array_t *array,
-                                      c_ext_pos_t cep,
-                                      c_chk_t logical_chunk,
-                                      struct page *page)
+static int c2_dirtytree_insert(c2_block_t *c2b)
 {
-    c_ext_pos_t cur_cep;
+    struct rb_node **p, *parent = NULL;
+    c_ext_dirtytree_t *dirtytree;
+    c2_block_t *tree_c2b;
+    unsigned long flags;
+    cycles_t hold;
+    int cmp;
 
-    /* We cannot accept any more pages, if we already have MAX_BIO_PAGES. */
-    if(array->next_idx >= MAX_BIO_PAGES)
-        return -1;
-    /* If it is an established array, reject pages for different chunks, or non-sequential ceps. */
-    if(array->next_idx > 0)
+    /* Get dirtytree and hold its lock while we manipulate the tree. */
+    dirtytree = castle_extent_dirtytree_by_id_get(c2b->cep.ext_id);
+    BUG_ON(!dirtytree);
+    spin_lock_irqsave(&dirtytree->lock, flags);
+
+    /* Find position in tree. */
+    p = &dirtytree->rb_root.rb_node;
+    while (*p)
     {
-        cur_cep = array->start_cep;
-        cur_cep.offset += array->next_idx * PAGE_SIZE;
-        if(logical_chunk != array->chunk)
-            return -2;
-        if(!EXT_POS_EQUAL(cur_cep, cep))
-            return -3;
+        parent = *p;
+        tree_c2b = rb_entry(parent, c2_block_t, rb_dirtytree);
+
+        cmp = EXT_POS_COMP(c2b->cep, tree_c2b->cep);
+        if (cmp < 0)
+            p = &(*p)->rb_left;
+        else if (cmp > 0)
+            p = &(*p)->rb_right;
+        else
+        {
+            /* We found a c2b with the same offset.  Larger to the right. */
+            /** @TODO would it make more sense to have C2B_COMP() above that calls
+             * EXT_POS_COMP and does below if result == 0? */
+
+            if (c2b->nr_pages < tree_c2b->nr_pages)
+                p = &(*p)->rb_left;
+            else if (c2b->nr_pages > tree_c2b->nr_pages)
+                p = &(*p)->rb_right;
+            else
+            {
+                castle_printk(LOG_ERROR, "c2b with cep "cep_fmt_str_nl" already in tree.\n",
+                        cep2str(c2b->cep));
+                BUG();
+            }
+        }
     }
-    /* If it is a new array, initialise start_cep and chunk. */
-    if(array->next_idx == 0)
+
+    /* Insert dirty c2b into the tree. */
+    spin_lock(&castle_cache_block_lru_lock); /* protects clean/dirty union. */
+    hold = get_cycles();
+    if (RB_EMPTY_ROOT(&dirtytree->rb_root))
     {
-        array->start_cep = cep;
-        array->chunk = logical_chunk;
-        cur_cep = cep;
+        /* First dirty c2b for this extent, place it onto the global
+         * list of dirty extents. */
+        list_add(&dirtytree->list, &castle_cache_extent_dirtylist);
+        atomic_inc(&castle_cache_extent_dirtylist_size);
     }
-    /* Add the page, increment the index. */
-    array->io_pages[array->next_idx] = page;
-    array->next_idx++;
+    rb_link_node(&c2b->rb_dirtytree, parent, p);
+    rb_insert_color(&c2b->rb_dirtytree, &dirtytree->rb_root);
+    dirtytree->nr_pages += c2b->nr_pages;
+    spin_unlock(&castle_cache_block_lru_lock);
+    castle_cache_lock_stats_update(castle_cache_block_lru_lock_stats, hold);
+
+    /* Keep the reference until the c2b is clean but drop the lock. */
+    c2b->dirtytree = dirtytree;
+    spin_unlock_irqrestore(&dirtytree->lock, flags);
 
     return EXIT_SUCCESS;
 }
 
 /**
- * Callback for synchronous c2b I/O completion.
+ * Mark c2b and associated c2ps dirty and place on dirtytree.
  *
- * Wakes thread that dispatched the synchronous I/O
+ * @param c2b   c2b to mark as dirty.
  *
- * @param c2b   completed c2b I/O
+ * - Insert c2b into per-extent RB-tree dirtytree
+ * - Move c2b from cleanlist to dirtytree
+ *   (also occurs when we free blocks in hash_clean())
+ * - Update cleanlist accounting.
+ *
+ * By maintaining a per-extent list of dirty c2bs we can flush dirty data out
+ * in a contiguous fashion to reduce disk seeks.
+ *
+ * @also castle_cache_block_hash_clean()
  */
-static void castle_cache_sync_io_end(c2_block_t *c2b)
+void dirty_c2b(c2_block_t *c2b)
 {
-    struct completion *completion = c2b->private;
+    unsigned long flags;
+    cycles_t hold;
+    int i, nr_c2ps;
 
-    complete(completion);
+    BUG_ON(!c2b_write_locked(c2b));
+    /* With overlapping c2bs we cannot rely on this c2b being dirty.
+     * We have to dirty all c2ps. */
+    nr_c2ps = castle_cache_pages_to_c2ps(c2b->nr_pages);
+    for (i = 0; i < nr_c2ps; i++)
+        dirty_c2p(c2b->c2ps[i]);
+
+    /* Place c2b on per-extent dirtytree if it is not already dirty. */
+    if (!c2b_dirty(c2b))
+    {
+        spin_lock_irqsave(&castle_cache_block_lru_lock, flags);
+        hold = get_cycles();
+
+        /* Don't continue if we've raced another thread. */
+        if (c2b_dirty(c2b))
+        {
+            spin_unlock_irqrestore(&castle_cache_block_lru_lock, flags);
+            castle_cache_lock_stats_update(castle_cache_block_lru_lock_stats, hold);
+            return;
+        }
+
+        /* Remove from cleanlist and do cachelist accounting. */
+        c2_policy->remove(c2b);
+        BUG_ON(atomic_dec_return(&castle_cache_cleanlist_size) < 0);
+        if (c2b_softpin(c2b))
+            BUG_ON(atomic_dec_return(&castle_cache_cleanlist_softpin_size) < 0);
+        set_c2b_dirty(c2b);
+        spin_unlock_irqrestore(&castle_cache_block_lru_lock, flags);
+        castle_cache_lock_stats_update(castle_cache_block_lru_lock_stats, hold);
+
+        /* Place dirty c2b onto per-extent dirtytree. */
+        c2_dirtytree_insert(c2b);
+    }
 }
 
 /**
- * Generates synchronous write I/O for disk block(s) associated with a remap c2b.
- * A remap c2b maps just one logical chunk.
+ * Mark c2b and associated c2ps clean and place on cleanlist.
  *
- * Iterates over passed c2b's c2ps
- * Populates array of pages from c2ps
- * Dispatches array to all disk chunks if a dirty page was found
- * Dispatches array to remap disk chunks only if a dirty page was not found
- * Continues until whole c2b has been dispatched
+ * @param c2b   c2b to mark as clean.
  *
- * @param c2b       The c2b to be written
- * @param chunks    The array of disk chunks for this logical chunk
- * @param nr_remaps The number of disk chunks that are for remaps
+ * - Remove c2b from per-extent RB-tree dirtytree
+ * - Place c2b onto cache cleanlist
+ *   (also occurs in hash_insert() for new c2bs)
+ * - Update cleanlist accounting.
+ * - Handles special case of remap c2bs which can have a clean c2b but dirty c2ps
  *
- * @also c_io_array_init()
- * @also c_io_array_page_add()
- * @also c_io_array_submit()
- * @also submit_c2b()
+ * @also castle_cache_block_hash_insert()
+ * @also c2_dirtytree_remove()
+ * @also I/O callback handlers (callers)
  */
-int submit_c2b_remap_rda(c2_block_t *c2b, c_disk_chk_t *chunks, int nr_remaps)
+void clean_c2b(c2_block_t *c2b)
 {
-    c2_page_t           *c2p;
-    c_io_array_t        *io_array;
-    struct page         *page;
-    int                 ret = 0;
-    c_ext_pos_t         cur_cep;
-    c_ext_id_t          ext_id = c2b->cep.ext_id;
-    uint32_t            k_factor = castle_extent_kfactor_get(ext_id);
-    int                 found_dirty_page = 0;
-    void                *ext_p;
-    struct completion   completion;
-
-    /* This can only be called with chunks populated, and nr_remaps > 0 */
-    BUG_ON(!chunks || !nr_remaps);
+    unsigned long flags;
+    cycles_t hold;
+    int i, nr_c2ps;
 
     BUG_ON(!c2b_locked(c2b));
+    BUG_ON(!c2b_dirty(c2b) && (!c2b_remap(c2b)));
 
-    debug("Submitting remap write c2b "cep_fmt_str", for %s\n", __cep2str(c2b->cep));
-
-    io_array = kmem_cache_alloc(castle_io_array_cache, GFP_KERNEL);
-    if (!io_array)
-        return -1;
+    /* Clean all c2ps. */
+    nr_c2ps = castle_cache_pages_to_c2ps(c2b->nr_pages);
+    for (i = 0; i < nr_c2ps; i++)
+        clean_c2p(c2b->c2ps[i]);
 
-    /* Set in-flight bit on the block. */
-    set_c2b_in_flight(c2b);
+    if (c2b_remap(c2b) && !c2b_dirty(c2b))
+        return;
 
-    /* c2b->remaining is effectively a reference count. Get one ref before we start. */
-    BUG_ON(atomic_read(&c2b->remaining) != 0);
-    atomic_inc(&c2b->remaining);
-    c_io_array_init(io_array);
-    /* Get extent reference (so that extent doesn't disappear under underneath us. */
-    ext_p = castle_extent_get(c2b->cep.ext_id);
+    /* Remove from per-extent dirtytree. */
+    c2_dirtytree_remove(c2b);
 
-    c2b->end_io = castle_cache_sync_io_end;
-    c2b->private = &completion;
-    init_completion(&completion);
+    /* Insert onto cleanlist and do cache list accounting. */
+    spin_lock_irqsave(&castle_cache_block_lru_lock, flags);
+    hold = get_cycles();
+    c2_policy->requeue(c2b);
+    atomic_inc(&castle_cache_cleanlist_size);
+    if (c2b_softpin(c2b))
+        atomic_inc(&castle_cache_cleanlist_softpin_size);
+    clear_c2b_dirty(c2b);
+    spin_unlock_irqrestore(&castle_cache_block_lru_lock, flags);
+    castle_cache_lock_stats_update(castle_cache_block_lru_lock_stats, hold);
+}
 
-    found_dirty_page = 0;
-    /* Everything initialised, go through each page in the c2p. */
-    c2b_for_each_page_start(page, c2p, cur_cep, c2b)
-    {
-        /* If any page is found to be dirty, the next c_io_array_submit must write to all slaves */
-        if (c2p_dirty(c2p))
-            found_dirty_page = 1;
+void update_c2b(c2_block_t *c2b)
+{
+    int i, nr_c2ps;
 
-        /* Add the page to the io array. */
-        if(c_io_array_page_add(io_array, cur_cep, 0, page) != EXIT_SUCCESS)
-        {
-            /*
-             * Failed to add this page to the array (see return code for reason).
-             * Dispatch the current array, initialise a new one and
-             * attempt to add the page to the new array.
-             */
-            debug("%s on c2p->cep="cep_fmt_str_nl,
-                    (found_dirty_page ? "Writing to all slaves" : "Writing to remap slaves only"),
-                    cep2str(c2p->cep));
+    BUG_ON(!c2b_write_locked(c2b));
 
-            /* Submit the array. */
-            ret = c_io_array_submit(WRITE, c2b, chunks, (found_dirty_page ? k_factor : nr_remaps),
-                                io_array, ext_id);
-            if (ret)
-            {
-                /*
-                 * Could not submit the IO, possibly due to a slave going out-of-service. Drop
-                 * our reference and return early.
-                 */
-                c2b_remaining_io_sub(WRITE, 1, c2b);
-                goto out;
-            }
-            /* Reinit the array, and re-try adding the current page. This should not
-               fail any more. */
-            c_io_array_init(io_array);
-            found_dirty_page = 0;
-            BUG_ON(c_io_array_page_add(io_array, cur_cep, 0, page));
-        }
+    /* Update all c2ps. */
+    nr_c2ps = castle_cache_pages_to_c2ps(c2b->nr_pages);
+    for(i=0; i<nr_c2ps; i++)
+    {
+        c2_page_t *c2p = c2b->c2ps[i];
+
+        BUG_ON(!c2p_write_locked(c2p));
+        set_c2p_uptodate(c2p);
     }
-    c2b_for_each_page_end(page, c2p, cur_cep, c2b);
+    /* Finally set the entire c2b uptodate. */
+    set_c2b_uptodate(c2b);
+}
 
-    /* IO array may contain leftover pages, submit those too. */
-    if(io_array->next_idx > 0)
+struct bio_info {
+    int                 rw;
+    struct bio          *bio;
+    c2_block_t          *c2b;
+    uint32_t            nr_pages;
+    struct block_device *bdev;
+    struct bio_info     *next;      /**< Next c2b sharing this bio (coalesced writeback). */
+};
+
+static void c2b_remaining_io_sub(int rw, int nr_pages, c2_block_t *c2b)
+{
+    BUG_ON(!c2b_in_flight(c2b));
+    if(!atomic_sub_and_test(nr_pages, &c2b->remaining))
+        return;
+
+    debug("Completed io on c2b"cep_fmt_str_nl, cep2str(c2b->cep));
+
+    /* Release the extent. */
+    castle_extent_put(c2b->cep.ext_id);
+
+    /* At least one of the bios for this c2b had an error. Handle that first. */
+    if(c2b_bio_error(c2b))
     {
-        ret = c_io_array_submit(WRITE, c2b, chunks, (found_dirty_page ? k_factor : nr_remaps),
-                                io_array, ext_id);
-        if (ret)
+        clear_c2b_bio_error(c2b);
+        if (!c2b_no_resubmit(c2b)) /* This c2b can be resubmitted */
+            castle_resubmit_c2b(rw, c2b);
+        else
         {
             /*
-             * Could not submit the IO, possibly due to a slave going out-of-service. Drop
-             * our reference and return early.
+             * Caller has set no_resubmit on c2b and is responsible for checking the c2b for
+             * I/O error via !uptodate or dirty flags.
              */
-            c2b_remaining_io_sub(WRITE, 1, c2b);
-            goto out;
+            debug("c2b %p had bio error(s) - returning error\n", c2b);
+            clear_c2b_in_flight(c2b);
+            c2b->end_io(c2b);
         }
+        return;
     }
-    /* Drop the 1 ref. */
-    c2b_remaining_io_sub(WRITE, 1, c2b);
-
-out:
-    wait_for_completion(&completion);
 
-    kmem_cache_free(castle_io_array_cache, io_array);
-    if (ret)
-        return ret;
+    /* All bios succeeded for this c2b. On reads, update the c2b, on writes clean it. */
+    if(rw == READ)
+        update_c2b(c2b);
     else
-        return(c2b_dirty(c2b));
+        clean_c2b(c2b);
+    clear_c2b_in_flight(c2b);
+    c2b->end_io(c2b);
 }
 
-/**
- * Generates I/O for disk block(s) associated with the c2b.
- *
- * Iterates over passed c2b's c2ps (ignoring those that are clean/uptodate for WRITEs/READs)
- * Populates array of pages from c2ps
- * Dispatches array once it reaches the a chunk boundry
- * Continues until whole c2b has been dispatched
- *
- * @see c_io_array_init()
- * @see c_io_array_page_add()
- * @see c_io_array_submit()
- */
-static int submit_c2b_rda(int rw, c2_block_t *c2b)
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
+static int c2b_multi_io_end(struct bio *bio, unsigned int completed, int err)
+#else
+static void c2b_multi_io_end(struct bio *bio, int err)
+#endif
 {
-    c2_page_t    *c2p;
-    c_io_array_t *io_array;
-    struct page  *page;
-    int           skip_c2p, ret = 0;
-    c_ext_pos_t   cur_cep;
-    c_chk_t       last_chk, cur_chk;
-    c_ext_id_t    ext_id = c2b->cep.ext_id;
-    uint32_t      k_factor = castle_extent_kfactor_get(ext_id);
-    c_disk_chk_t  chunks[k_factor];
-    void         *ext_p;
-
-    debug("Submitting c2b "cep_fmt_str", for %s\n",
-            __cep2str(c2b->cep), (rw == READ) ? "read" : "write");
-
-    io_array = kmem_cache_alloc(castle_io_array_cache, GFP_KERNEL);
-    if (!io_array)
-        return -1;
+    struct bio_info     *bio_info = bio->bi_private, *next;
+    struct castle_slave *slave, *io_slave;
+    c2_block_t          *c2b = bio_info->c2b;
+    struct list_head    *lh;
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
+    uint32_t             nr_pages;
+#endif
+#ifdef CASTLE_DEBUG
+    unsigned long flags;
 
-    /* c2b->remaining is effectively a reference count. Get one ref before we start. */
-    BUG_ON(atomic_read(&c2b->remaining) != 0);
-    atomic_inc(&c2b->remaining);
-    last_chk = INVAL_CHK;
-    cur_chk = INVAL_CHK;
-    c_io_array_init(io_array);
-    /* Get extent reference (so that extent doesn't disappear under underneath us. */
-    ext_p = castle_extent_get(c2b->cep.ext_id);
-    /* Everything initialised, go through each page in the c2p. */
-    c2b_for_each_page_start(page, c2p, cur_cep, c2b)
+    /* In debugging mode force the end_io to complete in atomic */
+    local_irq_save(flags);
+#endif
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
+    if (bio->bi_size)
     {
-        cur_chk = CHUNK(cur_cep.offset);
-        debug("Processing a c2b page, last_chk=%d, cur_chk=%d\n", last_chk, cur_chk);
-
-        /* Do not read into uptodate pages, do not write out of clean pages. */
-        skip_c2p = ((rw == READ)  && c2p_uptodate(c2p)) ||
-                   ((rw == WRITE) && !c2p_dirty(c2p));
-        debug("%s %s on c2p->cep="cep_fmt_str_nl,
-                    (skip_c2p ? "Skipping" : "Not skipping"),
-                    (rw == READ ? "read" : "write"),
-                    cep2str(c2p->cep));
-        /* Move to the next page, if we are not supposed to do IO on this page. */
-        if(skip_c2p)
-            goto next_page;
+#ifdef CASTLE_DEBUG
+        local_irq_restore(flags);
+#endif
+        return 1;
+    }
 
-        /* If we are not skipping, add the page to io array. */
-        if(c_io_array_page_add(io_array, cur_cep, cur_chk, page) != EXIT_SUCCESS)
-        {
-            /* Failed to add this page to the array (see return code for reason).
-             * Dispatch the current array, initialise a new one and
-             * attempt to add the page to the new array.
-             *
-             * We've got physical chunks for last_chk (logical chunk), this should
-               match with the logical chunk stored in io_array. */
-            BUG_ON(io_array->chunk != last_chk);
-            /* Submit the array. */
-            ret = c_io_array_submit(rw, c2b, chunks, k_factor, io_array, ext_id);
-            if (ret)
-            {
-                /*
-                 * Could not submit the IO, possibly due to a slave going out-of-service. Drop
-                 * our reference and return early.
-                 */
-                c2b_remaining_io_sub(rw, 1, c2b);
-                goto out;
-            }
-            /* Reinit the array, and re-try adding the current page. This should not
-               fail any more. */
-            c_io_array_init(io_array);
-            BUG_ON(c_io_array_page_add(io_array, cur_cep, cur_chk, page));
-        }
+    /* Check if we always complete the entire BIO. Likely yes, since
+       the interface in >= 2.6.24 removes the completed variable */
+    nr_pages = 0;
+    for (next = bio_info; next; next = next->next)
+        nr_pages += next->nr_pages;
+    BUG_ON((!err) && (completed != C_BLK_SIZE * nr_pages));
+    BUG_ON(err && test_bit(BIO_UPTODATE, &bio->bi_flags));
+#endif
 
-        /* Update chunk map when we move to a new chunk. */
-        if(cur_chk != last_chk)
+    if (INJECT_ERR(SLAVE_OOS_ERR))
+    {
+        struct castle_slave *oos_slave = castle_slave_find_by_bdev(bio_info->bdev);
+        if (oos_slave->uuid == castle_fault_arg)
         {
-            int ret;
-            debug("Asking extent manager for "cep_fmt_str_nl,
-                    cep2str(cur_cep));
-            ret = castle_extent_map_get(ext_p,
-                                        CHUNK(cur_cep.offset),
-                                        chunks,
-                                        rw);
-            /* Return value is supposed to be k_factor, unless the
-               extent has been deleted. */
-            BUG_ON((ret != 0) && (ret != k_factor));
-            if(ret == 0)
-            {
-                /* Complete the IO by dropping our reference, return early. */
-                c2b_remaining_io_sub(rw, 1, c2b);
-                goto out;
-            }
-
-            debug("chunks[0]="disk_chk_fmt_nl, disk_chk2str(chunks[0]));
-            last_chk = cur_chk;
+            castle_printk(LOG_DEVEL, "Injecting bio error on slave 0x%x\n", oos_slave->uuid);
+            castle_fault = castle_fault_arg = 0;
+            clear_bit(BIO_UPTODATE, &bio->bi_flags);
         }
     }
-next_page:
-    c2b_for_each_page_end(page, c2p, cur_cep, c2b);
 
-    /* IO array may contain leftover pages, submit those too. */
-    if(io_array->next_idx > 0)
+    io_slave = castle_slave_find_by_bdev(bio_info->bdev);
+    BUG_ON(!io_slave);
+
+    if (!test_bit(BIO_UPTODATE, &bio->bi_flags))
     {
-        /* Chunks array is always initialised for last_chk. */
-        BUG_ON(io_array->chunk != last_chk);
-        ret = c_io_array_submit(rw, c2b, chunks, k_factor, io_array, ext_id);
-        if (ret)
+        /* I/O has failed for this bio, or testing has injected fault. */
+        if (!test_and_set_bit(CASTLE_SLAVE_OOS_BIT, &io_slave->flags))
         {
             /*
-             * Could not submit the IO, possibly due to a slave going out-of-service. Drop
-             * our reference and return early.
+             * This is the first time a bio for this slave has failed. If removing this slave
+             * from service would leave us with less than the minimum number of live slaves,
+             * then BUG out. Otherwise, mark the slave as out-of-service and trigger a rebuild.
+             * Note: We only look at non-SSD slaves here, as SSD slaves can be remapped to
+             * non-SSD slaves.
              */
-            c2b_remaining_io_sub(rw, 1, c2b);
-            goto out;
+            if (!(io_slave->cs_superblock.pub.flags & CASTLE_SLAVE_SSD))
+            {
+                int nr_live_slaves=0;
+
+                rcu_read_lock();
+                list_for_each_rcu(lh, &castle_slaves.slaves)
+                {
+                    slave = list_entry(lh, struct castle_slave, list);
+                    if (!test_bit(CASTLE_SLAVE_EVACUATE_BIT, &slave->flags) &&
+                        !test_bit(CASTLE_SLAVE_OOS_BIT, &slave->flags) &&
+                        !(slave->cs_superblock.pub.flags & CASTLE_SLAVE_SSD))
+                        nr_live_slaves++;
+                }
+                rcu_read_unlock();
+                BUG_ON(nr_live_slaves < MIN_LIVE_SLAVES);
+            }
+            castle_printk(LOG_WARN, "Disabling slave 0x%x [%s], due to IO errors.\n",
+                    io_slave->uuid, io_slave->bdev_name);
+            castle_extents_rebuild_wake();
+        }
+
+        /* We may need to re-submit I/O for the c2bs. Mark them as 'bio_error' */
+        for (next = bio_info; next; next = next->next)
+            set_c2b_bio_error(next->c2b);
+    }
+
+    /* Record how many pages we've completed, potentially ending the c2b io.
+       Coalesced writeback bios carry a chain of bio_infos, one per c2b. */
+    do {
+        next = bio_info->next;
+        c2b  = bio_info->c2b;
+        BUG_ON(atomic_read(&c2b->remaining) == 0);
+        c2b_remaining_io_sub(bio_info->rw, bio_info->nr_pages, c2b);
+        castle_free(bio_info);
+        bio_info = next;
+    } while (bio_info);
+#ifdef CASTLE_DEBUG
+    local_irq_restore(flags);
+#endif
+    bio_put(bio);
+
+    /*
+     * io_in_flight logic. The ordering of the dec and read of io_in_flight and the test
+     * of CASTLE_SLAVE_OOS_BIT is important.
+     * Decrement io_in_flight. If the slave is marked out-of-service, then check if
+     * io_in_flight is zero. If it is, then we know that it cannot now be incremented
+     * in submit_c2b_io because it is only incremented there if the out-of-service flag
+     * is not set. It is therefore safe to queue the device for release.
+     */
+    atomic_dec(&io_slave->io_in_flight);
+
+    /* If slave is out-of-service, and no I/O is outstanding, then queue up bdev release. */
+    if (test_bit(CASTLE_SLAVE_OOS_BIT, &io_slave->flags) &&
+        (atomic_read(&io_slave->io_in_flight) == 0))
+    {
+        CASTLE_INIT_WORK(&io_slave->work, castle_release_oos_slave);
+        queue_work(castle_wq, &io_slave->work);
+    }
+
+#if LINUX_VERSION_CODE <= KERNEL_VERSION(2,6,18)
+    return 0;
+#endif
+}
+
+#ifdef CASTLE_DEBUG
+int chk_valid(c_disk_chk_t chk)
+{
+    struct castle_slave *cs = castle_slave_find_by_uuid(chk.slave_id);
+    c_chk_t size;
+
+    if (!cs)
+    {
+        castle_printk(LOG_DEBUG, "Couldn't find disk with uuid: %u\n", chk.slave_id);
+        return 0;
+    }
+
+    BUG_ON(test_bit(CASTLE_SLAVE_GHOST_BIT, &cs->flags));
+    castle_freespace_summary_get(cs, NULL, &size);
+    if (chk.offset >= size)
+    {
+        castle_printk(LOG_DEBUG, "Unexpected chunk "disk_chk_fmt", Disk Size: 0x%x\n",
+                disk_chk2str(chk), size);
+        return 0;
+    }
+
+    return 1;
+}
+#endif
+
+#define MAX_BIO_PAGES        128
+
+/**
+ * Allocate bio for pages & hand-off to Linux block layer.
+ *
+ * @param disk_chk  Chunk to be IOed to
+ * @param pages     Array of pages to be used for IO
+ * @param nr_pages  Size of @pages array
+ *
+ * @return          number of pages remaining un-submitted if slave is,
+ *                  or becomes, out-of-service. Otherwise EXIT_SUCCESS.
+ */
+int submit_c2b_io(int           rw,
+                  c2_block_t   *c2b,
+                  c_ext_pos_t   cep,
+                  c_disk_chk_t  disk_chk,
+                  struct page **pages,
+                  int           nr_pages)
+{
+    struct castle_slave *cs;
+    sector_t sector;
+    struct bio *bio;
+    struct bio_info *bio_info;
+    int i, j, batch;
+
+#ifdef CASTLE_DEBUG
+    /* Check that we are submitting IO to the right ceps. */
+    c_ext_pos_t dcep = cep;
+    c2_page_t *c2p;
+
+    /* This first one could be turned into a valid error. */
+    BUG_ON(DISK_CHK_INVAL(disk_chk));
+    BUG_ON(!SUPER_EXTENT(cep.ext_id) && !chk_valid(disk_chk));
+
+    /* Only works for 1 page c2ps. */
+    BUG_ON(PAGES_PER_C2P != 1);
+    for(i=0; i<nr_pages; i++)
+    {
+        c2p = (c2_page_t *)pages[i]->lru.next;
+        if(!EXT_POS_EQUAL(c2p->cep, dcep))
+        {
+            castle_printk(LOG_DEBUG, "Unmatching ceps "cep_fmt_str", "cep_fmt_str_nl,
+                cep2str(c2p->cep), cep2str(dcep));
+            BUG();
+        }
+        dcep.offset += PAGE_SIZE;
+    }
+#endif
+
+    /* Work out the slave structure. */
+    cs = castle_slave_find_by_uuid(disk_chk.slave_id);
+    debug("slave_id=%d, cs=%p\n", disk_chk.slave_id, cs);
+    BUG_ON(!cs);
+    BUG_ON(test_bit(CASTLE_SLAVE_GHOST_BIT, &cs->flags));
+    /* Work out the sector on the slave. */
+    sector = ((sector_t)disk_chk.offset << (C_CHK_SHIFT - 9)) +
+              (BLK_IN_CHK(cep.offset) << (C_BLK_SHIFT - 9));
+
+    BUG_ON(nr_pages > MAX_BIO_PAGES);
+    j = 0;
+    while (nr_pages > 0) {
+
+        /*
+         * io_in_flight logic. The ordering of the dec and read of io_in_flight and the test
+         * of CASTLE_SLAVE_OOS_BIT is important.
+         * Pre-increment io_in_flight, then check if the slave is out-of-service. If it is then
+         * decrement it and request device release if required. If it is not out-of-service
+         * then it remains incremented. This means that, effectively, io_in_flight is only
+         * incremented if the slave is not out-of-service.
+         */
+        atomic_inc(&cs->io_in_flight);
+        if (test_bit(CASTLE_SLAVE_OOS_BIT, &cs->flags))
+        {
+            /* Slave is OOS. Return true and release claimed device if no outstanding I/O. */
+            if (atomic_dec_and_test(&cs->io_in_flight) &&
+                (test_bit(CASTLE_SLAVE_BDCLAIMED_BIT, &cs->flags)))
+                castle_release_device(cs);
+            return nr_pages;
+        }
+
+        /*
+         * We may have more pages than we are allowed to submit in one bio. Each time we submit
+         * we re-calculate what we can send, because bio_get_nr_vecs can change dynamically.
+         */
+        batch = min(nr_pages, bio_get_nr_vecs(cs->bdev));
+
+        /* Allocate BIO and bio_info struct */
+        bio = bio_alloc(GFP_KERNEL, batch);
+        bio_info = castle_malloc(sizeof(struct bio_info), GFP_KERNEL);
+        BUG_ON(!bio_info);
+
+        /* Init BIO and bio_info. */
+        bio_info->rw       = rw;
+        bio_info->bio      = bio;
+        bio_info->c2b      = c2b;
+        bio_info->nr_pages = batch;
+        bio_info->bdev     = cs->bdev;
+        bio_info->next     = NULL;
+        for(i=0; i < batch; i++)
+        {
+            bio->bi_io_vec[i].bv_page   = pages[i + j];
+            bio->bi_io_vec[i].bv_len    = PAGE_SIZE;
+            bio->bi_io_vec[i].bv_offset = 0;
+        }
+        bio->bi_sector  = sector + (sector_t)(j * 8);
+        bio->bi_bdev    = cs->bdev;
+        bio->bi_vcnt    = batch;
+        bio->bi_idx     = 0;
+        bio->bi_size    = batch * C_BLK_SIZE;
+        bio->bi_end_io  = c2b_multi_io_end;
+        bio->bi_private = bio_info;
+
+        j += batch;
+        nr_pages -= batch;
+
+        bio_get(bio);
+        /* Hand off to Linux block layer. Deal with barrier writes correctly. */
+        if(unlikely(c2b_barrier(c2b) &&
+                    nr_pages <= 0 &&
+                    test_bit(CASTLE_SLAVE_ORDERED_SUPP_BIT, &cs->flags)))
+        {
+            BUG_ON(rw != WRITE);
+            /* Set the barrier flag, but only if that the last bio. */
+            submit_bio(WRITE_BARRIER, bio);
         }
+        else
+            submit_bio(rw, bio);
+        if(bio_flagged(bio, BIO_EOPNOTSUPP))
+        {
+            castle_printk(LOG_ERROR, "BIO flagged not supported.\n");
+            WARN_ON(1);
+        }
+        bio_put(bio);
+    }
+    return EXIT_SUCCESS;
+}
+
+typedef struct castle_io_array {
+    struct page *io_pages[MAX_BIO_PAGES];
+    c_ext_pos_t start_cep;
+    c_chk_t chunk;
+    int next_idx;
+} c_io_array_t;
+
+/* Coalesced I/O.
+ *
+ * Rather than submitting each c2b as a separate set of bios, flushes (and batched
+ * submit_c2bs() callers) stage their c2b I/O.  Each staged I/O is recorded as a
+ * (slave, sector) segment.  castle_cache_io_stage_submit() sorts the segments by
+ * slave and disk offset, and submits physically contiguous runs with a single
+ * multi-page bio. */
+#define CASTLE_CACHE_WB_STAGE_C2BS  (4 * CASTLE_CACHE_FLUSH_BATCH_SIZE) /**< Max c2bs in wb stage.*/
+#define CASTLE_CACHE_WB_STAGE_SEGS  (4096)                              /**< Max segs in wb stage.*/
+#define CASTLE_CACHE_WB_STAGE_POOL  (8)                 /**< Preallocated wb stages for flushes.  */
+
+typedef struct castle_cache_io_seg {
+    struct castle_slave *slave;         /**< Slave the segment is read from/written to.       */
+    sector_t             sector;        /**< First sector on the slave.                       */
+    c2_block_t          *c2b;           /**< c2b the pages belong to.                         */
+    int                  page_idx;      /**< Index of the first page in the c2b.              */
+    int                  nr_pages;      /**< Number of pages in the segment.                  */
+} c2_io_seg_t;
+
+typedef struct castle_cache_io_stage {
+    int                  rw;            /**< Direction of all staged I/O.                     */
+    int                  vmalloced;     /**< Stage got allocated with castle_vmalloc().       */
+    int                  pooled;        /**< Stage belongs to castle_cache_wb_stages.         */
+    struct list_head     list;          /**< Position on castle_cache_wb_stages.              */
+    int                  nr_c2bs;
+    int                  max_c2bs;
+    c2_block_t         **c2bs;          /**< Staged c2bs, each holds one c2b->remaining ref.  */
+    int                  nr_segs;
+    int                  max_segs;
+    c2_io_seg_t         *segs;          /**< Staged segments.                                 */
+} c2_io_stage_t;
+
+static         DEFINE_SPINLOCK(castle_cache_wb_stages_lock);
+static               LIST_HEAD(castle_cache_wb_stages);             /**< Free pooled wb stages    */
+
+/**
+ * Allocate an empty I/O stage.
+ *
+ * @param rw        Direction of I/O to be staged
+ * @param max_c2bs  Number of c2bs the stage can hold
+ * @param max_segs  Number of segments the stage can hold
+ */
+static c2_io_stage_t* castle_cache_io_stage_alloc(int rw, int max_c2bs, int max_segs)
+{
+    c2_io_stage_t *stage;
+    size_t size;
+    int vmalloced;
+
+    size = sizeof(c2_io_stage_t) + max_segs * sizeof(c2_io_seg_t)
+                                 + max_c2bs * sizeof(c2_block_t *);
+    vmalloced = (size > PAGE_SIZE);
+    if (vmalloced)
+        stage = castle_vmalloc(size);
+    else
+        stage = castle_malloc(size, GFP_KERNEL);
+    if (stage)
+    {
+        stage->rw        = rw;
+        stage->vmalloced = vmalloced;
+        stage->pooled    = 0;
+        stage->nr_c2bs   = 0;
+        stage->max_c2bs  = max_c2bs;
+        stage->nr_segs   = 0;
+        stage->max_segs  = max_segs;
+        /* Segments first, they need the strictest alignment. */
+        stage->segs      = (c2_io_seg_t *)(stage + 1);
+        stage->c2bs      = (c2_block_t **)(stage->segs + max_segs);
+    }
+
+    return stage;
+}
+
+/**
+ * Free an I/O stage.  All staged I/O must have been submitted.
+ */
+static void castle_cache_io_stage_free(c2_io_stage_t *stage)
+{
+    BUG_ON(stage->nr_c2bs || stage->nr_segs);
+    if (stage->vmalloced)
+        castle_vfree(stage);
+    else
+        castle_free(stage);
+}
+
+/**
+ * Get a write stage for an extent flush, from the preallocated pool if possible.
+ *
+ * The pool only runs dry with more than CASTLE_CACHE_WB_STAGE_POOL flushes in
+ * progress, further flushes allocate their own stage.
+ *
+ * @return NULL if no stage could be allocated, the caller must submit per-c2b IOs
+ *
+ * @also castle_cache_wb_stage_put()
+ */
+static c2_io_stage_t* castle_cache_wb_stage_get(void)
+{
+    c2_io_stage_t *stage = NULL;
+
+    spin_lock(&castle_cache_wb_stages_lock);
+    if (!list_empty(&castle_cache_wb_stages))
+    {
+        stage = list_first_entry(&castle_cache_wb_stages, c2_io_stage_t, list);
+        list_del(&stage->list);
+    }
+    spin_unlock(&castle_cache_wb_stages_lock);
+
+    if (!stage)
+        stage = castle_cache_io_stage_alloc(WRITE,
+                                            CASTLE_CACHE_WB_STAGE_C2BS,
+                                            CASTLE_CACHE_WB_STAGE_SEGS);
+
+    return stage;
+}
+
+/**
+ * Return a write stage to the pool, or free it if it was allocated on demand.
+ */
+static void castle_cache_wb_stage_put(c2_io_stage_t *stage)
+{
+    if (!stage->pooled)
+    {
+        castle_cache_io_stage_free(stage);
+        return;
+    }
+
+    BUG_ON(stage->nr_c2bs || stage->nr_segs);
+    spin_lock(&castle_cache_wb_stages_lock);
+    list_add(&stage->list, &castle_cache_wb_stages);
+    spin_unlock(&castle_cache_wb_stages_lock);
+}
+
+/**
+ * Stage I/O of an I/O array from/to a slave.
+ *
+ * @return -1 if the stage is out of segments, the caller must submit directly.
+ */
+static int castle_cache_io_seg_add(c2_io_stage_t *stage,
+                                   c2_block_t *c2b,
+                                   c_io_array_t *array,
+                                   struct castle_slave *cs,
+                                   c_disk_chk_t disk_chk)
+{
+    c2_io_seg_t *seg;
+
+    if (stage->nr_segs >= stage->max_segs)
+        return -1;
+
+    seg = &stage->segs[stage->nr_segs++];
+    seg->slave    = cs;
+    seg->sector   = ((sector_t)disk_chk.offset << (C_CHK_SHIFT - 9)) +
+                     (BLK_IN_CHK(array->start_cep.offset) << (C_BLK_SHIFT - 9));
+    seg->c2b      = c2b;
+    seg->page_idx = (array->start_cep.offset - c2b->cep.offset) / PAGE_SIZE;
+    seg->nr_pages = array->next_idx;
+    if (stage->rw == WRITE)
+        atomic_inc(&castle_cache_wb_segs);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Order writeback segments by slave and disk offset.
+ */
+static int castle_cache_io_seg_cmp(const void *a, const void *b)
+{
+    const c2_io_seg_t *s1 = a, *s2 = b;
+
+    if (s1->slave->uuid != s2->slave->uuid)
+        return s1->slave->uuid < s2->slave->uuid ? -1 : 1;
+    if (s1->sector != s2->sector)
+        return s1->sector < s2->sector ? -1 : 1;
+    return 0;
+}
+
+/**
+ * Read or write a run of physically contiguous segments on one slave.
+ *
+ * Bios are as large as the device allows, a bio_info is chained onto the bio for
+ * each c2b (part) it contains.  Pages not submitted because the slave is, or went,
+ * out-of-service are dropped from c2b->remaining, like submit_c2b_io() callers do.
+ * Reads can no longer be redirected to another slave at this point, so those c2bs
+ * get flagged with a bio error instead (and get resubmitted, unless no_resubmit).
+ *
+ * @also submit_c2b_io()
+ * @also c2b_multi_io_end()
+ */
+static void castle_cache_io_run_submit(int rw, c2_io_seg_t *segs, int nr_pages)
+{
+    struct castle_slave *cs = segs[0].slave;
+    sector_t sector = segs[0].sector;
+    struct bio_info *bio_info, *head, **tail;
+    struct bio *bio;
+    c2_block_t *c2b;
+    int i, n, k, batch, seg_off, done;
+
+    seg_off = 0;
+    done = 0;
+    while (nr_pages > 0)
+    {
+        /* io_in_flight logic, see submit_c2b_io(). */
+        atomic_inc(&cs->io_in_flight);
+        if (test_bit(CASTLE_SLAVE_OOS_BIT, &cs->flags))
+        {
+            if (atomic_dec_and_test(&cs->io_in_flight) &&
+                (test_bit(CASTLE_SLAVE_BDCLAIMED_BIT, &cs->flags)))
+                castle_release_device(cs);
+            while (nr_pages > 0)
+            {
+                n = segs->nr_pages - seg_off;
+                if (rw == READ)
+                {
+                    atomic_sub(n, &castle_cache_read_stats);
+                    set_c2b_bio_error(segs->c2b);
+                }
+                else
+                    atomic_sub(n, &castle_cache_write_stats);
+                atomic_sub(n, &segs->c2b->remaining);
+                nr_pages -= n;
+                seg_off = 0;
+                segs++;
+            }
+            return;
+        }
+
+        batch = min(nr_pages, bio_get_nr_vecs(cs->bdev));
+        bio = bio_alloc(GFP_KERNEL, batch);
+        head = NULL;
+        tail = &head;
+        for (i = 0; i < batch; )
+        {
+            c2b = segs->c2b;
+            n = min(batch - i, segs->nr_pages - seg_off);
+
+            bio_info = castle_malloc(sizeof(struct bio_info), GFP_KERNEL);
+            BUG_ON(!bio_info);
+            bio_info->rw       = rw;
+            bio_info->bio      = bio;
+            bio_info->c2b      = c2b;
+            bio_info->nr_pages = n;
+            bio_info->bdev     = cs->bdev;
+            bio_info->next     = NULL;
+            *tail = bio_info;
+            tail  = &bio_info->next;
+
+            for (k = segs->page_idx + seg_off; k < segs->page_idx + seg_off + n; k++, i++)
+            {
+                bio->bi_io_vec[i].bv_page   =
+                        c2b->c2ps[k / PAGES_PER_C2P]->pages[k % PAGES_PER_C2P];
+                bio->bi_io_vec[i].bv_len    = PAGE_SIZE;
+                bio->bi_io_vec[i].bv_offset = 0;
+            }
+            seg_off += n;
+            if (seg_off == segs->nr_pages)
+            {
+                seg_off = 0;
+                segs++;
+            }
+        }
+        bio->bi_sector  = sector + (sector_t)(done * 8);
+        bio->bi_bdev    = cs->bdev;
+        bio->bi_vcnt    = batch;
+        bio->bi_idx     = 0;
+        bio->bi_size    = batch * C_BLK_SIZE;
+        bio->bi_end_io  = c2b_multi_io_end;
+        bio->bi_private = head;
+
+        done += batch;
+        nr_pages -= batch;
+        if (rw == WRITE)
+            atomic_inc(&castle_cache_wb_bios);
+
+        bio_get(bio);
+        submit_bio(rw, bio);
+        if(bio_flagged(bio, BIO_EOPNOTSUPP))
+        {
+            castle_printk(LOG_ERROR, "BIO flagged not supported.\n");
+            WARN_ON(1);
+        }
+        bio_put(bio);
+    }
+}
+
+/**
+ * Submit all I/O staged in stage.
+ *
+ * Segments are sorted by slave and disk offset, physically contiguous segments are
+ * merged into runs of up to MAX_BIO_PAGES.  Finally the staging reference is dropped
+ * from each c2b.
+ *
+ * @also __submit_c2b()
+ */
+static void castle_cache_io_stage_submit(c2_io_stage_t *stage)
+{
+    c2_io_seg_t *prev, *seg;
+    int i, j, nr_pages;
+
+    sort(stage->segs, stage->nr_segs, sizeof(c2_io_seg_t), castle_cache_io_seg_cmp, NULL);
+    for (i = 0; i < stage->nr_segs; i = j)
+    {
+        nr_pages = stage->segs[i].nr_pages;
+        for (j = i + 1; j < stage->nr_segs; j++)
+        {
+            prev = &stage->segs[j - 1];
+            seg  = &stage->segs[j];
+            if (seg->slave != prev->slave
+                    || seg->sector != prev->sector + (sector_t)(prev->nr_pages * 8)
+                    || nr_pages + seg->nr_pages > MAX_BIO_PAGES)
+                break;
+            nr_pages += seg->nr_pages;
+        }
+        castle_cache_io_run_submit(stage->rw, &stage->segs[i], nr_pages);
+    }
+    stage->nr_segs = 0;
+
+    for (i = 0; i < stage->nr_c2bs; i++)
+        c2b_remaining_io_sub(stage->rw, 1, stage->c2bs[i]);
+    stage->nr_c2bs = 0;
+}
+
+/**
+ * Select the next slave to read from.
+ *
+ * @param chunks    The chunk for which a slave is to be selected
+ * @param k_factor  k_factor for the chunk
+ * @param idx       Returns the index in the chunk for the slave to use
+ *
+ * @return          ENOENT if no slave found, EXIT_SUCCESS if found
+ *                  EXIT_SUCCESS if a slave was found
+ */
+static int c_io_next_slave_get(c2_block_t *c2b, c_disk_chk_t *chunks, int k_factor, int *idx)
+{
+    struct castle_slave *slave;
+    int i, try_second, disk_idx;
+
+    /*
+     * At some point we'll have a proper read slave scheduler to optimise read I/O as mentioned
+     * above, but for the moment just return the first working slave.
+     *
+     * At the moment, when prefetching, avoid using the first copy, which may be stored on SSDs.
+     */
+    try_second = c2b_prefetch(c2b);
+    /* Loop around, searching for disks in service. */
+    disk_idx = -1;
+    for(i=0; i<k_factor; i++)
+    {
+        slave = castle_slave_find_by_uuid(chunks[i].slave_id);
+        BUG_ON(!slave);
+        if (!test_bit(CASTLE_SLAVE_OOS_BIT, &slave->flags))
+        {
+            disk_idx = i;
+            /* If we are not looking for second copy, or we are already looking past the first
+               copy, terminate. */
+            if(!try_second || i != 0)
+                goto out;
+        }
+    }
+out:
+    if(disk_idx >= 0)
+    {
+        *idx = disk_idx;
+        return EXIT_SUCCESS;
+    }
+    BUG_ON(disk_idx != -1);
+    /* Could not find a slave to read from. */
+    return -ENOENT;
+
+}
+
+/**
+ * Dispatches k copies of the I/O.
+ *
+ * I/O is staged rather than dispatched if a stage is provided (and has space).
+ *
+ * @see submit_c2b_io()
+ * @see castle_cache_io_seg_add()
+ */
+static int c_io_array_submit(int rw,
+                             c2_block_t *c2b,
+                             c_disk_chk_t *chunks,
+                             int k_factor,
+                             c_io_array_t *array,
+                             c_ext_id_t ext_id,
+                             c2_io_stage_t *stage)
+{
+    int                  i, nr_pages, nr_pages_remaining, read_idx, found;
+    struct castle_slave *slave;
+    int                  ret = 0;
+
+    nr_pages = array->next_idx;
+    debug("Submitting io_array of %d pages, for cep "cep_fmt_str", k_factor=%d, rw=%s\n",
+        nr_pages,
+        cep2str(array->start_cep),
+        k_factor,
+        (rw == READ) ? "read" : "write");
+
+    BUG_ON((nr_pages <= 0) || (nr_pages > MAX_BIO_PAGES));
+
+    if (rw == READ) /* Read from one slave only */
+    {
+        /* Accounting */
+        atomic_add(nr_pages, &castle_cache_read_stats);
+
+retry:
+        /* Call the slave scheduler to find the next slave to read from */
+        ret = c_io_next_slave_get(c2b, chunks, k_factor, &read_idx);
+        /*
+         * If there is a read failure here (no live slaves found) then we return error.
+         * Callers must check for read failure. For non-superblock extents this will be fatal.
+         * For superblock extents this is non-fatal, but the caller needs to know not to use the
+         * returned buffers.
+         */
+        if (ret)
+            return ret;
+
+        slave = castle_slave_find_by_uuid(chunks[read_idx].slave_id);
+        BUG_ON(!slave);
+
+        /* Only increment remaining count once we know we'll submit the IO. */
+        atomic_add(nr_pages, &c2b->remaining);
+        if (stage && castle_cache_io_seg_add(stage, c2b, array, slave, chunks[read_idx]) == EXIT_SUCCESS)
+            return EXIT_SUCCESS;
+        /* Submit the IO. */
+        nr_pages_remaining = submit_c2b_io(READ, c2b, array->start_cep, chunks[read_idx],
+                            array->io_pages, nr_pages);
+        if (nr_pages_remaining)
+        {
+            /*
+             * Failed to read nr_pages_remaining pages from this slave because it has gone
+             * out-of-service. Retry to find another slave to read from.
+             */
+            atomic_sub(nr_pages_remaining, &c2b->remaining);
+            goto retry;
+        }
+
+        /* Return with success. */
+        return EXIT_SUCCESS;
+    }
+
+    /* Write to all slaves */
+    BUG_ON(rw != WRITE);
+    found = 0;
+    for(i=0; i<k_factor; i++)
+    {
+        slave = castle_slave_find_by_uuid(chunks[i].slave_id);
+        BUG_ON(!slave);
+
+        if (!test_bit(CASTLE_SLAVE_OOS_BIT, &slave->flags))
+        {
+            found = 1;
+            /* Slave is not out-of-sevice - submit the IO */
+            atomic_add(nr_pages, &castle_cache_write_stats);
+            atomic_add(nr_pages, &c2b->remaining);
+            if (stage && castle_cache_io_seg_add(stage, c2b, array, slave, chunks[i]) == EXIT_SUCCESS)
+                continue;
+            nr_pages_remaining = submit_c2b_io(WRITE, c2b, array->start_cep, chunks[i],
+                                               array->io_pages, nr_pages);
+            if (nr_pages_remaining)
+            {
+                /*
+                 * Failed to write nr_pages_remaining pages to this slave because it has
+                 * gone out-of-service. Skip to next slave.
+                 */
+                atomic_sub(nr_pages_remaining, &castle_cache_write_stats);
+                atomic_sub(nr_pages_remaining, &c2b->remaining);
+                continue;
+            }
+        }
+    }
+
+    /*
+     * If no live slave was found , and the extent is for a superblock then we can treat this
+     * as successful because we don't care if writes fail to a to the superblock of a now-dead
+     * disk. We won't have incremented c2b->remaining so doing nothing here is safe.
+     * For all other extent types, if we find no live slave then return EAGAIN so the caller
+     * can retry if it wants.
+     */
+    if (!found && !SUPER_EXTENT(ext_id))
+    {
+        debug("Could not submit I/O. Only oos slaves specified in disk chunk\n");
+        return -EAGAIN;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static inline void c_io_array_init(c_io_array_t *array)
+{
+    array->start_cep = INVAL_EXT_POS;
+    array->chunk = INVAL_CHK;
+    array->next_idx = 0;
+}
+
+/**
+ * Add page to I/O array.
+ */
+static inline int c_io_array_page_add(c_io_array_t *array,
+                                      c_ext_pos_t cep,
+                                      c_chk_t logical_chunk,
+                                      struct page *page)
+{
+    c_ext_pos_t cur_cep;
+
+    /* We cannot accept any more pages, if we already have MAX_BIO_PAGES. */
+    if(array->next_idx >= MAX_BIO_PAGES)
+        return -1;
+    /* If it is an established array, reject pages for different chunks, or non-sequential ceps. */
+    if(array->next_idx > 0)
+    {
+        cur_cep = array->start_cep;
+        cur_cep.offset += array->next_idx * PAGE_SIZE;
+        if(logical_chunk != array->chunk)
+            return -2;
+        if(!EXT_POS_EQUAL(cur_cep, cep))
+            return -3;
+    }
+    /* If it is a new array, initialise start_cep and chunk. */
+    if(array->next_idx == 0)
+    {
+        array->start_cep = cep;
+        array->chunk = logical_chunk;
+        cur_cep = cep;
+    }
+    /* Add the page, increment the index. */
+    array->io_pages[array->next_idx] = page;
+    array->next_idx++;
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Callback for synchronous c2b I/O completion.
+ *
+ * Wakes thread that dispatched the synchronous I/O
+ *
+ * @param c2b   completed c2b I/O
+ */
+static void castle_cache_sync_io_end(c2_block_t *c2b)
+{
+    struct completion *completion = c2b->private;
+
+    complete(completion);
+}
+
+/**
+ * Generates synchronous write I/O for disk block(s) associated with a remap c2b.
+ * A remap c2b maps just one logical chunk.
+ *
+ * Iterates over passed c2b's c2ps
+ * Populates array of pages from c2ps
+ * Dispatches array to all disk chunks if a dirty page was found
+ * Dispatches array to remap disk chunks only if a dirty page was not found
+ * Continues until whole c2b has been dispatched
+ *
+ * @param c2b       The c2b to be written
+ * @param chunks    The array of disk chunks for this logical chunk
+ * @param nr_remaps The number of disk chunks that are for remaps
+ *
+ * @also c_io_array_init()
+ * @also c_io_array_page_add()
+ * @also c_io_array_submit()
+ * @also submit_c2b()
+ */
+int submit_c2b_remap_rda(c2_block_t *c2b, c_disk_chk_t *chunks, int nr_remaps)
+{
+    c2_page_t           *c2p;
+    c_io_array_t        *io_array;
+    struct page         *page;
+    int                 ret = 0;
+    c_ext_pos_t         cur_cep;
+    c_ext_id_t          ext_id = c2b->cep.ext_id;
+    uint32_t            k_factor = castle_extent_kfactor_get(ext_id);
+    int                 found_dirty_page = 0;
+    void                *ext_p;
+    struct completion   completion;
+
+    /* This can only be called with chunks populated, and nr_remaps > 0 */
+    BUG_ON(!chunks || !nr_remaps);
+
+    BUG_ON(!c2b_locked(c2b));
+
+    debug("Submitting remap write c2b "cep_fmt_str", for %s\n", __cep2str(c2b->cep));
+
+    io_array = kmem_cache_alloc(castle_io_array_cache, GFP_KERNEL);
+    if (!io_array)
+        return -1;
+
+    /* Set in-flight bit on the block. */
+    set_c2b_in_flight(c2b);
+
+    /* c2b->remaining is effectively a reference count. Get one ref before we start. */
+    BUG_ON(atomic_read(&c2b->remaining) != 0);
+    atomic_inc(&c2b->remaining);
+    c_io_array_init(io_array);
+    /* Get extent reference (so that extent doesn't disappear under underneath us. */
+    ext_p = castle_extent_get(c2b->cep.ext_id);
+
+    c2b->end_io = castle_cache_sync_io_end;
+    c2b->private = &completion;
+    init_completion(&completion);
+
+    found_dirty_page = 0;
+    /* Everything initialised, go through each page in the c2p. */
+    c2b_for_each_page_start(page, c2p, cur_cep, c2b)
+    {
+        /* If any page is found to be dirty, the next c_io_array_submit must write to all slaves */
+        if (c2p_dirty(c2p))
+            found_dirty_page = 1;
+
+        /* Add the page to the io array. */
+        if(c_io_array_page_add(io_array, cur_cep, 0, page) != EXIT_SUCCESS)
+        {
+            /*
+             * Failed to add this page to the array (see return code for reason).
+             * Dispatch the current array, initialise a new one and
+             * attempt to add the page to the new array.
+             */
+            debug("%s on c2p->cep="cep_fmt_str_nl,
+                    (found_dirty_page ? "Writing to all slaves" : "Writing to remap slaves only"),
+                    cep2str(c2p->cep));
+
+            /* Submit the array. */
+            ret = c_io_array_submit(WRITE, c2b, chunks, (found_dirty_page ? k_factor : nr_remaps),
+                                io_array, ext_id, NULL);
+            if (ret)
+            {
+                /*
+                 * Could not submit the IO, possibly due to a slave going out-of-service. Drop
+                 * our reference and return early.
+                 */
+                c2b_remaining_io_sub(WRITE, 1, c2b);
+                goto out;
+            }
+            /* Reinit the array, and re-try adding the current page. This should not
+               fail any more. */
+            c_io_array_init(io_array);
+            found_dirty_page = 0;
+            BUG_ON(c_io_array_page_add(io_array, cur_cep, 0, page));
+        }
+    }
+    c2b_for_each_page_end(page, c2p, cur_cep, c2b);
+
+    /* IO array may contain leftover pages, submit those too. */
+    if(io_array->next_idx > 0)
+    {
+        ret = c_io_array_submit(WRITE, c2b, chunks, (found_dirty_page ? k_factor : nr_remaps),
+                                io_array, ext_id, NULL);
+        if (ret)
+        {
+            /*
+             * Could not submit the IO, possibly due to a slave going out-of-service. Drop
+             * our reference and return early.
+             */
+            c2b_remaining_io_sub(WRITE, 1, c2b);
+            goto out;
+        }
+    }
+    /* Drop the 1 ref. */
+    c2b_remaining_io_sub(WRITE, 1, c2b);
+
+out:
+    wait_for_completion(&completion);
+
+    kmem_cache_free(castle_io_array_cache, io_array);
+    if (ret)
+        return ret;
+    else
+        return(c2b_dirty(c2b));
+}
+
+/**
+ * Generates I/O for disk block(s) associated with the c2b.
+ *
+ * Iterates over passed c2b's c2ps (ignoring those that are clean/uptodate for WRITEs/READs)
+ * Populates array of pages from c2ps
+ * Dispatches array once it reaches the a chunk boundry
+ * Continues until whole c2b has been dispatched
+ *
+ * If stage is provided, I/O is staged and the c2b keeps its initial
+ * c2b->remaining reference until castle_cache_io_stage_submit().
+ *
+ * @see c_io_array_init()
+ * @see c_io_array_page_add()
+ * @see c_io_array_submit()
+ */
+static int submit_c2b_rda(int rw, c2_block_t *c2b, c2_io_stage_t *stage)
+{
+    c2_page_t    *c2p;
+    c_io_array_t *io_array;
+    struct page  *page;
+    int           skip_c2p, ret = 0;
+    c_ext_pos_t   cur_cep;
+    c_chk_t       last_chk, cur_chk;
+    c_ext_id_t    ext_id = c2b->cep.ext_id;
+    uint32_t      k_factor = castle_extent_kfactor_get(ext_id);
+    c_disk_chk_t  chunks[k_factor];
+    void         *ext_p;
+
+    debug("Submitting c2b "cep_fmt_str", for %s\n",
+            __cep2str(c2b->cep), (rw == READ) ? "read" : "write");
+
+    io_array = kmem_cache_alloc(castle_io_array_cache, GFP_KERNEL);
+    if (!io_array)
+        return -1;
+
+    /* c2b->remaining is effectively a reference count. Get one ref before we start. */
+    BUG_ON(atomic_read(&c2b->remaining) != 0);
+    atomic_inc(&c2b->remaining);
+    last_chk = INVAL_CHK;
+    cur_chk = INVAL_CHK;
+    c_io_array_init(io_array);
+    /* Get extent reference (so that extent doesn't disappear under underneath us. */
+    ext_p = castle_extent_get(c2b->cep.ext_id);
+    /* Everything initialised, go through each page in the c2p. */
+    c2b_for_each_page_start(page, c2p, cur_cep, c2b)
+    {
+        cur_chk = CHUNK(cur_cep.offset);
+        debug("Processing a c2b page, last_chk=%d, cur_chk=%d\n", last_chk, cur_chk);
+
+        /* Do not read into uptodate pages, do not write out of clean pages. */
+        skip_c2p = ((rw == READ)  && c2p_uptodate(c2p)) ||
+                   ((rw == WRITE) && !c2p_dirty(c2p));
+        debug("%s %s on c2p->cep="cep_fmt_str_nl,
+                    (skip_c2p ? "Skipping" : "Not skipping"),
+                    (rw == READ ? "read" : "write"),
+                    cep2str(c2p->cep));
+        /* Move to the next page, if we are not supposed to do IO on this page. */
+        if(skip_c2p)
+            goto next_page;
+
+        /* If we are not skipping, add the page to io array. */
+        if(c_io_array_page_add(io_array, cur_cep, cur_chk, page) != EXIT_SUCCESS)
+        {
+            /* Failed to add this page to the array (see return code for reason).
+             * Dispatch the current array, initialise a new one and
+             * attempt to add the page to the new array.
+             *
+             * We've got physical chunks for last_chk (logical chunk), this should
+               match with the logical chunk stored in io_array. */
+            BUG_ON(io_array->chunk != last_chk);
+            /* Submit the array. */
+            ret = c_io_array_submit(rw, c2b, chunks, k_factor, io_array, ext_id, stage);
+            if (ret)
+            {
+                /*
+                 * Could not submit the IO, possibly due to a slave going out-of-service. Drop
+                 * our reference and return early.
+                 */
+                c2b_remaining_io_sub(rw, 1, c2b);
+                goto out;
+            }
+            /* Reinit the array, and re-try adding the current page. This should not
+               fail any more. */
+            c_io_array_init(io_array);
+            BUG_ON(c_io_array_page_add(io_array, cur_cep, cur_chk, page));
+        }
+
+        /* Update chunk map when we move to a new chunk. */
+        if(cur_chk != last_chk)
+        {
+            int ret;
+            debug("Asking extent manager for "cep_fmt_str_nl,
+                    cep2str(cur_cep));
+            ret = castle_extent_map_get(ext_p,
+                                        CHUNK(cur_cep.offset),
+                                        chunks,
+                                        rw);
+            /* Return value is supposed to be k_factor, unless the
+               extent has been deleted. */
+            BUG_ON((ret != 0) && (ret != k_factor));
+            if(ret == 0)
+            {
+                /* Complete the IO by dropping our reference, return early. */
+                c2b_remaining_io_sub(rw, 1, c2b);
+                goto out;
+            }
+
+            debug("chunks[0]="disk_chk_fmt_nl, disk_chk2str(chunks[0]));
+            last_chk = cur_chk;
+        }
+    }
+next_page:
+    c2b_for_each_page_end(page, c2p, cur_cep, c2b);
+
+    /* IO array may contain leftover pages, submit those too. */
+    if(io_array->next_idx > 0)
+    {
+        /* Chunks array is always initialised for last_chk. */
+        BUG_ON(io_array->chunk != last_chk);
+        ret = c_io_array_submit(rw, c2b, chunks, k_factor, io_array, ext_id, stage);
+        if (ret)
+        {
+            /*
+             * Could not submit the IO, possibly due to a slave going out-of-service. Drop
+             * our reference and return early.
+             */
+            c2b_remaining_io_sub(rw, 1, c2b);
+            goto out;
+        }
+    }
+    /* Drop the 1 ref, unless staged.  The stage drops it once it got submitted. */
+    if (stage)
+        stage->c2bs[stage->nr_c2bs++] = c2b;
+    else
+        c2b_remaining_io_sub(rw, 1, c2b);
+
+out:
+    kmem_cache_free(castle_io_array_cache, io_array);
+    return ret;
+}
+
+/**
+ * Submit asynchronous c2b I/O, optionally staging it.
+ *
+ * @param stage I/O stage (for rw) to add the I/O to, or NULL to dispatch immediately
+ *
+ * @also submit_c2b()
+ * @also castle_cache_io_stage_submit()
+ */
+static int __submit_c2b(int rw, c2_block_t *c2b, c2_io_stage_t *stage)
+{
+    BUG_ON(!c2b->end_io);
+    BUG_ON(EXT_POS_INVAL(c2b->cep));
+    BUG_ON(atomic_read(&c2b->remaining));
+    /* If we are reading into the c2b block, we need to hold the write lock */
+    BUG_ON((rw == READ) && !c2b_write_locked(c2b));
+    /* If we writing out of the block, we need to hold the lock in either mode */
+    BUG_ON((rw == WRITE) && !c2b_locked(c2b));
+    if (unlikely(BLOCK_OFFSET(c2b->cep.offset)))
+    {
+        castle_printk(LOG_ERROR, "RDA %s: nr_pages - %u cep: "cep_fmt_str_nl,
+                (rw == READ)?"Read":"Write", c2b->nr_pages, __cep2str(c2b->cep));
+        BUG();
+    }
+
+    /* Set in-flight bit on the block. */
+    set_c2b_in_flight(c2b);
+
+    /* Barrier writes are ordered, never stage them. */
+    if (stage && c2b_barrier(c2b))
+        stage = NULL;
+    if (stage)
+    {
+        BUG_ON(rw != stage->rw);
+        /* Make space for this c2b in the stage.  Segments that don't fit get
+           submitted directly, so keep plenty of those spare too. */
+        if (stage->nr_c2bs >= stage->max_c2bs
+                || stage->nr_segs >= stage->max_segs / 2)
+            castle_cache_io_stage_submit(stage);
+    }
+
+    /* Blocks evicted to the SSD cache get read from there. */
+    if ((rw == READ) && castle_cache_l2_read(c2b))
+        return EXIT_SUCCESS;
+
+    return submit_c2b_rda(rw, c2b, stage);
+}
+
+/**
+ * Submit asynchronous c2b I/O.
+ *
+ * Updates statistics before passing I/O to submit_c2b_rda().
+ *
+ * NOTE: IOs can also be submitted via submit_c2b_remap_rda().
+ *
+ * @also submit_c2b_rda()
+ * @also submit_c2b_remap_rda()
+ */
+int submit_c2b(int rw, c2_block_t *c2b)
+{
+    return __submit_c2b(rw, c2b, NULL);
+}
+
+/**
+ * Unplug queues on all live slaves.
+ *
+ * Useful if you know that a sequence of submit_c2b()s has been completed.
+ *
+ * @TODO we should be more intelligent about this and unplug just those slaves
+ * that need to be.
+ */
+static void castle_slaves_unplug(void)
+{
+    struct list_head *lh;
+
+    rcu_read_lock();
+    list_for_each_rcu(lh, &castle_slaves.slaves)
+    {
+        struct castle_slave *cs = list_entry(lh, struct castle_slave, list);
+        if (!test_bit(CASTLE_SLAVE_OOS_BIT, &cs->flags))
+            generic_unplug_device(bdev_get_queue(cs->bdev));
+    }
+    rcu_read_unlock();
+}
+
+/**
+ * Submit synchronous c2b I/O.
+ *
+ * Dispatches cache block-I/O then blocks for completion.
+ *
+ * @see submit_c2b()
+ */
+int submit_c2b_sync(int rw, c2_block_t *c2b)
+{
+    struct completion completion;
+    int ret;
+
+    BUG_ON((rw == READ)  &&  c2b_uptodate(c2b));
+    BUG_ON((rw == WRITE) && !c2b_dirty(c2b));
+    c2b->end_io = castle_cache_sync_io_end;
+    c2b->private = &completion;
+    init_completion(&completion);
+    if((ret = submit_c2b(rw, c2b)) != EXIT_SUCCESS)
+        return ret;
+    wait_for_completion(&completion);
+
+    /* Success (ret=0) if c2b is uptodate now for READ, or dirty now for WRITE */
+    if (rw == READ)
+        return !c2b_uptodate(c2b);
+    else
+        return c2b_dirty(c2b);
+}
+
+/**
+ * Submit synchronous c2b write, which is also a barrier write
+ * (as per: Documentation/block/barrier.txt).
+ *
+ * @see submit_c2b_sync()
+ */
+int submit_c2b_sync_barrier(int rw, c2_block_t *c2b)
+{
+    int ret;
+
+    /* Only makes sense for writes. */
+    BUG_ON(rw != WRITE);
+
+    /* Mark the c2b as a barrier c2b. */
+    set_c2b_barrier(c2b);
+
+    /* Submit the c2b as per usual. */
+    ret = submit_c2b_sync(rw, c2b);
+
+    /* Clear the bit, since c2b is write locked, noone else will see it. */
+    clear_c2b_barrier(c2b);
+
+    return ret;
+}
+
+/**
+ * State shared by all c2bs of a submit_c2bs() batch.
+ */
+typedef struct castle_cache_c2bs_batch {
+    atomic_t             remaining;     /**< c2bs in flight, +1 while still submitting.       */
+    int                  rw;
+    int                  err;           /**< Set if any c2b failed.                           */
+    c2bs_end_io_t        end_io;        /**< Called once, when the whole batch completed.     */
+    void                *private;       /**< Passed to end_io.                                */
+} c2_c2bs_batch_t;
+
+#define CASTLE_CACHE_BATCH_SEGS_PER_C2B (8) /**< Stage segments allocated per batched c2b.    */
+
+static void castle_cache_c2bs_batch_put(c2_c2bs_batch_t *batch)
+{
+    if (!atomic_dec_and_test(&batch->remaining))
+        return;
+
+    batch->end_io(batch->private, batch->err);
+    castle_free(batch);
+}
+
+/**
+ * Per-c2b completion for submit_c2bs().  Called from interrupt context.
+ */
+static void castle_cache_c2bs_io_end(c2_block_t *c2b)
+{
+    c2_c2bs_batch_t *batch = c2b->private;
+
+    /* Same success criteria as submit_c2b_sync(). */
+    if ((batch->rw == READ) ? !c2b_uptodate(c2b) : c2b_dirty(c2b))
+        batch->err = -EIO;
+    castle_cache_c2bs_batch_put(batch);
+}
+
+/**
+ * Submit asynchronous I/O for a batch of c2bs.
+ *
+ * Builds bios across all the c2bs in one pass (physically contiguous pages of
+ * different c2bs share bios), unplugs the slaves once, and calls end_io once all
+ * c2bs completed.  end_io may be called from interrupt context.
+ *
+ * c2bs must be locked as for submit_c2b().  Their end_io and private fields get
+ * overwritten.  If no memory is available to stage the I/O, c2bs are submitted
+ * one by one, still with a single completion.
+ *
+ * @param rw        READ or WRITE
+ * @param c2bs      Array of c2bs to submit
+ * @param nr_c2bs   Number of c2bs, must be > 0
+ * @param end_io    Completion callback, err is non-zero if any of the c2bs failed
+ * @param private   Passed to end_io
+ *
+ * @return -ENOMEM if nothing got submitted, EXIT_SUCCESS otherwise
+ *
+ * @also submit_c2bs_sync()
+ */
+int submit_c2bs(int rw,
+                c2_block_t **c2bs,
+                int nr_c2bs,
+                c2bs_end_io_t end_io,
+                void *private)
+{
+    c2_c2bs_batch_t *batch;
+    c2_io_stage_t *stage;
+    int i;
+
+    BUG_ON(nr_c2bs <= 0);
+    batch = castle_malloc(sizeof(c2_c2bs_batch_t), GFP_KERNEL);
+    if (!batch)
+        return -ENOMEM;
+    /* Hold an extra reference, so that end_io cannot be called before all c2bs
+       have been submitted. */
+    atomic_set(&batch->remaining, nr_c2bs + 1);
+    batch->rw      = rw;
+    batch->err     = 0;
+    batch->end_io  = end_io;
+    batch->private = private;
+
+    stage = castle_cache_io_stage_alloc(rw, nr_c2bs, nr_c2bs * CASTLE_CACHE_BATCH_SEGS_PER_C2B);
+    for (i = 0; i < nr_c2bs; i++)
+    {
+        c2bs[i]->end_io  = castle_cache_c2bs_io_end;
+        c2bs[i]->private = batch;
+        /* As with submit_c2b(), failure to submit isn't recoverable. */
+        BUG_ON(__submit_c2b(rw, c2bs[i], stage));
+    }
+    if (stage)
+    {
+        castle_cache_io_stage_submit(stage);
+        castle_cache_io_stage_free(stage);
+    }
+    castle_slaves_unplug();
+    castle_cache_c2bs_batch_put(batch);
+
+    return EXIT_SUCCESS;
+}
+
+typedef struct castle_cache_c2bs_sync {
+    struct completion    completion;
+    int                  err;
+} c2_c2bs_sync_t;
+
+static void castle_cache_c2bs_sync_io_end(void *private, int err)
+{
+    c2_c2bs_sync_t *sync = private;
+
+    sync->err = err;
+    complete(&sync->completion);
+}
+
+/**
+ * Submit synchronous I/O for a batch of c2bs.
+ *
+ * @return Non-zero if any of the c2bs failed (see submit_c2b_sync())
+ *
+ * @also submit_c2bs()
+ */
+int submit_c2bs_sync(int rw, c2_block_t **c2bs, int nr_c2bs)
+{
+    c2_c2bs_sync_t sync;
+    int i, ret;
+
+    for (i = 0; i < nr_c2bs; i++)
+    {
+        BUG_ON((rw == READ)  &&  c2b_uptodate(c2bs[i]));
+        BUG_ON((rw == WRITE) && !c2b_dirty(c2bs[i]));
+    }
+    init_completion(&sync.completion);
+    if ((ret = submit_c2bs(rw, c2bs, nr_c2bs, castle_cache_c2bs_sync_io_end, &sync)))
+        return ret;
+    wait_for_completion(&sync.completion);
+
+    return sync.err;
+}
+
+static inline unsigned long castle_cache_hash_idx(c_ext_pos_t cep, int nr_buckets)
+{
+    unsigned long hash_idx = (cep.ext_id ^ cep.offset);
+
+    hash_idx = hash_long(hash_idx, 32);
+    return (hash_idx % nr_buckets);
+}
+
+static inline void castle_cache_page_hash_idx(c_ext_pos_t cep, int *hash_idx_p, int *lock_idx_p)
+{
+    int hash_idx;
+
+    hash_idx = castle_cache_hash_idx(cep, castle_cache_page_hash_buckets);
+
+    if(hash_idx_p)
+        *hash_idx_p = hash_idx;
+    if(lock_idx_p)
+        *lock_idx_p = hash_idx / PAGE_HASH_LOCK_PERIOD;
+}
+
+/* Must be called with the page_hash lock held */
+static inline void __castle_cache_c2p_get(c2_page_t *c2p)
+{
+#ifdef CASTLE_DEBUG
+    int lock_idx;
+
+    castle_cache_page_hash_idx(c2p->cep, NULL, &lock_idx);
+    BUG_ON(!spin_is_locked(&castle_cache_page_hash_locks[lock_idx]));
+#endif
+    c2p->count++;
+}
+
+static c2_page_t* castle_cache_page_hash_find(c_ext_pos_t cep)
+{
+    struct hlist_node *lh;
+    c2_page_t *c2p;
+    int idx;
+
+    castle_cache_page_hash_idx(cep, &idx, NULL);
+    debug("Idx = %d\n", idx);
+    hlist_for_each_entry(c2p, lh, &castle_cache_page_hash[idx], hlist)
+    {
+        if(EXT_POS_EQUAL(c2p->cep, cep))
+            return c2p;
+    }
+
+    return NULL;
+}
+
+static c2_page_t* castle_cache_page_hash_insert_get(c2_page_t *c2p)
+{
+    c2_page_t *existing_c2p;
+    spinlock_t *lock;
+    int idx, lock_idx;
+
+    /* Work out the index, and the lock. */
+    castle_cache_page_hash_idx(c2p->cep, &idx, &lock_idx);
+    lock = castle_cache_page_hash_locks + lock_idx;
+
+    /* Check if already in the hash */
+    spin_lock_irq(lock);
+    existing_c2p = castle_cache_page_hash_find(c2p->cep);
+    if(existing_c2p)
+    {
+        __castle_cache_c2p_get(existing_c2p);
+        spin_unlock_irq(lock);
+        return existing_c2p;
+    }
+    else
+    {
+        __castle_cache_c2p_get(c2p);
+        hlist_add_head(&c2p->hlist, &castle_cache_page_hash[idx]);
+        spin_unlock_irq(lock);
+        return c2p;
+    }
+}
+
+#define MIN(_a, _b)     ((_a) < (_b) ? (_a) : (_b))
+static inline void castle_cache_c2p_put(c2_page_t *c2p, struct list_head *accumulator)
+{
+    spinlock_t *lock;
+    int idx, lock_idx;
+
+    castle_cache_page_hash_idx(c2p->cep, &idx, &lock_idx);
+    lock = castle_cache_page_hash_locks + lock_idx;
+    spin_lock_irq(lock);
+
+    c2p->count--;
+    /* If the count reached zero, delete from the hash, add to the accumulator list,
+       so that they get freed later on. */
+    if(c2p->count == 0)
+    {
+#ifdef CASTLE_DEBUG
+        char *buf, *poison="dead-page";
+        int i, j, str_len;
+
+        str_len = strlen(poison);
+        for(i=0; i<PAGES_PER_C2P; i++)
+        {
+            buf = pfn_to_kaddr(page_to_pfn(c2p->pages[i]));
+            for(j=0; j<PAGE_SIZE; j+=str_len)
+                memcpy(buf+j, poison, MIN(PAGE_SIZE-j, str_len));
+        }
+#endif
+        if (LOGICAL_EXTENT(c2p->cep.ext_id))
+            atomic_sub(PAGES_PER_C2P, &castle_cache_logical_ext_pages);
+        debug("Freeing c2p for cep="cep_fmt_str_nl, cep2str(c2p->cep));
+        BUG_ON(c2p_dirty(c2p));
+        atomic_sub(PAGES_PER_C2P, &castle_cache_clean_pages);
+        hlist_del(&c2p->hlist);
+        list_add(&c2p->list, accumulator);
+    }
+    spin_unlock_irq(lock);
+}
+
+static inline int castle_cache_block_hash_idx(c_ext_pos_t cep)
+{
+    return castle_cache_hash_idx(cep, castle_cache_block_hash_buckets);
+}
+
+/**
+ * Get the block hash lock protecting the hash bucket for cep.
+ *
+ * The block hash is striped: one lock covers BLOCK_HASH_LOCK_PERIOD consecutive
+ * buckets, so lookups for unrelated blocks do not serialise across CPUs.
+ */
+static inline spinlock_t* castle_cache_block_hash_lock_get(c_ext_pos_t cep)
+{
+    return castle_cache_block_hash_locks
+            + castle_cache_block_hash_idx(cep) / BLOCK_HASH_LOCK_PERIOD;
+}
+
+/**
+ * Find c2b matching (cep, nr_pages) in the block hash.
+ *
+ * @also castle_cache_block_hash_lock_get()
+ *
+ * @warning Caller must hold the hash lock for cep.
+ */
+static c2_block_t* castle_cache_block_hash_find(c_ext_pos_t cep, uint32_t nr_pages)
+{
+    struct hlist_node *lh;
+    c2_block_t *c2b;
+    int idx;
+
+    idx = castle_cache_block_hash_idx(cep);
+    debug("Idx = %d\n", idx);
+    BUG_ON(!spin_is_locked(&castle_cache_block_hash_locks[idx / BLOCK_HASH_LOCK_PERIOD]));
+    hlist_for_each_entry(c2b, lh, &castle_cache_block_hash[idx], hlist)
+    {
+        if(EXT_POS_EQUAL(c2b->cep, cep) && (c2b->nr_pages == nr_pages))
+            return c2b;
+    }
+
+    return NULL;
+}
+
+/**
+ * Gets c2b matching (cep, nr_pages) and adjusts its dirty/freelist position.
+ *
+ * @arg cep         Specifies the c2b offset and extent
+ * @arg nr_pages    Specifies size of block
+ * @arg promote     If set: advises LRU mechanism we will use this block
+ *                  If unset: advises LRU mechanism we will free this block
+ *
+ * @return Matching c2b with an additional reference
+ * @return NULL if no matches were found
+ */
+static inline c2_block_t* _castle_cache_block_hash_get(c_ext_pos_t cep,
+                               uint32_t nr_pages,
+                               int promote)
+{
+    c2_block_t *c2b = NULL;
+    spinlock_t *lock;
+    cycles_t hold, lru_hold;
+
+    /* Hold the hash lock. */
+    lock = castle_cache_block_hash_lock_get(cep);
+    spin_lock_irq(lock);
+    hold = get_cycles();
+
+    /* Try and get the matching block from the hash. */
+    c2b = castle_cache_block_hash_find(cep, nr_pages);
+
+    if (c2b)
+    {
+        /* We found a matching block. */
+
+        if (promote)
+        {
+            /* We are obtaining this block to be used.  Mark it as recently
+             * accessed, castle_cache_block_hash_clean() will give it a second
+             * chance by moving it to the end of the cleanlist rather than
+             * evicting it.  This keeps the global LRU lock off the hit path.
+             *
+             * We're going to return this block to the caller so hold a
+             * reference for them so it doesn't get removed. */
+            get_c2b(c2b);
+
+            if (!c2b_accessed(c2b))
+                set_c2b_accessed(c2b);
+        }
+        else if (atomic_read(&c2b->count) == 0)
+        {
+            /* No references on this block means it's not in use.
+             * If clean: demote so it gets reused next
+             * If dirty: don't touch it - let LRU mechanism handle it */
+            spin_lock(&castle_cache_block_lru_lock);
+            lru_hold = get_cycles();
+            if (!c2b_dirty(c2b))
+            {
+                clear_c2b_accessed(c2b);
+                c2_policy->demote(c2b);
+            }
+            spin_unlock(&castle_cache_block_lru_lock);
+            castle_cache_lock_stats_update(castle_cache_block_lru_lock_stats, lru_hold);
+        }
+    }
+
+    /* Release the hash lock. */
+    spin_unlock_irq(lock);
+    castle_cache_lock_stats_update(castle_cache_block_hash_lock_stats, hold);
+
+    return c2b;
+}
+
+/**
+ * Get c2b matching (cep, nr_pages).
+ *
+ * @arg cep     Specifies the c2b offset and extent
+ * @arg nr_pages    Specifies size of block
+ *
+ * @return Matching c2b with an additional reference
+ * @return NULL if no matches were found
+ */
+static inline c2_block_t* castle_cache_block_hash_get(c_ext_pos_t cep,
+                               uint32_t nr_pages)
+{
+    return _castle_cache_block_hash_get(cep, nr_pages, 1);
+}
+
+/**
+ * Find block matching (cep, nr_pages) and demote it in the clean/dirtytree.
+ *
+ * NOTE: does not obtain an addition reference on any block returned.  The
+ * caller is responsible for obtaining this if required.
+ *
+ * @arg cep         Specifies the c2b offset and extent
+ * @arg nr_pages    Specifies size of block
+ *
+ * @return 1 c2b found
+ * @return 0 c2b not found
+ */
+static inline int castle_cache_block_hash_demote(c_ext_pos_t cep,
+                                                         uint32_t nr_pages)
+{
+    return _castle_cache_block_hash_get(cep, nr_pages, 0) ? 1 : 0;
+}
+
+/**
+ * Insert a clean block into the hash.
+ *
+ * - Insert the block into the hash
+ * - Cleanlist accounting
+ *
+ * @warning The block must not be dirty.
+ *
+ * @return >0   on success
+ * @return  0   on failure
+ */
+static int castle_cache_block_hash_insert(c2_block_t *c2b, int transient)
+{
+    spinlock_t *lock;
+    cycles_t hold, lru_hold;
+    int idx, success;
+
+    lock = castle_cache_block_hash_lock_get(c2b->cep);
+    spin_lock_irq(lock);
+    hold = get_cycles();
+
+    /* Check if already in the hash */
+    success = 0;
+    if(castle_cache_block_hash_find(c2b->cep, c2b->nr_pages)) goto out;
+
+    /* Insert */
+    success = 1;
+    idx = castle_cache_block_hash_idx(c2b->cep);
+    hlist_add_head(&c2b->hlist, &castle_cache_block_hash[idx]);
+    BUG_ON(c2b_dirty(c2b));
+    BUG_ON(c2b_softpin(c2b));
+    spin_lock(&castle_cache_block_lru_lock);
+    lru_hold = get_cycles();
+    c2_policy->insert(c2b, transient);
+    /* Cleanlist accounting. */
+    atomic_inc(&castle_cache_cleanlist_size);
+    spin_unlock(&castle_cache_block_lru_lock);
+    castle_cache_lock_stats_update(castle_cache_block_lru_lock_stats, lru_hold);
+out:
+    spin_unlock_irq(lock);
+    castle_cache_lock_stats_update(castle_cache_block_hash_lock_stats, hold);
+    return success;
+}
+
+/**
+ * Get the NUMA node c2p pages were allocated on.
+ */
+static inline int castle_cache_c2p_node(c2_page_t *c2p)
+{
+    return page_to_nid(c2p->pages[0]);
+}
+
+/**
+ * Add c2p to freelist or reservelist and do list accounting.
+ *
+ * c2p goes to the reservelist if reservelist_size is below quota.
+ */
+static inline void __castle_cache_page_freelist_add(c2_page_t *c2p)
+{
+    int size, on_reservelist = 0;
+
+    BUG_ON(c2p->count != 0);
+
+    size = atomic_read(&castle_cache_page_reservelist_size);
+
+    if (unlikely(size < CASTLE_CACHE_RESERVELIST_QUOTA))
+    {
+        /* c2p reservelist is below quota.  Grab the lock and retest.  If it is
+         * still below quota, place this c2p on reservelist. */
+        spin_lock(&castle_cache_reservelist_lock);
+        size = atomic_read(&castle_cache_page_reservelist_size);
+        if (likely(size < CASTLE_CACHE_RESERVELIST_QUOTA))
+        {
+            list_add_tail(&c2p->list, &castle_cache_page_reservelist);
+            atomic_inc(&castle_cache_page_reservelist_size);
+            on_reservelist = 1;
+        }
+        spin_unlock(&castle_cache_reservelist_lock);
+    }
+
+    if (likely(!on_reservelist))
+    {
+        /* c2p reservelist is at its quota.  Place this c2p on its node's freelist. */
+        int node = castle_cache_c2p_node(c2p);
+
+        list_add_tail(&c2p->list, &castle_cache_page_freelists[node]);
+        castle_cache_page_freelist_node_size[node]++;
+        castle_cache_page_freelist_size++;
+    }
+}
+
+/**
+ * Remove a c2p from the freelists, preferring those local to node.
+ *
+ * @param node  Preferred NUMA node
+ *
+ * @return c2p from the freelist of node, or another node if node is empty.
+ * @return NULL if all freelists are empty.
+ *
+ * castle_cache_freelist_lock must be held.
+ */
+static c2_page_t* __castle_cache_page_freelist_del(int node)
+{
+    struct list_head *lh;
+    int n;
+
+    if (unlikely(list_empty(&castle_cache_page_freelists[node])))
+    {
+        node = -1;
+        for_each_online_node(n)
+        {
+            if (!list_empty(&castle_cache_page_freelists[n]))
+            {
+                node = n;
+                break;
+            }
+        }
+        if (node < 0)
+            return NULL;
+    }
+
+    lh = castle_cache_page_freelists[node].next;
+    list_del(lh);
+    castle_cache_page_freelist_node_size[node]--;
+    castle_cache_page_freelist_size--;
+
+    return list_entry(lh, c2_page_t, list);
+}
+
+/**
+ * Account nr_c2ps c2ps allocated on behalf of node.
+ *
+ * Counts remote allocations, i.e. c2ps whose pages live on other nodes.
+ */
+static void castle_cache_page_node_account(c2_page_t **c2ps, int nr_c2ps, int node)
+{
+    int i, remote = 0;
+
+    for (i = 0; i < nr_c2ps; i++)
+        if (castle_cache_c2p_node(c2ps[i]) != node)
+            remote++;
+
+    atomic64_add(nr_c2ps, &castle_cache_node_stats[node].allocs);
+    if (remote)
+        atomic64_add(remote, &castle_cache_node_stats[node].remote_allocs);
+}
+
+/**
+ * Add block to freelist or reservelist and do list accounting.
+ *
+ * c2b goes to the reservelist if reservelist_size is below quota.
+ */
+static inline void __castle_cache_block_freelist_add(c2_block_t *c2b)
+{
+    int size, on_reservelist = 0;
+
+    size = atomic_read(&castle_cache_block_reservelist_size);
+
+    if (unlikely(size < CASTLE_CACHE_RESERVELIST_QUOTA))
+    {
+        /* c2b reservelist is below quota.  Grab the lock and retest.  If it is
+         * still below quota, places this c2b on reservelist. */
+        spin_lock(&castle_cache_reservelist_lock);
+        size = atomic_read(&castle_cache_block_reservelist_size);
+        if (likely(size < CASTLE_CACHE_RESERVELIST_QUOTA))
+        {
+            list_add_tail(&c2b->reserve, &castle_cache_block_reservelist);
+            atomic_inc(&castle_cache_block_reservelist_size);
+            on_reservelist = 1;
+        }
+        spin_unlock(&castle_cache_reservelist_lock);
+    }
+
+    if (likely(!on_reservelist))
+    {
+        /* c2b reservelist is at its quota.  Places this c2b on freelist. */
+        list_add_tail(&c2b->free, &castle_cache_block_freelist);
+        castle_cache_block_freelist_size++;
+    }
+}
+
+/**
+ * Return freed c2ps, and optionally a c2b, to this CPU's magazine.
+ *
+ * @param c2ps  List of c2ps to free (threaded through c2p->list), emptied
+ * @param c2b   c2b to free, or NULL
+ *
+ * Objects that don't fit into the magazine go to the global freelists, after
+ * the magazine has been drained down to C2_MAGAZINE_BATCH.  c2ps with pages on
+ * a remote NUMA node also bypass the magazine, so that magazines only ever hold
+ * node-local c2ps.  If the reservelists are below quota everything goes through
+ * the global freelist code, which refills them.
+ *
+ * @also __castle_cache_page_freelist_add()
+ * @also __castle_cache_block_freelist_add()
+ */
+static void castle_cache_freelists_put(struct list_head *c2ps, c2_block_t *c2b)
+{
+    struct list_head *lh, *lt;
+    c2_magazine_t *mag;
+    c2_page_t *c2p;
+    int node, locked = 0;
+
+    if (unlikely(atomic_read(&castle_cache_page_reservelist_size) < CASTLE_CACHE_RESERVELIST_QUOTA
+              || atomic_read(&castle_cache_block_reservelist_size) < CASTLE_CACHE_RESERVELIST_QUOTA))
+    {
+        spin_lock(&castle_cache_freelist_lock);
+        list_for_each_safe(lh, lt, c2ps)
+        {
+            list_del(lh);
+            __castle_cache_page_freelist_add(list_entry(lh, c2_page_t, list));
+        }
+        if (c2b)
+            __castle_cache_block_freelist_add(c2b);
+        spin_unlock(&castle_cache_freelist_lock);
+
+        return;
+    }
+
+    mag = &get_cpu_var(castle_cache_magazines);
+    spin_lock(&mag->lock);
+    node = numa_node_id();
+    list_for_each_safe(lh, lt, c2ps)
+    {
+        list_del(lh);
+        c2p = list_entry(lh, c2_page_t, list);
+        BUG_ON(c2p->count != 0);
+        if (unlikely(castle_cache_c2p_node(c2p) != node))
+        {
+            /* Keep magazines node-local, remote c2ps go back to their node. */
+            if (!locked)
+                spin_lock(&castle_cache_freelist_lock);
+            locked = 1;
+            __castle_cache_page_freelist_add(c2p);
+            continue;
+        }
+        if (unlikely(mag->nr_c2ps == C2_MAGAZINE_SIZE) && !locked)
+        {
+            spin_lock(&castle_cache_freelist_lock);
+            locked = 1;
+            while (mag->nr_c2ps > C2_MAGAZINE_BATCH)
+                __castle_cache_page_freelist_add(mag->c2ps[--mag->nr_c2ps]);
+        }
+        if (mag->nr_c2ps < C2_MAGAZINE_SIZE)
+            mag->c2ps[mag->nr_c2ps++] = c2p;
+        else
+            __castle_cache_page_freelist_add(c2p);
+    }
+    if (c2b)
+    {
+        if (unlikely(mag->nr_c2bs == C2_MAGAZINE_SIZE))
+        {
+            if (!locked)
+                spin_lock(&castle_cache_freelist_lock);
+            locked = 1;
+            while (mag->nr_c2bs > C2_MAGAZINE_BATCH)
+                __castle_cache_block_freelist_add(mag->c2bs[--mag->nr_c2bs]);
+        }
+        mag->c2bs[mag->nr_c2bs++] = c2b;
+    }
+    if (locked)
+        spin_unlock(&castle_cache_freelist_lock);
+    spin_unlock(&mag->lock);
+    put_cpu_var(castle_cache_magazines);
+}
+
+/**
+ * Drain all per-CPU magazines back onto the global freelists.
+ *
+ * Used on teardown, and by castle_cache_freelists_grow() so that c2ps/c2bs cached
+ * by other CPUs can satisfy a request before it blocks.
+ */
+static void castle_cache_magazines_drain(void)
+{
+    c2_magazine_t *mag;
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        mag = &per_cpu(castle_cache_magazines, cpu);
+        spin_lock(&mag->lock);
+        spin_lock(&castle_cache_freelist_lock);
+        while (mag->nr_c2ps > 0)
+            __castle_cache_page_freelist_add(mag->c2ps[--mag->nr_c2ps]);
+        while (mag->nr_c2bs > 0)
+            __castle_cache_block_freelist_add(mag->c2bs[--mag->nr_c2bs]);
+        spin_unlock(&castle_cache_freelist_lock);
+        spin_unlock(&mag->lock);
+    }
+}
+
+/**
+ * Get nr_pages of c2ps from the freelist.
+ *
+ * c2ps local to the NUMA node of the current CPU are preferred.
+ *
+ * @also castle_cache_page_reservelist_get()
+ */
+static c2_page_t** castle_cache_page_freelist_get(int nr_pages)
+{
+    c2_magazine_t *mag;
+    c2_page_t **c2ps, *c2p;
+    int i, nr_c2ps, node;
+
+    debug("Asked for %d pages from the freelist.\n", nr_pages);
+    nr_c2ps = castle_cache_pages_to_c2ps(nr_pages);
+    c2ps = castle_zalloc(nr_c2ps * sizeof(c2_page_t *), GFP_KERNEL);
+    BUG_ON(!c2ps);
+
+    mag = &get_cpu_var(castle_cache_magazines);
+    spin_lock(&mag->lock);
+    node = numa_node_id();
+    if (likely(nr_c2ps <= C2_MAGAZINE_SIZE))
+    {
+        /* Refill the magazine from the global freelist, if necessary.  Only
+         * refill up to what is needed with c2ps from remote nodes. */
+        if (mag->nr_c2ps < nr_c2ps)
+        {
+            spin_lock(&castle_cache_freelist_lock);
+            while (mag->nr_c2ps < max(nr_c2ps, C2_MAGAZINE_BATCH))
+            {
+                if (mag->nr_c2ps >= nr_c2ps
+                        && list_empty(&castle_cache_page_freelists[node]))
+                    break;
+                c2p = __castle_cache_page_freelist_del(node);
+                if (!c2p)
+                    break;
+                mag->c2ps[mag->nr_c2ps++] = c2p;
+            }
+            spin_unlock(&castle_cache_freelist_lock);
+        }
+
+        if (mag->nr_c2ps < nr_c2ps)
+        {
+            spin_unlock(&mag->lock);
+            put_cpu_var(castle_cache_magazines);
+            castle_free(c2ps);
+            debug("Freelist too small to allocate %d pages.\n", nr_pages);
+            return NULL;
+        }
+
+        for (i = 0; i < nr_c2ps; i++)
+            c2ps[i] = mag->c2ps[--mag->nr_c2ps];
+        spin_unlock(&mag->lock);
+        put_cpu_var(castle_cache_magazines);
+        castle_cache_page_node_account(c2ps, nr_c2ps, node);
+
+        return c2ps;
+    }
+
+    /* Request is bigger than a magazine, allocate straight from the freelist.
+     * Give back what this CPU has cached first, so it can be used. */
+    spin_lock(&castle_cache_freelist_lock);
+    while (mag->nr_c2ps > 0)
+        __castle_cache_page_freelist_add(mag->c2ps[--mag->nr_c2ps]);
+    spin_unlock(&mag->lock);
+    put_cpu_var(castle_cache_magazines);
+    /* Will only be able to satisfy the request if we have nr_pages on the list */
+    if (castle_cache_page_freelist_size * PAGES_PER_C2P < nr_pages)
+    {
+        spin_unlock(&castle_cache_freelist_lock);
+        castle_free(c2ps);
+        debug("Freelist too small to allocate %d pages.\n", nr_pages);
+        return NULL;
+    }
+
+    i = 0;
+    while (nr_pages > 0)
+    {
+        BUG_ON(i >= nr_c2ps);
+        c2ps[i] = __castle_cache_page_freelist_del(node);
+        BUG_ON(!c2ps[i]);
+        i++;
+        nr_pages -= PAGES_PER_C2P;
+    }
+    spin_unlock(&castle_cache_freelist_lock);
+    castle_cache_page_node_account(c2ps, i, node);
+#ifdef CASTLE_DEBUG
+    for (i--; i>=0; i--)
+    {
+        debug("Got c2p id=%d from freelist.\n", c2ps[i]->id);
+    }
+#endif
+    /* Check that we _did_ succeed at allocating required number of c2ps */
+    BUG_ON(nr_pages > 0);
+
+    return c2ps;
+}
+
+/**
+ * Get nr_pages of c2ps from the reservelist.
+ *
+ * @also castle_cache_page_freelist_get()
+ */
+static c2_page_t** castle_cache_page_reservelist_get(int nr_pages)
+{
+    struct list_head *lh, *lt;
+    c2_page_t **c2ps;
+    int i, nr_c2ps;
+
+    nr_c2ps = castle_cache_pages_to_c2ps(nr_pages);
+    c2ps = castle_zalloc(nr_c2ps * sizeof(c2_page_t *), GFP_KERNEL);
+    BUG_ON(!c2ps);
+
+    spin_lock(&castle_cache_reservelist_lock);
+    if (atomic_read(&castle_cache_page_reservelist_size) * PAGES_PER_C2P < nr_pages)
+    {
+        spin_unlock(&castle_cache_reservelist_lock);
+        castle_free(c2ps);
+        debug("Reservelist too small to allocate %d pages.\n", nr_pages);
+        return NULL;
+    }
+
+    i = 0;
+    list_for_each_safe(lh, lt, &castle_cache_page_reservelist)
+    {
+        if (nr_pages <= 0)
+            break;
+        list_del(lh);
+        atomic_dec(&castle_cache_page_reservelist_size);
+        BUG_ON(i >= nr_c2ps);
+        c2ps[i++] = list_entry(lh, c2_page_t, list);
+        nr_pages -= PAGES_PER_C2P;
+    }
+    spin_unlock(&castle_cache_reservelist_lock);
+#ifdef CASTLE_DEBUG
+    for (i--; i >= 0; i--)
+    {
+        debug("Got c2p id=%d from reservelist.\n", c2ps[i]->id);
+    }
+#endif
+    BUG_ON(nr_pages > 0); /* verify we got nr_pages of c2ps */
+
+    castle_trace_cache(TRACE_VALUE,
+                       TRACE_CACHE_RESERVE_PGS_USED_ID,
+                       CASTLE_CACHE_RESERVELIST_QUOTA
+                            - atomic_read(&castle_cache_page_reservelist_size));
+
+    return c2ps;
+}
+
+/**
+ * Get a c2b from the freelist.
+ *
+ * @return c2b from freelist.
+ * @return NULL if the freelist is empty.
+ */
+static c2_block_t* castle_cache_block_freelist_get(void)
+{
+    struct list_head *lh;
+    c2_magazine_t *mag;
+    c2_block_t *c2b = NULL;
+
+    mag = &get_cpu_var(castle_cache_magazines);
+    spin_lock(&mag->lock);
+    if (mag->nr_c2bs == 0)
+    {
+        /* Magazine empty, refill it from the global freelist. */
+        spin_lock(&castle_cache_freelist_lock);
+        BUG_ON(castle_cache_block_freelist_size < 0);
+        while ((mag->nr_c2bs < C2_MAGAZINE_BATCH) && (castle_cache_block_freelist_size > 0))
+        {
+            lh = castle_cache_block_freelist.next;
+            list_del(lh);
+            castle_cache_block_freelist_size--;
+            mag->c2bs[mag->nr_c2bs++] = list_entry(lh, c2_block_t, free);
+        }
+        spin_unlock(&castle_cache_freelist_lock);
+    }
+    if (mag->nr_c2bs > 0)
+        c2b = mag->c2bs[--mag->nr_c2bs];
+    spin_unlock(&mag->lock);
+    put_cpu_var(castle_cache_magazines);
+
+    return c2b;
+}
+
+/**
+ * Return a c2b from the reservelist if one exists.
+ *
+ * @return      c2b from the reservelist
+ * @return NULL reservelist is empty
+ */
+static c2_block_t *castle_cache_block_reservelist_get(void)
+{
+    struct list_head *lh;
+    c2_block_t *c2b = NULL;
+
+    BUG_ON(current != castle_cache_flush_thread);
+
+    spin_lock(&castle_cache_reservelist_lock);
+    if (atomic_read(&castle_cache_block_reservelist_size) > 0)
+    {
+        lh = castle_cache_block_reservelist.next;
+        list_del(lh);
+        c2b = list_entry(lh, c2_block_t, reserve);
+        atomic_dec(&castle_cache_block_reservelist_size);
+    }
+    spin_unlock(&castle_cache_reservelist_lock);
+
+    castle_trace_cache(TRACE_VALUE,
+                       TRACE_CACHE_RESERVE_BLKS_USED_ID,
+                       CASTLE_CACHE_RESERVELIST_QUOTA
+                           - atomic_read(&castle_cache_block_reservelist_size));
+
+
+    return c2b;
+}
+
+static void castle_cache_page_init(c_ext_pos_t cep,
+                                   c2_page_t *c2p)
+{
+    BUG_ON(c2p->count != 0);
+    c2p->cep   = cep;
+    c2p->state = INIT_C2P_BITS;
+}
+
+static int castle_cache_pages_get(c_ext_pos_t cep,
+                                  c2_page_t **c2ps,
+                                  int nr_c2ps)
+{
+    LIST_HEAD(freed_c2ps);
+    c2_page_t *c2p;
+    int i, freed_c2ps_cnt, all_uptodate;
+
+    BUG_ON(nr_c2ps <= 0);
+
+    all_uptodate = 1;
+    freed_c2ps_cnt = 0;
+    for(i=0; i<nr_c2ps; i++)
+    {
+        castle_cache_page_init(cep, c2ps[i]);
+        debug("c2p for cep="cep_fmt_str_nl, cep2str(c2ps[i]->cep));
+        c2p = castle_cache_page_hash_insert_get(c2ps[i]);
+        if(c2p != c2ps[i])
+        {
+            debug("Found c2p in the hash\n");
+            list_add(&c2ps[i]->list, &freed_c2ps);
+            freed_c2ps_cnt++;
+            c2ps[i] = c2p;
+            BUG_ON(c2p == NULL);
+        }
+        else
+        {
+            atomic_add(PAGES_PER_C2P, &castle_cache_clean_pages);
+            if (LOGICAL_EXTENT(cep.ext_id))
+                atomic_add(PAGES_PER_C2P, &castle_cache_logical_ext_pages);
+        }
+        /* Check if this page is clean. */
+        if(!c2p_uptodate(c2ps[i]))
+            all_uptodate = 0;
+        cep.offset += PAGES_PER_C2P * PAGE_SIZE;
+    }
+
+    /* Return all the freed_c2ps back onto the freelist */
+    BUG_ON(!list_empty(&freed_c2ps) && (freed_c2ps_cnt == 0));
+    BUG_ON( list_empty(&freed_c2ps) && (freed_c2ps_cnt != 0));
+    /* Return early if we have nothing to free (this avoids locking). */
+    if(freed_c2ps_cnt == 0)
+        return all_uptodate;
+    castle_cache_freelists_put(&freed_c2ps, NULL);
+
+    return all_uptodate;
+}
+
+/**
+ * Initialises a c2b to meet cep, nr_pages.
+ *
+ * NOTE: c2b passed in could have come from the freelist so it is necessary
+ * to fully initialise all fields.
+ */
+static void castle_cache_block_init(c2_block_t *c2b,
+                                    c_ext_pos_t cep,
+                                    c2_page_t **c2ps,
+                                    int nr_pages)
+{
+    struct page *page;
+    c_ext_pos_t dcep;
+    c2_page_t *c2p;
+    int i, uptodate;
+
+    debug("Initing c2b for cep="cep_fmt_str", nr_pages=%d\n",
+            cep2str(cep), nr_pages);
+    /* c2b should only be initialised if it's not used */
+    BUG_ON(nr_pages > CASTLE_CACHE_VMAP_PGS);
+#ifdef CASTLE_DEBUG
+    /* On debug builds, unpoison the fields. */
+    atomic_set(&c2b->count, 0);
+    atomic_set(&c2b->lock_cnt, 0);
+    atomic_set(&c2b->seq, 0);
+    c2b->state.softpin_cnt = 0;
+#else
+    /* On non-debug builds, those fields should all be zero. */
+    BUG_ON(c2b->c2ps != NULL);
+    BUG_ON(atomic_read(&c2b->count) != 0);
+    BUG_ON(atomic_read(&c2b->lock_cnt) != 0);
+    BUG_ON(c2b->state.softpin_cnt != 0);
+#endif
+    /* Init the page array (note: this may substitute some c2ps,
+       if they aleady exist in the hash. */
+    uptodate = castle_cache_pages_get(cep, c2ps, castle_cache_pages_to_c2ps(nr_pages));
+    /* Initialise c2b. */
+    atomic_set(&c2b->remaining, 0);
+    c2b->cep = cep;
+    c2b->state.bits = INIT_C2B_BITS | (uptodate ? (1 << C2B_uptodate) : 0);
+    c2b->nr_pages = nr_pages;
+    c2b->c2ps = c2ps;
+    c2_partitions_add(c2b);
+
+    i = 0;
+    debug("c2b->nr_pages=%d\n", nr_pages);
+    down(&castle_cache_vmap_lock);
+    c2b_for_each_page_start(page, c2p, dcep, c2b)
+    {
+#ifdef CASTLE_DEBUG
+        debug("Adding c2p id=%d, to cep "cep_fmt_str_nl,
+                c2p->id, cep2str(dcep));
+#endif
+        castle_cache_vmap_pgs[i++] = page;
     }
-    /* Drop the 1 ref. */
-    c2b_remaining_io_sub(rw, 1, c2b);
+    c2b_for_each_page_end(page, c2p, dcep, c2b)
+    debug("Added %d pages.\n", i);
+    BUG_ON(i != nr_pages);
 
-out:
-    kmem_cache_free(castle_io_array_cache, io_array);
-    return ret;
+    if (nr_pages == 1)
+        c2b->buffer = pfn_to_kaddr(page_to_pfn(castle_cache_vmap_pgs[0]));
+    else if (nr_pages <= CASTLE_VMAP_PGS)
+            c2b->buffer = castle_vmap_fast_map(castle_cache_vmap_pgs, i);
+        else
+            c2b->buffer = vmap(castle_cache_vmap_pgs, i, VM_READ|VM_WRITE, PAGE_KERNEL);
+
+    up(&castle_cache_vmap_lock);
+    BUG_ON(!c2b->buffer);
 }
 
-/**
- * Submit asynchronous c2b I/O.
+/**********************************************************************************************
+ * Compressed tier.
  *
- * Updates statistics before passing I/O to submit_c2b_rda().
+ * Clean blocks of immutable extents (RO btree nodes, medium objects and bloom filters)
+ * get compressed into a bounded in-memory pool when evicted from the cache.  Cache
+ * misses check the pool before going to disk.  Blocks get moved, not copied, back into
+ * the cache, so a compressed block can never be stale w.r.t. a cached copy.
  *
- * NOTE: IOs can also be submitted via submit_c2b_remap_rda().
+ * Pool pages are allocated at init, the eviction path never allocates memory.  Each
+ * compressed block takes a chain of pool pages, with its header at the start of the
+ * first one.  Blocks of an extent are dropped when the extent gets freed.
  *
- * @also submit_c2b_rda()
- * @also submit_c2b_remap_rda()
+ * @also castle_cache_block_hash_clean()
+ * @also _castle_cache_block_get()
+ * @also castle_cache_ztier_extent_drop()
  */
-int submit_c2b(int rw, c2_block_t *c2b)
+#define CASTLE_CACHE_ZTIER_MAX_PAGES    (VLBA_HDD_RO_TREE_NODE_SIZE) /**< Largest c2b stored. */
+#define CASTLE_CACHE_ZTIER_SCRATCH_SIZE (CASTLE_LZ_WRKMEM_SIZE +                                  \
+                                         castle_lz_bound(CASTLE_CACHE_ZTIER_MAX_PAGES * PAGE_SIZE))
+#define CASTLE_CACHE_ZTIER_EXT_BUCKETS  (1024)      /**< Extent hash size, power of 2.            */
+
+typedef struct castle_cache_zblock {
+    struct hlist_node    hlist;         /**< Position in castle_cache_ztier_hash.             */
+    struct list_head     lru;           /**< Position on castle_cache_ztier_lru.              */
+    struct list_head     ext_list;      /**< Position in castle_cache_ztier_ext_hash.         */
+    struct list_head     pages;         /**< Pool pages after the first one.                  */
+    int                  nr_zpages;     /**< Pool pages taken, including the first one.       */
+    c_ext_pos_t          cep;
+    int                  nr_pages;
+    int                  len;           /**< Compressed length.                               */
+    uint8_t              data[0];       /**< Rest of the first page, continued in pages.      */
+} c2_zblock_t;
+
+#define CASTLE_CACHE_ZTIER_PAGES(_len)  ((sizeof(c2_zblock_t) + (_len) + PAGE_SIZE - 1) >> PAGE_SHIFT)
+
+static DEFINE_SPINLOCK(castle_cache_ztier_lock);                /**< Protects hashes, LRU, pool.  */
+static struct hlist_head      *castle_cache_ztier_hash = NULL;
+static int                     castle_cache_ztier_hash_buckets;
+static struct list_head        castle_cache_ztier_ext_hash[CASTLE_CACHE_ZTIER_EXT_BUCKETS];
+                                                                /**< Blocks hashed by extent.     */
+static LIST_HEAD(castle_cache_ztier_lru);                       /**< Oldest block at the head.    */
+static LIST_HEAD(castle_cache_ztier_free_pages);                /**< Unused pool pages.           */
+static unsigned long           castle_cache_ztier_nr_free = 0;
+static unsigned long           castle_cache_ztier_max_bytes = 0; /**< 0 when the tier is disabled.*/
+static unsigned long           castle_cache_ztier_bytes = 0;     /**< Pool memory used by blocks. */
+static unsigned long           castle_cache_ztier_raw_bytes = 0; /**< Uncompressed size of blocks.*/
+static unsigned long           castle_cache_ztier_blocks = 0;
+static void                   *castle_cache_ztier_scratch[NR_CPUS]; /**< Per-CPU LZ work areas.   */
+static atomic64_t              castle_cache_ztier_stores;       /**< Blocks compressed.           */
+static atomic64_t              castle_cache_ztier_rejects;      /**< Incompressible/too big.      */
+static atomic64_t              castle_cache_ztier_hits;         /**< Misses served by the tier.   */
+static atomic64_t              castle_cache_ztier_misses;       /**< Misses which went to disk.   */
+static atomic64_t              castle_cache_ztier_evictions;    /**< Blocks dropped from the tier.*/
+
+/**
+ * Should c2b, which is about to be evicted, be stored in the compressed tier.
+ */
+static int castle_cache_ztier_eligible(c2_block_t *c2b)
 {
-    BUG_ON(!c2b->end_io);
-    BUG_ON(EXT_POS_INVAL(c2b->cep));
-    BUG_ON(atomic_read(&c2b->remaining));
-    /* If we are reading into the c2b block, we need to hold the write lock */
-    BUG_ON((rw == READ) && !c2b_write_locked(c2b));
-    /* If we writing out of the block, we need to hold the lock in either mode */
-    BUG_ON((rw == WRITE) && !c2b_locked(c2b));
-    if (unlikely(BLOCK_OFFSET(c2b->cep.offset)))
+    if (!castle_cache_ztier_max_bytes)
+        return 0;
+    if (!c2b_uptodate(c2b) || c2b_transient(c2b))
+        return 0;
+    if ((c2b->nr_pages > CASTLE_CACHE_ZTIER_MAX_PAGES) || LOGICAL_EXTENT(c2b->cep.ext_id))
+        return 0;
+
+    switch (castle_extent_type_get(c2b->cep.ext_id))
     {
-        castle_printk(LOG_ERROR, "RDA %s: nr_pages - %u cep: "cep_fmt_str_nl,
-                (rw == READ)?"Read":"Write", c2b->nr_pages, __cep2str(c2b->cep));
-        BUG();
+        case EXT_T_INTERNAL_NODES:
+        case EXT_T_LEAF_NODES:
+        case EXT_T_MEDIUM_OBJECTS:
+        case EXT_T_BLOOM_FILTER:
+            return 1;
+        default:
+            return 0;
     }
+}
 
-    /* Set in-flight bit on the block. */
-    set_c2b_in_flight(c2b);
+static inline struct list_head* castle_cache_ztier_ext_bucket(c_ext_id_t ext_id)
+{
+    return &castle_cache_ztier_ext_hash[ext_id & (CASTLE_CACHE_ZTIER_EXT_BUCKETS - 1)];
+}
+
+/**
+ * Find compressed block for cep.  Must be called with castle_cache_ztier_lock held.
+ */
+static c2_zblock_t* __castle_cache_ztier_find(c_ext_pos_t cep)
+{
+    struct hlist_node *lh;
+    c2_zblock_t *zb;
+    int idx;
+
+    idx = castle_cache_hash_idx(cep, castle_cache_ztier_hash_buckets);
+    hlist_for_each_entry(zb, lh, &castle_cache_ztier_hash[idx], hlist)
+        if (EXT_POS_EQUAL(zb->cep, cep))
+            return zb;
 
-    return submit_c2b_rda(rw, c2b);
+    return NULL;
 }
 
 /**
- * Unplug queues on all live slaves.
- *
- * Useful if you know that a sequence of submit_c2b()s has been completed.
+ * Insert compressed block into the tier.  Must be called with castle_cache_ztier_lock held.
+ */
+static void __castle_cache_ztier_link(c2_zblock_t *zb)
+{
+    hlist_add_head(&zb->hlist,
+                   &castle_cache_ztier_hash[castle_cache_hash_idx(zb->cep,
+                                                                  castle_cache_ztier_hash_buckets)]);
+    list_add_tail(&zb->lru, &castle_cache_ztier_lru);
+    list_add(&zb->ext_list, castle_cache_ztier_ext_bucket(zb->cep.ext_id));
+    castle_cache_ztier_bytes     += zb->nr_zpages * PAGE_SIZE;
+    castle_cache_ztier_raw_bytes += zb->nr_pages * PAGE_SIZE;
+    castle_cache_ztier_blocks++;
+}
+
+/**
+ * Remove compressed block from the tier.  Must be called with castle_cache_ztier_lock held.
+ */
+static void __castle_cache_ztier_unlink(c2_zblock_t *zb)
+{
+    hlist_del(&zb->hlist);
+    list_del(&zb->lru);
+    list_del(&zb->ext_list);
+    castle_cache_ztier_bytes     -= zb->nr_zpages * PAGE_SIZE;
+    castle_cache_ztier_raw_bytes -= zb->nr_pages * PAGE_SIZE;
+    castle_cache_ztier_blocks--;
+}
+
+/**
+ * Return the pages of an unlinked compressed block to the pool.
+ * Must be called with castle_cache_ztier_lock held.
+ */
+static void __castle_cache_ztier_block_free(c2_zblock_t *zb)
+{
+    castle_cache_ztier_nr_free += zb->nr_zpages;
+    list_splice(&zb->pages, &castle_cache_ztier_free_pages);
+    list_add(&virt_to_page(zb)->lru, &castle_cache_ztier_free_pages);
+}
+
+/**
+ * Take a compressed block of len bytes off the pool, evicting the oldest blocks if need
+ * be.  Must be called with castle_cache_ztier_lock held.
  *
- * @TODO we should be more intelligent about this and unplug just those slaves
- * that need to be.
+ * @return Unlinked block, NULL if the block would not fit in the tier
  */
-static void castle_slaves_unplug(void)
+static c2_zblock_t* __castle_cache_ztier_block_alloc(int len)
 {
-    struct list_head *lh;
+    int nr_zpages = CASTLE_CACHE_ZTIER_PAGES(len);
+    struct page *page;
+    c2_zblock_t *zb;
 
-    rcu_read_lock();
-    list_for_each_rcu(lh, &castle_slaves.slaves)
+    while ((castle_cache_ztier_nr_free < nr_zpages) && !list_empty(&castle_cache_ztier_lru))
     {
-        struct castle_slave *cs = list_entry(lh, struct castle_slave, list);
-        if (!test_bit(CASTLE_SLAVE_OOS_BIT, &cs->flags))
-            generic_unplug_device(bdev_get_queue(cs->bdev));
+        zb = list_first_entry(&castle_cache_ztier_lru, c2_zblock_t, lru);
+        __castle_cache_ztier_unlink(zb);
+        __castle_cache_ztier_block_free(zb);
+        atomic64_inc(&castle_cache_ztier_evictions);
     }
-    rcu_read_unlock();
+    if (castle_cache_ztier_nr_free < nr_zpages)
+        return NULL;
+
+    castle_cache_ztier_nr_free -= nr_zpages;
+    page = list_first_entry(&castle_cache_ztier_free_pages, struct page, lru);
+    list_del(&page->lru);
+    zb = page_address(page);
+    INIT_LIST_HEAD(&zb->pages);
+    zb->nr_zpages = nr_zpages;
+    zb->len       = len;
+    while (--nr_zpages > 0)
+        list_move_tail(castle_cache_ztier_free_pages.next, &zb->pages);
+
+    return zb;
 }
 
 /**
- * Submit synchronous c2b I/O.
- *
- * Dispatches cache block-I/O then blocks for completion.
+ * Copy compressed data between buf and the pages of zb.
  *
- * @see submit_c2b()
+ * @param out   Copy from zb into buf if set, from buf into zb otherwise
  */
-int submit_c2b_sync(int rw, c2_block_t *c2b)
+static void castle_cache_ztier_block_copy(c2_zblock_t *zb, uint8_t *buf, int out)
 {
-    struct completion completion;
-    int ret;
-
-    BUG_ON((rw == READ)  &&  c2b_uptodate(c2b));
-    BUG_ON((rw == WRITE) && !c2b_dirty(c2b));
-    c2b->end_io = castle_cache_sync_io_end;
-    c2b->private = &completion;
-    init_completion(&completion);
-    if((ret = submit_c2b(rw, c2b)) != EXIT_SUCCESS)
-        return ret;
-    wait_for_completion(&completion);
+    struct page *page;
+    int chunk, left;
 
-    /* Success (ret=0) if c2b is uptodate now for READ, or dirty now for WRITE */
-    if (rw == READ)
-        return !c2b_uptodate(c2b);
+    left  = zb->len;
+    chunk = min_t(int, left, PAGE_SIZE - sizeof(c2_zblock_t));
+    if (out)
+        memcpy(buf, zb->data, chunk);
     else
-        return c2b_dirty(c2b);
+        memcpy(zb->data, buf, chunk);
+    list_for_each_entry(page, &zb->pages, lru)
+    {
+        buf  += chunk;
+        left -= chunk;
+        chunk = min_t(int, left, PAGE_SIZE);
+        if (out)
+            memcpy(buf, page_address(page), chunk);
+        else
+            memcpy(page_address(page), buf, chunk);
+    }
+    BUG_ON(left != chunk);
 }
 
 /**
- * Submit synchronous c2b write, which is also a barrier write
- * (as per: Documentation/block/barrier.txt).
+ * Compress c2b into the tier, if it is eligible and compresses well enough.
  *
- * @see submit_c2b_sync()
+ * c2b must already be out of the block hash, with no references.
  */
-int submit_c2b_sync_barrier(int rw, c2_block_t *c2b)
+static void castle_cache_ztier_store(c2_block_t *c2b)
 {
-    int ret;
-
-    /* Only makes sense for writes. */
-    BUG_ON(rw != WRITE);
+    c2_zblock_t *zb, *old;
+    uint8_t *scratch;
+    int raw, len;
 
-    /* Mark the c2b as a barrier c2b. */
-    set_c2b_barrier(c2b);
-
-    /* Submit the c2b as per usual. */
-    ret = submit_c2b_sync(rw, c2b);
+    if (!castle_cache_ztier_eligible(c2b))
+        return;
 
-    /* Clear the bit, since c2b is write locked, noone else will see it. */
-    clear_c2b_barrier(c2b);
+    /* Only keep blocks which compress by at least 1/8th. */
+    raw = c2b->nr_pages * PAGE_SIZE;
+    zb = NULL;
+    scratch = castle_cache_ztier_scratch[get_cpu()];
+    len = castle_lz_compress(c2b_buffer(c2b), raw, scratch + CASTLE_LZ_WRKMEM_SIZE,
+                             raw - raw / 8, scratch);
+    if (len > 0)
+    {
+        spin_lock(&castle_cache_ztier_lock);
+        zb = __castle_cache_ztier_block_alloc(len);
+        spin_unlock(&castle_cache_ztier_lock);
+        /* The block is not visible to anyone yet, fill it outside of the lock. */
+        if (zb)
+            castle_cache_ztier_block_copy(zb, scratch + CASTLE_LZ_WRKMEM_SIZE, 0 /*out*/);
+    }
+    put_cpu();
+    if (!zb)
+    {
+        atomic64_inc(&castle_cache_ztier_rejects);
+        return;
+    }
+    zb->cep      = c2b->cep;
+    zb->nr_pages = c2b->nr_pages;
 
-    return ret;
+    spin_lock(&castle_cache_ztier_lock);
+    /* Replace any previous copy. */
+    if ((old = __castle_cache_ztier_find(zb->cep)))
+    {
+        __castle_cache_ztier_unlink(old);
+        __castle_cache_ztier_block_free(old);
+    }
+    __castle_cache_ztier_link(zb);
+    spin_unlock(&castle_cache_ztier_lock);
+    atomic64_inc(&castle_cache_ztier_stores);
 }
 
-static inline unsigned long castle_cache_hash_idx(c_ext_pos_t cep, int nr_buckets)
+/**
+ * Fill a freshly allocated c2b from the compressed tier, if it holds the block.
+ *
+ * The compressed copy is removed from the tier whether or not it gets used.  It is
+ * only used if none of the c2b pages are uptodate (e.g. shared with overlapping c2bs),
+ * and if no-one else locked the c2b in the meantime.
+ *
+ * @param c2b   Referenced c2b which just got inserted into the block hash
+ */
+static void castle_cache_ztier_fill(c2_block_t *c2b)
 {
-    unsigned long hash_idx = (cep.ext_id ^ cep.offset);
+    c_ext_pos_t cep_unused;
+    c2_zblock_t *zb;
+    c2_page_t *c2p;
+    uint8_t *scratch;
+    int fill;
 
-    hash_idx = hash_long(hash_idx, 32);
-    return (hash_idx % nr_buckets);
+    if (!castle_cache_ztier_max_bytes || c2b_uptodate(c2b))
+        return;
+
+    spin_lock(&castle_cache_ztier_lock);
+    if ((zb = __castle_cache_ztier_find(c2b->cep)))
+        __castle_cache_ztier_unlink(zb);
+    spin_unlock(&castle_cache_ztier_lock);
+    if (!zb)
+    {
+        atomic64_inc(&castle_cache_ztier_misses);
+        return;
+    }
+
+    fill = (zb->nr_pages == c2b->nr_pages) && write_trylock_c2b(c2b);
+    if (fill)
+    {
+        c2b_for_each_c2p_start(c2p, cep_unused, c2b)
+        {
+            if (c2p_uptodate(c2p))
+                fill = 0;
+        }
+        c2b_for_each_c2p_end(c2p, cep_unused, c2b)
+        if (fill)
+        {
+            /* Compressed data isn't contiguous in the pool, decompress from scratch. */
+            scratch = castle_cache_ztier_scratch[get_cpu()] + CASTLE_LZ_WRKMEM_SIZE;
+            castle_cache_ztier_block_copy(zb, scratch, 1 /*out*/);
+            fill = (castle_lz_decompress(scratch, zb->len, c2b_buffer(c2b),
+                                         c2b->nr_pages * PAGE_SIZE) == 0);
+            put_cpu();
+        }
+        if (fill)
+            update_c2b(c2b);
+        write_unlock_c2b(c2b);
+    }
+    atomic64_inc(fill ? &castle_cache_ztier_hits : &castle_cache_ztier_misses);
+
+    spin_lock(&castle_cache_ztier_lock);
+    __castle_cache_ztier_block_free(zb);
+    spin_unlock(&castle_cache_ztier_lock);
 }
 
-static inline void castle_cache_page_hash_idx(c_ext_pos_t cep, int *hash_idx_p, int *lock_idx_p)
+/**
+ * Drop all compressed blocks of ext_id, which is being freed.
+ */
+void castle_cache_ztier_extent_drop(c_ext_id_t ext_id)
 {
-    int hash_idx;
+    c2_zblock_t *zb, *tmp;
 
-    hash_idx = castle_cache_hash_idx(cep, castle_cache_page_hash_buckets);
+    if (!castle_cache_ztier_max_bytes)
+        return;
 
-    if(hash_idx_p)
-        *hash_idx_p = hash_idx;
-    if(lock_idx_p)
-        *lock_idx_p = hash_idx / PAGE_HASH_LOCK_PERIOD;
+    spin_lock(&castle_cache_ztier_lock);
+    list_for_each_entry_safe(zb, tmp, castle_cache_ztier_ext_bucket(ext_id), ext_list)
+    {
+        if (zb->cep.ext_id != ext_id)
+            continue;
+        __castle_cache_ztier_unlink(zb);
+        __castle_cache_ztier_block_free(zb);
+    }
+    spin_unlock(&castle_cache_ztier_lock);
 }
 
-/* Must be called with the page_hash lock held */
-static inline void __castle_cache_c2p_get(c2_page_t *c2p)
+/**
+ * Get compressed tier statistics.
+ */
+void castle_cache_ztier_stats_get(c2_ztier_stats_t *stats)
 {
-#ifdef CASTLE_DEBUG
-    int lock_idx;
-
-    castle_cache_page_hash_idx(c2p->cep, NULL, &lock_idx);
-    BUG_ON(!spin_is_locked(&castle_cache_page_hash_locks[lock_idx]));
-#endif
-    c2p->count++;
+    spin_lock(&castle_cache_ztier_lock);
+    stats->max_bytes = castle_cache_ztier_max_bytes;
+    stats->bytes     = castle_cache_ztier_bytes;
+    stats->raw_bytes = castle_cache_ztier_raw_bytes;
+    stats->blocks    = castle_cache_ztier_blocks;
+    spin_unlock(&castle_cache_ztier_lock);
+    stats->stores    = atomic64_read(&castle_cache_ztier_stores);
+    stats->rejects   = atomic64_read(&castle_cache_ztier_rejects);
+    stats->hits      = atomic64_read(&castle_cache_ztier_hits);
+    stats->misses    = atomic64_read(&castle_cache_ztier_misses);
+    stats->evictions = atomic64_read(&castle_cache_ztier_evictions);
 }
 
-static c2_page_t* castle_cache_page_hash_find(c_ext_pos_t cep)
+static void castle_cache_ztier_fini(void)
 {
-    struct hlist_node *lh;
-    c2_page_t *c2p;
-    int idx;
+    c2_zblock_t *zb, *tmp;
+    struct page *page, *ptmp;
+    int cpu;
 
-    castle_cache_page_hash_idx(cep, &idx, NULL);
-    debug("Idx = %d\n", idx);
-    hlist_for_each_entry(c2p, lh, &castle_cache_page_hash[idx], hlist)
+    castle_cache_ztier_max_bytes = 0;
+    list_for_each_entry_safe(zb, tmp, &castle_cache_ztier_lru, lru)
     {
-        if(EXT_POS_EQUAL(c2p->cep, cep))
-            return c2p;
+        __castle_cache_ztier_unlink(zb);
+        __castle_cache_ztier_block_free(zb);
     }
-
-    return NULL;
+    list_for_each_entry_safe(page, ptmp, &castle_cache_ztier_free_pages, lru)
+    {
+        list_del(&page->lru);
+        __free_page(page);
+    }
+    castle_cache_ztier_nr_free = 0;
+    for_each_possible_cpu(cpu)
+    {
+        if (castle_cache_ztier_scratch[cpu])
+            castle_vfree(castle_cache_ztier_scratch[cpu]);
+        castle_cache_ztier_scratch[cpu] = NULL;
+    }
+    if (castle_cache_ztier_hash)
+        castle_vfree(castle_cache_ztier_hash);
+    castle_cache_ztier_hash = NULL;
 }
 
-static c2_page_t* castle_cache_page_hash_insert_get(c2_page_t *c2p)
+static int castle_cache_ztier_init(void)
 {
-    c2_page_t *existing_c2p;
-    spinlock_t *lock;
-    int idx, lock_idx;
+    unsigned long nr_pages;
+    struct page *page;
+    int i, cpu;
 
-    /* Work out the index, and the lock. */
-    castle_cache_page_hash_idx(c2p->cep, &idx, &lock_idx);
-    lock = castle_cache_page_hash_locks + lock_idx;
+    if (!castle_cache_ztier_size)
+        return 0;
 
-    /* Check if already in the hash */
-    spin_lock_irq(lock);
-    existing_c2p = castle_cache_page_hash_find(c2p->cep);
-    if(existing_c2p)
-    {
-        __castle_cache_c2p_get(existing_c2p);
-        spin_unlock_irq(lock);
-        return existing_c2p;
+    /* Assume blocks compress to about a quarter of a VLBA RO node each. */
+    castle_cache_ztier_hash_buckets = (castle_cache_ztier_size << 20) /
+                    (CASTLE_CACHE_ZTIER_MAX_PAGES * PAGE_SIZE / 4) + 1;
+    castle_cache_ztier_hash = castle_vmalloc(castle_cache_ztier_hash_buckets *
+                                             sizeof(struct hlist_head));
+    if (!castle_cache_ztier_hash)
+        goto err_out;
+    for (i = 0; i < castle_cache_ztier_hash_buckets; i++)
+        INIT_HLIST_HEAD(&castle_cache_ztier_hash[i]);
+    for (i = 0; i < CASTLE_CACHE_ZTIER_EXT_BUCKETS; i++)
+        INIT_LIST_HEAD(&castle_cache_ztier_ext_hash[i]);
+    for_each_possible_cpu(cpu)
+    {
+        castle_cache_ztier_scratch[cpu] = castle_vmalloc(CASTLE_CACHE_ZTIER_SCRATCH_SIZE);
+        if (!castle_cache_ztier_scratch[cpu])
+            goto err_out;
     }
-    else
+    /* Preallocate the pool, pages need to be mapped (no highmem). */
+    nr_pages = (unsigned long)castle_cache_ztier_size << (20 - PAGE_SHIFT);
+    while (castle_cache_ztier_nr_free < nr_pages)
     {
-        __castle_cache_c2p_get(c2p);
-        hlist_add_head(&c2p->hlist, &castle_cache_page_hash[idx]);
-        spin_unlock_irq(lock);
-        return c2p;
+        if (!(page = alloc_page(GFP_KERNEL)))
+            goto err_out;
+        list_add(&page->lru, &castle_cache_ztier_free_pages);
+        castle_cache_ztier_nr_free++;
     }
+    castle_cache_ztier_max_bytes = (unsigned long)castle_cache_ztier_size << 20;
+    castle_printk(LOG_INIT, "Compressed cache tier: %u MB.\n", castle_cache_ztier_size);
+
+    return 0;
+
+err_out:
+    castle_printk(LOG_WARN, "Failed to allocate compressed cache tier.\n");
+    castle_cache_ztier_fini();
+
+    return -ENOMEM;
 }
 
-#define MIN(_a, _b)     ((_a) < (_b) ? (_a) : (_b))
-static inline void castle_cache_c2p_put(c2_page_t *c2p, struct list_head *accumulator)
-{
-    spinlock_t *lock;
-    int idx, lock_idx;
+/**********************************************************************************************
+ * SSD victim cache (L2).
+ *
+ * Clean blocks of immutable HDD extents that get evicted from the cache are appended to
+ * a circular log in an SSD_ONLY_EXT extent.  An in-memory index maps their ceps to log
+ * positions, reads submitted for blocks in the index are served from the log instead of
+ * the HDD, asynchronously like any other read.  The index is protected by hashed locks,
+ * its entries come off a preallocated free list.
+ *
+ * The log is written one chunk-sized segment at a time.  Evicted blocks are copied into
+ * an in-memory staging segment (blocks can't be written from the eviction path), full
+ * segments are written out from castle_wq.  Blocks in staging segments are served from
+ * memory.  When the log wraps, index entries of the segment about to be overwritten get
+ * dropped before the new segment starts filling.  Readers validate the log position of
+ * their entry after reading it, as the segment might have been overwritten meanwhile.
+ *
+ * The log extent is not referenced from any persistent structure, it is freed as a dead
+ * extent on the next restart.
+ *
+ * @also castle_cache_block_hash_clean()
+ * @also __submit_c2b()
+ */
+#define CASTLE_CACHE_L2_SEG_PAGES       (BLKS_PER_CHK)              /**< One chunk per segment.   */
+#define CASTLE_CACHE_L2_MAX_PAGES       (VLBA_HDD_RO_TREE_NODE_SIZE) /**< Largest c2b stored.     */
+#define CASTLE_CACHE_L2_STAGES          (2)         /**< One segment filling, one being written.  */
+#define CASTLE_CACHE_L2_IO_BATCH        (32)        /**< Log pages per segment write batch.       */
+#define CASTLE_CACHE_L2_HASH_LOCKS      (256)       /**< Index hash locks, buckets share them.    */
+#define CASTLE_CACHE_L2_FREE_ENTRIES    (2 * CASTLE_CACHE_L2_SEG_PAGES)
+                                                    /**< Entries kept preallocated.               */
+
+enum {
+    C2_L2_STAGE_FREE,
+    C2_L2_STAGE_FILLING,
+    C2_L2_STAGE_WRITING,
+};
 
-    castle_cache_page_hash_idx(c2p->cep, &idx, &lock_idx);
-    lock = castle_cache_page_hash_locks + lock_idx;
-    spin_lock_irq(lock);
+typedef struct castle_cache_l2_entry {
+    struct hlist_node    hlist;         /**< Position in castle_cache_l2_hash.                */
+    struct list_head     log;           /**< Position on castle_cache_l2_log, oldest first,   */
+                                        /**< or on castle_cache_l2_free.                      */
+    c_ext_pos_t          cep;
+    int                  nr_pages;
+    uint64_t             pos;           /**< Position in the (unwrapped) log.                 */
+    c_byte_off_t         log_off;       /**< Offset within the log extent.                    */
+} c2_l2_entry_t;
+
+typedef struct castle_cache_l2_stage {
+    int                  state;
+    uint64_t             seg;           /**< Segment number, pos >> C_CHK_SHIFT.              */
+    c_byte_off_t         log_off;       /**< Offset of the segment within the log extent.     */
+    int                  used;          /**< Pages filled.                                    */
+    void                *buf;           /**< CASTLE_CACHE_L2_SEG_PAGES pages.                 */
+    struct work_struct   work;
+} c2_l2_stage_t;
+
+/**
+ * Read of a block from the L2 log, see castle_cache_l2_read().
+ */
+typedef struct castle_cache_l2_read {
+    c2_block_t          *c2b;           /**< Block being read, locked by the submitter.       */
+    uint64_t             pos;           /**< Log position of its entry when the read started. */
+    int                  nr_pages;
+    c2_block_t          *log_c2bs[CASTLE_CACHE_L2_MAX_PAGES]; /**< Log pages, locked.         */
+    struct work_struct   work;          /**< Falls back to the HDD if the entry went away.    */
+} c2_l2_read_t;
+
+static DEFINE_SPINLOCK(castle_cache_l2_lock);   /**< Protects log list, stages and free list. */
+static spinlock_t              castle_cache_l2_hash_locks[CASTLE_CACHE_L2_HASH_LOCKS];
+                                                /**< Protect the index, taken with IRQs off.  */
+static int                     castle_cache_l2_enabled = 0;     /**< Stores and reads allowed.    */
+static c_ext_id_t              castle_cache_l2_ext_id = INVAL_EXT_ID; /**< Log extent.            */
+static c_chk_cnt_t             castle_cache_l2_chunks = 0;      /**< Log size.                    */
+static struct hlist_head      *castle_cache_l2_hash = NULL;
+static int                     castle_cache_l2_hash_buckets;
+static LIST_HEAD(castle_cache_l2_log);                          /**< Entries in log order.        */
+static uint64_t                castle_cache_l2_entries = 0;
+static LIST_HEAD(castle_cache_l2_free);                         /**< Preallocated entries.        */
+static int                     castle_cache_l2_nr_free = 0;
+static int                     castle_cache_l2_refilling = 0;   /**< Refill queued.               */
+static struct work_struct      castle_cache_l2_refill_work;
+static uint64_t                castle_cache_l2_next_seg = 0;    /**< Next segment to fill.        */
+static c_chk_t                 castle_cache_l2_next_chunk = 0;  /**< Log chunk of next segment.   */
+static uint64_t                castle_cache_l2_tail = 0;        /**< Oldest valid log position.   */
+static c2_l2_stage_t           castle_cache_l2_stages[CASTLE_CACHE_L2_STAGES];
+static c2_l2_stage_t          *castle_cache_l2_cur = NULL;      /**< Stage being filled.          */
+static atomic_t                castle_cache_l2_pending = ATOMIC_INIT(0);
+                                                /**< Segment writes, reads and refills queued. */
+static DECLARE_WAIT_QUEUE_HEAD(castle_cache_l2_pending_wq);
+static atomic64_t              castle_cache_l2_stores;          /**< Blocks added to the log.     */
+static atomic64_t              castle_cache_l2_skips;           /**< Blocks already in the log.   */
+static atomic64_t              castle_cache_l2_rejects;         /**< No staging space/entries.    */
+static atomic64_t              castle_cache_l2_invalidations;   /**< Entries dropped on wrap.     */
+static atomic64_t              castle_cache_l2_stored_bytes;    /**< Bytes of blocks stored.      */
+static atomic64_t              castle_cache_l2_written_bytes;   /**< Bytes written to the SSD.    */
+static atomic64_t              castle_cache_l2_read_bytes;      /**< Bytes of blocks served.      */
+static atomic64_t              castle_cache_l2_hits;
+static atomic64_t              castle_cache_l2_misses;
+
+/**
+ * Should c2b, which is about to be evicted, be stored in the L2.
+ */
+static int castle_cache_l2_eligible(c2_block_t *c2b)
+{
+    if (!castle_cache_l2_enabled)
+        return 0;
+    if (!c2b_uptodate(c2b) || c2b_transient(c2b))
+        return 0;
+    if ((c2b->nr_pages > CASTLE_CACHE_L2_MAX_PAGES) || LOGICAL_EXTENT(c2b->cep.ext_id))
+        return 0;
+    if (c2b->cep.ext_id == castle_cache_l2_ext_id)
+        return 0;
+    /* SSD_RDA extents already have a copy on an SSD. */
+    if (castle_extent_rda_type_get(c2b->cep.ext_id) != DEFAULT_RDA)
+        return 0;
 
-    c2p->count--;
-    /* If the count reached zero, delete from the hash, add to the accumulator list,
-       so that they get freed later on. */
-    if(c2p->count == 0)
+    switch (castle_extent_type_get(c2b->cep.ext_id))
     {
-#ifdef CASTLE_DEBUG
-        char *buf, *poison="dead-page";
-        int i, j, str_len;
-
-        str_len = strlen(poison);
-        for(i=0; i<PAGES_PER_C2P; i++)
-        {
-            buf = pfn_to_kaddr(page_to_pfn(c2p->pages[i]));
-            for(j=0; j<PAGE_SIZE; j+=str_len)
-                memcpy(buf+j, poison, MIN(PAGE_SIZE-j, str_len));
-        }
-#endif
-        if (LOGICAL_EXTENT(c2p->cep.ext_id))
-            atomic_sub(PAGES_PER_C2P, &castle_cache_logical_ext_pages);
-        debug("Freeing c2p for cep="cep_fmt_str_nl, cep2str(c2p->cep));
-        BUG_ON(c2p_dirty(c2p));
-        atomic_sub(PAGES_PER_C2P, &castle_cache_clean_pages);
-        hlist_del(&c2p->hlist);
-        list_add(&c2p->list, accumulator);
+        case EXT_T_INTERNAL_NODES:
+        case EXT_T_LEAF_NODES:
+        case EXT_T_MEDIUM_OBJECTS:
+        case EXT_T_BLOOM_FILTER:
+            return 1;
+        default:
+            return 0;
     }
-    spin_unlock_irq(lock);
 }
 
-static inline int castle_cache_block_hash_idx(c_ext_pos_t cep)
+static inline spinlock_t* castle_cache_l2_hash_lock(int idx)
 {
-    return castle_cache_hash_idx(cep, castle_cache_block_hash_buckets);
+    return &castle_cache_l2_hash_locks[idx % CASTLE_CACHE_L2_HASH_LOCKS];
 }
 
-static c2_block_t* castle_cache_block_hash_find(c_ext_pos_t cep, uint32_t nr_pages)
+/**
+ * Find the index entry for cep.
+ *
+ * NOTE: Needs the hash lock of cep's bucket.
+ */
+static c2_l2_entry_t* __castle_cache_l2_find(c_ext_pos_t cep, int idx)
 {
-    struct hlist_node *lh;
-    c2_block_t *c2b;
-    int idx;
+    struct hlist_node *le;
+    c2_l2_entry_t *entry;
 
-    idx = castle_cache_block_hash_idx(cep);
-    debug("Idx = %d\n", idx);
-    hlist_for_each_entry(c2b, lh, &castle_cache_block_hash[idx], hlist)
-    {
-        if(EXT_POS_EQUAL(c2b->cep, cep) && (c2b->nr_pages == nr_pages))
-            return c2b;
-    }
+    hlist_for_each_entry(entry, le, &castle_cache_l2_hash[idx], hlist)
+        if (EXT_POS_EQUAL(entry->cep, cep))
+            return entry;
 
     return NULL;
 }
 
 /**
- * Gets c2b matching (cep, nr_pages) and adjusts its dirty/freelist position.
- *
- * @arg cep         Specifies the c2b offset and extent
- * @arg nr_pages    Specifies size of block
- * @arg promote     If set: advises LRU mechanism we will use this block
- *                  If unset: advises LRU mechanism we will free this block
+ * Log position of the index entry for cep, if it has one of nr_pages.
  *
- * @return Matching c2b with an additional reference
- * @return NULL if no matches were found
+ * @return Log position, or -1 if there is no such entry
  */
-static inline c2_block_t* _castle_cache_block_hash_get(c_ext_pos_t cep,
-                               uint32_t nr_pages,
-                               int promote)
+static int64_t castle_cache_l2_pos_get(c_ext_pos_t cep, int nr_pages, c_byte_off_t *log_off)
 {
-    c2_block_t *c2b = NULL;
-
-    /* Hold the hash lock. */
-    spin_lock_irq(&castle_cache_block_hash_lock);
-
-    /* Try and get the matching block from the hash. */
-    c2b = castle_cache_block_hash_find(cep, nr_pages);
+    int idx = castle_cache_hash_idx(cep, castle_cache_l2_hash_buckets);
+    c2_l2_entry_t *entry;
+    unsigned long flags;
+    int64_t pos = -1;
 
-    if (c2b)
+    spin_lock_irqsave(castle_cache_l2_hash_lock(idx), flags);
+    entry = __castle_cache_l2_find(cep, idx);
+    if (entry && (entry->nr_pages == nr_pages))
     {
-        /* We found a matching block. */
-
-        if (promote)
-        {
-            /* We are obtaining this block to be used.  We should push it to
-             * the end of the LRU list indicating that it is recently used
-             * and should not be freed any time soon.
-             *
-             * We're going to return this block to the caller so hold a
-             * reference for them so it doesn't get removed. */
-            get_c2b(c2b);
-
-            if (!c2b_dirty(c2b))
-                list_move_tail(&c2b->clean, &castle_cache_cleanlist);
-        }
-        else if (atomic_read(&c2b->count) == 0)
-        {
-            /* No references on this block means it's not in use.
-             * If clean: demote so it gets reused next
-             * If dirty: don't touch it - let LRU mechanism handle it */
-            if (!c2b_dirty(c2b))
-                list_move(&c2b->clean, &castle_cache_cleanlist);
-        }
+        pos = entry->pos;
+        if (log_off)
+            *log_off = entry->log_off;
     }
+    spin_unlock_irqrestore(castle_cache_l2_hash_lock(idx), flags);
 
-    /* Release the hash lock. */
-    spin_unlock_irq(&castle_cache_block_hash_lock);
-
-    return c2b;
+    return pos;
 }
 
 /**
- * Get c2b matching (cep, nr_pages).
- *
- * @arg cep     Specifies the c2b offset and extent
- * @arg nr_pages    Specifies size of block
+ * Drop entry from the index and the log, back onto the free list.
  *
- * @return Matching c2b with an additional reference
- * @return NULL if no matches were found
+ * NOTE: Needs castle_cache_l2_lock.
  */
-static inline c2_block_t* castle_cache_block_hash_get(c_ext_pos_t cep,
-                               uint32_t nr_pages)
+static void __castle_cache_l2_unlink(c2_l2_entry_t *entry)
 {
-    return _castle_cache_block_hash_get(cep, nr_pages, 1);
+    int idx = castle_cache_hash_idx(entry->cep, castle_cache_l2_hash_buckets);
+    unsigned long flags;
+
+    spin_lock_irqsave(castle_cache_l2_hash_lock(idx), flags);
+    hlist_del(&entry->hlist);
+    spin_unlock_irqrestore(castle_cache_l2_hash_lock(idx), flags);
+    list_move(&entry->log, &castle_cache_l2_free);
+    castle_cache_l2_nr_free++;
+    castle_cache_l2_entries--;
 }
 
 /**
- * Find block matching (cep, nr_pages) and demote it in the clean/dirtytree.
- *
- * NOTE: does not obtain an addition reference on any block returned.  The
- * caller is responsible for obtaining this if required.
- *
- * @arg cep         Specifies the c2b offset and extent
- * @arg nr_pages    Specifies size of block
- *
- * @return 1 c2b found
- * @return 0 c2b not found
+ * Top up the free list of entries, so that castle_cache_l2_store() never allocates.
  */
-static inline int castle_cache_block_hash_demote(c_ext_pos_t cep,
-                                                         uint32_t nr_pages)
+static void castle_cache_l2_refill(void)
 {
-    return _castle_cache_block_hash_get(cep, nr_pages, 0) ? 1 : 0;
+    c2_l2_entry_t *entry;
+    LIST_HEAD(entries);
+    int nr;
+
+    spin_lock(&castle_cache_l2_lock);
+    nr = CASTLE_CACHE_L2_FREE_ENTRIES - castle_cache_l2_nr_free;
+    spin_unlock(&castle_cache_l2_lock);
+    for (; nr > 0; nr--)
+    {
+        entry = castle_malloc(sizeof(c2_l2_entry_t), GFP_KERNEL);
+        if (!entry)
+            break;
+        list_add(&entry->log, &entries);
+    }
+
+    spin_lock(&castle_cache_l2_lock);
+    while (!list_empty(&entries))
+    {
+        list_move(entries.next, &castle_cache_l2_free);
+        castle_cache_l2_nr_free++;
+    }
+    castle_cache_l2_refilling = 0;
+    spin_unlock(&castle_cache_l2_lock);
+}
+
+static void castle_cache_l2_refill_work_fn(struct work_struct *work)
+{
+    castle_cache_l2_refill();
+    if (atomic_dec_and_test(&castle_cache_l2_pending))
+        wake_up(&castle_cache_l2_pending_wq);
 }
 
 /**
- * Insert a clean block into the hash.
- *
- * - Insert the block into the hash
- * - Cleanlist accounting
+ * Take an entry off the free list, queueing a refill once it runs low.
  *
- * @warning The block must not be dirty.
+ * NOTE: Needs castle_cache_l2_lock.
  *
- * @return >0   on success
- * @return  0   on failure
+ * @return NULL if the free list is empty
  */
-static int castle_cache_block_hash_insert(c2_block_t *c2b, int transient)
+static c2_l2_entry_t* __castle_cache_l2_entry_get(void)
 {
-    int idx, success;
-
-    spin_lock_irq(&castle_cache_block_hash_lock);
+    c2_l2_entry_t *entry = NULL;
 
-    /* Check if already in the hash */
-    success = 0;
-    if(castle_cache_block_hash_find(c2b->cep, c2b->nr_pages)) goto out;
+    if (!list_empty(&castle_cache_l2_free))
+    {
+        entry = list_first_entry(&castle_cache_l2_free, c2_l2_entry_t, log);
+        list_del(&entry->log);
+        castle_cache_l2_nr_free--;
+    }
+    if ((castle_cache_l2_nr_free < CASTLE_CACHE_L2_FREE_ENTRIES / 2) &&
+        !castle_cache_l2_refilling)
+    {
+        castle_cache_l2_refilling = 1;
+        atomic_inc(&castle_cache_l2_pending);
+        queue_work(castle_wq, &castle_cache_l2_refill_work);
+    }
 
-    /* Insert */
-    success = 1;
-    idx = castle_cache_block_hash_idx(c2b->cep);
-    hlist_add_head(&c2b->hlist, &castle_cache_block_hash[idx]);
-    BUG_ON(c2b_dirty(c2b));
-    BUG_ON(c2b_softpin(c2b));
-    if (transient)
-        list_add(&c2b->clean, &castle_cache_cleanlist);
-    else
-        list_add_tail(&c2b->clean, &castle_cache_cleanlist);
-    /* Cleanlist accounting. */
-    atomic_inc(&castle_cache_cleanlist_size);
-out:
-    spin_unlock_irq(&castle_cache_block_hash_lock);
-    return success;
+    return entry;
 }
 
 /**
- * Add c2p to freelist or reservelist and do list accounting.
- *
- * c2p goes to the reservelist if reservelist_size is below quota.
+ * Find the stage holding log position pos, if it's still in memory.
  */
-static inline void __castle_cache_page_freelist_add(c2_page_t *c2p)
+static c2_l2_stage_t* __castle_cache_l2_stage_find(uint64_t pos)
 {
-    int size, on_reservelist = 0;
+    int i;
 
-    BUG_ON(c2p->count != 0);
+    for (i = 0; i < CASTLE_CACHE_L2_STAGES; i++)
+        if ((castle_cache_l2_stages[i].state != C2_L2_STAGE_FREE) &&
+            (castle_cache_l2_stages[i].seg == pos >> C_CHK_SHIFT))
+            return &castle_cache_l2_stages[i];
 
-    size = atomic_read(&castle_cache_page_reservelist_size);
+    return NULL;
+}
 
-    if (unlikely(size < CASTLE_CACHE_RESERVELIST_QUOTA))
+/**
+ * Write nr_pages of the L2 log at log_off, from buf.
+ *
+ * The log is always accessed through single page c2bs.  Entries and segments start at
+ * arbitrary pages and have varying sizes, so this keeps the geometry of the c2b at any
+ * log cep fixed, however the log got laid out over time.
+ *
+ * @return Non-zero if the I/O failed
+ */
+static int castle_cache_l2_log_write(c_byte_off_t log_off, void *buf, int nr_pages)
+{
+    c2_block_t *c2bs[CASTLE_CACHE_L2_IO_BATCH];
+    c_ext_pos_t cep;
+    int i, nr, done, ret = 0;
+
+    cep.ext_id = castle_cache_l2_ext_id;
+    for (done = 0; done < nr_pages; done += nr)
     {
-        /* c2p reservelist is below quota.  Grab the lock and retest.  If it is
-         * still below quota, place this c2p on reservelist. */
-        spin_lock(&castle_cache_reservelist_lock);
-        size = atomic_read(&castle_cache_page_reservelist_size);
-        if (likely(size < CASTLE_CACHE_RESERVELIST_QUOTA))
+        nr = min(nr_pages - done, CASTLE_CACHE_L2_IO_BATCH);
+        for (i = 0; i < nr; i++)
         {
-            list_add_tail(&c2p->list, &castle_cache_page_reservelist);
-            atomic_inc(&castle_cache_page_reservelist_size);
-            on_reservelist = 1;
+            cep.offset = log_off + (c_byte_off_t)(done + i) * PAGE_SIZE;
+            c2bs[i] = _castle_cache_block_get(cep, 1, 1 /*transient*/);
+            write_lock_c2b(c2bs[i]);
+            memcpy(c2b_buffer(c2bs[i]), buf + (done + i) * PAGE_SIZE, PAGE_SIZE);
+            update_c2b(c2bs[i]);
+            dirty_c2b(c2bs[i]);
         }
-        spin_unlock(&castle_cache_reservelist_lock);
+        if (submit_c2bs_sync(WRITE, c2bs, nr))
+            ret = -EIO;
+        for (i = 0; i < nr; i++)
+        {
+            write_unlock_c2b(c2bs[i]);
+            put_c2b(c2bs[i]);
+        }
+        if (ret)
+            break;
     }
 
-    if (likely(!on_reservelist))
-    {
-        /* c2p reservelist is at its quota.  Place this c2p on freelist. */
-        list_add_tail(&c2p->list, &castle_cache_page_freelist);
-        castle_cache_page_freelist_size++;
-    }
+    return ret;
 }
 
 /**
- * Add block to freelist or reservelist and do list accounting.
- *
- * c2b goes to the reservelist if reservelist_size is below quota.
+ * Write a full staging segment to the log.
  */
-static inline void __castle_cache_block_freelist_add(c2_block_t *c2b)
+static void castle_cache_l2_stage_write(struct work_struct *work)
 {
-    int size, on_reservelist = 0;
+    c2_l2_stage_t *stage = container_of(work, c2_l2_stage_t, work);
+    c2_l2_entry_t *entry, *tmp;
+    uint64_t start;
+    int ret;
 
-    size = atomic_read(&castle_cache_block_reservelist_size);
+    BUG_ON(stage->state != C2_L2_STAGE_WRITING);
 
-    if (unlikely(size < CASTLE_CACHE_RESERVELIST_QUOTA))
-    {
-        /* c2b reservelist is below quota.  Grab the lock and retest.  If it is
-         * still below quota, places this c2b on reservelist. */
-        spin_lock(&castle_cache_reservelist_lock);
-        size = atomic_read(&castle_cache_block_reservelist_size);
-        if (likely(size < CASTLE_CACHE_RESERVELIST_QUOTA))
-        {
-            list_add_tail(&c2b->reserve, &castle_cache_block_reservelist);
-            atomic_inc(&castle_cache_block_reservelist_size);
-            on_reservelist = 1;
-        }
-        spin_unlock(&castle_cache_reservelist_lock);
-    }
+    ret = castle_cache_l2_log_write(stage->log_off, stage->buf, stage->used);
 
-    if (likely(!on_reservelist))
+    spin_lock(&castle_cache_l2_lock);
+    if (ret)
     {
-        /* c2b reservelist is at its quota.  Places this c2b on freelist. */
-        list_add_tail(&c2b->free, &castle_cache_block_freelist);
-        castle_cache_block_freelist_size++;
+        /* The log doesn't hold the blocks, drop their entries. */
+        castle_printk(LOG_WARN, "Failed to write SSD cache segment %llu, ret=%d.\n",
+                stage->seg, ret);
+        start = stage->seg << C_CHK_SHIFT;
+        list_for_each_entry_safe(entry, tmp, &castle_cache_l2_log, log)
+            if ((entry->pos >= start) && (entry->pos < start + C_CHK_SIZE))
+                __castle_cache_l2_unlink(entry);
     }
+    else
+        atomic64_add(stage->used * PAGE_SIZE, &castle_cache_l2_written_bytes);
+    stage->state = C2_L2_STAGE_FREE;
+    spin_unlock(&castle_cache_l2_lock);
+
+    if (atomic_dec_and_test(&castle_cache_l2_pending))
+        wake_up(&castle_cache_l2_pending_wq);
 }
 
 /**
- * Get nr_pages of c2ps from the freelist.
+ * Seal the stage being filled and start filling the next log segment.
  *
- * @also castle_cache_page_reservelist_get()
+ * Entries of the segment which the new one overwrites get dropped.
+ *
+ * @return NULL if both stages are busy
  */
-static c2_page_t** castle_cache_page_freelist_get(int nr_pages)
+static c2_l2_stage_t* __castle_cache_l2_stage_next(void)
 {
-    struct list_head *lh, *lt;
-    c2_page_t **c2ps;
-    int i, nr_c2ps;
+    c2_l2_stage_t *stage = NULL;
+    c2_l2_entry_t *entry;
+    int i;
 
-    debug("Asked for %d pages from the freelist.\n", nr_pages);
-    nr_c2ps = castle_cache_pages_to_c2ps(nr_pages);
-    c2ps = castle_zalloc(nr_c2ps * sizeof(c2_page_t *), GFP_KERNEL);
-    BUG_ON(!c2ps);
-    spin_lock(&castle_cache_freelist_lock);
-    /* Will only be able to satisfy the request if we have nr_pages on the list */
-    if (castle_cache_page_freelist_size * PAGES_PER_C2P < nr_pages)
+    if (castle_cache_l2_cur)
     {
-        spin_unlock(&castle_cache_freelist_lock);
-        castle_free(c2ps);
-        debug("Freelist too small to allocate %d pages.\n", nr_pages);
-        return NULL;
+        BUG_ON(!castle_cache_l2_cur->used);
+        castle_cache_l2_cur->state = C2_L2_STAGE_WRITING;
+        atomic_inc(&castle_cache_l2_pending);
+        CASTLE_INIT_WORK(&castle_cache_l2_cur->work, castle_cache_l2_stage_write);
+        queue_work(castle_wq, &castle_cache_l2_cur->work);
+        castle_cache_l2_cur = NULL;
     }
 
-    i = 0;
-    list_for_each_safe(lh, lt, &castle_cache_page_freelist)
-    {
-        if (nr_pages <= 0)
-            break;
-        list_del(lh);
-        castle_cache_page_freelist_size--;
-        BUG_ON(i >= nr_c2ps);
-        c2ps[i++] = list_entry(lh, c2_page_t, list);
-        nr_pages -= PAGES_PER_C2P;
-    }
-    spin_unlock(&castle_cache_freelist_lock);
-#ifdef CASTLE_DEBUG
-    for (i--; i>=0; i--)
+    for (i = 0; i < CASTLE_CACHE_L2_STAGES; i++)
+        if (castle_cache_l2_stages[i].state == C2_L2_STAGE_FREE)
+            stage = &castle_cache_l2_stages[i];
+    if (!stage)
+        return NULL;
+
+    stage->state   = C2_L2_STAGE_FILLING;
+    stage->seg     = castle_cache_l2_next_seg++;
+    stage->log_off = (c_byte_off_t)castle_cache_l2_next_chunk * C_CHK_SIZE;
+    stage->used    = 0;
+    if (++castle_cache_l2_next_chunk == castle_cache_l2_chunks)
+        castle_cache_l2_next_chunk = 0;
+
+    /* The new segment overwrites the oldest one once the log has wrapped. */
+    if (stage->seg + 1 > castle_cache_l2_chunks)
+        castle_cache_l2_tail = (stage->seg + 1 - castle_cache_l2_chunks) << C_CHK_SHIFT;
+    while (!list_empty(&castle_cache_l2_log))
     {
-        debug("Got c2p id=%d from freelist.\n", c2ps[i]->id);
-    }
-#endif
-    /* Check that we _did_ succeed at allocating required number of c2ps */
-    BUG_ON(nr_pages > 0);
+        entry = list_first_entry(&castle_cache_l2_log, c2_l2_entry_t, log);
+        if (entry->pos >= castle_cache_l2_tail)
+            break;
+        __castle_cache_l2_unlink(entry);
+        atomic64_inc(&castle_cache_l2_invalidations);
+    }
+    castle_cache_l2_cur = stage;
 
-    return c2ps;
+    return stage;
 }
 
 /**
- * Get nr_pages of c2ps from the reservelist.
+ * Append c2b, which is about to be evicted, to the L2 log.
  *
- * @also castle_cache_page_freelist_get()
+ * Entries come off a preallocated free list, blocks are rejected if it's empty.
  */
-static c2_page_t** castle_cache_page_reservelist_get(int nr_pages)
+static void castle_cache_l2_store(c2_block_t *c2b)
 {
-    struct list_head *lh, *lt;
-    c2_page_t **c2ps;
-    int i, nr_c2ps;
+    c2_l2_entry_t *entry;
+    c2_l2_stage_t *stage;
+    unsigned long flags;
+    int idx;
 
-    nr_c2ps = castle_cache_pages_to_c2ps(nr_pages);
-    c2ps = castle_zalloc(nr_c2ps * sizeof(c2_page_t *), GFP_KERNEL);
-    BUG_ON(!c2ps);
+    if (!castle_cache_l2_eligible(c2b))
+        return;
 
-    spin_lock(&castle_cache_reservelist_lock);
-    if (atomic_read(&castle_cache_page_reservelist_size) * PAGES_PER_C2P < nr_pages)
+    /* Immutable extents: a block in the log is still valid, don't write it again. */
+    if (castle_cache_l2_pos_get(c2b->cep, c2b->nr_pages, NULL) >= 0)
     {
-        spin_unlock(&castle_cache_reservelist_lock);
-        castle_free(c2ps);
-        debug("Reservelist too small to allocate %d pages.\n", nr_pages);
-        return NULL;
+        atomic64_inc(&castle_cache_l2_skips);
+        return;
     }
 
-    i = 0;
-    list_for_each_safe(lh, lt, &castle_cache_page_reservelist)
+    spin_lock(&castle_cache_l2_lock);
+    if (!castle_cache_l2_enabled)
     {
-        if (nr_pages <= 0)
-            break;
-        list_del(lh);
-        atomic_dec(&castle_cache_page_reservelist_size);
-        BUG_ON(i >= nr_c2ps);
-        c2ps[i++] = list_entry(lh, c2_page_t, list);
-        nr_pages -= PAGES_PER_C2P;
+        spin_unlock(&castle_cache_l2_lock);
+        return;
     }
-    spin_unlock(&castle_cache_reservelist_lock);
-#ifdef CASTLE_DEBUG
-    for (i--; i >= 0; i--)
+    entry = __castle_cache_l2_entry_get();
+    stage = castle_cache_l2_cur;
+    if (entry && (!stage || (stage->used + c2b->nr_pages > CASTLE_CACHE_L2_SEG_PAGES)))
+        stage = __castle_cache_l2_stage_next();
+    if (!entry || !stage)
     {
-        debug("Got c2p id=%d from reservelist.\n", c2ps[i]->id);
+        if (entry)
+        {
+            list_add(&entry->log, &castle_cache_l2_free);
+            castle_cache_l2_nr_free++;
+        }
+        spin_unlock(&castle_cache_l2_lock);
+        atomic64_inc(&castle_cache_l2_rejects);
+        return;
     }
-#endif
-    BUG_ON(nr_pages > 0); /* verify we got nr_pages of c2ps */
-
-    castle_trace_cache(TRACE_VALUE,
-                       TRACE_CACHE_RESERVE_PGS_USED_ID,
-                       CASTLE_CACHE_RESERVELIST_QUOTA
-                            - atomic_read(&castle_cache_page_reservelist_size));
+    memcpy(stage->buf + stage->used * PAGE_SIZE, c2b_buffer(c2b), c2b->nr_pages * PAGE_SIZE);
+    entry->cep      = c2b->cep;
+    entry->nr_pages = c2b->nr_pages;
+    entry->pos      = (stage->seg << C_CHK_SHIFT) + stage->used * PAGE_SIZE;
+    entry->log_off  = stage->log_off + stage->used * PAGE_SIZE;
+    stage->used    += c2b->nr_pages;
+    idx = castle_cache_hash_idx(entry->cep, castle_cache_l2_hash_buckets);
+    spin_lock_irqsave(castle_cache_l2_hash_lock(idx), flags);
+    /* Stores of the same block race on eviction, the first one wins. */
+    if (__castle_cache_l2_find(entry->cep, idx))
+    {
+        spin_unlock_irqrestore(castle_cache_l2_hash_lock(idx), flags);
+        stage->used -= c2b->nr_pages;
+        list_add(&entry->log, &castle_cache_l2_free);
+        castle_cache_l2_nr_free++;
+        spin_unlock(&castle_cache_l2_lock);
+        atomic64_inc(&castle_cache_l2_skips);
+        return;
+    }
+    hlist_add_head(&entry->hlist, &castle_cache_l2_hash[idx]);
+    spin_unlock_irqrestore(castle_cache_l2_hash_lock(idx), flags);
+    list_add_tail(&entry->log, &castle_cache_l2_log);
+    castle_cache_l2_entries++;
+    spin_unlock(&castle_cache_l2_lock);
+    atomic64_inc(&castle_cache_l2_stores);
+    atomic64_add(c2b->nr_pages * PAGE_SIZE, &castle_cache_l2_stored_bytes);
+}
 
-    return c2ps;
+/**
+ * Complete a read served by the L2, as c2b_remaining_io_sub() would.
+ */
+static void castle_cache_l2_read_done(c2_block_t *c2b)
+{
+    atomic64_inc(&castle_cache_l2_hits);
+    atomic64_add(c2b->nr_pages * PAGE_SIZE, &castle_cache_l2_read_bytes);
+    update_c2b(c2b);
+    clear_c2b_in_flight(c2b);
+    c2b->end_io(c2b);
 }
 
 /**
- * Get a c2b from the freelist.
- *
- * @return c2b from freelist.
- * @return NULL if the freelist is empty.
+ * Read the block from the HDD after all, for reads whose L2 entry went away.
  */
-static c2_block_t* castle_cache_block_freelist_get(void)
+static void castle_cache_l2_read_fallback(struct work_struct *work)
 {
-    struct list_head *lh;
-    c2_block_t *c2b = NULL;
+    c2_l2_read_t *read = container_of(work, c2_l2_read_t, work);
+    c2_block_t *c2b = read->c2b;
 
-    spin_lock(&castle_cache_freelist_lock);
-    BUG_ON(castle_cache_block_freelist_size < 0);
-    if(castle_cache_block_freelist_size > 0)
+    castle_free(read);
+    if (submit_c2b_rda(READ, c2b, NULL))
     {
-        lh = castle_cache_block_freelist.next;
-        list_del(lh);
-        c2b = list_entry(lh, c2_block_t, free);
-        castle_cache_block_freelist_size--;
+        /* Fails as any other read that couldn't be submitted, c2b isn't uptodate. */
+        clear_c2b_in_flight(c2b);
+        c2b->end_io(c2b);
     }
-    spin_unlock(&castle_cache_freelist_lock);
-
-    return c2b;
+    castle_slaves_unplug();
+    if (atomic_dec_and_test(&castle_cache_l2_pending))
+        wake_up(&castle_cache_l2_pending_wq);
 }
 
 /**
- * Return a c2b from the reservelist if one exists.
+ * Completion of the log pages read by castle_cache_l2_read().  May be called from
+ * interrupt context.
  *
- * @return      c2b from the reservelist
- * @return NULL reservelist is empty
+ * The segment might have been reused (or failed to write) while we were reading, in
+ * which case our entry is gone, and the block gets read from the HDD instead.
  */
-static c2_block_t *castle_cache_block_reservelist_get(void)
+static void castle_cache_l2_read_end(void *private, int err)
 {
-    struct list_head *lh;
-    c2_block_t *c2b = NULL;
-
-    BUG_ON(current != castle_cache_flush_thread);
+    c2_l2_read_t *read = private;
+    c2_block_t *c2b = read->c2b;
+    int i, fill;
 
-    spin_lock(&castle_cache_reservelist_lock);
-    if (atomic_read(&castle_cache_block_reservelist_size) > 0)
+    fill = !err && (castle_cache_l2_pos_get(c2b->cep, read->nr_pages, NULL) == read->pos);
+    for (i = 0; i < read->nr_pages; i++)
     {
-        lh = castle_cache_block_reservelist.next;
-        list_del(lh);
-        c2b = list_entry(lh, c2_block_t, reserve);
-        atomic_dec(&castle_cache_block_reservelist_size);
+        if (fill)
+            memcpy(c2b_buffer(c2b) + i * PAGE_SIZE, c2b_buffer(read->log_c2bs[i]), PAGE_SIZE);
+        write_unlock_c2b(read->log_c2bs[i]);
+        put_c2b(read->log_c2bs[i]);
     }
-    spin_unlock(&castle_cache_reservelist_lock);
-
-    castle_trace_cache(TRACE_VALUE,
-                       TRACE_CACHE_RESERVE_BLKS_USED_ID,
-                       CASTLE_CACHE_RESERVELIST_QUOTA
-                           - atomic_read(&castle_cache_block_reservelist_size));
 
+    if (fill)
+    {
+        castle_free(read);
+        castle_cache_l2_read_done(c2b);
+        if (atomic_dec_and_test(&castle_cache_l2_pending))
+            wake_up(&castle_cache_l2_pending_wq);
+        return;
+    }
 
-    return c2b;
-}
-
-static void castle_cache_page_init(c_ext_pos_t cep,
-                                   c2_page_t *c2p)
-{
-    BUG_ON(c2p->count != 0);
-    c2p->cep   = cep;
-    c2p->state = INIT_C2P_BITS;
+    atomic64_inc(&castle_cache_l2_misses);
+    CASTLE_INIT_WORK(&read->work, castle_cache_l2_read_fallback);
+    queue_work(castle_wq, &read->work);
 }
 
-static int castle_cache_pages_get(c_ext_pos_t cep,
-                                  c2_page_t **c2ps,
-                                  int nr_c2ps)
+/**
+ * Serve a read of c2b from the L2, if it holds the block.
+ *
+ * Called from __submit_c2b() for reads, with c2b write locked and in flight.  Blocks
+ * still in a staging segment are copied straight away, blocks in the log are read
+ * asynchronously, and c2b->end_io() gets called once c2b is uptodate.  Like
+ * castle_cache_ztier_fill(), the block is only used if none of the c2b pages are
+ * uptodate.
+ *
+ * @return 1 if the L2 took the read, 0 if it needs to go to the HDD
+ */
+static int castle_cache_l2_read(c2_block_t *c2b)
 {
-    struct list_head *lh, *lt;
-    LIST_HEAD(freed_c2ps);
+    c_ext_pos_t cep, cep_unused;
+    c_byte_off_t log_off;
+    c2_l2_stage_t *stage;
+    c2_l2_read_t *read;
+    c2_block_t *io_c2bs[CASTLE_CACHE_L2_MAX_PAGES];
     c2_page_t *c2p;
-    int i, freed_c2ps_cnt, all_uptodate;
+    int64_t pos;
+    int i, nr_io;
 
-    BUG_ON(nr_c2ps <= 0);
+    if (!castle_cache_l2_enabled || (c2b->nr_pages > CASTLE_CACHE_L2_MAX_PAGES) ||
+        LOGICAL_EXTENT(c2b->cep.ext_id) || (c2b->cep.ext_id == castle_cache_l2_ext_id))
+        return 0;
 
-    all_uptodate = 1;
-    freed_c2ps_cnt = 0;
-    for(i=0; i<nr_c2ps; i++)
+    pos = castle_cache_l2_pos_get(c2b->cep, c2b->nr_pages, &log_off);
+    if (pos < 0)
+        goto miss;
+    c2b_for_each_c2p_start(c2p, cep_unused, c2b)
     {
-        castle_cache_page_init(cep, c2ps[i]);
-        debug("c2p for cep="cep_fmt_str_nl, cep2str(c2ps[i]->cep));
-        c2p = castle_cache_page_hash_insert_get(c2ps[i]);
-        if(c2p != c2ps[i])
+        if (c2p_uptodate(c2p))
+            goto miss;
+    }
+    c2b_for_each_c2p_end(c2p, cep_unused, c2b)
+
+    /* Only the last two segments can be in memory.  castle_cache_l2_next_seg only grows,
+       so a stale value can only make this check pass needlessly. */
+    if ((pos >> C_CHK_SHIFT) + CASTLE_CACHE_L2_STAGES >= castle_cache_l2_next_seg)
+    {
+        spin_lock(&castle_cache_l2_lock);
+        stage = __castle_cache_l2_stage_find(pos);
+        if (stage && (castle_cache_l2_pos_get(c2b->cep, c2b->nr_pages, NULL) == pos))
         {
-            debug("Found c2p in the hash\n");
-            list_add(&c2ps[i]->list, &freed_c2ps);
-            freed_c2ps_cnt++;
-            c2ps[i] = c2p;
-            BUG_ON(c2p == NULL);
+            /* Not written out yet. */
+            memcpy(c2b_buffer(c2b), stage->buf + (pos & (C_CHK_SIZE - 1)),
+                   c2b->nr_pages * PAGE_SIZE);
+            spin_unlock(&castle_cache_l2_lock);
+            castle_cache_l2_read_done(c2b);
+            return 1;
         }
-        else
+        spin_unlock(&castle_cache_l2_lock);
+        if (stage)
+            goto miss;
+    }
+
+    read = castle_malloc(sizeof(c2_l2_read_t), GFP_KERNEL);
+    if (!read)
+        goto miss;
+    read->c2b      = c2b;
+    read->pos      = pos;
+    read->nr_pages = c2b->nr_pages;
+    cep.ext_id = castle_cache_l2_ext_id;
+    for (i = 0, nr_io = 0; i < read->nr_pages; i++)
+    {
+        cep.offset = log_off + (c_byte_off_t)i * PAGE_SIZE;
+        read->log_c2bs[i] = _castle_cache_block_get(cep, 1, 1 /*transient*/);
+        write_lock_c2b(read->log_c2bs[i]);
+        if (!c2b_uptodate(read->log_c2bs[i]))
+            io_c2bs[nr_io++] = read->log_c2bs[i];
+    }
+    atomic_inc(&castle_cache_l2_pending);
+    if (nr_io == 0)
+        castle_cache_l2_read_end(read, 0);
+    else if (submit_c2bs(READ, io_c2bs, nr_io, castle_cache_l2_read_end, read))
+    {
+        for (i = 0; i < read->nr_pages; i++)
         {
-            atomic_add(PAGES_PER_C2P, &castle_cache_clean_pages);
-            if (LOGICAL_EXTENT(cep.ext_id))
-                atomic_add(PAGES_PER_C2P, &castle_cache_logical_ext_pages);
+            write_unlock_c2b(read->log_c2bs[i]);
+            put_c2b(read->log_c2bs[i]);
         }
-        /* Check if this page is clean. */
-        if(!c2p_uptodate(c2ps[i]))
-            all_uptodate = 0;
-        cep.offset += PAGES_PER_C2P * PAGE_SIZE;
+        castle_free(read);
+        if (atomic_dec_and_test(&castle_cache_l2_pending))
+            wake_up(&castle_cache_l2_pending_wq);
+        goto miss;
     }
 
-    /* Return all the freed_c2ps back onto the freelist */
-    BUG_ON(!list_empty(&freed_c2ps) && (freed_c2ps_cnt == 0));
-    BUG_ON( list_empty(&freed_c2ps) && (freed_c2ps_cnt != 0));
-    /* Return early if we have nothing to free (this avoids locking). */
-    if(freed_c2ps_cnt == 0)
-        return all_uptodate;
-    spin_lock(&castle_cache_freelist_lock);
-    list_for_each_safe(lh, lt, &freed_c2ps)
-    {
-        list_del(lh);
-        c2p = list_entry(lh, c2_page_t, list);
-        __castle_cache_page_freelist_add(c2p);
-    }
-    spin_unlock(&castle_cache_freelist_lock);
+    return 1;
 
-    return all_uptodate;
+miss:
+    atomic64_inc(&castle_cache_l2_misses);
+    return 0;
 }
 
 /**
- * Initialises a c2b to meet cep, nr_pages.
+ * Get L2 statistics.
+ */
+void castle_cache_l2_stats_get(c2_l2_stats_t *stats)
+{
+    spin_lock(&castle_cache_l2_lock);
+    stats->size_bytes    = castle_cache_l2_enabled ?
+                            (uint64_t)castle_cache_l2_chunks * C_CHK_SIZE : 0;
+    stats->used_bytes    = min((castle_cache_l2_next_seg << C_CHK_SHIFT) - castle_cache_l2_tail,
+                               stats->size_bytes);
+    stats->entries       = castle_cache_l2_entries;
+    spin_unlock(&castle_cache_l2_lock);
+    stats->stores        = atomic64_read(&castle_cache_l2_stores);
+    stats->skips         = atomic64_read(&castle_cache_l2_skips);
+    stats->rejects       = atomic64_read(&castle_cache_l2_rejects);
+    stats->invalidations = atomic64_read(&castle_cache_l2_invalidations);
+    stats->stored_bytes  = atomic64_read(&castle_cache_l2_stored_bytes);
+    stats->written_bytes = atomic64_read(&castle_cache_l2_written_bytes);
+    stats->read_bytes    = atomic64_read(&castle_cache_l2_read_bytes);
+    stats->hits          = atomic64_read(&castle_cache_l2_hits);
+    stats->misses        = atomic64_read(&castle_cache_l2_misses);
+}
+
+/**
+ * Allocate the L2 log on an SSD, once extents can be allocated.
  *
- * NOTE: c2b passed in could have come from the freelist so it is necessary
- * to fully initialise all fields.
+ * @also castle_fs_init()
  */
-static void castle_cache_block_init(c2_block_t *c2b,
-                                    c_ext_pos_t cep,
-                                    c2_page_t **c2ps,
-                                    int nr_pages)
+void castle_cache_l2_start(void)
 {
-    struct page *page;
-    c_ext_pos_t dcep;
-    c2_page_t *c2p;
-    int i, uptodate;
+    c_chk_cnt_t chunks;
+    c_ext_id_t ext_id;
 
-    debug("Initing c2b for cep="cep_fmt_str", nr_pages=%d\n",
-            cep2str(cep), nr_pages);
-    /* c2b should only be initialised if it's not used */
-    BUG_ON(nr_pages > CASTLE_CACHE_VMAP_PGS);
-#ifdef CASTLE_DEBUG
-    /* On debug builds, unpoison the fields. */
-    atomic_set(&c2b->count, 0);
-    atomic_set(&c2b->lock_cnt, 0);
-    c2b->state.softpin_cnt = 0;
-#else
-    /* On non-debug builds, those fields should all be zero. */
-    BUG_ON(c2b->c2ps != NULL);
-    BUG_ON(atomic_read(&c2b->count) != 0);
-    BUG_ON(atomic_read(&c2b->lock_cnt) != 0);
-    BUG_ON(c2b->state.softpin_cnt != 0);
-#endif
-    /* Init the page array (note: this may substitute some c2ps,
-       if they aleady exist in the hash. */
-    uptodate = castle_cache_pages_get(cep, c2ps, castle_cache_pages_to_c2ps(nr_pages));
-    /* Initialise c2b. */
-    atomic_set(&c2b->remaining, 0);
-    c2b->cep = cep;
-    c2b->state.bits = INIT_C2B_BITS | (uptodate ? (1 << C2B_uptodate) : 0);
-    c2b->nr_pages = nr_pages;
-    c2b->c2ps = c2ps;
+    if (!castle_cache_l2_hash)
+        return;
 
-    i = 0;
-    debug("c2b->nr_pages=%d\n", nr_pages);
-    down(&castle_cache_vmap_lock);
-    c2b_for_each_page_start(page, c2p, dcep, c2b)
+    chunks = castle_cache_l2_size >> (C_CHK_SHIFT - 20);
+    ext_id = castle_extent_alloc(SSD_ONLY_EXT, INVAL_DA, EXT_T_META_DATA, chunks, 0, NULL, NULL);
+    if (EXT_ID_INVAL(ext_id))
     {
-#ifdef CASTLE_DEBUG
-        debug("Adding c2p id=%d, to cep "cep_fmt_str_nl,
-                c2p->id, cep2str(dcep));
-#endif
-        castle_cache_vmap_pgs[i++] = page;
+        castle_printk(LOG_WARN, "Could not allocate %u MB SSD cache log, SSD cache disabled.\n",
+                castle_cache_l2_size);
+        return;
     }
-    c2b_for_each_page_end(page, c2p, dcep, c2b)
-    debug("Added %d pages.\n", i);
-    BUG_ON(i != nr_pages);
 
-    if (nr_pages == 1)
-        c2b->buffer = pfn_to_kaddr(page_to_pfn(castle_cache_vmap_pgs[0]));
-    else if (nr_pages <= CASTLE_VMAP_PGS)
-            c2b->buffer = castle_vmap_fast_map(castle_cache_vmap_pgs, i);
-        else
-            c2b->buffer = vmap(castle_cache_vmap_pgs, i, VM_READ|VM_WRITE, PAGE_KERNEL);
+    spin_lock(&castle_cache_l2_lock);
+    castle_cache_l2_chunks  = chunks;
+    castle_cache_l2_ext_id  = ext_id;
+    castle_cache_l2_enabled = 1;
+    spin_unlock(&castle_cache_l2_lock);
+    castle_printk(LOG_INIT, "SSD cache: %u MB log in extent %llu.\n", castle_cache_l2_size, ext_id);
+}
 
-    up(&castle_cache_vmap_lock);
-    BUG_ON(!c2b->buffer);
+static void castle_cache_l2_fini(void)
+{
+    c2_l2_entry_t *entry, *tmp;
+    int i;
+
+    /* Stop stores and reads, wait for segment writes, reads and refills. */
+    spin_lock(&castle_cache_l2_lock);
+    castle_cache_l2_enabled = 0;
+    spin_unlock(&castle_cache_l2_lock);
+    wait_event(castle_cache_l2_pending_wq, atomic_read(&castle_cache_l2_pending) == 0);
+
+    list_for_each_entry_safe(entry, tmp, &castle_cache_l2_log, log)
+        __castle_cache_l2_unlink(entry);
+    list_for_each_entry_safe(entry, tmp, &castle_cache_l2_free, log)
+    {
+        list_del(&entry->log);
+        castle_free(entry);
+    }
+    castle_cache_l2_nr_free = 0;
+    for (i = 0; i < CASTLE_CACHE_L2_STAGES; i++)
+    {
+        if (castle_cache_l2_stages[i].buf)
+            castle_vfree(castle_cache_l2_stages[i].buf);
+        castle_cache_l2_stages[i].buf = NULL;
+    }
+    castle_cache_l2_cur = NULL;
+    if (castle_cache_l2_hash)
+        castle_vfree(castle_cache_l2_hash);
+    castle_cache_l2_hash = NULL;
+}
+
+static int castle_cache_l2_init(void)
+{
+    int i;
+
+    if (!castle_cache_l2_size)
+        return 0;
+    if (castle_cache_l2_size < (C_CHK_SIZE >> 20) * 2)
+    {
+        castle_printk(LOG_INIT, "SSD cache log must be at least %llu MB.\n", (C_CHK_SIZE >> 20) * 2);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < CASTLE_CACHE_L2_HASH_LOCKS; i++)
+        spin_lock_init(&castle_cache_l2_hash_locks[i]);
+    CASTLE_INIT_WORK(&castle_cache_l2_refill_work, castle_cache_l2_refill_work_fn);
+    /* Assume blocks are a quarter of a VLBA RO node on average. */
+    castle_cache_l2_hash_buckets = ((uint64_t)castle_cache_l2_size << 20) /
+                    (CASTLE_CACHE_L2_MAX_PAGES * PAGE_SIZE / 4) + 1;
+    castle_cache_l2_hash = castle_vmalloc(castle_cache_l2_hash_buckets * sizeof(struct hlist_head));
+    if (!castle_cache_l2_hash)
+        goto err_out;
+    for (i = 0; i < castle_cache_l2_hash_buckets; i++)
+        INIT_HLIST_HEAD(&castle_cache_l2_hash[i]);
+    for (i = 0; i < CASTLE_CACHE_L2_STAGES; i++)
+    {
+        castle_cache_l2_stages[i].state = C2_L2_STAGE_FREE;
+        castle_cache_l2_stages[i].buf   = castle_vmalloc(CASTLE_CACHE_L2_SEG_PAGES * PAGE_SIZE);
+        if (!castle_cache_l2_stages[i].buf)
+            goto err_out;
+    }
+    castle_cache_l2_refill();
+    if (castle_cache_l2_nr_free < CASTLE_CACHE_L2_FREE_ENTRIES)
+        goto err_out;
+
+    return 0;
+
+err_out:
+    castle_printk(LOG_WARN, "Failed to allocate SSD cache index.\n");
+    castle_cache_l2_fini();
+
+    return -ENOMEM;
 }
 
 /**
@@ -2549,9 +5461,8 @@ static void castle_cache_block_init(c2_block_t *c2b,
  */
 static void castle_cache_block_free(c2_block_t *c2b)
 {
-    struct list_head *lh, *lt;
     LIST_HEAD(freed_c2ps);
-    c2_page_t *c2p, **c2ps;
+    c2_page_t **c2ps;
     int i, nr_c2ps;
 
 #ifdef CASTLE_DEBUG
@@ -2588,6 +5499,8 @@ static void castle_cache_block_free(c2_block_t *c2b)
     if (c2b_windowstart(c2b))
         c2_pref_c2b_destroy(c2b);
 
+    c2_partitions_del(c2b);
+
     /* Add the pages back to the freelist */
     for(i=0; i<nr_c2ps; i++)
         castle_cache_c2p_put(c2b->c2ps[i], &freed_c2ps);
@@ -2599,25 +5512,15 @@ static void castle_cache_block_free(c2_block_t *c2b)
 #endif
     /* Set c2ps array to NULL, BUGed_ON in _init(). */
     c2b->c2ps = NULL;
-    /* Changes to freelists under freelist_lock */
-    spin_lock(&castle_cache_freelist_lock);
-    /* Free all the c2ps. */
-    list_for_each_safe(lh, lt, &freed_c2ps)
-    {
-        list_del(lh);
-        c2p = list_entry(lh, c2_page_t, list);
-        __castle_cache_page_freelist_add(c2p);
-    }
-    /* Then put the block on its freelist */
-    __castle_cache_block_freelist_add(c2b);
-    spin_unlock(&castle_cache_freelist_lock);
+    /* Free all the c2ps and the block itself. */
+    castle_cache_freelists_put(&freed_c2ps, c2b);
     /* Free the c2ps array. By this point, we must not use c2b any more. */
     castle_free(c2ps);
 }
 
 static inline int c2b_busy(c2_block_t *c2b, int expected_count)
 {
-    BUG_ON(!spin_is_locked(&castle_cache_block_hash_lock));
+    BUG_ON(!spin_is_locked(castle_cache_block_hash_lock_get(c2b->cep)));
     /* c2b_locked() implies (c2b->count > 0) */
     return (atomic_read(&c2b->count) != expected_count) ||
           (c2b->state.bits & (1 << C2B_dirty)) ||
@@ -2629,7 +5532,10 @@ static inline int c2b_busy(c2_block_t *c2b, int expected_count)
  *
  * - Return immediately if clean blocks make up < 10% of the cache.
  * - Evict softpin blocks if softpin blocks make up 1/2 of the cleanlist.
+ * - Evict blocks from partitions above their maximum share first, never evict blocks
+ *   from partitions at or below their minimum share.
  * - Iterate through the cleanlist looking for evictable blocks.
+ * - Give blocks hit since they were last considered a second chance.
  * - If we weren't able to evict BATCH_FREE blocks then victimise softpin blocks
  *   and try again.
  *
@@ -2647,9 +5553,12 @@ static int castle_cache_block_hash_clean(void)
     struct hlist_node *le, *te;
     HLIST_HEAD(victims);
     LIST_HEAD(unevictable);
+    struct list_head *lists[C2_POLICY_MAX_LISTS];
     c2_block_t *c2b;
+    spinlock_t *hash_lock;
+    cycles_t hold, hash_hold;
     int clean, dirty, softpin;
-    int nr_victims, nr_pages, victimise_softpin;
+    int nr_victims, nr_pages, victimise_softpin, over_max_only, nr_lists, i;
 
     /* Initialise. */
     nr_victims = nr_pages = victimise_softpin = 0;
@@ -2675,71 +5584,120 @@ static int castle_cache_block_hash_clean(void)
     if (softpin > clean / 2)
         victimise_softpin = 1;
 
-    /* Hunt for victim c2bs. Hold hash lock for duration. */
-    spin_lock_irq(&castle_cache_block_hash_lock);
+    /* Evict only from partitions above their maximum share in the first pass. */
+    over_max_only = c2_partitions_over_max();
 
-    do
+    /* Hunt for victim c2bs. Hold LRU lock for duration.  Per-block hash locks
+     * are only trylocked (we take them out of order), blocks whose hash lock
+     * is contended are treated as busy. */
+    spin_lock_irq(&castle_cache_block_lru_lock);
+    hold = get_cycles();
+
+    for (;;)
     {
-        list_for_each_safe(lh, th, &castle_cache_cleanlist)
+        nr_lists = c2_policy->victim_lists(lists);
+        for (i = 0; (i < nr_lists) && (nr_victims < BATCH_FREE); i++)
         {
-            c2b = list_entry(lh, c2_block_t, clean);
-            nr_pages += c2b->nr_pages;
-
-            /* Blocks that match the following criteria are evicted:
-             *
-             * (1) Not actively referenced by cache consumers (e.g. only non-busy blocks).
-             * (2) Softpin blocks are prioritised (see comment above).
-             * (3) Are marked as blocks that sit at the beginning of a prefetch window for an extent
-             *     that no longer exists.  This allows us to correctly evict softpinned blocks from
-             *     extents that have now been removed - by targetting the start of window block we
-             *     unpin and demote those other blocks from the window.
-             * (4) Must be transient or from an evictable extent (i.e. not from the super, micro or
-             *     mstore extents).  @TODO longer term solution: pools. */
-            if (!c2b_busy(c2b, 0) /* (1) */
-                    && (victimise_softpin || !c2b_softpin(c2b) /* (2) */
-                        || (c2b_windowstart(c2b) && !castle_extent_exists(c2b->cep.ext_id))) /*(3)*/
-                    && (c2b_transient(c2b) || EVICTABLE_EXTENT(c2b->cep.ext_id))) /* (4) */
+            list_for_each_safe(lh, th, lists[i])
             {
-                debug("Found a %svictim.\n", c2b_softpin(c2b) ? "softpin " : "");
+                c2b = list_entry(lh, c2_block_t, clean);
+                nr_pages += c2b->nr_pages;
 
-                hlist_del(&c2b->hlist);
-                list_del(&c2b->clean);
-                hlist_add_head(&c2b->hlist, &victims);
+                /* Blocks that the policy considers recently referenced get a second
+                 * chance: move them to the end of their list. */
+                if (c2_policy->referenced(c2b))
+                {
+                    list_del(&c2b->clean);
+                    list_add(&c2b->clean, &unevictable);
+                    continue;
+                }
 
-                /* Cleanlist accounting and victimisation stats. */
-                BUG_ON(atomic_read(&castle_cache_cleanlist_size) == 0);
-                atomic_dec(&castle_cache_cleanlist_size);
-                if (c2b_softpin(c2b))
+                hash_lock = castle_cache_block_hash_lock_get(c2b->cep);
+                if (!spin_trylock(hash_lock))
                 {
-                    clearsoftpin_c2b(c2b);
-                    atomic_inc(&castle_cache_softpin_block_victims);
+                    list_del(&c2b->clean);
+                    list_add(&c2b->clean, &unevictable);
+                    continue;
+                }
+                hash_hold = get_cycles();
+
+                /* Blocks that match the following criteria are evicted:
+                 *
+                 * (1) Not actively referenced by cache consumers (e.g. only non-busy blocks).
+                 * (2) Softpin blocks are prioritised (see comment above).
+                 * (3) Are marked as blocks that sit at the beginning of a prefetch window for an extent
+                 *     that no longer exists.  This allows us to correctly evict softpinned blocks from
+                 *     extents that have now been removed - by targetting the start of window block we
+                 *     unpin and demote those other blocks from the window.
+                 * (4) Must be transient or from an evictable extent (i.e. not from the super, micro or
+                 *     mstore extents).  @TODO longer term solution: pools.
+                 * (5) Partitions of the block allow it (see c2_partitions_evictable()). */
+                if (!c2b_busy(c2b, 0) /* (1) */
+                        && (victimise_softpin || !c2b_softpin(c2b) /* (2) */
+                            || (c2b_windowstart(c2b) && !castle_extent_exists(c2b->cep.ext_id))) /*(3)*/
+                        && (c2b_transient(c2b) || EVICTABLE_EXTENT(c2b->cep.ext_id)) /* (4) */
+                        && c2_partitions_evictable(c2b, over_max_only)) /* (5) */
+                {
+                    debug("Found a %svictim.\n", c2b_softpin(c2b) ? "softpin " : "");
+
+                    hlist_del(&c2b->hlist);
+                    spin_unlock(hash_lock);
+                    castle_cache_lock_stats_update(castle_cache_block_hash_lock_stats, hash_hold);
+                    c2_policy->remove(c2b);
+                    c2_policy->evicted(c2b);
+                    hlist_add_head(&c2b->hlist, &victims);
+
+                    /* Cleanlist accounting and victimisation stats. */
+                    BUG_ON(atomic_read(&castle_cache_cleanlist_size) == 0);
+                    atomic_dec(&castle_cache_cleanlist_size);
+                    if (c2b_softpin(c2b))
+                    {
+                        clearsoftpin_c2b(c2b);
+                        atomic_inc(&castle_cache_softpin_block_victims);
+                    }
+                    else
+                        atomic_inc(&castle_cache_block_victims);
+                    nr_victims++;
                 }
                 else
-                    atomic_inc(&castle_cache_block_victims);
-                nr_victims++;
-            }
-            else
-            {
-                /* Remove the unevictable block from its current location, and stick it
-                   at the end of the list. This will prevent the clean list accumulating
-                   unevictable blocks at the start, and this function having to go
-                   through them every time. */
-                list_del(&c2b->clean);
-                list_add(&c2b->clean, &unevictable);
+                {
+                    spin_unlock(hash_lock);
+                    castle_cache_lock_stats_update(castle_cache_block_hash_lock_stats, hash_hold);
+                    /* Remove the unevictable block from its current location, and stick it
+                       at the end of the list. This will prevent the clean list accumulating
+                       unevictable blocks at the start, and this function having to go
+                       through them every time. */
+                    list_del(&c2b->clean);
+                    list_add(&c2b->clean, &unevictable);
+                }
+
+                if (nr_victims >= BATCH_FREE)
+                    break;
             }
+            /* Put all the unevictable pages back on their list, but at the tail of it. */
+            list_splice_init(&unevictable, lists[i]->prev);
+        }
 
-            if (nr_victims >= BATCH_FREE)
-                break;
+        if (nr_victims >= BATCH_FREE)
+            break;
+        /* Not enough victims.  Retry considering all partitions first... */
+        if (over_max_only)
+        {
+            over_max_only = 0;
+            continue;
+        }
+        /* ...then victimising softpin c2bs, if we have not already done so. */
+        if (!victimise_softpin)
+        {
+            victimise_softpin = 1;
+            continue;
         }
-        /* Put all the unevictable pages back on the clean list, but at the tail of the list. */
-        list_splice_init(&unevictable, castle_cache_cleanlist.prev);
+        break;
     }
-    /* If we weren't able to clean BATCH_FREE c2bs to the freelist then begin
-     * victimising softpin c2bs if we have not already done so. */
-    while (!victimise_softpin && (victimise_softpin = (nr_victims < BATCH_FREE)));
 
-    /* Hunt complete.  Release hash lock. */
-    spin_unlock_irq(&castle_cache_block_hash_lock);
+    /* Hunt complete.  Release LRU lock. */
+    spin_unlock_irq(&castle_cache_block_lru_lock);
+    castle_cache_lock_stats_update(castle_cache_block_lru_lock_stats, hold);
 
     /* We couldn't find any victims */
     if (hlist_empty(&victims))
@@ -2761,6 +5719,8 @@ static int castle_cache_block_hash_clean(void)
     hlist_for_each_entry_safe(c2b, le, te, &victims, hlist)
     {
         hlist_del(le);
+        castle_cache_ztier_store(c2b);
+        castle_cache_l2_store(c2b);
         castle_cache_block_free(c2b);
     }
 
@@ -2781,16 +5741,22 @@ static int castle_cache_block_hash_clean(void)
  */
 int castle_cache_block_destroy(c2_block_t *c2b)
 {
+    spinlock_t *lock;
+    cycles_t hold;
     int ret;
 
     /* Check whether the c2b is busy, under the hash lock so that no other references
        can be taken. */
-    spin_lock_irq(&castle_cache_block_hash_lock);
+    lock = castle_cache_block_hash_lock_get(c2b->cep);
+    spin_lock_irq(lock);
+    hold = get_cycles();
     ret = c2b_busy(c2b, 1) ? -EINVAL : 0;
     if(!ret)
     {
         hlist_del(&c2b->hlist);
-        list_del(&c2b->clean);
+        spin_lock(&castle_cache_block_lru_lock);
+        c2_policy->remove(c2b);
+        spin_unlock(&castle_cache_block_lru_lock);
         /* Update bookkeeping info. */
         atomic_dec(&castle_cache_cleanlist_size);
         if (c2b_softpin(c2b))
@@ -2801,7 +5767,8 @@ int castle_cache_block_destroy(c2_block_t *c2b)
         else
             atomic_inc(&castle_cache_block_victims);
     }
-    spin_unlock_irq(&castle_cache_block_hash_lock);
+    spin_unlock_irq(lock);
+    castle_cache_lock_stats_update(castle_cache_block_hash_lock_stats, hold);
     /* If the c2b was busy, exit early. */
     if(ret)
     {
@@ -2842,7 +5809,7 @@ void castle_cache_flush_wakeup(void)
  */
 static void castle_cache_freelists_grow(int nr_c2bs, int nr_pages)
 {
-    int flush_seq, success;
+    int flush_seq, success, mag_c2ps, mag_c2bs;
 
     while (castle_cache_block_hash_clean() != EXIT_SUCCESS)
     {
@@ -2863,6 +5830,22 @@ static void castle_cache_freelists_grow(int nr_c2bs, int nr_pages)
         if (success)
             return;
 
+        /* The freelists don't account for c2ps/c2bs cached in per-CPU magazines.
+         * Return them to the freelists, the request may fit once they are. */
+        castle_cache_magazines_count(&mag_c2ps, &mag_c2bs);
+        if (mag_c2ps || mag_c2bs)
+        {
+            castle_cache_magazines_drain();
+
+            spin_lock(&castle_cache_freelist_lock);
+            success = (castle_cache_page_freelist_size * PAGES_PER_C2P >= nr_pages)
+                && (castle_cache_block_freelist_size >= nr_c2bs);
+            spin_unlock(&castle_cache_freelist_lock);
+
+            if (success)
+                return;
+        }
+
         /* If we're the flush thread the reservelist should now be capable of
          * satisfying our request.  We raced with castle_extent_remap() if it
          * isn't - in this case, wait and then try cleaning the hash again. */
@@ -2920,7 +5903,45 @@ static inline void castle_cache_page_freelist_grow(int nr_pages)
     castle_cache_freelists_grow(0, nr_pages);
 }
 
-c2_block_t* _castle_cache_block_get(c_ext_pos_t cep, int nr_pages, int transient)
+/**
+ * Mark c2b's pages as accessed by a cache consumer.
+ *
+ * Used by the prefetcher to measure how much of each prefetch window got used.
+ *
+ * @also c2_pref_block_chunk_put()
+ */
+static inline void castle_cache_c2ps_accessed(c2_block_t *c2b)
+{
+    int i, nr_c2ps = castle_cache_pages_to_c2ps(c2b->nr_pages);
+
+    /* Avoid dirtying the cacheline if the bit is already set. */
+    for (i = 0; i < nr_c2ps; i++)
+        if (!c2p_accessed(c2b->c2ps[i]))
+            set_c2p_accessed(c2b->c2ps[i]);
+}
+
+/**
+ * Forget earlier accesses to c2b's pages, as it is about to be (re)prefetched.
+ *
+ * @also c2_pref_block_chunk_get()
+ */
+static inline void castle_cache_c2ps_accessed_clear(c2_block_t *c2b)
+{
+    int i, nr_c2ps = castle_cache_pages_to_c2ps(c2b->nr_pages);
+
+    for (i = 0; i < nr_c2ps; i++)
+        if (c2p_accessed(c2b->c2ps[i]))
+            clear_c2p_accessed(c2b->c2ps[i]);
+}
+
+/**
+ * Get block starting at cep, size nr_pages.
+ *
+ * @param prefetch  Set by the prefetcher, whose gets don't count as page accesses
+ *
+ * @also castle_cache_c2ps_accessed()
+ */
+static c2_block_t* __castle_cache_block_get(c_ext_pos_t cep, int nr_pages, int transient, int prefetch)
 {
     c2_block_t *c2b;
     c2_page_t **c2ps;
@@ -2940,6 +5961,10 @@ c2_block_t* _castle_cache_block_get(c_ext_pos_t cep, int nr_pages, int transient
         {
             /* Make sure that the number of pages agrees */
             BUG_ON(c2b->nr_pages != nr_pages);
+            c2_policy_lookup(1);
+            c2_partitions_lookup(c2b, 1);
+            if (!prefetch)
+                castle_cache_c2ps_accessed(c2b);
             return c2b;
         }
 
@@ -3009,11 +6034,21 @@ c2_block_t* _castle_cache_block_get(c_ext_pos_t cep, int nr_pages, int transient
             BUG_ON(c2b->nr_pages != nr_pages);
             /* Mark c2b as transient, if required. */
             if (transient)  set_c2b_transient(c2b);
+            c2_policy_lookup(0);
+            c2_partitions_lookup(c2b, 0);
+            castle_cache_ztier_fill(c2b);
+            if (!prefetch)
+                castle_cache_c2ps_accessed(c2b);
             return c2b;
         }
     }
 }
 
+c2_block_t* _castle_cache_block_get(c_ext_pos_t cep, int nr_pages, int transient)
+{
+    return __castle_cache_block_get(cep, nr_pages, transient, 0 /*prefetch*/);
+}
+
 /**
  * Get block starting at cep, size nr_pages.
  *
@@ -3091,6 +6126,14 @@ void castle_cache_page_block_unreserve(c2_block_t *c2b)
  *
  * Prefetch algorithm and variables:
  *    Algorithm and variables: see comments in c2_pref_window_advance().
+ *
+ * Adaptive windows:
+ *    Consumer gets mark c2ps as accessed (castle_cache_c2ps_accessed()), the
+ *    prefetcher's own gets don't.  When chunks fall off the front of a window
+ *    the accessed pages count as used, the rest (and chunks evicted before
+ *    falloff) as wasted.  On each advance an adaptive window doubles its size
+ *    if little of what fell off was wasted and halves it otherwise.
+ *    @also c2_pref_window_resize()
  *    c2b references are held only during I/O.  When a window is moved forward
  *    chunks that fall off the front of the window are deprecated in the LRU
  *    cache if their softpin count reaches 0.
@@ -3145,7 +6188,8 @@ void castle_cache_page_block_unreserve(c2_block_t *c2b)
 #define PREF_WINDOW_SOFTPIN         (0x20)          /**< Keep c2bs in cache if possible.          */
 #define PREF_PAGES                  4 *BLKS_PER_CHK /**< #pages to non-adaptive prefetch.         */
 #define PREF_ADAP_INITIAL           1 *BLKS_PER_CHK /**< Initial #pages to adaptive prefetch.     */
-#define PREF_ADAP_MAX               16*BLKS_PER_CHK /**< Maximum #pages to adaptive prefetch.     */
+#define PREF_ADAP_MIN               1 *BLKS_PER_CHK /**< Minimum #pages to adaptive prefetch.     */
+#define PREF_ADAP_WASTE_SHIFT       2               /**< Shrink if >1/4 of falloff was wasted.    */
 #define PREF_ADV_THRESH             4 *BLKS_PER_CHK /**< #pages from window end before prefetch.  */
 
 /**
@@ -3164,6 +6208,8 @@ typedef struct castle_cache_prefetch_window {
  has been prefetched.  Chunk aligned.       */
     uint32_t        pref_pages; /**< Number of pages we prefetch.                                 */
     uint32_t        adv_thresh; /**< #pages from end_off before we prefetch.                      */
+    uint64_t        used_pages; /**< Prefetched pages accessed before falling off the window.     */
+    uint64_t        wasted_pages;/**< Prefetched pages not accessed, or evicted, before falloff.  */
     struct rb_node  rb_node;    /**< RB-node for this window.                                     */
     atomic_t        count;      /**< Reference count.                                             */
     struct mutex    lock;       /**< Hold while changing start_off, end_off, pref_pages.          */
@@ -3174,19 +6220,34 @@ static struct rb_root           c2p_rb_root = RB_ROOT;      /**< RB tree of c2_p
 static  DECLARE_WAIT_QUEUE_HEAD(castle_cache_prefetch_wq);  /**< _in_flight wait queue.           */
 static atomic_t                 castle_cache_prefetch_in_flight = ATOMIC_INIT(0);   /**< Number of
                                                                  outstanding prefetch IOs.        */
+static atomic64_t               c2_pref_used_pages;         /**< Sum of all windows' used_pages.  */
+static atomic64_t               c2_pref_wasted_pages;       /**< Sum of all windows' wasted_pages.*/
+static atomic64_t               c2_pref_grows;              /**< Adaptive window size doublings.  */
+static atomic64_t               c2_pref_shrinks;            /**< Adaptive window size halvings.   */
+
+/**
+ * Efficiency of a window: used pages in hundredths of a percent of pages that fell off.
+ */
+static inline uint64_t c2_pref_efficiency(uint64_t used, uint64_t wasted)
+{
+    return (used + wasted) ? used * 10000 / (used + wasted) : 0;
+}
 
 static USED char* c2_pref_window_to_str(c2_pref_window_t *window)
 {
-#define PREF_WINDOW_STR_LEN     (128)
+#define PREF_WINDOW_STR_LEN     (256)
     static char win_str[PREF_WINDOW_STR_LEN];
     c_ext_pos_t cep;
+    uint64_t eff;
 
     cep.ext_id = window->ext_id;
     cep.offset = window->start_off;
+    eff = c2_pref_efficiency(window->used_pages, window->wasted_pages);
 
     snprintf(win_str, PREF_WINDOW_STR_LEN,
         "%s%s%s pref win: {cep="cep_fmt_str", start_off=0x%llx (%lld), "
-        "end_off=0x%llx (%lld), pref_pages=%d (%lld), st=0x%.2x, cnt=%d",
+        "end_off=0x%llx (%lld), pref_pages=%d (%lld), used=%llu, wasted=%llu, "
+        "eff=%llu.%02llu%%, st=0x%.2x, cnt=%d",
         window->state & PREF_WINDOW_NEW ? "N": "",
         window->state & PREF_WINDOW_SOFTPIN ? "S": "",
         window->state & PREF_WINDOW_ADAPTIVE ? "A" : "",
@@ -3197,6 +6258,9 @@ static USED char* c2_pref_window_to_str(c2_pref_window_t *window)
         CHUNK(window->end_off),
         window->pref_pages,
         window->pref_pages / BLKS_PER_CHK,
+        window->used_pages,
+        window->wasted_pages,
+        eff / 100, eff % 100,
         window->state,
         atomic_read(&window->count));
     win_str[PREF_WINDOW_STR_LEN-1] = '\0';
@@ -3208,7 +6272,7 @@ static USED char* c2_pref_window_to_str(c2_pref_window_t *window)
  * Get a c2b for use by the prefetcher setting necessary bits.
  *
  * - Get c2b
- * - Mark as prefetch
+ * - Mark as prefetch, clearing the accessed bits of its pages
  * - Mark as softpin if window is softpin
  *
  * @return c2b
@@ -3217,11 +6281,15 @@ static c2_block_t* c2_pref_block_chunk_get(c_ext_pos_t cep, c2_pref_window_t *wi
 {
     c2_block_t *c2b;
 
-    if ((c2b = castle_cache_block_get(cep, BLKS_PER_CHK)))
+    if ((c2b = __castle_cache_block_get(cep, BLKS_PER_CHK, 0, 1 /*prefetch*/)))
     {
-        /* Set c2b status bits. */
+        /* Set c2b status bits.  Only accesses made while the chunk is part of a window
+           count towards its used pages, see c2_pref_block_chunk_put(). */
         if (!test_set_c2b_prefetch(c2b))
+        {
             atomic_inc(&c2_pref_active_window_size);
+            castle_cache_c2ps_accessed_clear(c2b);
+        }
         if (window->state & PREF_WINDOW_SOFTPIN)
             softpin_c2b(c2b);
     }
@@ -3239,13 +6307,17 @@ static c2_block_t* c2_pref_block_chunk_get(c_ext_pos_t cep, c2_pref_window_t *wi
  * - Lookup c2b, if one exists:
  * - Clear prefetch bit
  *   - Maintain prefetch_chunks stats if the bit was previously set
+ *   - Account accessed pages as used and the rest as wasted
  * - Handle softpin blocks
  * - Position for eviction in LRU if prefetch & softpin counts reach 0
+ * - If no c2b exists, account the chunk as wasted
  */
 static void c2_pref_block_chunk_put(c_ext_pos_t cep, c2_pref_window_t *window, int debug)
 {
     c2_block_t *c2b;
-    int demote = 0;
+    int i, used, demote = 0;
+
+    BUG_ON(!mutex_is_locked(&window->lock));
 
     if ((c2b = castle_cache_block_hash_get(cep, BLKS_PER_CHK)))
     {
@@ -3254,6 +6326,16 @@ static void c2_pref_block_chunk_put(c_ext_pos_t cep, c2_pref_window_t *window, i
         {
             atomic_dec(&c2_pref_active_window_size);
             set_c2b_prefetched(c2b);
+
+            /* Only the window that cleared the bit does the accounting. */
+            used = 0;
+            for (i = 0; i < castle_cache_pages_to_c2ps(c2b->nr_pages); i++)
+                if (c2p_accessed(c2b->c2ps[i]))
+                    used += PAGES_PER_C2P;
+            window->used_pages   += used;
+            window->wasted_pages += c2b->nr_pages - used;
+            atomic64_add(used, &c2_pref_used_pages);
+            atomic64_add(c2b->nr_pages - used, &c2_pref_wasted_pages);
         }
         if (window->state & PREF_WINDOW_SOFTPIN)
             demote = demote || unsoftpin_c2b(c2b);
@@ -3266,6 +6348,12 @@ static void c2_pref_block_chunk_put(c_ext_pos_t cep, c2_pref_window_t *window, i
         if (demote)
             castle_cache_block_hash_demote(cep, BLKS_PER_CHK);
     }
+    else if (CHUNK(cep.offset) < castle_extent_size_get(cep.ext_id))
+    {
+        /* Evicted before we got here, the consumer may well have to read it again. */
+        window->wasted_pages += BLKS_PER_CHK;
+        atomic64_add(BLKS_PER_CHK, &c2_pref_wasted_pages);
+    }
 }
 
 /**
@@ -3583,24 +6671,28 @@ static int c2_pref_window_insert(c2_pref_window_t *window)
      * castle_cache_block_free() and c2_pref_c2b_destroy()).  By marking the
      * first block in the window we try to prevent holes from occurring in the
      * window during LRU eviction. */
-    window->cur_c2b = castle_cache_block_get(cep, BLKS_PER_CHK);
+    window->cur_c2b = __castle_cache_block_get(cep, BLKS_PER_CHK, 0, 1 /*prefetch*/);
     set_c2b_windowstart(window->cur_c2b);
     put_c2b(window->cur_c2b);
 
     return EXIT_SUCCESS;
 }
 
-#ifdef PREF_DEBUG
 /**
  * Walk and print entries in the prefetch window RB-tree.
  *
- * For debug purposes.
+ * @param buf   Buffer to print windows and their efficiency to, if NULL windows
+ *              get printed with pref_debug()
+ * @param size  Size of buf
+ *
+ * @return Number of bytes printed to buf
  */
-static void c2_pref_window_dump(void)
+static int c2_pref_window_dump(char *buf, int size)
 {
     struct rb_node **p, *parent = NULL;
     c2_pref_window_t *cur_window;
-    int entries = 0;
+    int entries = 0, len = 0;
+    uint64_t eff;
 
     /* We must hold the c2_prefetch_lock while working. */
     spin_lock(&c2_prefetch_lock);
@@ -3617,7 +6709,23 @@ static void c2_pref_window_dump(void)
     while(parent)
     {
         cur_window = rb_entry(parent, c2_pref_window_t, rb_node);
-        pref_debug(0, "%s\n", c2_pref_window_to_str(cur_window));
+        if (!buf)
+            pref_debug(0, "%s\n", c2_pref_window_to_str(cur_window));
+        else if (len < size)
+        {
+            /* Window fields are changed under window->lock, values may be slightly stale. */
+            eff = c2_pref_efficiency(cur_window->used_pages, cur_window->wasted_pages);
+            len += snprintf(buf + len, size - len,
+                    "Window: ext_id=%lld chunks=%lld-%lld pref_chunks=%u used=%llu "
+                    "wasted=%llu efficiency=%llu.%02llu%%\n",
+                    cur_window->ext_id,
+                    CHUNK(cur_window->start_off),
+                    CHUNK(cur_window->end_off),
+                    cur_window->pref_pages / BLKS_PER_CHK,
+                    cur_window->used_pages,
+                    cur_window->wasted_pages,
+                    eff / 100, eff % 100);
+        }
         parent = rb_next(parent);
 
         /* Record how many entries we find. */
@@ -3628,8 +6736,9 @@ static void c2_pref_window_dump(void)
 
     /* Release the lock. */
     spin_unlock(&c2_prefetch_lock);
+
+    return min(len, size);
 }
-#endif
 
 /**
  * Allocate new prefetch window for ext_id & initialise as PREF_WINDOW_NEW.
@@ -3651,6 +6760,8 @@ static c2_pref_window_t * c2_pref_window_alloc(c2_pref_window_t *window,
     window->start_off       = cep.offset;
     window->end_off         = cep.offset;
     window->adv_thresh      = PREF_ADV_THRESH;
+    window->used_pages      = 0;
+    window->wasted_pages    = 0;
 
     if (advise & C2_ADV_STATIC)
         window->pref_pages  = PREF_PAGES;
@@ -3700,7 +6811,7 @@ static c2_pref_window_t* c2_pref_window_get(c_ext_pos_t cep, c2_advise_t advise)
     /* No matching prefetch windows exist.  Allocate one. */
     pref_debug(0, "Failed to find window for cep="cep_fmt_str_nl, cep2str(cep));
 #ifdef PREF_DEBUG
-    c2_pref_window_dump();
+    c2_pref_window_dump(NULL, 0);
 #endif
 
     if ((window = c2_pref_window_alloc(window, cep, advise)) == NULL)
@@ -3991,6 +7102,88 @@ static void c2_pref_window_submit(c2_pref_window_t *window, c_ext_pos_t cep, int
     castle_slaves_unplug();
 }
 
+/**
+ * Largest adaptive prefetch window in pages.
+ *
+ * castle_cache_prefetch_max, but no more than 1/8 of the cache so that windows
+ * don't evict their own prefetched chunks before they are used.
+ */
+static uint32_t c2_pref_adap_max_pages(void)
+{
+    uint32_t chunks;
+
+    chunks = min((uint32_t)castle_cache_prefetch_max << (20 - C_CHK_SHIFT),
+                 (uint32_t)castle_cache_size / 8 / BLKS_PER_CHK);
+
+    return max(chunks, 1U) * BLKS_PER_CHK;
+}
+
+/**
+ * Resize adaptive window based on how much of the falloff was used.
+ *
+ * @param used      Pages used out of those that just fell off the window
+ * @param wasted    Pages wasted out of those that just fell off the window
+ *
+ * - Halve the window if more than 1/4 of the falloff was wasted (sparse access,
+ *   or the window is too big to stay in the cache)
+ * - Double the window otherwise (first advance, or sequential access)
+ * - Keep adv_thresh proportional, so large windows get advanced early enough
+ *   to keep the disk busy
+ */
+static void c2_pref_window_resize(c2_pref_window_t *window, uint64_t used, uint64_t wasted, int debug)
+{
+    uint32_t pref_pages, max_pages;
+
+    BUG_ON(!mutex_is_locked(&window->lock));
+    BUG_ON(!(window->state & PREF_WINDOW_ADAPTIVE));
+
+    max_pages = c2_pref_adap_max_pages();
+    if (wasted > ((used + wasted) >> PREF_ADAP_WASTE_SHIFT))
+    {
+        pref_pages = max((uint32_t)(window->pref_pages / BLKS_PER_CHK / 2 * BLKS_PER_CHK),
+                         (uint32_t)PREF_ADAP_MIN);
+        if (pref_pages < window->pref_pages)
+            atomic64_inc(&c2_pref_shrinks);
+    }
+    else
+    {
+        pref_pages = min(window->pref_pages * 2, max_pages);
+        if (pref_pages > window->pref_pages)
+            atomic64_inc(&c2_pref_grows);
+    }
+    /* castle_cache_prefetch_max might have been reduced. */
+    pref_pages = min(pref_pages, max_pages);
+
+    pref_debug(debug, "Window pref_pages %d->%d chunks for next advance, used=%llu wasted=%llu.\n",
+            window->pref_pages / BLKS_PER_CHK, pref_pages / BLKS_PER_CHK, used, wasted);
+    window->pref_pages = pref_pages;
+    window->adv_thresh = max((uint32_t)(pref_pages / BLKS_PER_CHK / 2 * BLKS_PER_CHK),
+                             (uint32_t)PREF_ADV_THRESH);
+}
+
+/**
+ * Get global prefetcher statistics.
+ */
+void castle_cache_prefetch_stats_get(c2_pref_stats_t *stats)
+{
+    stats->max_pages    = c2_pref_adap_max_pages();
+    stats->active_pages = atomic_read(&c2_pref_active_window_size) * BLKS_PER_CHK;
+    stats->used_pages   = atomic64_read(&c2_pref_used_pages);
+    stats->wasted_pages = atomic64_read(&c2_pref_wasted_pages);
+    stats->grows        = atomic64_read(&c2_pref_grows);
+    stats->shrinks      = atomic64_read(&c2_pref_shrinks);
+}
+
+/**
+ * Print active prefetch windows and their efficiency to buf.
+ *
+ * @return Number of bytes printed
+ */
+int castle_cache_prefetch_windows_print(char *buf, int size)
+{
+    return c2_pref_window_dump(buf, size);
+}
+
 /*
  * Advance the window and kick off prefetch I/O if necessary.
  *
@@ -4005,6 +7198,7 @@ static int c2_pref_window_advance(c2_pref_window_t *window, c_ext_pos_t cep, c2_
     int ret = EXIT_SUCCESS;
     int size, from_end, pages, falloff_pages;
     c_ext_pos_t falloff_cep, submit_cep;
+    uint64_t used, wasted;
 
     BUG_ON(!mutex_is_locked(&window->lock));
     BUG_ON(cep.ext_id != window->ext_id);
@@ -4057,18 +7251,17 @@ static int c2_pref_window_advance(c2_pref_window_t *window, c_ext_pos_t cep, c2_
     /* Operations on window while not in tree. */
     window->start_off = cep.offset;
     window->end_off   = window->end_off + pages * PAGE_SIZE;
-    if (window->state & PREF_WINDOW_ADAPTIVE && window->pref_pages < PREF_ADAP_MAX)
-    {
-        /* Double the number of prefetch pages. */
-        pref_debug(debug, "Window pref_pages %d->%d chunks for next advance.\n",
-                window->pref_pages / BLKS_PER_CHK, window->pref_pages * 2 / BLKS_PER_CHK);
-        window->pref_pages *= 2;
-        if (window->pref_pages > PREF_ADAP_MAX)
-            window->pref_pages = PREF_ADAP_MAX;
-    }
+    used              = window->used_pages;
+    wasted            = window->wasted_pages;
+    c2_pref_window_falloff(falloff_cep, falloff_pages, window, debug);
+    /* Size the window for the next advance from what just fell off. */
+    if (window->state & PREF_WINDOW_ADAPTIVE)
+        c2_pref_window_resize(window,
+                              window->used_pages - used,
+                              window->wasted_pages - wasted,
+                              debug);
     /* End of operations on while while not in tree. */
 
-    c2_pref_window_falloff(falloff_cep, falloff_pages, window, debug);
     c2_pref_window_submit(window, submit_cep, pages, debug);
 
     if (c2_pref_window_insert(window) != EXIT_SUCCESS)
@@ -4280,14 +7473,15 @@ void castle_cache_prefetch_fini(void)
 static int castle_cache_debug_counts = 1;
 void castle_cache_debug(void)
 {
-    int dirty, clean, free, diff;
+    int dirty, clean, free, diff, mag_c2ps, mag_c2bs;
 
     if(!castle_cache_debug_counts)
         return;
 
+    castle_cache_magazines_count(&mag_c2ps, &mag_c2bs);
     dirty = atomic_read(&castle_cache_dirty_pages);
     clean = atomic_read(&castle_cache_clean_pages);
-    free  = PAGES_PER_C2P * castle_cache_page_freelist_size;
+    free  = PAGES_PER_C2P * (castle_cache_page_freelist_size + mag_c2ps);
 
     diff = castle_cache_size - (dirty + clean + free);
     if(diff < 0) diff *= (-1);
@@ -4345,12 +7539,14 @@ static void castle_cache_extent_flush_endio(c2_block_t *c2b)
  * @param   c2b_batch   Array of dirty c2bs
  * @param   batch_idx   Number of dirty c2bs in c2b_batch
  * @param   in_flight_p Number of c2bs currently in-flight
+ * @param   stage       Writeback stage to add c2bs to, NULL to submit them now
  *
  * @also __castle_cache_extent_flush()
  */
 static inline void __castle_cache_extent_flush_batch(c2_block_t *c2b_batch[],
                                                      int *batch_idx,
-                                                     atomic_t *in_flight_p)
+                                                     atomic_t *in_flight_p,
+                                                     c2_io_stage_t *stage)
 {
     int i;
 
@@ -4359,7 +7555,7 @@ static inline void __castle_cache_extent_flush_batch(c2_block_t *c2b_batch[],
         atomic_inc(in_flight_p);
         c2b_batch[i]->end_io  = castle_cache_extent_flush_endio;
         c2b_batch[i]->private = (void *)in_flight_p;
-        BUG_ON(submit_c2b(WRITE, c2b_batch[i]));
+        BUG_ON(__submit_c2b(WRITE, c2b_batch[i], stage));
     }
 
     *batch_idx = 0;
@@ -4377,6 +7573,8 @@ static inline void __castle_cache_extent_flush_batch(c2_block_t *c2b_batch[],
  * @param flushed_p     [out]   Number of pages flushed from extent
  * @param waitlock      [in]    True if caller wants to block on c2b readlock,
  *                              otherwise use read_trylock()
+ * @param stage         [in]    Writeback stage to coalesce writes in, or NULL.
+ *                              Caller must castle_cache_io_stage_submit() it
  *
  * Caller must hold an explicit reference to the dirtytree otherwise in the
  * process of submitting IOs the IO completion handlers might free the tree.
@@ -4396,7 +7594,8 @@ void __castle_cache_extent_flush(c_ext_dirtytree_t *dirtytree,
                                  int max_pgs,
                                  atomic_t *in_flight_p,
                                  int *flushed_p,
-                                 int waitlock)
+                                 int waitlock,
+                                 c2_io_stage_t *stage)
 {
     c2_block_t *c2b;
     struct rb_node *parent;
@@ -4459,7 +7658,10 @@ restart_traverse:
                         dirtytree_locked = 0;
                         __castle_cache_extent_flush_batch(c2b_batch,
                                                           &batch_idx,
-                                                          in_flight_p);
+                                                          in_flight_p,
+                                                          stage);
+                        if (stage)
+                            castle_cache_io_stage_submit(stage);
 
                         /* Dirty c2bs should never overlap. */
                         BUG_ON(c2b->cep.offset < last_end_off);
@@ -4504,7 +7706,7 @@ next_c2b:
             spin_unlock_irq(&dirtytree->lock);
 
         /* Flush batch of c2bs. */
-        __castle_cache_extent_flush_batch(c2b_batch, &batch_idx, in_flight_p);
+        __castle_cache_extent_flush_batch(c2b_batch, &batch_idx, in_flight_p, stage);
     } while (parent);
 
     /* Return number of pages to caller, if requested. */
@@ -4512,6 +7714,260 @@ next_c2b:
         *flushed_p = flushed;
 }
 
+/**********************************************************************************************
+ * Latency-adaptive checkpoint ratelimit.
+ *
+ * Foreground get/replace latencies are collected in per-CPU log2 histograms.  While a
+ * checkpoint flushes extents, the flush rate is re-evaluated at most every
+ * CASTLE_CHECKPOINT_RATE_TICK: halved if the p99 latency since the previous evaluation
+ * exceeds castle_checkpoint_latency_target, raised by an eighth of
+ * castle_checkpoint_ratelimit otherwise.  Until CASTLE_CHECKPOINT_LAT_MIN_SAMPLES latencies
+ * have been seen the p99 is unknown, samples keep accumulating and the rate is left alone.
+ * The rate never drops below what is needed to finish the flush within 3/4 of
+ * castle_checkpoint_period, so checkpoints do not overrun.
+ */
+#define CASTLE_CHECKPOINT_LAT_BUCKETS       (32)    /**< Bucket i: [2^(i-1), 2^i) usecs.      */
+#define CASTLE_CHECKPOINT_LAT_MIN_SAMPLES   (32)    /**< Fewer: p99 unknown.                  */
+#define CASTLE_CHECKPOINT_RATE_TICK         (HZ/2)  /**< Min jiffies between rate changes.    */
+
+/* Counters only ever grow (and wrap), samples since the last p99 are the difference of
+   their sum with castle_checkpoint_lat_base[]. */
+typedef struct castle_checkpoint_lat_hist {
+    local_t             counts[CASTLE_CHECKPOINT_LAT_BUCKETS];
+} c2_ckpt_lat_hist_t;
+static DEFINE_PER_CPU(c2_ckpt_lat_hist_t, castle_checkpoint_lat_hist);
+static unsigned long castle_checkpoint_lat_base[CASTLE_CHECKPOINT_LAT_BUCKETS];
+
+static struct {
+    unsigned int    rate;           /**< Current flush rate in KB/s.                        */
+    unsigned int    deadline_rate;  /**< Rate needed to finish flush by the deadline.       */
+    unsigned int    p99_us;         /**< Last measured foreground p99 latency.              */
+    uint64_t        pages_left;     /**< Estimate of dirty pages left to flush.             */
+    unsigned long   deadline;       /**< Flush should be done by then (jiffies).            */
+    unsigned long   last_adapt;     /**< Last time the rate got re-evaluated (jiffies).     */
+    int             flushing;       /**< Checkpoint flush in progress.                      */
+    uint64_t        decreases;      /**< Rate halved because of foreground latency.         */
+    uint64_t        increases;      /**< Rate raised.                                       */
+    uint64_t        deadline_clamps;/**< Rate raised to meet the deadline.                  */
+} castle_checkpoint_rc;
+
+/**
+ * Record foreground get/replace latency.
+ *
+ * @also castle_double_array_submit()
+ */
+void castle_checkpoint_latency_record(unsigned int usecs)
+{
+    c2_ckpt_lat_hist_t *hist;
+
+    hist = &get_cpu_var(castle_checkpoint_lat_hist);
+    local_inc(&hist->counts[min_t(int, fls(usecs), CASTLE_CHECKPOINT_LAT_BUCKETS - 1)]);
+    put_cpu_var(castle_checkpoint_lat_hist);
+}
+
+/**
+ * Count latencies recorded since the last time the samples were consumed.
+ *
+ * @param sums      [out] Current per bucket totals, over all CPUs
+ * @param counts    [out] Samples per bucket since the last consume
+ *
+ * @return Number of samples since the last consume
+ */
+static uint64_t castle_checkpoint_latency_counts(unsigned long *sums, unsigned long *counts)
+{
+    uint64_t total;
+    int i, cpu;
+
+    for (i = 0; i < CASTLE_CHECKPOINT_LAT_BUCKETS; i++)
+        sums[i] = 0;
+    for_each_possible_cpu(cpu)
+        for (i = 0; i < CASTLE_CHECKPOINT_LAT_BUCKETS; i++)
+            sums[i] += local_read(&per_cpu(castle_checkpoint_lat_hist, cpu).counts[i]);
+    total = 0;
+    for (i = 0; i < CASTLE_CHECKPOINT_LAT_BUCKETS; i++)
+    {
+        counts[i] = sums[i] - castle_checkpoint_lat_base[i];
+        total += counts[i];
+    }
+
+    return total;
+}
+
+/**
+ * Drop latencies recorded so far.
+ */
+static void castle_checkpoint_latency_reset(void)
+{
+    unsigned long counts[CASTLE_CHECKPOINT_LAT_BUCKETS];
+
+    castle_checkpoint_latency_counts(castle_checkpoint_lat_base, counts);
+}
+
+/**
+ * Estimate p99 of latencies recorded since it was last estimated.
+ *
+ * Samples are only consumed once there are enough of them.
+ *
+ * @param p99_p     [out] p99 latency in usecs, interpolated within its bucket
+ *
+ * @return 0 on success, -EAGAIN if there are too few samples yet
+ */
+static int castle_checkpoint_latency_p99(unsigned int *p99_p)
+{
+    unsigned long sums[CASTLE_CHECKPOINT_LAT_BUCKETS], counts[CASTLE_CHECKPOINT_LAT_BUCKETS];
+    uint64_t total, needed, below;
+    unsigned int lo, hi;
+    int i;
+
+    total = castle_checkpoint_latency_counts(sums, counts);
+    if (total < CASTLE_CHECKPOINT_LAT_MIN_SAMPLES)
+        return -EAGAIN;
+    memcpy(castle_checkpoint_lat_base, sums, sizeof(sums));
+
+    needed = (total * 99 + 99) / 100;
+    below  = 0;
+    for (i = 0; i < CASTLE_CHECKPOINT_LAT_BUCKETS - 1; i++)
+    {
+        if (below + counts[i] >= needed)
+            break;
+        below += counts[i];
+    }
+    if (counts[i] == 0)
+    {
+        *p99_p = 1U << i;
+        return 0;
+    }
+    lo = i ? 1U << (i - 1) : 0;
+    hi = 1U << i;
+    *p99_p = lo + (unsigned int)((hi - lo) * (needed - below) / counts[i]);
+
+    return 0;
+}
+
+/**
+ * Set up rate control for a checkpoint flush of extents on flush_list.
+ *
+ * @param ratelimit     Starting rate in KB/s (the configured checkpoint ratelimit)
+ */
+static void castle_checkpoint_rate_start(struct list_head *flush_list, unsigned int ratelimit)
+{
+    struct castle_cache_flush_entry *entry;
+    c_ext_dirtytree_t *dirtytree;
+    struct list_head *lh;
+    uint64_t pages = 0;
+
+    list_for_each(lh, flush_list)
+    {
+        entry = list_entry(lh, struct castle_cache_flush_entry, list);
+        dirtytree = castle_extent_dirtytree_by_id_get(entry->ext_id);
+        if (!dirtytree)
+            continue;
+        spin_lock_irq(&dirtytree->lock);
+        pages += dirtytree->nr_pages;
+        spin_unlock_irq(&dirtytree->lock);
+        castle_extent_dirtytree_put(dirtytree);
+    }
+
+    castle_checkpoint_rc.pages_left    = pages;
+    castle_checkpoint_rc.deadline      = jiffies + castle_checkpoint_period * HZ * 3 / 4;
+    castle_checkpoint_rc.rate          = ratelimit;
+    castle_checkpoint_rc.deadline_rate = 0;
+    castle_checkpoint_rc.last_adapt    = jiffies;
+    /* Only latencies seen while flushing count. */
+    castle_checkpoint_latency_reset();
+    castle_checkpoint_rc.flushing      = 1;
+}
+
+static void castle_checkpoint_rate_end(void)
+{
+    castle_checkpoint_rc.flushing = 0;
+}
+
+/**
+ * Work out the flush rate for the next batch of a checkpoint flush.
+ *
+ * Called before every batch of every extent, but the latency driven part only runs once
+ * per CASTLE_CHECKPOINT_RATE_TICK, and only if the p99 is known.
+ *
+ * @param flushed   Pages flushed by the previous batch
+ *
+ * @return Rate in KB/s
+ */
+static unsigned int castle_checkpoint_rate_adapt(int flushed)
+{
+    unsigned int base, rate, p99, step;
+    uint64_t deadline_rate;
+    long time_left;
+
+    castle_checkpoint_rc.pages_left -= min_t(uint64_t, castle_checkpoint_rc.pages_left, flushed);
+
+    /* Rate needed to flush the remaining pages before the deadline. */
+    time_left = (long)(castle_checkpoint_rc.deadline - jiffies);
+    if (time_left <= 0)
+        deadline_rate = CASTLE_MAX_CHECKPOINT_RATELIMIT;
+    else
+        deadline_rate = castle_checkpoint_rc.pages_left * (PAGE_SIZE / 1024) * HZ / time_left;
+    castle_checkpoint_rc.deadline_rate =
+        min_t(uint64_t, deadline_rate, CASTLE_MAX_CHECKPOINT_RATELIMIT);
+
+    base = max_t(unsigned int, castle_checkpoint_ratelimit, CASTLE_MIN_CHECKPOINT_RATELIMIT);
+    rate = castle_checkpoint_rc.rate;
+    if (castle_checkpoint_latency_target == 0)
+        rate = base;
+    else if (time_after_eq(jiffies, castle_checkpoint_rc.last_adapt + CASTLE_CHECKPOINT_RATE_TICK)
+                && (castle_checkpoint_latency_p99(&p99) == 0))
+    {
+        castle_checkpoint_rc.last_adapt = jiffies;
+        castle_checkpoint_rc.p99_us = p99;
+        step = max_t(unsigned int, base / 8, 1024);
+        if (p99 > castle_checkpoint_latency_target)
+        {
+            rate /= 2;
+            castle_checkpoint_rc.decreases++;
+        }
+        else if (rate < CASTLE_MAX_CHECKPOINT_RATELIMIT)
+        {
+            rate += step;
+            castle_checkpoint_rc.increases++;
+        }
+        rate = max_t(unsigned int, rate, CASTLE_MIN_CHECKPOINT_RATELIMIT);
+        rate = min_t(unsigned int, rate, CASTLE_MAX_CHECKPOINT_RATELIMIT);
+    }
+
+    /* Checkpoint must complete within the period, whatever the foreground sees. */
+    if (rate < castle_checkpoint_rc.deadline_rate)
+    {
+        rate = castle_checkpoint_rc.deadline_rate;
+        castle_checkpoint_rc.deadline_clamps++;
+    }
+    castle_checkpoint_rc.rate = rate;
+    castle_trace_cache(TRACE_VALUE, TRACE_CACHE_CHECKPOINT_RATE_ID, rate);
+
+    return rate;
+}
+
+void castle_checkpoint_rate_stats_get(c2_ckpt_rate_stats_t *stats)
+{
+    stats->target_p99_us   = castle_checkpoint_latency_target;
+    stats->p99_us          = castle_checkpoint_rc.p99_us;
+    stats->base_rate       = castle_checkpoint_ratelimit;
+    stats->rate            = castle_checkpoint_rc.rate;
+    stats->deadline_rate   = castle_checkpoint_rc.deadline_rate;
+    stats->pages_left      = castle_checkpoint_rc.pages_left;
+    stats->flushing        = castle_checkpoint_rc.flushing;
+    stats->decreases       = castle_checkpoint_rc.decreases;
+    stats->increases       = castle_checkpoint_rc.increases;
+    stats->deadline_clamps = castle_checkpoint_rc.deadline_clamps;
+}
+
+/**
+ * Set foreground p99 latency target for checkpoint flushes, 0 for a fixed ratelimit.
+ */
+void castle_checkpoint_latency_target_set(unsigned int usecs)
+{
+    castle_checkpoint_latency_target = usecs;
+}
+
 /**
  * Synchronously flush dirty pages from beginning of extent to start+size.
  * Extent must exist, checked with a BUG_ON(!dirtytree).
@@ -4523,15 +7979,22 @@ next_c2b:
  * @param start     Byte offset to flush from (ignored)
  * @param size      Bytes to flush from start
  * @param ratelimit Ratelimit in KB/s, 0 for unlimited
+ * @param adaptive  Re-evaluate ratelimit before each batch, see
+ *                  castle_checkpoint_rate_adapt()
+ *
+ * @return Approximate number of pages written
  */
-void castle_cache_extent_flush(c_ext_id_t ext_id,
-                               uint64_t start,
-                               uint64_t size,
-                               unsigned int ratelimit)
+static uint64_t _castle_cache_extent_flush(c_ext_id_t ext_id,
+                                           uint64_t start,
+                                           uint64_t size,
+                                           unsigned int ratelimit,
+                                           int adaptive)
 {
     atomic_t in_flight = ATOMIC(0);
     c_ext_dirtytree_t *dirtytree;
+    c2_io_stage_t *stage;
     int batch, batch_period, io_time, flushed;
+    uint64_t total = 0;
     unsigned long io_start;
 
     /* Calculate end_off for __castle_cache_extent_flush(). */
@@ -4542,6 +8005,9 @@ void castle_cache_extent_flush(c_ext_id_t ext_id,
     dirtytree = castle_extent_dirtytree_by_id_get(ext_id);
     BUG_ON(!dirtytree);
 
+    /* Coalesce writes if we can, fall back to per-c2b IOs otherwise. */
+    stage = castle_cache_wb_stage_get();
+
     /* Flush 8 MB at the time if there is a ratelimit. */
     batch = INT_MAX;
     batch_period = 0;
@@ -4555,7 +8021,14 @@ void castle_cache_extent_flush(c_ext_id_t ext_id,
 
     /* Continue flushing batches for as long as there are dirty blocks
        in the specified range. */
+    flushed = 0;
     do {
+        if (adaptive && (ratelimit != 0))
+        {
+            ratelimit    = castle_checkpoint_rate_adapt(flushed);
+            batch_period = (4 * 1000 * batch) / ratelimit;
+        }
+
         /* Record when the flush starts. */
         io_start = jiffies;
 
@@ -4565,27 +8038,138 @@ void castle_cache_extent_flush(c_ext_id_t ext_id,
                                     batch,        /* max_pgs      */
                                     &in_flight,   /* in_flight_p  */
                                     &flushed,     /* flushed_p    */
-                                    1);           /* waitlock     */
+                                    1,            /* waitlock     */
+                                    stage);       /* stage        */
+        if (stage)
+            castle_cache_io_stage_submit(stage);
 
         /* Wait for IO from the current batch to complete. */
         wait_event(castle_cache_flush_wq, (atomic_read(&in_flight) == 0));
+        total += flushed;
 
         /* If there is ratelimiting, sleep for the required amount of time. */
         if((ratelimit != 0) && (flushed > 0))
         {
-            io_time = jiffies_to_msecs(jiffies - io_start);
-            /* Only go to sleep if IO took less time than batch_period. */
-            if(batch_period > io_time)
-                msleep_interruptible(batch_period - io_time);
+            io_time = jiffies_to_msecs(jiffies - io_start);
+            /* Only go to sleep if IO took less time than batch_period. */
+            if(batch_period > io_time)
+                msleep_interruptible(batch_period - io_time);
+        }
+
+    } while(flushed > 0);
+
+    /* Put the dirtytree. */
+    castle_extent_dirtytree_put(dirtytree);
+    if (stage)
+        castle_cache_wb_stage_put(stage);
+
+    /* There should be no IO in flight by now. */
+    BUG_ON(atomic_read(&in_flight) != 0);
+
+    return total;
+}
+
+uint64_t castle_cache_extent_flush(c_ext_id_t ext_id,
+                                   uint64_t start,
+                                   uint64_t size,
+                                   unsigned int ratelimit)
+{
+    return _castle_cache_extent_flush(ext_id, start, size, ratelimit, 0 /*adaptive*/);
+}
+
+#define MIN_FLUSH_SIZE  128
+#define MAX_FLUSH_SIZE  (4*1024)
+#define MIN_FLUSH_FREQ  5           /* Min flush rate: 5*128pgs/s = 2.5MB/s */
+
+/**
+ * Is ext_type a T0 (RWCT) extent?
+ *
+ * T0s are rewritten until merged and never checkpointed, so they are only flushed
+ * when the cache has more dirty pages than its target.
+ */
+static inline int castle_cache_ext_type_rwct(c_ext_type_t ext_type)
+{
+    return (ext_type == EXT_T_T0_INTERNAL_NODES ||
+            ext_type == EXT_T_T0_LEAF_NODES ||
+            ext_type == EXT_T_T0_MEDIUM_OBJECTS);
+}
+
+/**
+ * Trickle-flush dirty pages of non-T0 extents ahead of the next checkpoint.
+ *
+ * Each extent gets an equal share of its dirty pages flushed per flush thread tick, aiming
+ * for it to be clean a quarter of a period before the next checkpoint.  The checkpoint's
+ * own flush then finds little left to write.  Pages flushed per tick are bounded by the
+ * checkpoint ratelimit.
+ *
+ * @param last_tick [both]  Jiffies of the last trickle
+ *
+ * @return Approximate number of pages submitted
+ *
+ * @also castle_periodic_checkpoint()
+ */
+static int castle_cache_trickle_flush(atomic_t *in_flight_p,
+                                      c2_io_stage_t *stage,
+                                      unsigned long *last_tick)
+{
+    c_ext_dirtytree_t *dirtytree;
+    long ticks_left;
+    int i, nr_pages, budget, share, flushed, total;
+
+    /* Flush thread may run more often than MIN_FLUSH_FREQ under pressure. */
+    if (!castle_fs_inited || time_before(jiffies, *last_tick + HZ / MIN_FLUSH_FREQ))
+        return 0;
+    *last_tick = jiffies;
+
+    ticks_left = (long)(castle_checkpoint_next - jiffies) - castle_checkpoint_period * HZ / 4;
+    ticks_left = ticks_left * MIN_FLUSH_FREQ / HZ;
+    if (ticks_left < 1)
+        ticks_left = 1;
+    budget = max_t(unsigned int, castle_checkpoint_ratelimit, CASTLE_MIN_CHECKPOINT_RATELIMIT)
+                / (PAGE_SIZE / 1024) / MIN_FLUSH_FREQ;
+
+    total = 0;
+    i = atomic_read(&castle_cache_extent_dirtylist_size);
+    while (i-- > 0 && budget > 0)
+    {
+        /* Get next per-extent dirtytree, see castle_cache_flush(). */
+        spin_lock_irq(&castle_cache_block_lru_lock);
+        if (list_empty(&castle_cache_extent_dirtylist))
+        {
+            spin_unlock_irq(&castle_cache_block_lru_lock);
+            break;
         }
+        dirtytree = list_entry(castle_cache_extent_dirtylist.next,
+                c_ext_dirtytree_t, list);
+        castle_extent_dirtytree_get(dirtytree);
+        list_move_tail(&dirtytree->list, &castle_cache_extent_dirtylist);
+        spin_unlock_irq(&castle_cache_block_lru_lock);
 
-    } while(flushed > 0);
+        if (!castle_cache_ext_type_rwct(castle_extent_type_get(dirtytree->ext_id)))
+        {
+            spin_lock_irq(&dirtytree->lock);
+            nr_pages = dirtytree->nr_pages;
+            spin_unlock_irq(&dirtytree->lock);
 
-    /* Put the dirtytree. */
-    castle_extent_dirtytree_put(dirtytree);
+            share = min_t(int, budget, (nr_pages + ticks_left - 1) / ticks_left);
+            if (share > 0)
+            {
+                __castle_cache_extent_flush(dirtytree,  /* dirtytree    */
+                                            0,          /* end_off      */
+                                            share,      /* max_pgs      */
+                                            in_flight_p,/* in_flight    */
+                                            &flushed,   /* flushed_p    */
+                                            0,          /* waitlock     */
+                                            stage);     /* stage        */
+                budget -= flushed;
+                total  += flushed;
+            }
+        }
+        castle_extent_dirtytree_put(dirtytree);
+    }
+    atomic_add(total, &castle_cache_trickle_pgs);
 
-    /* There should be no IO in flight by now. */
-    BUG_ON(atomic_read(&in_flight) != 0);
+    return total;
 }
 
 /**
@@ -4617,12 +8201,17 @@ void castle_cache_extent_flush(c_ext_id_t ext_id,
  */
 static int castle_cache_flush(void *unused)
 {
-#define MIN_FLUSH_SIZE  128
-#define MAX_FLUSH_SIZE  (4*1024)
-#define MIN_FLUSH_FREQ  5           /* Min flush rate: 5*128pgs/s = 2.5MB/s */
     int exiting, flushing_rwcts, target_dirty_pgs, dirty_pgs, to_flush, last_flush, i;
     atomic_t in_flight = ATOMIC(0);
     c_ext_type_t ext_type;
+    c2_io_stage_t *stage;
+    unsigned long last_trickle = jiffies - HZ;
+
+    /* Writes from all extents flushed in one iteration are coalesced and sorted
+       together.  Fall back to per-c2b IOs if the stage can't be allocated. */
+    stage = castle_cache_io_stage_alloc(WRITE,
+                                        CASTLE_CACHE_WB_STAGE_C2BS,
+                                        CASTLE_CACHE_WB_STAGE_SEGS);
 
     /* Try and keep 3/4 of pages in the cache dirty. */
     target_dirty_pgs = 3 * (castle_cache_size / 4);
@@ -4675,6 +8264,16 @@ static int castle_cache_flush(void *unused)
         }
         last_flush = to_flush;
 
+        /* Keep checkpoints short by writing out checkpointed extents as they get dirty.
+         * Trickled pages count towards this iteration's flush. */
+        if (!exiting)
+        {
+            int trickled = castle_cache_trickle_flush(&in_flight, stage, &last_trickle);
+
+            to_flush  -= trickled;
+            last_flush = max(last_flush, trickled);
+        }
+
         /* Iterate over all dirty extents trying to find pages to flush. */
         flushing_rwcts = 0;
         i = atomic_read(&castle_cache_extent_dirtylist_size);
@@ -4708,31 +8307,31 @@ static int castle_cache_flush(void *unused)
             i--;
 
             /* Get next per-extent dirtytree to flush. */
-            spin_lock_irq(&castle_cache_block_hash_lock);
+            spin_lock_irq(&castle_cache_block_lru_lock);
             if (list_empty(&castle_cache_extent_dirtylist))
             {
-                spin_unlock_irq(&castle_cache_block_hash_lock);
+                spin_unlock_irq(&castle_cache_block_lru_lock);
                 break;
             }
             dirtytree = list_entry(castle_cache_extent_dirtylist.next,
                     c_ext_dirtytree_t, list);
-            /* Get dirtytree ref under castle_cache_block_hash_lock.  Prevents
+            /* Get dirtytree ref under castle_cache_block_lru_lock.  Prevents
              * a potential race where all c2bs in tree are flushing and final
              * c2b IO completion callback handler might free the dirtytree. */
             castle_extent_dirtytree_get(dirtytree);
             list_move_tail(&dirtytree->list, &castle_cache_extent_dirtylist);
-            spin_unlock_irq(&castle_cache_block_hash_lock);
+            spin_unlock_irq(&castle_cache_block_lru_lock);
 
             /* Check extent type. If its T0, only flush if flushing_rwcts flag is set.
                Note that if ext_id belongs to a deleted extent, we are going to get
                EXT_T_INVALID returned. We are therefore going to flush it, _even_ if
                it used to belong to a T0. */
             ext_type = castle_extent_type_get(dirtytree->ext_id);
-            if(!flushing_rwcts &&
-                    (ext_type == EXT_T_T0_INTERNAL_NODES ||
-                     ext_type == EXT_T_T0_LEAF_NODES ||
-                     ext_type == EXT_T_T0_MEDIUM_OBJECTS))
+            if(!flushing_rwcts && castle_cache_ext_type_rwct(ext_type))
+            {
+                castle_extent_dirtytree_put(dirtytree);
                 continue;
+            }
 
 
             /* Flushed will be set to an approximation of pages flushed. */
@@ -4741,13 +8340,21 @@ static int castle_cache_flush(void *unused)
                                         to_flush,   /* max_pgs      */
                                         &in_flight, /* in_flight    */
                                         &flushed,   /* flushed_p    */
-                                        0);         /* waitlock     */
+                                        0,          /* waitlock     */
+                                        stage);     /* stage        */
             castle_extent_dirtytree_put(dirtytree);
 
             to_flush -= flushed;
         }
+
+        /* Submit writes staged during this iteration. */
+        if (stage)
+            castle_cache_io_stage_submit(stage);
     }
 
+    if (stage)
+        castle_cache_io_stage_free(stage);
+
     /* We shouldn't need locks to check these lists now. */
     BUG_ON(atomic_read(&castle_cache_extent_dirtylist_size) != 0);
     BUG_ON(!list_empty(&castle_cache_extent_dirtylist));
@@ -4757,22 +8364,54 @@ static int castle_cache_flush(void *unused)
 }
 
 /***** Init/fini functions *****/
+static void castle_cache_wb_stages_fini(void)
+{
+    c2_io_stage_t *stage, *t;
+
+    list_for_each_entry_safe(stage, t, &castle_cache_wb_stages, list)
+    {
+        list_del(&stage->list);
+        castle_cache_io_stage_free(stage);
+    }
+}
+
 static int castle_cache_flush_init(void)
 {
+    c2_io_stage_t *stage;
+    int i;
+
+    /* Preallocate stages for castle_cache_extent_flush() callers. */
+    for (i = 0; i < CASTLE_CACHE_WB_STAGE_POOL; i++)
+    {
+        stage = castle_cache_io_stage_alloc(WRITE,
+                                            CASTLE_CACHE_WB_STAGE_C2BS,
+                                            CASTLE_CACHE_WB_STAGE_SEGS);
+        if (!stage)
+        {
+            castle_cache_wb_stages_fini();
+            return -ENOMEM;
+        }
+        stage->pooled = 1;
+        list_add(&stage->list, &castle_cache_wb_stages);
+    }
+
     castle_cache_flush_thread = kthread_run(castle_cache_flush, NULL, "castle_flush");
     return 0;
 }
 
 static void castle_cache_flush_fini(void)
 {
-    kthread_stop(castle_cache_flush_thread);
+    if (castle_cache_flush_thread)
+        kthread_stop(castle_cache_flush_thread);
+    castle_cache_wb_stages_fini();
 }
 
 static int castle_cache_hashes_init(void)
 {
     int i;
 
-    if(!castle_cache_page_hash || !castle_cache_page_hash_locks || !castle_cache_block_hash)
+    if(!castle_cache_page_hash || !castle_cache_page_hash_locks
+            || !castle_cache_block_hash || !castle_cache_block_hash_locks)
         return -ENOMEM;
 
     /* Init the tables. */
@@ -4782,6 +8421,8 @@ static int castle_cache_hashes_init(void)
         spin_lock_init(&castle_cache_page_hash_locks[i]);
     for(i=0; i<castle_cache_block_hash_buckets; i++)
         INIT_HLIST_HEAD(&castle_cache_block_hash[i]);
+    for(i=0; i<(castle_cache_block_hash_buckets / BLOCK_HASH_LOCK_PERIOD + 1); i++)
+        spin_lock_init(&castle_cache_block_hash_locks[i]);
 
     return 0;
 }
@@ -4805,6 +8446,8 @@ static void castle_cache_hashes_fini(void)
             castle_vfree(castle_cache_page_hash);
         if(castle_cache_page_hash_locks)
             castle_vfree(castle_cache_page_hash_locks);
+        if(castle_cache_block_hash_locks)
+            castle_vfree(castle_cache_block_hash_locks);
         return;
     }
 
@@ -4824,7 +8467,7 @@ static void castle_cache_hashes_fini(void)
 #endif
             }
             BUG_ON(c2b_dirty(c2b));
-            list_del(&c2b->clean);
+            c2_policy->remove(c2b);
 
             /* Cleanlist accounting. */
             atomic_dec(&castle_cache_cleanlist_size);
@@ -4838,6 +8481,7 @@ static void castle_cache_hashes_fini(void)
     /* Ensure cleanlist accounting is in order. */
     BUG_ON(atomic_read(&castle_cache_cleanlist_size) != 0);
     BUG_ON(atomic_read(&castle_cache_cleanlist_softpin_size) != 0);
+    BUG_ON(atomic_read(&castle_cache_probationlist_size) != 0);
     BUG_ON(atomic_read(&c2_pref_active_window_size) != 0);
     BUG_ON(c2_pref_total_window_size != 0);
 
@@ -4857,16 +8501,16 @@ static void castle_cache_hashes_fini(void)
 #endif
 }
 
-static int castle_cache_c2p_init(c2_page_t *c2p)
+static int castle_cache_c2p_init(c2_page_t *c2p, int node)
 {
     int j;
 
     c2p->count = 0;
     init_rwsem(&c2p->lock);
-    /* Allocate pages for this c2p */
+    /* Allocate pages for this c2p, preferably on node. */
     for(j=0; j<PAGES_PER_C2P; j++)
     {
-        struct page *page = alloc_page(GFP_KERNEL);
+        struct page *page = alloc_pages_node(node, GFP_KERNEL, 0);
 
         if(!page)
             goto err_out;
@@ -4913,7 +8557,7 @@ static void castle_cache_c2b_init(c2_block_t *c2b)
  */
 static int castle_cache_freelists_init(void)
 {
-    int i;
+    int i, node;
 
     if (!castle_cache_blks || !castle_cache_pgs)
         return -ENOMEM;
@@ -4921,22 +8565,41 @@ static int castle_cache_freelists_init(void)
     memset(castle_cache_blks, 0, sizeof(c2_block_t) * castle_cache_block_freelist_size);
     memset(castle_cache_pgs,  0, sizeof(c2_page_t)  * castle_cache_page_freelist_size);
 
-    /* Initialise the c2p freelist and meta-extent reserve freelist. */
+    for (node = 0; node < MAX_NUMNODES; node++)
+    {
+        INIT_LIST_HEAD(&castle_cache_page_freelists[node]);
+        castle_cache_page_freelist_node_size[node] = 0;
+        castle_cache_node_stats[node].c2ps = 0;
+        atomic64_set(&castle_cache_node_stats[node].allocs, 0);
+        atomic64_set(&castle_cache_node_stats[node].remote_allocs, 0);
+    }
+
+    /* Initialise the c2p freelist and meta-extent reserve freelist.
+       Pages are interleaved across all online nodes. */
     BUG_ON(CASTLE_CACHE_RESERVELIST_QUOTA >= castle_cache_page_freelist_size);
+    node = first_node(node_online_map);
     for (i = 0; i < castle_cache_page_freelist_size; i++)
     {
         c2_page_t *c2p = castle_cache_pgs + i;
 
-        castle_cache_c2p_init(c2p);
+        castle_cache_c2p_init(c2p, node);
 #ifdef CASTLE_DEBUG
         c2p->id = i;
 #endif
+        node = next_node(node, node_online_map);
+        if (node >= MAX_NUMNODES)
+            node = first_node(node_online_map);
 
-        /* Thread c2p onto the relevant freelist. */
+        /* Thread c2p onto the relevant freelist.  The allocator may have
+           fallen back to another node, account by where the pages really are. */
+        castle_cache_node_stats[castle_cache_c2p_node(c2p)].c2ps++;
         if (unlikely(i < CASTLE_CACHE_RESERVELIST_QUOTA))
             list_add(&c2p->list, &castle_cache_page_reservelist);
         else
-            list_add(&c2p->list, &castle_cache_page_freelist);
+        {
+            list_add(&c2p->list, &castle_cache_page_freelists[castle_cache_c2p_node(c2p)]);
+            castle_cache_page_freelist_node_size[castle_cache_c2p_node(c2p)]++;
+        }
     }
     /* Finish by adjusting the freelist sizes. */
     castle_cache_page_freelist_size  -= CASTLE_CACHE_RESERVELIST_QUOTA;
@@ -4989,8 +8652,10 @@ static void castle_cache_freelists_fini(void)
         return;
     }
 
-    list_splice(&castle_cache_page_reservelist, &castle_cache_page_freelist);
-    list_for_each_safe(l, t, &castle_cache_page_freelist)
+    castle_cache_magazines_drain();
+    for (i = 0; i < MAX_NUMNODES; i++)
+        list_splice_init(&castle_cache_page_freelists[i], &castle_cache_page_reservelist);
+    list_for_each_safe(l, t, &castle_cache_page_reservelist)
     {
         list_del(l);
         c2p = list_entry(l, c2_page_t, list);
@@ -5012,6 +8677,15 @@ static void castle_cache_freelists_fini(void)
 /**********************************************************************************************
  * Generic storage functionality for (usually small) persistent data (e.g. versions in
  * version tree, double arrays).
+ *
+ * Mstores are written out from scratch at each checkpoint.  Entries are densely packed
+ * into pages in key order (keys are page cep + index in the page), with no entry
+ * straddling pages.  Pages are allocated in runs of contiguous pages, of doubling size.
+ * An index page, pointed to by the FS superblock, lists the runs, chaining further index
+ * pages if there are too many of them.  Reads can thus issue large sequential I/O and read
+ * ahead, and entries can be updated or deleted by key directly.
+ *
+ * Stores in the old format (a linked list of nodes, slave version 14) can still be read.
  */
 #define CASTLE_MSTORE_ENTRY_DELETED     (1<<1)
 struct castle_mstore_entry {
@@ -5022,6 +8696,8 @@ struct castle_mstore_entry {
     /*          8 */
 } PACKED;
 
+#define MSTORE_RUN_MAX_SHIFT            6       /**< Runs grow up to 64 pages.                  */
+
 static inline struct castle_mstore_entry* castle_mstore_entry_get(struct castle_mstore *mstore,
                                                                   struct castle_mlist_node *node,
                                                                   int idx)
@@ -5044,6 +8720,32 @@ static inline size_t castle_mstore_payload_size(struct castle_mstore *mstore)
     return mstore->entry_size - sizeof(struct castle_mstore_entry);
 }
 
+static inline int castle_mstore_page_entries(struct castle_mstore *mstore)
+{
+    return PAGE_SIZE / mstore->entry_size;
+}
+
+static inline struct castle_mstore_entry* castle_mstore_page_entry_get(struct castle_mstore *mstore,
+                                                                       void *page,
+                                                                       int idx)
+/* Works out where a given entry is in a packed page */
+{
+    return (struct castle_mstore_entry *)((char *)page + mstore->entry_size * idx);
+}
+
+static inline struct castle_mstore_entry* castle_mstore_key_entry_get(struct castle_mstore *mstore,
+                                                                      void *buffer,
+                                                                      int idx)
+/* Works out where the entry for a key is, in either format. Packed pages start with an
+   entry, whose flags and zeroed padding never match the node magic. */
+{
+    struct castle_mlist_node *node = buffer;
+
+    if(node->magic == MLIST_NODE_MAGIC)
+        return castle_mstore_entry_get(mstore, node, idx);
+    return castle_mstore_page_entry_get(mstore, buffer, idx);
+}
+
 static void castle_mstore_iterator_validate(struct castle_mstore_iter *iter)
 {
     struct castle_mlist_node *node = c2b_buffer(iter->node_c2b);
@@ -5093,15 +8795,6 @@ again:
                 debug_mstore("Scheduling a read.\n");
                 BUG_ON(submit_c2b_sync(READ, c2b));
             }
-        } else
-        /* For the sole benefit of initialising the store */
-        {
-            down(&iter->store->mutex);
-            iter->store->last_node_cep    = iter->node_c2b->cep;
-            iter->store->last_node_unused = node->capacity - node->used;
-            up(&iter->store->mutex);
-            debug_mstore("End of the list, last_node_unused=%d.\n",
-                    iter->store->last_node_unused);
         }
         debug_mstore("Unlocking prev node.\n");
         write_unlock_c2b(iter->node_c2b);
@@ -5122,8 +8815,173 @@ again:
     debug_mstore("Exiting advance.\n");
 }
 
+/**
+ * Read completion for a batch of packed pages, unlocks the pages read.
+ *
+ * Mustn't touch the batch after the last unlock, the iterator may reuse it from then on.
+ */
+static void castle_mstore_iterator_batch_io_end(void *private, int err)
+{
+    struct castle_mstore_iter_batch *batch = private;
+    c2_block_t **io = batch->io;
+    int i, nr_io = batch->nr_io;
+
+    /* Failed reads are retried synchronously by castle_mstore_iterator_page_lock(). */
+    for(i=0; i<nr_io; i++)
+        write_unlock_c2b(io[i]);
+}
+
+/**
+ * Continue with the runs listed by the next page of a chained index.
+ */
+static void castle_mstore_iterator_index_next(struct castle_mstore_iter *iter)
+{
+    c_ext_pos_t cep = iter->index->next;
+    c2_block_t *c2b;
+
+    /* Fewer pages than entries in the index, castle_mstore_index_validate() checks that. */
+    BUG_ON(EXT_POS_INVAL(cep));
+    c2b = castle_cache_page_block_get(cep);
+    write_lock_c2b(c2b);
+    if(!c2b_uptodate(c2b))
+        BUG_ON(submit_c2b_sync(READ, c2b));
+    if(castle_mstore_index_validate(iter->store, c2b_buffer(c2b), cep))
+    {
+        castle_printk(LOG_ERROR, "Corrupt index page "cep_fmt_str" of mstore id=%d.\n",
+                cep2str(cep), iter->store->store_id);
+        BUG();
+    }
+    memcpy(iter->index, c2b_buffer(c2b), PAGE_SIZE);
+    write_unlock_c2b(c2b);
+    put_c2b(c2b);
+
+    iter->run      = 0;
+    iter->run_page = 0;
+}
+
+/**
+ * Get the next MSTORE_ITER_BATCH pages of the store and start reading those not in cache.
+ *
+ * Pages of a run are contiguous, so the batch is read with few large I/Os.
+ */
+static void castle_mstore_iterator_batch_read(struct castle_mstore_iter *iter,
+                                              struct castle_mstore_iter_batch *batch)
+{
+    struct castle_mstore_index *index = iter->index;
+    struct castle_mstore_run *run;
+    c_ext_pos_t cep;
+    c2_block_t *c2b;
+
+    batch->nr    = 0;
+    batch->nr_io = 0;
+    while((batch->nr < MSTORE_ITER_BATCH) && (iter->pages_left > 0))
+    {
+        if(iter->run == index->nr_runs)
+            castle_mstore_iterator_index_next(iter);
+        run = &index->runs[iter->run];
+        cep.ext_id = index->ext_id;
+        cep.offset = run->offset + (c_byte_off_t)iter->run_page * C_BLK_SIZE;
+        c2b = castle_cache_page_block_get(cep);
+        batch->c2bs[batch->nr++] = c2b;
+        write_lock_c2b(c2b);
+        if(c2b_uptodate(c2b))
+            write_unlock_c2b(c2b);
+        else
+            batch->io[batch->nr_io++] = c2b;
+
+        iter->pages_left--;
+        if(++iter->run_page == run->nr_pages)
+        {
+            iter->run++;
+            iter->run_page = 0;
+        }
+    }
+
+    /* Without memory for the batch, pages get read one by one when they're needed. */
+    if(batch->nr_io &&
+       submit_c2bs(READ, batch->io, batch->nr_io, castle_mstore_iterator_batch_io_end, batch))
+        castle_mstore_iterator_batch_io_end(batch, -ENOMEM);
+}
+
+/**
+ * Drop the pages of a batch, waiting for its outstanding reads.
+ */
+static void castle_mstore_iterator_batch_put(struct castle_mstore_iter_batch *batch)
+{
+    int i;
+
+    for(i=0; i<batch->nr; i++)
+    {
+        write_lock_c2b(batch->c2bs[i]);
+        write_unlock_c2b(batch->c2bs[i]);
+        put_c2b(batch->c2bs[i]);
+    }
+    batch->nr = 0;
+}
+
+/**
+ * Lock the page of the current entry, once it has been read.
+ */
+static c2_block_t* castle_mstore_iterator_page_lock(struct castle_mstore_iter *iter)
+{
+    c2_block_t *c2b = iter->batch[iter->cur].c2bs[iter->page];
+
+    write_lock_c2b(c2b);
+    if(!c2b_uptodate(c2b))
+        BUG_ON(submit_c2b_sync(READ, c2b));
+
+    return c2b;
+}
+
+/**
+ * Move the indexed iterator to the following entry, deleted or not.
+ *
+ * When done with the current batch, continue with the read-ahead batch and start reading
+ * the batch after it.
+ */
+static void castle_mstore_iterator_step(struct castle_mstore_iter *iter)
+{
+    struct castle_mstore_iter_batch *batch = &iter->batch[iter->cur];
+
+    iter->entries_left--;
+    if(++iter->idx < castle_mstore_page_entries(iter->store))
+        return;
+    iter->idx = 0;
+    if(++iter->page < batch->nr)
+        return;
+    castle_mstore_iterator_batch_put(batch);
+    castle_mstore_iterator_batch_read(iter, batch);
+    iter->cur ^= 1;
+    iter->page = 0;
+}
+
+/**
+ * Position the indexed iterator on the next entry which hasn't been deleted.
+ */
+static void castle_mstore_iterator_index_advance(struct castle_mstore_iter *iter)
+{
+    struct castle_mstore_entry *mentry;
+    c2_block_t *c2b;
+    int deleted;
+
+    while(iter->entries_left > 0)
+    {
+        c2b = castle_mstore_iterator_page_lock(iter);
+        mentry = castle_mstore_page_entry_get(iter->store, c2b_buffer(c2b), iter->idx);
+        deleted = mentry->flags & CASTLE_MSTORE_ENTRY_DELETED;
+        write_unlock_c2b(c2b);
+        if(!deleted)
+            return;
+        debug_mstore("The entry has been deleted. Advancing.");
+        castle_mstore_iterator_step(iter);
+    }
+}
+
 int castle_mstore_iterator_has_next(struct castle_mstore_iter *iter)
 {
+    if(iter->index)
+        return iter->entries_left > 0;
+
     debug_mstore("Iterator %s.\n", iter->node_c2b ? "has next" : "doesn't have next");
     return iter->node_c2b ? 1 : 0;
 }
@@ -5133,9 +8991,28 @@ void castle_mstore_iterator_next(struct castle_mstore_iter *iter,
                                  c_mstore_key_t *key)
 {
     struct castle_mlist_node *node;
+    c2_block_t *c2b;
 
     debug_mstore("Iterator next.\n");
     BUG_ON(!castle_mstore_iterator_has_next(iter));
+    if(iter->index)
+    {
+        c2b = castle_mstore_iterator_page_lock(iter);
+        if(entry)
+            memcpy(entry,
+                   castle_mstore_page_entry_get(iter->store, c2b_buffer(c2b), iter->idx)->payload,
+                   castle_mstore_payload_size(iter->store));
+        if(key)
+        {
+            key->cep = c2b->cep;
+            key->idx = iter->idx;
+        }
+        write_unlock_c2b(c2b);
+        castle_mstore_iterator_step(iter);
+        castle_mstore_iterator_index_advance(iter);
+        return;
+    }
+
     node = c2b_buffer(iter->node_c2b);
     if(entry)
     {
@@ -5155,138 +9032,307 @@ void castle_mstore_iterator_next(struct castle_mstore_iter *iter,
     castle_mstore_iterator_advance(iter);
 }
 
-void castle_mstore_iterator_destroy(struct castle_mstore_iter *iter)
+void castle_mstore_iterator_destroy(struct castle_mstore_iter *iter)
+{
+    debug_mstore("Destroying the iterator.\n");
+    if(iter->index)
+    {
+        castle_mstore_iterator_batch_put(&iter->batch[0]);
+        castle_mstore_iterator_batch_put(&iter->batch[1]);
+        castle_free(iter->index);
+    }
+    if(iter->node_c2b)
+    {
+        debug_mstore("Unlocking the node.\n");
+        write_unlock_c2b(iter->node_c2b);
+        put_c2b(iter->node_c2b);
+    }
+    debug_mstore("Freeing.\n");
+    castle_free(iter);
+}
+
+/**
+ * Check that the index describes a store that can be read with entries of this size.
+ */
+static int castle_mstore_index_validate(struct castle_mstore *store,
+                                        struct castle_mstore_index *index,
+                                        c_ext_pos_t index_cep)
+{
+    uint64_t pages = 0;
+    int i;
+
+    if((index->magic != MSTORE_INDEX_MAGIC) ||
+       (index->entry_size != store->entry_size) ||
+       (index->ext_id != index_cep.ext_id) ||
+       (index->nr_runs > MSTORE_INDEX_RUNS))
+        return -EINVAL;
+    /* Chained pages are checked as the iterator gets to them. */
+    if(!EXT_POS_INVAL(index->next))
+        return (index->next.ext_id == index->ext_id) ? 0 : -EINVAL;
+    for(i=0; i<index->nr_runs; i++)
+        pages += index->runs[i].nr_pages;
+    if(pages * castle_mstore_page_entries(store) < index->nr_entries)
+        return -EINVAL;
+
+    return 0;
+}
+
+struct castle_mstore_iter* castle_mstore_iterate(struct castle_mstore *store)
+{
+    struct castle_fs_superblock *fs_sb;
+    struct castle_mstore_iter *iter;
+    c_ext_pos_t  list_cep;
+    c2_block_t *c2b;
+    int per_page;
+
+    debug_mstore("Creating the iterator.\n");
+    fs_sb = castle_fs_superblocks_get();
+    list_cep = fs_sb->mstore[store->store_id];
+    castle_fs_superblocks_put(fs_sb, 0);
+    debug_mstore("Read first block for mstore %d, got "cep_fmt_str_nl,
+                    store->store_id, cep2str(list_cep));
+    if(EXT_POS_INVAL(list_cep))
+        return NULL;
+
+    iter = castle_zalloc(sizeof(struct castle_mstore_iter), GFP_KERNEL);
+    if(!iter)
+        return NULL;
+    iter->store = store;
+
+    c2b = castle_cache_page_block_get(list_cep);
+    write_lock_c2b(c2b);
+    if(!c2b_uptodate(c2b))
+        BUG_ON(submit_c2b_sync(READ, c2b));
+
+    /* Old format, walk the list of nodes. */
+    if(((struct castle_mlist_node *)c2b_buffer(c2b))->magic == MLIST_NODE_MAGIC)
+    {
+        debug_mstore("Iterating over mlist nodes.\n");
+        iter->node_c2b = c2b;
+        iter->node_idx = -1;
+        castle_mstore_iterator_validate(iter);
+        castle_mstore_iterator_advance(iter);
+        return iter;
+    }
+
+    if(castle_mstore_index_validate(store, c2b_buffer(c2b), list_cep) ||
+       !(iter->index = castle_malloc(PAGE_SIZE, GFP_KERNEL)))
+    {
+        castle_printk(LOG_WARN, "Failed to read index of mstore id=%d.\n", store->store_id);
+        write_unlock_c2b(c2b);
+        put_c2b(c2b);
+        castle_free(iter);
+        return NULL;
+    }
+    memcpy(iter->index, c2b_buffer(c2b), PAGE_SIZE);
+    write_unlock_c2b(c2b);
+    put_c2b(c2b);
+
+    /* Start reading the first batch, and read ahead the second. */
+    per_page = castle_mstore_page_entries(store);
+    iter->entries_left = iter->index->nr_entries;
+    iter->pages_left   = (iter->entries_left + per_page - 1) / per_page;
+    castle_mstore_iterator_batch_read(iter, &iter->batch[0]);
+    castle_mstore_iterator_batch_read(iter, &iter->batch[1]);
+    castle_mstore_iterator_index_advance(iter);
+    debug_mstore("Iterator ready.\n");
+
+    return iter;
+}
+
+/**
+ * Write out the page being filled, unless it matches its on-disk copy.
+ *
+ * Mstores are laid out from the start of the checkpoint slot extent on each checkpoint.
+ * Metadata which hasn't changed since the last checkpoint to this slot therefore produces
+ * pages identical to the clean copies still in the cache.  Dirtying such pages is deferred
+ * until they are complete, and skipped altogether if their contents haven't changed, so
+ * that checkpoints only write the metadata that has changed.
+ *
+ * The deferred page's reference is held until now, which keeps it in the cache.
+ *
+ * @also castle_mstore_page_add()
+ */
+static void castle_mstore_page_complete(struct castle_mstore *store)
+{
+    c2_block_t *c2b = store->page_c2b;
+
+    if (!c2b)
+        return;
+
+    write_lock_c2b(c2b);
+    if (memcmp(c2b_buffer(c2b), store->page_old, PAGE_SIZE))
+        dirty_c2b(c2b);
+    write_unlock_c2b(c2b);
+    put_c2b(c2b);
+    store->page_c2b = NULL;
+}
+
+/**
+ * Initialise an empty index page of the store.
+ */
+static void castle_mstore_index_page_init(struct castle_mstore *store,
+                                          struct castle_mstore_index *index,
+                                          c_ext_id_t ext_id)
+{
+    memset(index, 0, PAGE_SIZE);
+    index->magic      = MSTORE_INDEX_MAGIC;
+    index->entry_size = store->entry_size;
+    index->ext_id     = ext_id;
+    index->next       = INVAL_EXT_POS;
+}
+
+/**
+ * Write out an index page, if it differs from what's on disk.
+ */
+static void castle_mstore_index_write(c_ext_pos_t cep, struct castle_mstore_index *index)
+{
+    c2_block_t *c2b;
+
+    c2b = castle_cache_page_block_get(cep);
+    write_lock_c2b(c2b);
+    if(!c2b_uptodate(c2b) || c2b_dirty(c2b) ||
+       memcmp(c2b_buffer(c2b), index, PAGE_SIZE))
+    {
+        memcpy(c2b_buffer(c2b), index, PAGE_SIZE);
+        set_c2b_uptodate(c2b);
+        dirty_c2b(c2b);
+    }
+    write_unlock_c2b(c2b);
+    put_c2b(c2b);
+}
+
+/**
+ * Index page new runs get added to, the first page until it fills up.
+ */
+static inline struct castle_mstore_index* castle_mstore_index_tail_get(struct castle_mstore *store)
 {
-    debug_mstore("Destroying the iterator.\n");
-    if(iter->node_c2b)
-    {
-        debug_mstore("Unlocking the node.\n");
-        write_unlock_c2b(iter->node_c2b);
-        put_c2b(iter->node_c2b);
-    }
-    debug_mstore("Freeing.\n");
-    castle_free(iter);
+    return EXT_POS_INVAL(store->index_tail_cep) ? store->index : store->index_tail;
 }
 
-struct castle_mstore_iter* castle_mstore_iterate(struct castle_mstore *store)
+/**
+ * Chain a new index page after the full one.
+ *
+ * Runs listed by the full page don't change any more, so unless it's the first page (which
+ * holds the entry count) it's written out straight away, and its buffer reused.
+ */
+static void castle_mstore_index_page_add(struct castle_mstore *store)
 {
-    struct castle_fs_superblock *fs_sb;
-    struct castle_mstore_iter *iter;
-    c_ext_pos_t  list_cep;
+    struct castle_mstore_index *tail = castle_mstore_index_tail_get(store);
+    c_ext_pos_t cep;
 
-    debug_mstore("Creating the iterator.\n");
-    iter = castle_zalloc(sizeof(struct castle_mstore_iter), GFP_KERNEL);
-    if(!iter)
-        return NULL;
+    BUG_ON(castle_ext_freespace_get(&mstore_ext_free,
+                                     C_BLK_SIZE,
+                                     0,
+                                     &cep) < 0);
+    BUG_ON(cep.ext_id != store->index->ext_id);
+    debug_mstore("Chaining index page at "cep_fmt_str_nl, cep2str(cep));
 
-    iter->store = store;
-    fs_sb = castle_fs_superblocks_get();
-    list_cep = fs_sb->mstore[store->store_id];
-    castle_fs_superblocks_put(fs_sb, 0);
-    debug_mstore("Read first list node for mstore %d, got "cep_fmt_str_nl,
-                    store->store_id, cep2str(list_cep));
-    if(EXT_POS_INVAL(list_cep))
-        return NULL;
-    iter->node_c2b = castle_cache_page_block_get(list_cep);
-    iter->node_idx = -1;
-    debug_mstore("Locknig the first node "cep_fmt_str_nl,
-            cep2str(iter->node_c2b->cep));
-    write_lock_c2b(iter->node_c2b);
-    if(!c2b_uptodate(iter->node_c2b))
-        BUG_ON(submit_c2b_sync(READ, iter->node_c2b));
-    debug_mstore("Node uptodate\n");
-    castle_mstore_iterator_validate(iter);
-    castle_mstore_iterator_advance(iter);
-    debug_mstore("Iterator ready.\n");
+    tail->next = cep;
+    if(tail != store->index)
+        castle_mstore_index_write(store->index_tail_cep, tail);
+    castle_mstore_index_page_init(store, store->index_tail, cep.ext_id);
+    store->index_tail_cep = cep;
+}
 
-    return iter;
+/**
+ * Allocate the next run of contiguous pages, twice as long as the previous one.
+ */
+static void castle_mstore_run_add(struct castle_mstore *store)
+{
+    struct castle_mstore_index *index = castle_mstore_index_tail_get(store);
+    struct castle_mstore_run *run;
+    c_ext_pos_t cep;
+    uint32_t nr_pages;
+
+    if(index->nr_runs == MSTORE_INDEX_RUNS)
+    {
+        castle_mstore_index_page_add(store);
+        index = store->index_tail;
+    }
+    /* Runs listed by chained pages are all of the maximum size. */
+    if(index == store->index)
+        nr_pages = 1U << min_t(uint32_t, index->nr_runs, MSTORE_RUN_MAX_SHIFT);
+    else
+        nr_pages = 1U << MSTORE_RUN_MAX_SHIFT;
+    BUG_ON(castle_ext_freespace_get(&mstore_ext_free,
+                                     nr_pages * C_BLK_SIZE,
+                                     0,
+                                     &cep) < 0);
+    BUG_ON(cep.ext_id != index->ext_id);
+    debug_mstore("Allocated run of %u pages at "cep_fmt_str_nl, nr_pages, cep2str(cep));
+
+    run = &index->runs[index->nr_runs++];
+    run->offset      = cep.offset;
+    run->nr_pages    = nr_pages;
+    store->run_unused = nr_pages;
 }
 
 /**
- * Place node on mstore list.
+ * Start filling the next page of the store.
  *
- * NOTE: Needs to be called with store mutex locked. Otherwise two/more racing
- * node_adds may be generated due to the lock-free period between
- * last_node_unused check, and node_add.
+ * NOTE: Needs to be called with store mutex locked.
  */
-static void castle_mstore_node_add(struct castle_mstore *store)
+static void castle_mstore_page_add(struct castle_mstore *store)
 {
-    struct castle_mlist_node *node, *prev_node;
-    struct castle_fs_superblock *fs_sb;
-    c2_block_t *c2b, *prev_c2b;
-    c_ext_pos_t  cep;
+    struct castle_mstore_index *index;
+    struct castle_mstore_run *run;
+    c2_block_t *c2b;
+    c_ext_pos_t cep;
+    int deferred;
 
-    debug_mstore("Adding a node.\n");
+    debug_mstore("Adding a page.\n");
     /* Check if mutex is locked */
     BUG_ON(down_trylock(&store->mutex) == 0);
 
-    /* Prepare the node first */
-    BUG_ON(castle_ext_freespace_get(&mstore_ext_free,
-                                     C_BLK_SIZE,
-                                     0,
-                                     &cep) < 0);
+    /* Prev page is complete now. */
+    castle_mstore_page_complete(store);
+
+    if(store->run_unused == 0)
+        castle_mstore_run_add(store);
+    index = castle_mstore_index_tail_get(store);
+    run = &index->runs[index->nr_runs - 1];
+    cep.ext_id = index->ext_id;
+    cep.offset = run->offset + (c_byte_off_t)(run->nr_pages - store->run_unused) * C_BLK_SIZE;
+    store->run_unused--;
+
     c2b = castle_cache_page_block_get(cep);
-    debug_mstore("Allocated "cep_fmt_str_nl, cep2str(cep));
     write_lock_c2b(c2b);
+    /* Clean uptodate block holds what is on disk, remember it to elide the write. */
+    deferred = store->page_old && c2b_uptodate(c2b) && !c2b_dirty(c2b);
+    if(deferred)
+        memcpy(store->page_old, c2b_buffer(c2b), PAGE_SIZE);
+    memset(c2b_buffer(c2b), 0, PAGE_SIZE);
     set_c2b_uptodate(c2b);
-    debug_mstore("Locked.\n");
-
-    /* Init the node correctly */
-    node = c2b_buffer(c2b);
-    node->magic     = MLIST_NODE_MAGIC;
-    node->capacity  = (PAGE_SIZE - sizeof(struct castle_mlist_node)) / store->entry_size;
-    node->used      = 0;
-    node->next      = INVAL_EXT_POS;
-    dirty_c2b(c2b);
-    debug_mstore("Inited the node.\n");
-    /* Update relevant pointers to point to us (either FS superblock, or prev node) */
-    if(EXT_POS_INVAL(store->last_node_cep))
-    {
-        debug_mstore("Linking into the superblock.\n");
-        fs_sb = castle_fs_superblocks_get();
-        BUG_ON(!EXT_POS_INVAL(fs_sb->mstore[store->store_id]));
-        fs_sb->mstore[store->store_id] = cep;
-        castle_fs_superblocks_put(fs_sb, 1);
-    } else
-    {
-        prev_c2b = castle_cache_page_block_get(store->last_node_cep);
-        debug_mstore("Linking into the prev node "cep_fmt_str_nl,
-                cep2str(prev_c2b->cep));
-        write_lock_c2b(prev_c2b);
-        if(!c2b_uptodate(prev_c2b))
-            BUG_ON(submit_c2b_sync(READ, prev_c2b));
-        debug_mstore("Read prev node.\n");
-        prev_node = c2b_buffer(prev_c2b);
-        prev_node->next = cep;
-        dirty_c2b(prev_c2b);
-        write_unlock_c2b(prev_c2b);
-        put_c2b(prev_c2b);
-    }
-    debug_mstore("Updating the saved last node.\n");
-    /* Finally, save this node as the last node */
-    store->last_node_cep    = cep;
-    store->last_node_unused = node->capacity;
+    if(!deferred)
+        dirty_c2b(c2b);
     write_unlock_c2b(c2b);
-    put_c2b(c2b);
+
+    store->page_cep    = cep;
+    store->page_unused = castle_mstore_page_entries(store);
+    /* Deferred page keeps its reference until castle_mstore_page_complete(). */
+    if(deferred)
+        store->page_c2b = c2b;
+    else
+        put_c2b(c2b);
 }
 
 static void castle_mstore_entry_mod(struct castle_mstore *store,
                                     c_mstore_key_t key,
                                     void *entry)
 {
-    struct castle_mlist_node *node;
     struct castle_mstore_entry *mentry;
     c2_block_t *node_c2b;
 
     debug_mstore("Modifying an entry in "cep_fmt_str", idx=%d, %s.\n",
             cep2str(key.cep), key.idx, entry ? "updating" : "deleting");
+    down(&store->mutex);
     node_c2b = castle_cache_page_block_get(key.cep);
     write_lock_c2b(node_c2b);
     if(!c2b_uptodate(node_c2b))
         BUG_ON(submit_c2b_sync(READ, node_c2b));
     debug_mstore("Read the block.\n");
-    node = c2b_buffer(node_c2b);
-    mentry = castle_mstore_entry_get(store, node, key.idx);
+    mentry = castle_mstore_key_entry_get(store, c2b_buffer(node_c2b), key.idx);
     if(entry == NULL)
     {
         mentry->flags |= CASTLE_MSTORE_ENTRY_DELETED;
@@ -5303,9 +9349,11 @@ static void castle_mstore_entry_mod(struct castle_mstore *store,
                entry,
                castle_mstore_payload_size(store));
     }
-    dirty_c2b(node_c2b);
+    if(node_c2b != store->page_c2b)
+        dirty_c2b(node_c2b);
     write_unlock_c2b(node_c2b);
     put_c2b(node_c2b);
+    up(&store->mutex);
 }
 
 void castle_mstore_entry_update(struct castle_mstore *store,
@@ -5325,43 +9373,36 @@ void castle_mstore_entry_delete(struct castle_mstore *store,
 c_mstore_key_t castle_mstore_entry_insert(struct castle_mstore *store,
                                           void *entry)
 {
-    struct castle_mlist_node *node;
     struct castle_mstore_entry *mentry;
     c_mstore_key_t key;
     c2_block_t *c2b;
 
     debug_mstore("Inserting a new entry.\n");
     down(&store->mutex);
-    /* We should always have at least one more entry left in the last node */
-    BUG_ON(store->last_node_unused <= 0);
-    /* Write the entry to the last node */
-    debug_mstore("Reading last node "cep_fmt_str_nl,
-            cep2str(store->last_node_cep));
-    c2b = castle_cache_page_block_get(store->last_node_cep);
+    /* Stores opened for reading can't be appended to. */
+    BUG_ON(!store->index);
+    if(store->page_unused == 0)
+        castle_mstore_page_add(store);
+    /* Write the entry to the page being filled */
+    debug_mstore("Reading page "cep_fmt_str_nl, cep2str(store->page_cep));
+    c2b = castle_cache_page_block_get(store->page_cep);
     write_lock_c2b(c2b);
     if(!c2b_uptodate(c2b))
         BUG_ON(submit_c2b_sync(READ, c2b));
-    node = c2b_buffer(c2b);
     key.cep = c2b->cep;
-    key.idx = node->used;
+    key.idx = castle_mstore_page_entries(store) - store->page_unused;
     debug_mstore("Writing out under idx=%d.\n", key.idx);
-    mentry = castle_mstore_entry_get(store, node, key.idx);
+    mentry = castle_mstore_page_entry_get(store, c2b_buffer(c2b), key.idx);
     mentry->flags = 0;
     memcpy(mentry->payload,
            entry,
            castle_mstore_payload_size(store));
-    node->used++;
-    store->last_node_unused--;
-    dirty_c2b(c2b);
+    store->page_unused--;
+    store->index->nr_entries++;
+    if(c2b != store->page_c2b)
+        dirty_c2b(c2b);
     write_unlock_c2b(c2b);
     put_c2b(c2b);
-
-    /* Add a new node if we've run out */
-    if(store->last_node_unused == 0)
-    {
-        debug_mstore("Adding a new node to the list.\n");
-        castle_mstore_node_add(store);
-    }
     up(&store->mutex);
 
     return key;
@@ -5379,18 +9420,24 @@ static struct castle_mstore *castle_mstore_alloc(c_mstore_id_t store_id, size_t
     store->store_id         = store_id;
     store->entry_size       = entry_size + sizeof(struct castle_mstore_entry);
     init_MUTEX(&store->mutex);
-    store->last_node_cep    = INVAL_EXT_POS;
-    store->last_node_unused = -1;
+    store->index_cep        = INVAL_EXT_POS;
+    store->index_tail_cep   = INVAL_EXT_POS;
+    store->page_cep         = INVAL_EXT_POS;
     debug_mstore("Done.\n");
 
     return store;
 }
 
+/**
+ * Open a store written by a previous checkpoint, for reading.
+ *
+ * Doesn't read anything, castle_mstore_iterate() does.
+ */
 struct castle_mstore* castle_mstore_open(c_mstore_id_t store_id, size_t entry_size)
 {
     struct castle_fs_superblock *fs_sb;
     struct castle_mstore *store;
-    struct castle_mstore_iter *iterator;
+    c_ext_pos_t cep;
 
     debug_mstore("Opening mstore.\n");
     /* Sanity check, to see if store_id isn't too large. */
@@ -5400,29 +9447,25 @@ struct castle_mstore* castle_mstore_open(c_mstore_id_t store_id, size_t entry_si
         return NULL;
     }
 
+    /* Store must have been written. */
+    fs_sb = castle_fs_superblocks_get();
+    cep = fs_sb->mstore[store_id];
+    castle_fs_superblocks_put(fs_sb, 0);
+    if(EXT_POS_INVAL(cep))
+        return NULL;
+
     store = castle_mstore_alloc(store_id, entry_size);
     if(!store)
         return NULL;
-    /* Inefficient, because we read all the data to get to the last node,
-       but mstores are expected to be small.
-       The iterator will initialise last_node_{cep,unused} */
-    debug_mstore("Iterating to find last node.\n");
-    iterator = castle_mstore_iterate(store);
-    if(!iterator)
-    {
-        castle_free(store);
-        return NULL;
-    }
-    while(castle_mstore_iterator_has_next(iterator))
-        castle_mstore_iterator_next(iterator, NULL, NULL);
-    debug_mstore("Destroying iterator and exiting.\n");
-    castle_mstore_iterator_destroy(iterator);
 
     atomic_inc(&mstores_ref_cnt);
 
     return store;
 }
 
+/**
+ * Create a new, empty store in the current checkpoint slot.
+ */
 struct castle_mstore* castle_mstore_init(c_mstore_id_t store_id, size_t entry_size)
 {
     struct castle_fs_superblock *fs_sb;
@@ -5439,10 +9482,31 @@ struct castle_mstore* castle_mstore_init(c_mstore_id_t store_id, size_t entry_si
     store = castle_mstore_alloc(store_id, entry_size);
     if(!store)
         return NULL;
-    debug_mstore("Initialising first list node.\n");
-    down(&store->mutex);
-    castle_mstore_node_add(store);
-    up(&store->mutex);
+    store->index      = castle_malloc(PAGE_SIZE, GFP_KERNEL);
+    store->index_tail = castle_malloc(PAGE_SIZE, GFP_KERNEL);
+    if(!store->index || !store->index_tail)
+    {
+        if(store->index)
+            castle_free(store->index);
+        if(store->index_tail)
+            castle_free(store->index_tail);
+        castle_free(store);
+        return NULL;
+    }
+    /* Without the buffer every page is written out. */
+    store->page_old = castle_malloc(PAGE_SIZE, GFP_KERNEL);
+
+    debug_mstore("Initialising the index.\n");
+    BUG_ON(castle_ext_freespace_get(&mstore_ext_free,
+                                     C_BLK_SIZE,
+                                     0,
+                                     &store->index_cep) < 0);
+    castle_mstore_index_page_init(store, store->index, store->index_cep.ext_id);
+
+    fs_sb = castle_fs_superblocks_get();
+    BUG_ON(!EXT_POS_INVAL(fs_sb->mstore[store->store_id]));
+    fs_sb->mstore[store->store_id] = store->index_cep;
+    castle_fs_superblocks_put(fs_sb, 1);
 
     atomic_inc(&mstores_ref_cnt);
 
@@ -5452,6 +9516,19 @@ struct castle_mstore* castle_mstore_init(c_mstore_id_t store_id, size_t entry_si
 void castle_mstore_fini(struct castle_mstore *store)
 {
     debug_mstore("Closing mstore id=%d.\n", store->store_id);
+    if(store->index)
+    {
+        down(&store->mutex);
+        castle_mstore_page_complete(store);
+        if(!EXT_POS_INVAL(store->index_tail_cep))
+            castle_mstore_index_write(store->index_tail_cep, store->index_tail);
+        castle_mstore_index_write(store->index_cep, store->index);
+        up(&store->mutex);
+        castle_free(store->index);
+        castle_free(store->index_tail);
+    }
+    if(store->page_old)
+        castle_free(store->page_old);
     castle_free(store);
 
     atomic_dec(&mstores_ref_cnt);
@@ -5483,6 +9560,8 @@ int castle_checkpoint_version_inc(void)
             continue;
         cs_sb = castle_slave_superblock_get(cs);
         cs_sb->fs_version++;
+        /* Mstores of this checkpoint are written in the current format. */
+        cs_sb->pub.version = CASTLE_SLAVE_VERSION;
         if (fs_version != cs_sb->fs_version)
         {
             castle_printk(LOG_ERROR, "%x:%x\n", fs_version, cs_sb->fs_version);
@@ -5583,6 +9662,354 @@ int castle_stats_read(void)
     return 0;
 }
 
+/**********************************************************************************************
+ * Warm cache persistence.
+ *
+ * At checkpoint time the most recently used clean blocks are recorded in the warm cache
+ * mstore.  On the next mount they get read back in, in cep order, by a background thread.
+ * The thread stops as soon as the blocks no longer fit in free cache pages, or when the
+ * first foreground request arrives.
+ */
+#define CASTLE_CACHE_WARM_IOS   (64)                    /**< Max warm-up reads in flight.     */
+#define CASTLE_CACHE_WARM_BATCH (256)                   /**< Blocks visited per lru lock hold.*/
+
+static struct castle_wlist_entry *castle_cache_warm_entries = NULL; /**< Blocks to prefetch.  */
+static int                     castle_cache_warm_nr = 0;    /**< Entries in warm_entries[].   */
+static int                     castle_cache_warm_stop = 0;  /**< Set on first foreground IO.  */
+static struct task_struct     *castle_cache_warm_thread = NULL;
+static atomic_t                castle_cache_warm_in_flight = ATOMIC_INIT(0);
+static DECLARE_WAIT_QUEUE_HEAD(castle_cache_warm_wq);
+
+/**
+ * Order warm cache entries by descending heat.
+ */
+static int castle_cache_warm_heat_cmp(const void *a, const void *b)
+{
+    const struct castle_wlist_entry *e1 = a, *e2 = b;
+
+    if (e1->heat > e2->heat)
+        return -1;
+    if (e1->heat < e2->heat)
+        return 1;
+    return 0;
+}
+
+/**
+ * Order warm cache entries by cep.
+ */
+static int castle_cache_warm_cep_cmp(const void *a, const void *b)
+{
+    const struct castle_wlist_entry *e1 = a, *e2 = b;
+
+    return EXT_POS_COMP(e1->cep, e2->cep);
+}
+
+/**
+ * Record the hottest clean blocks in the warm cache mstore.
+ *
+ * Blocks get their heat from the order they're found in, hottest first.  Most recently
+ * used blocks are at the tail of the cleanlist; with the 2q policy the probationlist
+ * (blocks seen once) follows.
+ *
+ * The lists are walked in batches of CASTLE_CACHE_WARM_BATCH blocks, dropping the
+ * lru lock (and re-enabling IRQs) in between.  No reference is held across the gap: the
+ * walk remembers the cep of the block to resume from, and looks it up again under its
+ * hash lock, then the lru lock (the order castle_cache_block_destroy() uses).  The walk
+ * stops if that block is gone, left the list or got moved, which only costs some warm-up
+ * hints.  A block recorded twice keeps its hottest entry.
+ *
+ * @also castle_cache_warm_start()
+ */
+static int castle_cache_warm_writeback(void)
+{
+    struct castle_wlist_entry *entries;
+    struct list_head *lists[2], *lh, *last;
+    c_mstore_t *store;
+    c2_block_t *c2b;
+    c_ext_pos_t next_cep;
+    uint32_t next_nr_pages;
+    spinlock_t *hash_lock;
+    unsigned long flags;
+    int i, j, nr, max, scanned, resume;
+
+    max = castle_cache_warm_blocks;
+    if (max == 0)
+        return 0;
+
+    entries = castle_vmalloc(max * sizeof(struct castle_wlist_entry));
+    if (!entries)
+        return -ENOMEM;
+
+    nr = 0;
+    lists[0] = &castle_cache_cleanlist;
+    lists[1] = &castle_cache_probationlist;
+    for (i = 0; i < 2 && nr < max; i++)
+    {
+        resume = 0;
+        last   = NULL;
+        do {
+            if (!resume)
+            {
+                spin_lock_irqsave(&castle_cache_block_lru_lock, flags);
+                lh = lists[i]->prev;
+            }
+            else
+            {
+                /* Find the block again, it is only safe to use while it's hashed. */
+                hash_lock = castle_cache_block_hash_lock_get(next_cep);
+                spin_lock_irqsave(hash_lock, flags);
+                c2b = castle_cache_block_hash_find(next_cep, next_nr_pages);
+                spin_lock(&castle_cache_block_lru_lock);
+                /* Resume from it, unless it left this list, or moved within it. */
+                if (!c2b || c2b_dirty(c2b)
+                        || (!!c2b_probation(c2b) != (lists[i] == &castle_cache_probationlist))
+                        || (c2b->clean.next != last))
+                    lh = lists[i];
+                else
+                    lh = &c2b->clean;
+                /* Holding the lru lock keeps it on the list from here on. */
+                spin_unlock(hash_lock);
+                resume = 0;
+            }
+            for (scanned = 0; (lh != lists[i]) && (nr < max); lh = lh->prev, scanned++)
+            {
+                c2b = list_entry(lh, c2_block_t, clean);
+                if (scanned == CASTLE_CACHE_WARM_BATCH)
+                {
+                    next_cep      = c2b->cep;
+                    next_nr_pages = c2b->nr_pages;
+                    last          = lh->next;
+                    resume        = 1;
+                    break;
+                }
+                /* Logical extents are always read in on mount anyway. */
+                if (LOGICAL_EXTENT(c2b->cep.ext_id)
+                        || EXT_ID_INVAL(c2b->cep.ext_id)
+                        || EXT_ID_RESERVE(c2b->cep.ext_id)
+                        || !c2b_uptodate(c2b))
+                    continue;
+
+                memset(&entries[nr], 0, sizeof(struct castle_wlist_entry));
+                entries[nr].cep      = c2b->cep;
+                entries[nr].nr_pages = c2b->nr_pages;
+                entries[nr].heat     = max - nr;
+                nr++;
+            }
+            spin_unlock_irqrestore(&castle_cache_block_lru_lock, flags);
+        } while (resume);
+    }
+
+    /* Drop duplicates, keeping the hottest entry of each block. */
+    sort(entries, nr, sizeof(struct castle_wlist_entry), castle_cache_warm_cep_cmp, NULL);
+    for (i = 0, j = 0; i < nr; i++)
+    {
+        if ((j > 0) && EXT_POS_EQUAL(entries[j-1].cep, entries[i].cep))
+        {
+            if (entries[i].heat > entries[j-1].heat)
+                entries[j-1].heat = entries[i].heat;
+            continue;
+        }
+        entries[j++] = entries[i];
+    }
+    nr = j;
+
+    store = castle_mstore_init(MSTORE_WARM_CACHE, sizeof(struct castle_wlist_entry));
+    if (!store)
+    {
+        castle_vfree(entries);
+        return -ENOMEM;
+    }
+    for (i = 0; i < nr; i++)
+        castle_mstore_entry_insert(store, &entries[i]);
+    castle_mstore_fini(store);
+    castle_vfree(entries);
+
+    return 0;
+}
+
+/**
+ * Warm-up read completion callback.
+ */
+static void castle_cache_warm_io_end(c2_block_t *c2b)
+{
+    c_ext_id_t ext_id = c2b->cep.ext_id;
+
+    write_unlock_c2b(c2b);
+    put_c2b(c2b);
+    castle_extent_put(ext_id);
+
+    if (atomic_dec_return(&castle_cache_warm_in_flight) < CASTLE_CACHE_WARM_IOS)
+        wake_up(&castle_cache_warm_wq);
+}
+
+/**
+ * Prefetch blocks recorded in the warm cache mstore.
+ *
+ * Runs until all blocks have been read, the cache has no free pages left for the next
+ * block, foreground I/O arrives or the thread is stopped.  Then waits to be stopped.
+ *
+ * @also castle_cache_warm_start()
+ * @also castle_cache_warm_fini()
+ */
+static int castle_cache_warm_run(void *unused)
+{
+    struct castle_wlist_entry *entry;
+    c2_block_t *c2b;
+    int i, submitted = 0;
+
+    for (i = 0; i < castle_cache_warm_nr; i++)
+    {
+        entry = &castle_cache_warm_entries[i];
+
+        if (kthread_should_stop() || castle_cache_warm_stop)
+            break;
+        /* Don't evict anything to make space for warm-up blocks. */
+        if (castle_cache_page_freelist_size * PAGES_PER_C2P < entry->nr_pages)
+            break;
+
+        if (atomic_read(&castle_cache_warm_in_flight) >= CASTLE_CACHE_WARM_IOS)
+        {
+            castle_slaves_unplug();
+            wait_event(castle_cache_warm_wq,
+                       atomic_read(&castle_cache_warm_in_flight) < CASTLE_CACHE_WARM_IOS);
+        }
+
+        /* Extent may have been freed since the checkpoint. Reference is dropped in
+           castle_cache_warm_io_end(). */
+        if (!castle_extent_get(entry->cep.ext_id))
+            continue;
+        if ((uint64_t)castle_extent_size_get(entry->cep.ext_id) * C_CHK_SIZE
+                < entry->cep.offset + (uint64_t)entry->nr_pages * C_BLK_SIZE)
+        {
+            castle_extent_put(entry->cep.ext_id);
+            continue;
+        }
+
+        c2b = castle_cache_block_get(entry->cep, entry->nr_pages);
+        write_lock_c2b(c2b);
+        if (c2b_uptodate(c2b))
+        {
+            write_unlock_c2b(c2b);
+            put_c2b(c2b);
+            castle_extent_put(entry->cep.ext_id);
+            continue;
+        }
+        c2b->end_io = castle_cache_warm_io_end;
+        atomic_inc(&castle_cache_warm_in_flight);
+        BUG_ON(submit_c2b(READ, c2b));
+        submitted++;
+    }
+    castle_slaves_unplug();
+    wait_event(castle_cache_warm_wq, atomic_read(&castle_cache_warm_in_flight) == 0);
+
+    castle_printk(LOG_INIT, "Warm cache: prefetched %d of %d recorded blocks.\n",
+            submitted, castle_cache_warm_nr);
+    castle_vfree(castle_cache_warm_entries);
+    castle_cache_warm_entries = NULL;
+
+    /* Wait for castle_cache_warm_fini(). */
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop())
+    {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+
+    return 0;
+}
+
+/**
+ * Read the warm cache mstore and start prefetching the recorded blocks.
+ *
+ * Must be called on fs restore, before the first checkpoint replaces the mstore.  Failures
+ * are not fatal, the cache simply starts cold.
+ *
+ * @also castle_cache_warm_writeback()
+ */
+void castle_cache_warm_start(void)
+{
+    struct castle_mstore_iter *iterator;
+    struct castle_wlist_entry entry;
+    c_mstore_t *store;
+    c_mstore_key_t key;
+    int max, nr, nr_pages;
+
+    max = castle_cache_warm_blocks;
+    if (max == 0)
+        return;
+
+    store = castle_mstore_open(MSTORE_WARM_CACHE, sizeof(struct castle_wlist_entry));
+    if (!store)
+        return;
+    iterator = castle_mstore_iterate(store);
+    if (!iterator)
+        goto out;
+
+    castle_cache_warm_entries = castle_vmalloc(max * sizeof(struct castle_wlist_entry));
+    if (!castle_cache_warm_entries)
+        goto out;
+
+    nr = 0;
+    while (castle_mstore_iterator_has_next(iterator) && nr < max)
+        castle_mstore_iterator_next(iterator, &castle_cache_warm_entries[nr++], &key);
+    /* Drain the rest, if the list was recorded with a bigger castle_cache_warm_blocks. */
+    while (castle_mstore_iterator_has_next(iterator))
+        castle_mstore_iterator_next(iterator, &entry, &key);
+
+    /* Keep the hottest blocks that fit in the cache, then read them in disk order. */
+    sort(castle_cache_warm_entries, nr, sizeof(struct castle_wlist_entry),
+         castle_cache_warm_heat_cmp, NULL);
+    nr_pages = 0;
+    for (castle_cache_warm_nr = 0; castle_cache_warm_nr < nr; castle_cache_warm_nr++)
+    {
+        nr_pages += castle_cache_warm_entries[castle_cache_warm_nr].nr_pages;
+        if (nr_pages > castle_cache_size)
+            break;
+    }
+    sort(castle_cache_warm_entries, castle_cache_warm_nr, sizeof(struct castle_wlist_entry),
+         castle_cache_warm_cep_cmp, NULL);
+
+    castle_cache_warm_stop = 0;
+    castle_cache_warm_thread = kthread_run(castle_cache_warm_run, NULL, "castle_warm");
+    if (IS_ERR(castle_cache_warm_thread))
+    {
+        castle_printk(LOG_WARN, "Failed to start warm cache thread.\n");
+        castle_cache_warm_thread = NULL;
+        castle_vfree(castle_cache_warm_entries);
+        castle_cache_warm_entries = NULL;
+    }
+
+out:
+    if (iterator)
+        castle_mstore_iterator_destroy(iterator);
+    castle_mstore_fini(store);
+}
+
+/**
+ * Stop warm cache prefetch, foreground I/O has arrived.
+ *
+ * @also castle_double_array_submit()
+ */
+void castle_cache_warm_foreground_io(void)
+{
+    if (unlikely(castle_cache_warm_thread && !castle_cache_warm_stop))
+        castle_cache_warm_stop = 1;
+}
+
+/**
+ * Stop the warm cache thread, waiting for outstanding prefetch I/O.
+ */
+void castle_cache_warm_fini(void)
+{
+    if (!castle_cache_warm_thread)
+        return;
+
+    castle_cache_warm_stop = 1;
+    kthread_stop(castle_cache_warm_thread);
+    castle_cache_warm_thread = NULL;
+}
+
 int castle_mstores_writeback(uint32_t version, int is_fini)
 {
     struct castle_fs_superblock *fs_sb;
@@ -5611,6 +10038,7 @@ int castle_mstores_writeback(uint32_t version, int is_fini)
     castle_versions_writeback(is_fini);
     castle_extents_writeback();
     castle_stats_writeback();
+    castle_cache_warm_writeback();
 
     BUG_ON(!castle_ext_freespace_consistent(&mstore_ext_free));
     castle_cache_extent_flush_schedule(MSTORE_EXT_ID + slot, 0,
@@ -5672,19 +10100,30 @@ int castle_cache_extent_flush_schedule(c_ext_id_t ext_id, uint64_t start,
  * - Flush all extents on flush_list
  * - Drop extent reference after flush
  *
- * @param ratelimit     Ratelimit in KB/s, 0 for unlimited.
+ * @param ratelimit     Starting ratelimit in KB/s, 0 for unlimited.  Adjusted to foreground
+ *                      latency, see castle_checkpoint_rate_adapt().
+ *
+ * @return Approximate number of bytes written
  *
  * @also castle_cache_extent_flush_schedule()
  */
-void castle_cache_extents_flush(struct list_head *flush_list, unsigned int ratelimit)
+uint64_t castle_cache_extents_flush(struct list_head *flush_list, unsigned int ratelimit)
 {
     struct list_head *lh, *tmp;
     struct castle_cache_flush_entry *entry;
+    uint64_t pages = 0;
+
+    if (ratelimit != 0)
+        castle_checkpoint_rate_start(flush_list, ratelimit);
 
     list_for_each_safe(lh, tmp, flush_list)
     {
         entry = list_entry(lh, struct castle_cache_flush_entry, list);
-        castle_cache_extent_flush(entry->ext_id, entry->start, entry->count, ratelimit);
+        pages += _castle_cache_extent_flush(entry->ext_id,
+                                            entry->start,
+                                            entry->count,
+                                            ratelimit,
+                                            1 /*adaptive*/);
         castle_extent_put(entry->ext_id);
 
         list_del(lh);
@@ -5692,6 +10131,9 @@ void castle_cache_extents_flush(struct list_head *flush_list, unsigned int ratel
     }
 
     BUG_ON(!list_empty(flush_list));
+    castle_checkpoint_rate_end();
+
+    return pages * PAGE_SIZE;
 }
 
 extern atomic_t current_rebuild_seqno;
@@ -5815,6 +10257,11 @@ void castle_checkpoint_ratelimit_set(unsigned long ratelimit)
  *          - Flush all data (extents belong to previous version) and mstore on to disk
  *          - Flush superblocks onto all slaves
  *
+ *          Notes: Checkpoints are incremental.  The flush thread trickle-flushes checkpointed
+ *                 extents between checkpoints, and mstore nodes unchanged since the last
+ *                 checkpoint to the same slot are not rewritten.  The flush above is thus
+ *                 mostly a short metadata commit.
+ *
  *      CHECKPOINT END
  *
  *          - Increment version, goto next version
@@ -5830,11 +10277,18 @@ static int castle_periodic_checkpoint(void *unused)
     int      ret, i;
     int      exit_loop = 0;
     struct   list_head flush_list;
+    unsigned long start;
+    uint64_t bytes;
 
     if(castle_merges_checkpoint) castle_printk(LOG_INIT, "Will checkpoint on-going DA merges.\n");
     else castle_printk(LOG_INIT, "Will NOT checkpoint on-going DA merges.\n");
 
     do {
+        /* Let the flush thread know when dirty data needs to be on disk by. */
+        castle_checkpoint_next = jiffies
+                    + max(MIN_CHECKPOINT_PERIOD, min(castle_checkpoint_period,
+                                                     MAX_CHECKPOINT_PERIOD)) * HZ;
+
         /* Wakes-up once in a second just to check whether to stop the thread.
          * After every castle_checkpoint_period seconds checkpoints the filesystem. */
         for (i=0;
@@ -5854,6 +10308,7 @@ static int castle_periodic_checkpoint(void *unused)
         castle_printk(LOG_DEVEL, "***** Checkpoint start (period %ds) *****\n",
                       castle_checkpoint_period);
         castle_trace_cache(TRACE_START, TRACE_CACHE_CHECKPOINT_ID, 0);
+        start = jiffies;
 
         /* Perform any necessary work before we take the transaction lock. */
         if (castle_mstores_pre_writeback(version) != EXIT_SUCCESS)
@@ -5891,7 +10346,7 @@ static int castle_periodic_checkpoint(void *unused)
         CASTLE_TRANSACTION_END;
 
         /* Flush all marked extents from cache. */
-        castle_cache_extents_flush(&flush_list,
+        bytes = castle_cache_extents_flush(&flush_list,
                                    exit_loop ? 0 :
                                    max_t(unsigned int,
                                          castle_checkpoint_ratelimit,
@@ -5917,7 +10372,12 @@ static int castle_periodic_checkpoint(void *unused)
 
         castle_checkpoint_version_inc();
 
-        castle_printk(LOG_DEVEL, "***** Completed checkpoint of version: %u *****\n", version);
+        castle_printk(LOG_DEVEL, "***** Completed checkpoint of version: %u in %ums, "
+                      "%llu bytes written *****\n",
+                      version, jiffies_to_msecs(jiffies - start), bytes);
+        castle_trace_cache(TRACE_VALUE, TRACE_CACHE_CHECKPOINT_MSECS_ID,
+                           jiffies_to_msecs(jiffies - start));
+        castle_trace_cache(TRACE_VALUE, TRACE_CACHE_CHECKPOINT_BYTES_ID, bytes);
         castle_trace_cache(TRACE_END, TRACE_CACHE_CHECKPOINT_ID, 0);
     } while (!exit_loop);
     /* Clean exit, return success. */
@@ -5951,7 +10411,7 @@ int castle_cache_init(void)
 {
     unsigned long max_ram;
     struct sysinfo i;
-    int ret;
+    int ret, cpu;
 
     /* Find out how much memory there is in the system. */
     si_meminfo(&i);
@@ -5994,19 +10454,29 @@ int castle_cache_init(void)
                                              sizeof(spinlock_t));
     castle_cache_block_hash = castle_vmalloc(castle_cache_block_hash_buckets *
                                              sizeof(struct hlist_head));
+    castle_cache_block_hash_locks
+        = castle_vmalloc((castle_cache_block_hash_buckets / BLOCK_HASH_LOCK_PERIOD + 1) *
+                                             sizeof(spinlock_t));
     castle_cache_blks       = castle_vmalloc(castle_cache_block_freelist_size *
                                              sizeof(c2_block_t));
     castle_cache_pgs        = castle_vmalloc(castle_cache_page_freelist_size  *
                                              sizeof(c2_page_t));
     /* Init other variables */
+    for_each_possible_cpu(cpu)
+        spin_lock_init(&per_cpu(castle_cache_magazines, cpu).lock);
     atomic_set(&castle_cache_dirty_pages, 0);
     atomic_set(&castle_cache_clean_pages, 0);
     atomic_set(&castle_cache_flush_seq, 0);
     atomic_set(&castle_cache_extent_dirtylist_size, 0);
     atomic_set(&castle_cache_cleanlist_size, 0);
     atomic_set(&castle_cache_cleanlist_softpin_size, 0);
+    atomic_set(&castle_cache_probationlist_size, 0);
     atomic_set(&castle_cache_block_victims, 0);
     atomic_set(&castle_cache_softpin_block_victims, 0);
+    castle_cache_lock_stats_sum(castle_cache_block_hash_lock_stats,
+                                &castle_cache_block_hash_lock_last);
+    castle_cache_lock_stats_sum(castle_cache_block_lru_lock_stats,
+                                &castle_cache_block_lru_lock_last);
     atomic_set(&c2_pref_active_window_size, 0);
     c2_pref_total_window_size = 0;
     castle_cache_allow_hardpinning = castle_cache_size > CASTLE_CACHE_MIN_HARDPIN_SIZE << (20 - PAGE_SHIFT);
@@ -6016,9 +10486,13 @@ int castle_cache_init(void)
                 CASTLE_CACHE_MIN_HARDPIN_SIZE);
 
     if((ret = castle_cache_hashes_init()))    goto err_out;
+    if((ret = castle_cache_policy_init()))    goto err_out;
+    castle_cache_partitions_init();
     if((ret = castle_cache_freelists_init())) goto err_out;
     if((ret = castle_vmap_fast_map_init()))   goto err_out;
     if((ret = castle_cache_flush_init()))     goto err_out;
+    if((ret = castle_cache_ztier_init()))     goto err_out;
+    if((ret = castle_cache_l2_init()))        goto err_out;
 
     /* Init kmem_cache for io_array (Structure is too big to fit in stack). */
     castle_io_array_cache = kmem_cache_create("castle_io_array",
@@ -6053,10 +10527,14 @@ err_out:
  */
 void castle_cache_fini(void)
 {
+    castle_cache_l2_fini();
     castle_cache_debug_fini();
     castle_cache_prefetch_fini();
     castle_cache_flush_fini();
+    castle_cache_ztier_fini();
     castle_cache_hashes_fini();
+    castle_cache_partitions_fini();
+    castle_cache_policy_fini();
     castle_vmap_fast_map_fini();
     castle_cache_freelists_fini();
 
@@ -6066,6 +10544,7 @@ void castle_cache_fini(void)
     if(castle_cache_page_hash)       castle_vfree(castle_cache_page_hash);
     if(castle_cache_block_hash)      castle_vfree(castle_cache_block_hash);
     if(castle_cache_page_hash_locks) castle_vfree(castle_cache_page_hash_locks);
+    if(castle_cache_block_hash_locks) castle_vfree(castle_cache_block_hash_locks);
     if(castle_cache_blks)            castle_vfree(castle_cache_blks);
     if(castle_cache_pgs)             castle_vfree(castle_cache_pgs);
 }
@@ -4,6 +4,8 @@
 #define __CASTLE_CACHE_H__
 
 struct castle_cache_page;
+struct castle_cache_partition;
+
 typedef struct castle_cache_block {
     c_ext_pos_t                cep;
     atomic_t                   remaining;
@@ -27,6 +29,9 @@ typedef struct castle_cache_block {
     } state;
     atomic_t                   count;           /**< Count of active consumers                    */
     atomic_t                   lock_cnt;
+    atomic_t                   seq;             /**< Write sequence, odd while write-locked       */
+    struct castle_cache_partition *type_part;   /**< Extent type partition                        */
+    struct castle_cache_partition *da_part;     /**< DA partition, NULL if not in a DA            */
     void                     (*end_io)(struct castle_cache_block *c2b); /**< IO CB handler routine*/
     void                      *private;         /**< Can only be used if c2b is locked            */
 #ifdef CASTLE_DEBUG
@@ -66,6 +71,33 @@ int  c2b_write_locked(c2_block_t *c2b);
      __lock_c2b(_c2b, 0);
 #endif /* CASTLE_DEBUG */
 
+/**
+ * Start an optimistic (lockless) read of c2b contents.
+ *
+ * Caller must hold a reference on the c2b.  An odd sequence means a writer
+ * currently holds the c2b, in which case c2b_read_seq_retry() always fails.
+ *
+ * @also c2b_read_seq_retry()
+ */
+static inline unsigned int c2b_read_seq_begin(c2_block_t *c2b)
+{
+    unsigned int seq = atomic_read(&c2b->seq);
+
+    smp_rmb();
+    return seq;
+}
+
+/**
+ * Check whether an optimistic read of c2b contents raced with a writer.
+ *
+ * @return Non-zero if the data read since c2b_read_seq_begin() must be discarded.
+ */
+static inline int c2b_read_seq_retry(c2_block_t *c2b, unsigned int seq)
+{
+    smp_rmb();
+    return (seq & 1) || (atomic_read(&c2b->seq) != seq);
+}
+
 static inline int write_trylock_c2b(c2_block_t *c2b)
 {
      return __trylock_c2b(c2b, 1);
@@ -153,6 +185,10 @@ int         submit_c2b                (int rw, c2_block_t *c2b);
 int         submit_c2b_sync           (int rw, c2_block_t *c2b);
 int         submit_c2b_sync_barrier   (int rw, c2_block_t *c2b);
 int         submit_c2b_remap_rda      (c2_block_t *c2b, c_disk_chk_t *remap_chunks, int nr_remaps);
+typedef void (*c2bs_end_io_t)(void *private, int err);
+int         submit_c2bs               (int rw, c2_block_t **c2bs, int nr_c2bs,
+                                       c2bs_end_io_t end_io, void *private);
+int         submit_c2bs_sync          (int rw, c2_block_t **c2bs, int nr_c2bs);
 
 #define     castle_cache_page_block_get(_cep) \
             castle_cache_block_get    (_cep, 1)
@@ -195,7 +231,90 @@ int                        castle_chk_disk                 (void);
 
 void                       castle_cache_stats_print        (int verbose);
 int                        castle_cache_size_get           (void);
+char*                      castle_cache_policy_stats_get   (uint64_t *hits,
+                                                            uint64_t *misses);
+char*                      castle_cache_policy_name_get    (void);
+int                        castle_cache_node_stats_get     (int node,
+                                                            int *pages,
+                                                            int *free_pages,
+                                                            uint64_t *allocs,
+                                                            uint64_t *remote_allocs);
+typedef struct castle_cache_ztier_stats {
+    uint64_t                   max_bytes;       /**< Configured size, 0 if disabled.              */
+    uint64_t                   bytes;           /**< Memory used by compressed blocks.            */
+    uint64_t                   raw_bytes;       /**< Uncompressed size of the stored blocks.      */
+    uint64_t                   blocks;
+    uint64_t                   stores;
+    uint64_t                   rejects;
+    uint64_t                   hits;
+    uint64_t                   misses;
+    uint64_t                   evictions;
+} c2_ztier_stats_t;
+void                       castle_cache_ztier_stats_get    (c2_ztier_stats_t *stats);
+void                       castle_cache_ztier_extent_drop  (c_ext_id_t ext_id);
+typedef struct castle_cache_partition_stats {
+    uint64_t                   pages;           /**< Cache pages held by the partition.           */
+    unsigned int               min_share;       /**< In percent of the cache.                     */
+    unsigned int               max_share;       /**< In percent of the cache.                     */
+    uint64_t                   hits;
+    uint64_t                   misses;
+} c2_partition_stats_t;
+int                        castle_cache_type_partition_set (c_ext_type_t type,
+                                                            unsigned int min_share,
+                                                            unsigned int max_share);
+int                        castle_cache_da_partition_set   (c_da_t da_id,
+                                                            unsigned int min_share,
+                                                            unsigned int max_share);
+void                       castle_cache_da_partition_release(c_da_t da_id);
+void                       castle_cache_type_partition_stats_get(c_ext_type_t type,
+                                                            c2_partition_stats_t *stats);
+void                       castle_cache_da_partition_stats_get(c_da_t da_id,
+                                                            c2_partition_stats_t *stats);
+typedef struct castle_cache_l2_stats {
+    uint64_t                   size_bytes;      /**< Log size, 0 if disabled.                     */
+    uint64_t                   used_bytes;      /**< Log bytes holding valid segments.            */
+    uint64_t                   entries;         /**< Blocks in the index.                         */
+    uint64_t                   stores;
+    uint64_t                   skips;           /**< Evicted blocks already in the log.           */
+    uint64_t                   rejects;
+    uint64_t                   invalidations;   /**< Blocks dropped when the log wrapped.         */
+    uint64_t                   stored_bytes;    /**< Bytes of blocks appended to the log.         */
+    uint64_t                   written_bytes;   /**< Bytes written to the SSD.                    */
+    uint64_t                   read_bytes;      /**< Bytes of blocks served from the L2.          */
+    uint64_t                   hits;
+    uint64_t                   misses;
+} c2_l2_stats_t;
+void                       castle_cache_l2_stats_get       (c2_l2_stats_t *stats);
+void                       castle_cache_l2_start           (void);
+typedef struct castle_cache_prefetch_stats {
+    uint32_t                   max_pages;       /**< Largest adaptive window.                     */
+    uint32_t                   active_pages;    /**< Pages covered by windows in the tree.        */
+    uint64_t                   used_pages;      /**< Prefetched pages used before falloff.        */
+    uint64_t                   wasted_pages;    /**< Prefetched pages unused, or evicted.         */
+    uint64_t                   grows;
+    uint64_t                   shrinks;
+} c2_pref_stats_t;
+void                       castle_cache_prefetch_stats_get (c2_pref_stats_t *stats);
+int                        castle_cache_prefetch_windows_print(char *buf, int size);
+typedef struct castle_checkpoint_rate_stats {
+    unsigned int               target_p99_us;   /**< Foreground p99 target, 0 for fixed rate.     */
+    unsigned int               p99_us;          /**< Last measured foreground p99.                */
+    unsigned int               base_rate;       /**< Configured ratelimit in KB/s.                */
+    unsigned int               rate;            /**< Current flush rate in KB/s.                  */
+    unsigned int               deadline_rate;   /**< Rate needed to finish in time, in KB/s.      */
+    uint64_t                   pages_left;      /**< Estimate of pages left to flush.             */
+    int                        flushing;
+    uint64_t                   decreases;
+    uint64_t                   increases;
+    uint64_t                   deadline_clamps;
+} c2_ckpt_rate_stats_t;
+void                       castle_checkpoint_rate_stats_get(c2_ckpt_rate_stats_t *stats);
+void                       castle_checkpoint_latency_target_set(unsigned int usecs);
+void                       castle_checkpoint_latency_record(unsigned int usecs);
 int                        castle_cache_block_destroy      (c2_block_t *c2b);
+void                       castle_cache_warm_start         (void);
+void                       castle_cache_warm_foreground_io (void);
+void                       castle_cache_warm_fini          (void);
 
 /**********************************************************************************************
  * Cache init/fini.
@@ -1,6 +1,9 @@
 #include <linux/sched.h>
 #include <linux/delay.h>
 #include <linux/kthread.h>
+#include <linux/sort.h>
+#include <linux/percpu.h>
+#include <asm/local.h>
 
 #include "castle_public.h"
 #include "castle_utils.h"
@@ -89,6 +92,37 @@ static int                      castle_use_ssd_leaf_nodes = 0;
 module_param(castle_use_ssd_leaf_nodes, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
 MODULE_PARM_DESC(castle_use_ssd_leaf_nodes, "Use SSDs for btree leaf nodes");
 
+/* set to 0 to fully bring up all DAs at mount, rather than on first attach/request */
+static int                      castle_da_lazy_activation = 1;
+
+module_param(castle_da_lazy_activation, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_da_lazy_activation, "Activate DAs on first attach or request");
+
+/* set to 0 to disable pinned fence indices for RO CTs */
+static int                      castle_fence_index_da_max = 32;
+
+module_param(castle_fence_index_da_max, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_fence_index_da_max, "Memory (MB) per DA for in-memory CT leaf indices");
+
+/* set to N to probe all CT bloom filters in parallel for gets to DAs with at least N CTs
+   with bloom filters; 0 probes them one at a time, in between btree lookups */
+static int                      castle_da_parallel_blooms = 0;
+
+module_param(castle_da_parallel_blooms, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_da_parallel_blooms, "Min CTs with blooms for gets to probe all bloom "
+                                            "filters in parallel, 0 to disable");
+
+/* per-DA row cache size in MB, caching point get results; set to 0 to disable */
+static int                      castle_da_row_cache_size = 0;
+
+module_param(castle_da_row_cache_size, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP);
+MODULE_PARM_DESC(castle_da_row_cache_size, "Memory (MB) per DA for caching point get results");
+
+#define CASTLE_DA_WARMUP_DELAY          (100)   /**< ms between background DA activations. */
+
+static DEFINE_MUTEX(castle_da_activate_mutex);  /**< Serialises castle_da_activate().       */
+static struct task_struct      *castle_da_warmup_thread = NULL;
+
 /**********************************************************************************************/
 /* Notes about the locking on doubling arrays & component trees.
    Each doubling array has a spinlock which protects the lists of component trees rooted in
@@ -148,7 +182,11 @@ static void castle_da_read_bvec_start(struct castle_double_array *da, c_bvec_t *
 static void castle_da_write_bvec_start(struct castle_double_array *da, c_bvec_t *c_bvec);
 static void castle_da_reserve(struct castle_double_array *da, c_bvec_t *c_bvec);
 static void castle_da_get(struct castle_double_array *da);
+static void castle_da_activate_work(struct work_struct *work);
 static void castle_da_put(struct castle_double_array *da);
+static struct castle_da_row_cache* castle_da_row_cache_alloc(uint64_t max_bytes);
+static void castle_da_row_cache_free(struct castle_da_row_cache *cache);
+static void castle_da_row_cache_flush(struct castle_da_row_cache *cache);
 static void castle_da_merge_serialise(struct castle_da_merge *merge);
 static void castle_da_merge_marshall(struct castle_dmserlist_entry *merge_mstore,
                                      struct castle_da_merge *merge,
@@ -235,6 +273,11 @@ static inline int castle_da_need_compaction(struct castle_double_array *da)
     return test_bit(DOUBLE_ARRAY_NEED_COMPACTION_BIT, &da->flags);
 }
 
+static inline int castle_da_inactive(struct castle_double_array *da)
+{
+    return test_bit(DOUBLE_ARRAY_INACTIVE_BIT, &da->flags);
+}
+
 static inline void castle_da_need_compaction_set(struct castle_double_array *da)
 {
     set_bit(DOUBLE_ARRAY_NEED_COMPACTION_BIT, &da->flags);
@@ -1163,6 +1206,65 @@ struct castle_iterator_type castle_ct_modlist_iter = {
     .skip        = NULL,
 };
 
+/* Normalising a key costs about as much as a couple of btree->key_compare() calls, and
+   each RB-tree insert then saves one key_compare() per level.  With few component
+   iterators the tree is too shallow for that to pay off. */
+#define CASTLE_MERGED_ITER_NKEY_MIN_ITERS   (8)     /**< Normalise keys from this many iters. */
+
+/**
+ * Normalises the key of the entry cached in a component iterator.
+ *
+ * Keys which can't be normalised (e.g. btree min/max keys) are marked with zero length
+ * nkey, and compared with btree->key_compare().
+ */
+static void castle_ct_merged_iter_cached_nkey_set(struct component_iterator *comp_iter)
+{
+    if (!comp_iter->cached_nkey)
+        return;
+
+    if (castle_object_btree_key_normalise_buf(comp_iter->cached_entry.k,
+                                              comp_iter->cached_nkey,
+                                              NKEY_MAX_LENGTH))
+        comp_iter->cached_nkey->length = 0;
+}
+
+/**
+ * Compares (key,version) pairs cached in two component iterators.
+ *
+ * Uses normalised keys (single memcmp) if both iterators have them.
+ *
+ * @also castle_kv_compare()
+ */
+static int castle_ct_merged_iter_kv_compare(c_merged_iter_t *iter,
+                                            struct component_iterator *comp_iter1,
+                                            struct component_iterator *comp_iter2)
+{
+    c_vl_nkey_t *nkey1 = comp_iter1->cached_nkey;
+    c_vl_nkey_t *nkey2 = comp_iter2->cached_nkey;
+    int ret;
+
+    if (!nkey1 || !nkey2 || !nkey1->length || !nkey2->length)
+        return castle_kv_compare(iter->btree,
+                                 comp_iter1->cached_entry.k,
+                                 comp_iter1->cached_entry.v,
+                                 comp_iter2->cached_entry.k,
+                                 comp_iter2->cached_entry.v);
+
+    ret = castle_object_nkey_compare(nkey1, nkey2);
+#ifdef CASTLE_DEBUG
+    {
+        int key_cmp = iter->btree->key_compare(comp_iter1->cached_entry.k,
+                                               comp_iter2->cached_entry.k);
+        BUG_ON((ret < 0) != (key_cmp < 0) || (ret > 0) != (key_cmp > 0));
+    }
+#endif
+    if (ret != 0)
+        return ret;
+
+    /* Reverse v achieved by inverting v1<->v2 given to version_compare() function */
+    return castle_version_compare(comp_iter2->cached_entry.v, comp_iter1->cached_entry.v);
+}
+
 /**
  * Insert (key,version) into RB-tree.
  *
@@ -1198,11 +1300,7 @@ static int castle_ct_merged_iter_rbtree_insert(c_merged_iter_t *iter,
         BUG_ON(c_iter == comp_iter);
 
         /* Compare the entry in RB Tree with new entry. */
-        kv_cmp = castle_kv_compare(iter->btree,
-                                   comp_iter->cached_entry.k,
-                                   comp_iter->cached_entry.v,
-                                   c_iter->cached_entry.k,
-                                   c_iter->cached_entry.v);
+        kv_cmp = castle_ct_merged_iter_kv_compare(iter, comp_iter, c_iter);
         nr_cmps++;
 
         /* New (key,version) is smaller than key in tree.  Traverse left. */
@@ -1308,6 +1406,7 @@ static int _castle_ct_merged_iter_prep_next(c_merged_iter_t *iter,
                                                &comp_iter->cached_entry.k,
                                                &comp_iter->cached_entry.v,
                                                &comp_iter->cached_entry.cvt);
+                castle_ct_merged_iter_cached_nkey_set(comp_iter);
                 comp_iter->cached = 1;
                 iter->src_items_completed++;
                 debug_iter("%s:%p:%d - cached\n", __FUNCTION__, iter, i);
@@ -1440,8 +1539,15 @@ static void castle_ct_merged_iter_skip(c_merged_iter_t *iter,
 
 static void castle_ct_merged_iter_cancel(c_merged_iter_t *iter)
 {
+    int i;
+
     if (iter->iterators)
+    {
+        for (i = 0; i < iter->nr_iters; i++)
+            if (iter->iterators[i].cached_nkey)
+                castle_free(iter->iterators[i].cached_nkey);
         castle_free(iter->iterators);
+    }
 }
 
 /**
@@ -1457,7 +1563,7 @@ static void castle_ct_merged_iter_init(c_merged_iter_t *iter,
                                        struct castle_iterator_type **iterator_types,
                                        castle_merged_iterator_each_skip each_skip)
 {
-    int i;
+    int i, nkeys;
 
     debug("Initing merged iterator for %d component iterators.\n", iter->nr_iters);
     BUG_ON(iter->nr_iters <= 0);
@@ -1478,6 +1584,11 @@ static void castle_ct_merged_iter_init(c_merged_iter_t *iter,
        Assume that all iterators have something in them, and let the has_next_check()
        handle the opposite. */
     iter->non_empty_cnt = iter->nr_iters;
+    /* Object keys get normalised, so that the RB-tree compares are memcmp()s, if the tree
+       is deep enough for it to be worth it. */
+    nkeys = ((iter->btree->magic == RW_VLBA_TREE_TYPE) ||
+             (iter->btree->magic == RO_VLBA_TREE_TYPE)) &&
+            (iter->nr_iters >= CASTLE_MERGED_ITER_NKEY_MIN_ITERS);
     for(i=0; i<iter->nr_iters; i++)
     {
         struct component_iterator *comp_iter = iter->iterators + i;
@@ -1486,6 +1597,9 @@ static void castle_ct_merged_iter_init(c_merged_iter_t *iter,
         comp_iter->iterator_type = iterator_types[i];
         comp_iter->cached        = 0;
         comp_iter->completed     = 0;
+        /* Falls back to btree->key_compare() if the allocation fails. */
+        comp_iter->cached_nkey   = nkeys ? castle_malloc(sizeof(c_vl_nkey_t) + NKEY_MAX_LENGTH,
+                                                         GFP_KERNEL) : NULL;
 
         if (comp_iter->iterator_type->register_cb)
             comp_iter->iterator_type->register_cb(comp_iter->iterator,
@@ -1782,6 +1896,8 @@ struct castle_da_merge {
                                                              checkpoint (for merge serdes).     */
     struct castle_version_states  version_states;       /**< Merged version states.             */
     struct castle_version_delete_state snapshot_delete; /**< Snapshot delete state.             */
+    c_fence_index_t              *fence_index;          /**< Fence index of out_tree, built as
+                                                             leaf nodes complete.               */
 
 #ifdef CASTLE_PERF_DEBUG
     u64                           get_c2b_ns;           /**< ns in castle_cache_block_get()     */
@@ -2276,6 +2392,7 @@ static int castle_da_iterators_create(struct castle_da_merge *merge)
                             &comp[i]->cached_entry.k,
                             &comp[i]->cached_entry.v,
                             &comp[i]->cached_entry.cvt);
+                    castle_ct_merged_iter_cached_nkey_set(comp[i]);
                     /* Restore the rbtree */
                     /* Assume we should never serialise on a deleted kv pair */
                     BUG_ON(castle_ct_merged_iter_rbtree_insert(merge->merged_iter, comp[i]));
@@ -2936,6 +3053,117 @@ static inline void castle_da_merge_node_info_get(struct castle_da_merge *merge,
     *ext_free = &merge->out_tree->tree_ext_free;
 }
 
+/**
+ * Allocates a fence index for a RO CT of da, bounded by what's left of the DA budget.
+ *
+ * @return NULL if fence indices are disabled, DA budget is used up, or on ENOMEM
+ */
+static c_fence_index_t* castle_da_fence_index_alloc(struct castle_double_array *da,
+                                                    c_ext_id_t ext_id)
+{
+    int64_t avail;
+
+    avail = ((int64_t)castle_fence_index_da_max << 20) - atomic64_read(&da->fence_index_bytes);
+    if (avail <= 0)
+        return NULL;
+
+    return castle_btree_fence_index_alloc(ext_id, min_t(int64_t, avail, UINT_MAX));
+}
+
+/**
+ * Accounts a completed fence index against the DA budget.
+ *
+ * @return 0 on success, -ENOSPC if the index doesn't fit in the DA budget any more
+ */
+static int castle_da_fence_index_charge(struct castle_double_array *da, c_fence_index_t *fi)
+{
+    if (atomic64_add_return(fi->bytes, &da->fence_index_bytes) >
+            ((int64_t)castle_fence_index_da_max << 20))
+    {
+        atomic64_sub(fi->bytes, &da->fence_index_bytes);
+        return -ENOSPC;
+    }
+
+    return 0;
+}
+
+/**
+ * Frees the fence index of a CT, and returns its memory to the DA budget.
+ */
+static void castle_da_fence_index_uncharge_free(struct castle_component_tree *ct)
+{
+    struct castle_double_array *da = castle_da_hash_get(ct->da);
+
+    if (da)
+        atomic64_sub(ct->fence_index->bytes, &da->fence_index_bytes);
+    castle_btree_fence_index_free(ct->fence_index);
+    ct->fence_index = NULL;
+}
+
+/**
+ * Fence index rebuild of a CT read from disk, queued by castle_da_ct_fence_index_load().
+ */
+struct castle_da_fence_index_load {
+    struct work_struct              work;
+    struct castle_double_array     *da;         /**< Reference held until the build is done. */
+    struct castle_component_tree   *ct;         /**< Reference held until the build is done. */
+};
+
+/**
+ * Rebuilds the fence index of a CT read from disk, see castle_btree_fence_index_build().
+ *
+ * Reads every node above the leaves synchronously, so it runs from the DA workqueue.  Gets
+ * walk the tree from the root until the index gets published.
+ */
+static void castle_da_ct_fence_index_load_work(struct work_struct *work)
+{
+    struct castle_da_fence_index_load *load = container_of(work, struct castle_da_fence_index_load,
+                                                           work);
+    struct castle_component_tree *ct = load->ct;
+    struct castle_double_array *da = load->da;
+    c_fence_index_t *fi;
+
+    fi = castle_da_fence_index_alloc(da, ct->tree_ext_free.ext_id);
+    if (!fi)
+        goto out;
+    if (castle_btree_fence_index_build(ct, fi) || castle_da_fence_index_charge(da, fi))
+    {
+        castle_printk(LOG_WARN, "Could not load fence index for ct=%d.\n", ct->seq);
+        castle_btree_fence_index_free(fi);
+        goto out;
+    }
+    castle_btree_fence_index_finish(fi);
+    smp_wmb();
+    ct->fence_index = fi;
+
+out:
+    castle_ct_put(ct, 0);
+    castle_da_put(da);
+    castle_free(load);
+}
+
+/**
+ * Queues the rebuild of the fence index of a CT read from disk.
+ */
+static void castle_da_ct_fence_index_load(struct castle_component_tree *ct)
+{
+    struct castle_double_array *da = castle_da_hash_get(ct->da);
+    struct castle_da_fence_index_load *load;
+
+    ct->fence_index_load = 0;
+    if (!da || ct->dynamic || (ct->tree_depth < 2))
+        return;
+    load = castle_malloc(sizeof(struct castle_da_fence_index_load), GFP_KERNEL);
+    if (!load)
+        return;
+    castle_da_get(da);
+    castle_ct_get(ct, 0);
+    load->da = da;
+    load->ct = ct;
+    CASTLE_INIT_WORK(&load->work, castle_da_ct_fence_index_load_work);
+    queue_work(castle_da_wqs[0], &load->work);
+}
+
 /**
  * Add an entry to the nodes that are being constructed in merge.
  *
@@ -3203,6 +3431,9 @@ static void castle_da_node_complete(struct castle_da_merge *merge, int depth)
         btree->entries_drop(node, valid_end_idx + 1, node->used - 1);
 
     BUG_ON(node->used != valid_end_idx + 1);
+    /* Node contents are final now, let the btree type build its search aids. */
+    if (btree->node_finalise)
+        btree->node_finalise(node);
     btree->entry_get(node, valid_end_idx, &key, &version, &cvt);
     debug("Inserting into parent key=%p, *key=%d, version=%d\n",
             key, *((uint32_t*)key), node->version);
@@ -3221,6 +3452,15 @@ static void castle_da_node_complete(struct castle_da_merge *merge, int depth)
         goto release_node;
     }
     CVT_NODE_SET(node_cvt, (node_c2b->nr_pages * C_BLK_SIZE), node_c2b->cep);
+    /* The parent entry of a leaf is its fence. */
+    if ((depth == 0) && merge->fence_index &&
+            castle_btree_fence_index_add(merge->fence_index, key, node->version, node_c2b->cep))
+    {
+        castle_printk(LOG_DEBUG, "%s::dropping fence index for da %d level %d.\n",
+            __FUNCTION__, merge->da->id, merge->level);
+        castle_btree_fence_index_free(merge->fence_index);
+        merge->fence_index = NULL;
+    }
     castle_da_entry_add(merge, depth+1, key, node->version, node_cvt, 0);
 release_node:
     debug("Releasing c2b for cep=" cep_fmt_str_nl, cep2str(node_c2b->cep));
@@ -3298,6 +3538,31 @@ static struct castle_component_tree* castle_da_merge_package(struct castle_da_me
             out_tree->seq, out_tree, out_tree->tree_depth);
     out_tree->root_node = root_cep;
 
+    /* Pin the fence index, unless the tree is just a leaf or the DA is out of budget. */
+    if (merge->fence_index)
+    {
+        castle_btree_fence_index_finish(merge->fence_index);
+#ifdef CASTLE_DEBUG
+        /* The index must match what the CT will get when it's loaded from disk. */
+        if (out_tree->tree_depth >= 2)
+        {
+            c_fence_index_t *fi;
+
+            fi = castle_btree_fence_index_alloc(out_tree->tree_ext_free.ext_id, UINT_MAX);
+            if (fi && !castle_btree_fence_index_build(out_tree, fi))
+                BUG_ON(!castle_btree_fence_index_equal(fi, merge->fence_index));
+            if (fi)
+                castle_btree_fence_index_free(fi);
+        }
+#endif
+        if ((out_tree->tree_depth >= 2) &&
+                !castle_da_fence_index_charge(merge->da, merge->fence_index))
+            out_tree->fence_index = merge->fence_index;
+        else
+            castle_btree_fence_index_free(merge->fence_index);
+        merge->fence_index = NULL;
+    }
+
     debug("Root for that tree is: " cep_fmt_str_nl, cep2str(out_tree->root_node));
     /* Write counts out */
     atomic64_set(&out_tree->item_count, merge->nr_entries);
@@ -3457,7 +3722,12 @@ static struct castle_component_tree* castle_da_merge_complete(struct castle_da_m
     }
     /* Write out the max keys along the max path. */
     if (merge->nr_entries)
+    {
         castle_da_max_path_complete(merge, root_cep);
+        /* The fence of the right-most leaf went with it. */
+        if (merge->fence_index && (merge->root_depth > 0))
+            castle_btree_fence_index_maxify(merge->fence_index);
+    }
 
     /* Complete Bloom filters. */
     if (merge->out_tree->bloom_exists)
@@ -3542,6 +3812,9 @@ static void castle_da_merge_dealloc(struct castle_da_merge *merge, int err)
     if (merge->last_leaf_node_c2b)
         put_c2b(merge->last_leaf_node_c2b);
 
+    if (merge->fence_index)
+        castle_btree_fence_index_free(merge->fence_index);
+
     /* Free all the buffers */
     if (merge->snapshot_delete.occupied)
         castle_free(merge->snapshot_delete.occupied);
@@ -3756,6 +4029,89 @@ static int castle_da_entry_skip(struct castle_da_merge *merge,
     return castle_version_is_deletable(state, version);
 }
 
+#define CASTLE_DA_MERGE_READAHEAD_NODES (4) /**< Leaf nodes read ahead per input tree/unit.  */
+
+/**
+ * State of a merge readahead batch.
+ */
+struct castle_da_merge_readahead {
+    int                           nr_c2bs;
+    c2_block_t                   *c2bs[0];
+};
+
+static void castle_da_merge_readahead_end_io(void *private, int err)
+{
+    struct castle_da_merge_readahead *ra = private;
+    int i;
+
+    /* Errors get handled if and when the iterator reads these nodes. */
+    for (i = 0; i < ra->nr_c2bs; i++)
+    {
+        write_unlock_c2b(ra->c2bs[i]);
+        put_c2b(ra->c2bs[i]);
+    }
+    castle_free(ra);
+}
+
+/**
+ * Read ahead leaf nodes of all immutable input trees with a single batched I/O.
+ *
+ * Reads the nodes following each iterator's next_c2b.  Nodes which are cached, or
+ * locked (e.g. already being prefetched) are skipped.  The iterators will block on
+ * the c2b locks, if they get to the nodes before the I/O completes.
+ *
+ * @also castle_ct_immut_iter_next_node_find()
+ */
+static void castle_da_merge_readahead(struct castle_da_merge *merge)
+{
+    struct castle_da_merge_readahead *ra;
+    c_immut_iter_t *iter;
+    c_ext_pos_t cep;
+    c2_block_t *c2b;
+    uint16_t node_size;
+    int i, j;
+
+    ra = castle_malloc(sizeof(struct castle_da_merge_readahead) +
+                       merge->nr_trees * CASTLE_DA_MERGE_READAHEAD_NODES * sizeof(c2_block_t *),
+                       GFP_KERNEL);
+    if (!ra)
+        return;
+    ra->nr_c2bs = 0;
+
+    FOR_EACH_MERGE_TREE(i, merge)
+    {
+        if (merge->in_trees[i]->dynamic)
+            continue;
+        iter = merge->iters[i];
+        if (iter->completed || !iter->next_c2b)
+            continue;
+
+        cep = iter->next_c2b->cep;
+        node_size = iter->next_c2b->nr_pages;
+        for (j = 0; j < CASTLE_DA_MERGE_READAHEAD_NODES; j++)
+        {
+            cep = castle_ct_immut_iter_next_node_cep_find(iter, cep, node_size);
+            if (EXT_POS_INVAL(cep))
+                break;
+            c2b = castle_cache_block_get(cep, node_size);
+            if (!c2b_uptodate(c2b) && write_trylock_c2b(c2b))
+            {
+                if (!c2b_uptodate(c2b))
+                {
+                    ra->c2bs[ra->nr_c2bs++] = c2b;
+                    continue;
+                }
+                write_unlock_c2b(c2b);
+            }
+            put_c2b(c2b);
+        }
+    }
+
+    if (ra->nr_c2bs == 0
+            || submit_c2bs(READ, ra->c2bs, ra->nr_c2bs, castle_da_merge_readahead_end_io, ra))
+        castle_da_merge_readahead_end_io(ra, 0);
+}
+
 static int castle_da_merge_unit_do(struct castle_da_merge *merge, uint32_t unit_nr)
 {
     void *key;
@@ -3766,6 +4122,9 @@ static int castle_da_merge_unit_do(struct castle_da_merge *merge, uint32_t unit_
     struct timespec ts_start, ts_end;
 #endif
 
+    /* Get the input leaf nodes for this unit in flight together. */
+    castle_da_merge_readahead(merge);
+
     while (castle_ct_merged_iter_has_next(merge->merged_iter))
     {
         cv_nonatomic_stats_t stats;
@@ -4473,6 +4832,9 @@ static struct castle_da_merge* castle_da_merge_init(struct castle_double_array *
         ret = castle_da_merge_extents_alloc(merge);
         if(ret)
             goto error_out;
+        /* Fences of leaves completed before a merge got serialised are not known after
+           deserialisation, only fresh merges build fence indices. */
+        merge->fence_index = castle_da_fence_index_alloc(da, merge->out_tree->tree_ext_free.ext_id);
     }
 
     if(da->levels[level].merge.serdes.des)
@@ -5402,6 +5764,10 @@ void castle_da_version_delete(c_da_t da_id)
 
     atomic_inc(&(da->nr_del_versions));
 
+    /* Deleted versions may go away, don't keep cache entries referring to them. */
+    if (da->row_cache)
+        castle_da_row_cache_flush(da->row_cache);
+
     /* Mark DA for compaction. */
     castle_da_need_compaction_set(da);
 
@@ -5843,6 +6209,9 @@ static int castle_da_merge_stop(struct castle_double_array *da, void *unused)
 
     /* castle_da_exiting should have been set by now. */
     BUG_ON(!exit_cond);
+    /* Merge threads of inactive DAs have never run, start them so that they can exit. */
+    if (test_and_clear_bit(DOUBLE_ARRAY_INACTIVE_BIT, &da->flags))
+        castle_da_merge_start(da, NULL);
     wake_up(&da->merge_waitq);
     for(i=0; i<MAX_DA_LEVEL-1; i++)
     {
@@ -6115,6 +6484,8 @@ static void castle_da_dealloc(struct castle_double_array *da)
         castle_free(da->ios_waiting);
     if (da->t0_lfs)
         castle_free(da->t0_lfs);
+    if (da->row_cache)
+        castle_da_row_cache_free(da->row_cache);
     /* Poison and free (may be repoisoned on debug kernel builds). */
     memset(da, 0xa7, sizeof(struct castle_double_array));
     castle_free(da);
@@ -6136,6 +6507,7 @@ static struct castle_double_array* castle_da_alloc(c_da_t da_id)
     rwlock_init(&da->lock);
     da->flags           = 0;
     da->nr_trees        = 0;
+    da->nr_bloom_trees  = 0;
     atomic_set(&da->ref_cnt, 1);
     da->attachment_cnt  = 0;
     atomic_set(&da->ios_waiting_cnt, 0);
@@ -6145,6 +6517,17 @@ static struct castle_double_array* castle_da_alloc(c_da_t da_id)
     da->ios_rate        = 0;
     da->top_level       = 0;
     atomic_set(&da->nr_del_versions, 0);
+    atomic64_set(&da->accesses, 0);
+    atomic64_set(&da->fence_index_bytes, 0);
+    da->row_cache       = NULL;
+    if (castle_da_row_cache_size > 0)
+    {
+        da->row_cache = castle_da_row_cache_alloc((uint64_t)castle_da_row_cache_size << 20);
+        if (!da->row_cache)
+            castle_printk(LOG_WARN, "Failed to allocate row cache for DA=%d, continuing "
+                    "without.\n", da_id);
+    }
+    CASTLE_INIT_WORK(&da->activate_work, castle_da_activate_work);
     /* For existing double arrays driver merge has to be reset after loading it. */
     da->driver_merge    = -1;
     da->compaction_ct_seq = INVAL_TREE;
@@ -6232,8 +6615,10 @@ err_out:
 void castle_da_marshall(struct castle_dlist_entry *dam,
                         struct castle_double_array *da)
 {
+    memset(dam, 0, sizeof(struct castle_dlist_entry));
     dam->id           = da->id;
     dam->root_version = da->root_version;
+    dam->accesses     = atomic64_read(&da->accesses);
 }
 
 static void castle_da_unmarshall(struct castle_double_array *da,
@@ -6241,6 +6626,7 @@ static void castle_da_unmarshall(struct castle_double_array *da,
 {
     da->id           = dam->id;
     da->root_version = dam->root_version;
+    atomic64_set(&da->accesses, dam->accesses);
     castle_sysfs_da_add(da);
 }
 
@@ -6317,6 +6703,8 @@ static void castle_component_tree_add(struct castle_double_array *da,
     list_add(&ct->da_list, head);
     da->levels[ct->level].nr_trees++;
     da->nr_trees++;
+    if (ct->bloom_exists)
+        da->nr_bloom_trees++;
 
     if (ct->level > da->top_level)
     {
@@ -6345,6 +6733,8 @@ static void castle_component_tree_del(struct castle_double_array *da,
     else
         da->levels[ct->level].nr_trees--;
     da->nr_trees--;
+    if (ct->bloom_exists)
+        da->nr_bloom_trees--;
 }
 
 /**
@@ -6505,6 +6895,9 @@ void castle_ct_put(struct castle_component_tree *ct, int write)
     if (ct->bloom_exists)
         castle_bloom_destroy(&ct->bloom);
 
+    if (ct->fence_index)
+        castle_da_fence_index_uncharge_free(ct);
+
     /* Poison ct (note this will be repoisoned by kfree on kernel debug build. */
     memset(ct, 0xde, sizeof(struct castle_component_tree));
     castle_free(ct);
@@ -6646,6 +7039,8 @@ void castle_da_ct_marshall(struct castle_clist_entry *ctm,
     ctm->bloom_exists = ct->bloom_exists;
     if (ct->bloom_exists)
         castle_bloom_marshall(&ct->bloom, ctm);
+
+    ctm->fence_index = (ct->fence_index != NULL);
 }
 
 /**
@@ -6687,7 +7082,17 @@ static c_da_t castle_da_ct_unmarshall(struct castle_component_tree *ct,
     ct->bloom_exists = ctm->bloom_exists;
     if (ctm->bloom_exists)
         castle_bloom_unmarshall(&ct->bloom, ctm);
-    /* Pre-warm cache for T0 btree extents. */
+    ct->fence_index      = NULL;
+    ct->fence_index_load = ctm->fence_index;
+
+    return ctm->da_id;
+}
+
+/**
+ * Pre-warm cache for T0 btree extents and bloom filters of an unmarshalled CT.
+ */
+static void castle_da_ct_prefetch(struct castle_component_tree *ct)
+{
     if (ct->level == 0)
     {
         /* CHUNK() will give us the offset of the last btree node (from chunk 0)
@@ -6698,84 +7103,279 @@ static c_da_t castle_da_ct_unmarshall(struct castle_component_tree *ct,
         castle_cache_advise((c_ext_pos_t){ct->tree_ext_free.ext_id, 0},
                 C2_ADV_EXTENT|C2_ADV_PREFETCH, chunks, -1, 0);
     }
-
-    return ctm->da_id;
+    if (ct->bloom_exists)
+        castle_bloom_prefetch(&ct->bloom);
+    if (ct->fence_index_load)
+        castle_da_ct_fence_index_load(ct);
 }
 
 /**
- * Run fn() on each CT in the doubling array.
+ * Prefetch all CTs of a DA, see castle_da_ct_prefetch().
  *
- * @param da    Doubling array's CTs to enumerate
- * @param fn    Function to pass each of the da's CTs too
- * @param token ???
+ * CTs are pinned with references taken under the DA lock, because prefetching sleeps.
  */
-static void __castle_da_foreach_tree(struct castle_double_array *da,
-                                     int (*fn)(struct castle_double_array *da,
-                                               struct castle_component_tree *ct,
-                                               int level_cnt,
-                                               void *token),
-                                     void *token)
+static void castle_da_trees_prefetch(struct castle_double_array *da)
 {
-    struct castle_component_tree *ct;
-    struct list_head *lh, *t;
-    int i, j;
+    struct castle_component_tree **cts, *ct;
+    struct list_head *l;
+    int i, nr, max;
 
-    for(i=0; i<MAX_DA_LEVEL; i++)
-    {
-        j = 0;
-        list_for_each_safe(lh, t, &da->levels[i].trees)
+    max = da->nr_trees;
+    if (max == 0)
+        return;
+    cts = castle_malloc(max * sizeof(struct castle_component_tree *), GFP_KERNEL);
+    if (!cts)
+        return;
+
+    nr = 0;
+    read_lock(&da->lock);
+    for (i = 0; i < MAX_DA_LEVEL; i++)
+        list_for_each(l, &da->levels[i].trees)
         {
-            ct = list_entry(lh, struct castle_component_tree, da_list);
-            if(fn(da, ct, j, token))
-                return;
-            j++;
+            if (nr >= max)
+                break;
+            ct = list_entry(l, struct castle_component_tree, da_list);
+            castle_ct_get(ct, 0);
+            cts[nr++] = ct;
         }
+    read_unlock(&da->lock);
+
+    for (i = 0; i < nr; i++)
+    {
+        castle_da_ct_prefetch(cts[i]);
+        castle_ct_put(cts[i], 0);
     }
+    castle_free(cts);
 }
 
-static void castle_da_foreach_tree(struct castle_double_array *da,
-                                   int (*fn)(struct castle_double_array *da,
-                                             struct castle_component_tree *ct,
-                                             int level_cnt,
-                                             void *token),
-                                   void *token)
+/**
+ * Start the merge threads of an inactive DA, without prefetching its trees.
+ *
+ * Used on its own by castle_double_array_destroy(), which only needs the merge threads
+ * running so that they exit and drop their DA references.
+ */
+static void __castle_da_merges_activate(struct castle_double_array *da)
 {
-    write_lock(&da->lock);
-    __castle_da_foreach_tree(da, fn, token);
-    write_unlock(&da->lock);
+    BUG_ON(!mutex_is_locked(&castle_da_activate_mutex));
+
+    clear_bit(DOUBLE_ARRAY_INACTIVE_BIT, &da->flags);
+    castle_da_merge_start(da, NULL);
 }
 
-static int castle_ct_hash_destroy_check(struct castle_component_tree *ct, void *ct_hash)
+/**
+ * Bring up a DA left inactive by castle_double_array_read().
+ *
+ * Inactive DAs serve requests (all their CTs, including full T0s, are in place), but
+ * their trees haven't been prefetched and their merge threads haven't been started yet.
+ * Starting the merge threads also resumes (deserialises) merges that were in progress
+ * at the last checkpoint.
+ *
+ * Called on attach, on DA compaction, from the first request (through
+ * castle_da_activate_work()) and from the background warm-up thread.
+ *
+ * @also castle_da_warmup_run()
+ */
+static void __castle_da_activate(struct castle_double_array *da)
 {
-    struct list_head *lh, *t;
-    int    err = 0;
+    BUG_ON(!mutex_is_locked(&castle_da_activate_mutex));
 
-    /* Only the global component tree should remain when we destroy DA hash. */
-    if(((unsigned long)ct_hash > 0) && !TREE_GLOBAL(ct->seq))
-    {
-        castle_printk(LOG_WARN, "Error: Found CT=%d not on any DA's list, it claims DA=%d\n",
-            ct->seq, ct->da);
-        err = -1;
-    }
+    castle_da_trees_prefetch(da);
+    __castle_da_merges_activate(da);
+    castle_printk(LOG_INFO, "Activated DA=%d\n", da->id);
+}
 
-   /* All CTs apart of global are expected to be on a DA list. */
-   if(!TREE_GLOBAL(ct->seq) && (ct->da_list.next == NULL))
-   {
-       castle_printk(LOG_WARN, "Error: CT=%d is not on DA list, for DA=%d\n",
-               ct->seq, ct->da);
-       err = -2;
-   }
+static void castle_da_activate(struct castle_double_array *da)
+{
+    if (likely(!castle_da_inactive(da)))
+        return;
 
-   if(TREE_GLOBAL(ct->seq) && (ct->da_list.next != NULL))
-   {
-       castle_printk(LOG_WARN, "Error: Global CT=%d is on DA list, for DA=%d\n",
-               ct->seq, ct->da);
-       err = -3;
-   }
+    mutex_lock(&castle_da_activate_mutex);
+    if (castle_da_inactive(da))
+        __castle_da_activate(da);
+    mutex_unlock(&castle_da_activate_mutex);
+}
 
-   /* Ref count should be 1 by now. */
-   if(atomic_read(&ct->ref_count) != 1)
-   {
+/**
+ * Activate a DA from process context, scheduled by castle_double_array_submit().
+ */
+static void castle_da_activate_work(struct work_struct *work)
+{
+    struct castle_double_array *da = container_of(work, struct castle_double_array,
+                                                  activate_work);
+
+    castle_da_activate(da);
+    /* castle_double_array_submit() took a reference for us. */
+    castle_da_put(da);
+}
+
+struct castle_da_warmup_entry {
+    c_da_t          id;
+    uint64_t        accesses;
+};
+
+struct castle_da_warmup_state {
+    struct castle_da_warmup_entry  *entries;
+    int                             nr;
+    int                             max;
+};
+
+static int castle_da_warmup_collect(struct castle_double_array *da, void *_state)
+{
+    struct castle_da_warmup_state *state = _state;
+
+    if (castle_da_inactive(da) && (state->nr < state->max))
+    {
+        state->entries[state->nr].id       = da->id;
+        state->entries[state->nr].accesses = atomic64_read(&da->accesses);
+        state->nr++;
+    }
+
+    return 0;
+}
+
+static int castle_da_warmup_cmp(const void *a, const void *b)
+{
+    const struct castle_da_warmup_entry *e1 = a, *e2 = b;
+
+    if (e1->accesses == e2->accesses)
+        return 0;
+    return (e1->accesses > e2->accesses) ? -1 : 1;
+}
+
+/**
+ * Activate inactive DAs in the background, most frequently accessed first.
+ *
+ * DAs are looked up by id under castle_da_activate_mutex, which castle_double_array_destroy()
+ * also holds while removing a DA from the hash.
+ */
+static int castle_da_warmup_run(void *unused)
+{
+    struct castle_da_warmup_state state;
+    struct castle_double_array *da;
+    int i, activated = 0;
+
+    state.nr      = 0;
+    state.max     = castle_da_count();
+    state.entries = castle_malloc(state.max * sizeof(struct castle_da_warmup_entry), GFP_KERNEL);
+    if (state.entries)
+    {
+        castle_da_hash_iterate(castle_da_warmup_collect, &state);
+        sort(state.entries, state.nr, sizeof(struct castle_da_warmup_entry),
+             castle_da_warmup_cmp, NULL);
+    }
+    else
+        state.nr = 0;
+
+    for (i = 0; (i < state.nr) && !kthread_should_stop(); i++)
+    {
+        int active = 1;
+
+        mutex_lock(&castle_da_activate_mutex);
+        da = castle_da_hash_get(state.entries[i].id);
+        if (da && castle_da_inactive(da))
+        {
+            __castle_da_activate(da);
+            active = 0;
+        }
+        mutex_unlock(&castle_da_activate_mutex);
+
+        /* Skip DAs destroyed or activated on demand in the meantime. */
+        if (active)
+            continue;
+        activated++;
+        msleep_interruptible(CASTLE_DA_WARMUP_DELAY);
+    }
+    castle_printk(LOG_INIT, "Activated %d of %d inactive DAs in the background.\n",
+            activated, state.nr);
+    if (state.entries)
+        castle_free(state.entries);
+
+    /* Wait for castle_double_array_merges_fini(). */
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop())
+    {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+
+    return 0;
+}
+
+/**
+ * Run fn() on each CT in the doubling array.
+ *
+ * @param da    Doubling array's CTs to enumerate
+ * @param fn    Function to pass each of the da's CTs too
+ * @param token ???
+ */
+static void __castle_da_foreach_tree(struct castle_double_array *da,
+                                     int (*fn)(struct castle_double_array *da,
+                                               struct castle_component_tree *ct,
+                                               int level_cnt,
+                                               void *token),
+                                     void *token)
+{
+    struct castle_component_tree *ct;
+    struct list_head *lh, *t;
+    int i, j;
+
+    for(i=0; i<MAX_DA_LEVEL; i++)
+    {
+        j = 0;
+        list_for_each_safe(lh, t, &da->levels[i].trees)
+        {
+            ct = list_entry(lh, struct castle_component_tree, da_list);
+            if(fn(da, ct, j, token))
+                return;
+            j++;
+        }
+    }
+}
+
+static void castle_da_foreach_tree(struct castle_double_array *da,
+                                   int (*fn)(struct castle_double_array *da,
+                                             struct castle_component_tree *ct,
+                                             int level_cnt,
+                                             void *token),
+                                   void *token)
+{
+    write_lock(&da->lock);
+    __castle_da_foreach_tree(da, fn, token);
+    write_unlock(&da->lock);
+}
+
+static int castle_ct_hash_destroy_check(struct castle_component_tree *ct, void *ct_hash)
+{
+    struct list_head *lh, *t;
+    int    err = 0;
+
+    /* Only the global component tree should remain when we destroy DA hash. */
+    if(((unsigned long)ct_hash > 0) && !TREE_GLOBAL(ct->seq))
+    {
+        castle_printk(LOG_WARN, "Error: Found CT=%d not on any DA's list, it claims DA=%d\n",
+            ct->seq, ct->da);
+        err = -1;
+    }
+
+   /* All CTs apart of global are expected to be on a DA list. */
+   if(!TREE_GLOBAL(ct->seq) && (ct->da_list.next == NULL))
+   {
+       castle_printk(LOG_WARN, "Error: CT=%d is not on DA list, for DA=%d\n",
+               ct->seq, ct->da);
+       err = -2;
+   }
+
+   if(TREE_GLOBAL(ct->seq) && (ct->da_list.next != NULL))
+   {
+       castle_printk(LOG_WARN, "Error: Global CT=%d is on DA list, for DA=%d\n",
+               ct->seq, ct->da);
+       err = -3;
+   }
+
+   /* Ref count should be 1 by now. */
+   if(atomic_read(&ct->ref_count) != 1)
+   {
        castle_printk(LOG_WARN, "Error: Bogus ref count=%d for ct=%d, da=%d when exiting.\n",
                atomic_read(&ct->ref_count), ct->seq, ct->da);
        err = -4;
@@ -7277,6 +7877,14 @@ static int castle_da_rwct_init(struct castle_double_array *da, void *unused)
     return 0;
 }
 
+static int castle_da_active_merge_start(struct castle_double_array *da, void *unused)
+{
+    if (!castle_da_inactive(da))
+        castle_da_merge_start(da, NULL);
+
+    return 0;
+}
+
 /**
  * Start existing doubling arrays.
  *
@@ -7287,9 +7895,24 @@ static int castle_da_rwct_init(struct castle_double_array *da, void *unused)
  */
 int castle_double_array_start(void)
 {
+    /* Wake up merge threads of active DAs read in by castle_double_array_read(). */
+    castle_da_hash_iterate(castle_da_active_merge_start, NULL);
+
     /* Check all DAs to see whether any merges need to be done. */
     castle_da_hash_iterate(castle_da_merge_restart, NULL);
 
+    /* Activate the remaining DAs in the background. */
+    if (castle_da_lazy_activation)
+    {
+        castle_da_warmup_thread = kthread_run(castle_da_warmup_run, NULL, "castle_da_warmup");
+        if (IS_ERR(castle_da_warmup_thread))
+        {
+            castle_printk(LOG_WARN, "Failed to start DA warm-up thread, "
+                    "DAs will be activated on first use.\n");
+            castle_da_warmup_thread = NULL;
+        }
+    }
+
     return 0;
 }
 
@@ -7323,6 +7946,51 @@ static int castle_da_ct_bloom_build_param_deserialise(struct castle_component_tr
     return 0;
 }
 
+struct castle_da_restore_state {
+    struct castle_double_array **das;
+    uint32_t                     nr;
+};
+
+static int castle_da_restore_collect(struct castle_double_array *da, void *_restore)
+{
+    struct castle_da_restore_state *restore = _restore;
+
+    restore->das[restore->nr++] = da;
+
+    return 0;
+}
+
+/**
+ * Finish restoring a DA after its component trees have been read in.
+ *
+ * - Called from castle_parallel_run(), concurrently for different DAs
+ *
+ * @also castle_double_array_read()
+ */
+static int castle_da_restore(int item, void *_das)
+{
+    struct castle_double_array *da = ((struct castle_double_array **)_das)[item];
+
+    /* DAs that need their T0s rebuilt (imported from a system with a different CPU count)
+       get activated straight away, so that inactive DAs can always take writes. */
+    if (castle_da_inactive(da) && (da->levels[0].nr_trees != castle_double_array_request_cpus()))
+    {
+        castle_da_trees_prefetch(da);
+        clear_bit(DOUBLE_ARRAY_INACTIVE_BIT, &da->flags);
+    }
+
+    /* Promote level 0 RWCTs if necessary. */
+    castle_da_level0_check_promote(da, NULL);
+    /* Sort all the tree lists by the sequence number */
+    castle_da_trees_sort(da, NULL);
+    /* Create T0 RWCTs if the DA doesn't have them (acquires lock). */
+    castle_da_rwct_init(da, NULL);
+    /* Reset driver merge. */
+    __castle_da_driver_merge_reset(da, NULL);
+
+    return 0;
+}
+
 /**
  * Read doubling arrays and serialised component trees in from disk.
  *
@@ -7338,8 +8006,11 @@ int castle_double_array_read(void)
     struct castle_mstore_iter *iterator = NULL;
     struct castle_component_tree *ct;
     struct castle_double_array *da;
+    struct castle_double_array **das;
+    struct castle_da_restore_state restore;
     c_mstore_key_t key;
     c_da_t da_id;
+    uint32_t nr_das;
     int ret = 0;
     castle_printk(LOG_DEBUG, "%s::start.\n", __FUNCTION__);
 
@@ -7367,6 +8038,10 @@ int castle_double_array_read(void)
         if(!da)
             goto error_out;
         castle_da_unmarshall(da, &mstore_dentry);
+        /* With lazy activation, CTs only get prefetched and merges only started once
+           the DA gets used, see castle_da_activate(). */
+        if (castle_da_lazy_activation)
+            set_bit(DOUBLE_ARRAY_INACTIVE_BIT, &da->flags);
         castle_da_hash_add(da);
         debug("Read DA id=%d\n", da->id);
         castle_next_da_id = (da->id >= castle_next_da_id) ? da->id + 1 : castle_next_da_id;
@@ -7426,6 +8101,7 @@ int castle_double_array_read(void)
         ct_da_id = castle_da_ct_unmarshall(des_da->levels[level].merge.serdes.out_tree,
                                         &des_da->levels[level].merge.serdes.mstore_entry->out_tree);
         BUG_ON(da_id != ct_da_id);
+        castle_da_ct_prefetch(des_da->levels[level].merge.serdes.out_tree);
         castle_ct_hash_add(des_da->levels[level].merge.serdes.out_tree);
         castle_printk(LOG_DEBUG, "%s::deserialising merge on da %d level %d with incomplete ct seq %d\n",
                 __FUNCTION__, da_id, level, des_da->levels[level].merge.serdes.out_tree->seq);
@@ -7475,6 +8151,8 @@ int castle_double_array_read(void)
         da = castle_da_hash_get(da_id);
         if(!da)
             goto error_out;
+        if (!castle_da_inactive(da))
+            castle_da_ct_prefetch(ct);
         debug("Read CT seq=%d\n", ct->seq);
         write_lock(&da->lock);
         castle_component_tree_add(da, ct, NULL /*head*/, 1 /*in_init*/);
@@ -7524,19 +8202,21 @@ int castle_double_array_read(void)
     castle_mstore_iterator_destroy(iterator);
     iterator = NULL;
 
-    /* Promote level 0 RWCTs if necessary. */
-    castle_da_hash_iterate(castle_da_level0_check_promote, NULL);
-    /* Sort all the tree lists by the sequence number */
-    castle_da_hash_iterate(castle_da_trees_sort, NULL);
-
-    /* Create T0 RWCTs for all DAs that don't have them (acquires lock).
-     * castle_da_rwct_init() wraps castle_da_rwcts_create() for hash_iter. */
-    __castle_da_hash_iterate(castle_da_rwct_init, NULL);
-
-    /* Reset driver merge for all DAs. */
-    castle_da_hash_iterate(__castle_da_driver_merge_reset, NULL);
-
-    castle_da_hash_iterate(castle_da_merge_start, NULL);
+    /* Finish restoring each DA. DAs are independent of each other, restore them in parallel.
+     * Merge threads get woken up from castle_double_array_start(), once versions are in. */
+    nr_das = castle_da_count();
+    if (nr_das)
+    {
+        das = castle_malloc(nr_das * sizeof(struct castle_double_array *), GFP_KERNEL);
+        if (!das)
+            goto error_out;
+        restore.das = das;
+        restore.nr  = 0;
+        __castle_da_hash_iterate(castle_da_restore_collect, &restore);
+        BUG_ON(restore.nr != nr_das);
+        castle_parallel_run(nr_das, num_online_cpus(), castle_da_restore, das, "castle_da_restore");
+        castle_free(das);
+    }
 
     goto out;
 
@@ -7610,6 +8290,7 @@ static struct castle_component_tree* castle_ct_alloc(struct castle_double_array
     ct->tree_ext_free.ext_id     = INVAL_EXT_ID;
     ct->data_ext_free.ext_id     = INVAL_EXT_ID;
     ct->bloom_exists    = 0;
+    ct->fence_index     = NULL;
 #ifdef CASTLE_PERF_DEBUG
     ct->bt_c2bsync_ns   = 0;
     ct->data_c2bsync_ns = 0;
@@ -8137,6 +8818,419 @@ static void castle_da_queue_kick(struct work_struct *work)
     }
 }
 
+/**** Row cache ****/
+
+#define CASTLE_DA_ROW_CACHE_HASH_SIZE   (4096)  /**< Must be a power of 2. */
+#define CASTLE_DA_ROW_CACHE_LOCKS       (256)   /**< Bucket locks, power of 2, buckets share them. */
+
+/**
+ * Cached result of a point get of key at version.
+ */
+struct castle_da_row_cache_entry
+{
+    struct list_head            hash_list;  /**< Hash bucket list.                          */
+    struct list_head            clock_list; /**< CLOCK ring, the hand is at the head.       */
+    atomic_t                    ref_cnt;    /**< One for the cache, one per copying reader. */
+    int                         referenced; /**< CLOCK reference bit.                       */
+    uint32_t                    hash;
+    uint32_t                    size;       /**< Bytes charged to the cache.                */
+    c_ver_t                     version;
+    c_val_tup_t                 cvt;        /**< Inline value (in data[]), tombstone or
+                                                 invalid for keys not found.                */
+    c_vl_bkey_t                *key;        /**< In data[], after the inline value.         */
+    uint8_t                     data[0];
+};
+
+/**
+ * Row cache counters updated on every get or write, kept per-CPU.
+ */
+struct castle_da_row_cache_cpu_stats
+{
+    local_t                     hits;
+    local_t                     misses;
+    local_t                     invalidations;
+};
+
+/**
+ * Per-DA cache of point get results, keyed by (key, version).
+ *
+ * Holds inline values, tombstones and misses, but not on-disk values: those are only
+ * valid while the CT holding them is, and merges would invalidate them.  Writes drop
+ * entries for the same key at the written version and all its descendants.  Gets which
+ * raced with an invalidation of their hash bucket don't fill the cache, see gens[].
+ *
+ * Hash buckets are protected by striped locks, the CLOCK ring and byte accounting by
+ * clock_lock, which nests inside bucket locks.  The CLOCK hand only trylocks the bucket
+ * of the entry it is about to evict.
+ */
+struct castle_da_row_cache
+{
+    spinlock_t                  clock_lock; /**< Protects the CLOCK ring and counters up to
+                                                 evictions.                                 */
+    struct list_head            clock;      /**< All entries, in CLOCK order.               */
+    uint64_t                    max_bytes;
+    uint64_t                    bytes;
+    uint64_t                    entries;
+    uint64_t                    inserts;
+    uint64_t                    evictions;
+    struct castle_da_row_cache_cpu_stats *stats;
+    spinlock_t                  locks[CASTLE_DA_ROW_CACHE_LOCKS];
+                                            /**< Protect hash buckets and their gens[].     */
+    uint32_t                    gens[CASTLE_DA_ROW_CACHE_HASH_SIZE];
+                                            /**< Bumped by invalidations of the bucket.     */
+    struct list_head            hash[CASTLE_DA_ROW_CACHE_HASH_SIZE];
+};
+
+static inline spinlock_t* castle_da_row_cache_lock(struct castle_da_row_cache *cache,
+                                                   uint32_t bucket)
+{
+    return &cache->locks[bucket & (CASTLE_DA_ROW_CACHE_LOCKS - 1)];
+}
+
+static struct castle_da_row_cache* castle_da_row_cache_alloc(uint64_t max_bytes)
+{
+    struct castle_da_row_cache *cache;
+    int i;
+
+    cache = castle_vmalloc(sizeof(struct castle_da_row_cache));
+    if (!cache)
+        return NULL;
+
+    memset(cache, 0, sizeof(struct castle_da_row_cache));
+    cache->stats = alloc_percpu(struct castle_da_row_cache_cpu_stats);
+    if (!cache->stats)
+    {
+        castle_vfree(cache);
+        return NULL;
+    }
+    spin_lock_init(&cache->clock_lock);
+    INIT_LIST_HEAD(&cache->clock);
+    cache->max_bytes = max_bytes;
+    for (i = 0; i < CASTLE_DA_ROW_CACHE_LOCKS; i++)
+        spin_lock_init(&cache->locks[i]);
+    for (i = 0; i < CASTLE_DA_ROW_CACHE_HASH_SIZE; i++)
+        INIT_LIST_HEAD(&cache->hash[i]);
+
+    return cache;
+}
+
+static void castle_da_row_cache_entry_put(struct castle_da_row_cache_entry *entry)
+{
+    if (atomic_dec_and_test(&entry->ref_cnt))
+        castle_free(entry);
+}
+
+/**
+ * Unlinks entry from the cache and drops the cache's reference to it.
+ *
+ * Both the bucket lock of the entry and the clock lock must be held.
+ *
+ * @also castle_da_row_cache_entry_put()
+ */
+static void __castle_da_row_cache_entry_drop(struct castle_da_row_cache *cache,
+                                             struct castle_da_row_cache_entry *entry)
+{
+    BUG_ON(!spin_is_locked(&cache->clock_lock));
+
+    list_del(&entry->hash_list);
+    list_del(&entry->clock_list);
+    cache->bytes -= entry->size;
+    cache->entries--;
+    castle_da_row_cache_entry_put(entry);
+}
+
+/**
+ * Drops all entries and invalidates any gets that are in flight.
+ */
+static void castle_da_row_cache_flush(struct castle_da_row_cache *cache)
+{
+    struct castle_da_row_cache_entry *entry, *t;
+    int i, bucket;
+
+    for (i = 0; i < CASTLE_DA_ROW_CACHE_LOCKS; i++)
+    {
+        spin_lock(&cache->locks[i]);
+        spin_lock(&cache->clock_lock);
+        for (bucket = i; bucket < CASTLE_DA_ROW_CACHE_HASH_SIZE; bucket += CASTLE_DA_ROW_CACHE_LOCKS)
+        {
+            list_for_each_entry_safe(entry, t, &cache->hash[bucket], hash_list)
+                __castle_da_row_cache_entry_drop(cache, entry);
+            cache->gens[bucket]++;
+        }
+        spin_unlock(&cache->clock_lock);
+        spin_unlock(&cache->locks[i]);
+    }
+}
+
+static void castle_da_row_cache_free(struct castle_da_row_cache *cache)
+{
+    castle_da_row_cache_flush(cache);
+    BUG_ON(cache->bytes || cache->entries);
+    free_percpu(cache->stats);
+    castle_vfree(cache);
+}
+
+/**
+ * Finds the entry for key at version.  Bucket lock must be held.
+ */
+static struct castle_da_row_cache_entry*
+__castle_da_row_cache_find(struct castle_da_row_cache *cache, void *key, uint32_t hash, c_ver_t version)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(RW_VLBA_TREE_TYPE);
+    struct castle_da_row_cache_entry *entry;
+
+    list_for_each_entry(entry, &cache->hash[hash & (CASTLE_DA_ROW_CACHE_HASH_SIZE - 1)], hash_list)
+        if ((entry->hash == hash) && (entry->version == version)
+                && (btree->key_compare(entry->key, key) == 0))
+            return entry;
+
+    return NULL;
+}
+
+/**
+ * Looks c_bvec's key up at c_bvec->version.
+ *
+ * On a miss c_bvec is marked so the result of the get fills the cache on completion,
+ * provided no write to the same hash bucket completes in the meantime.
+ *
+ * @param   cvt_p   Set to the cached result on a hit, inline values are copied and
+ *                  must be freed by the caller as for btree gets
+ *
+ * @return  1 on a hit, 0 otherwise
+ */
+static int castle_da_row_cache_get(struct castle_da_row_cache *cache,
+                                   c_bvec_t *c_bvec,
+                                   c_val_tup_t *cvt_p)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(RW_VLBA_TREE_TYPE);
+    struct castle_da_row_cache_entry *entry;
+    uint32_t hash, bucket;
+    spinlock_t *lock;
+    void *val;
+
+    hash = btree->key_hash(c_bvec->key, 0);
+    bucket = hash & (CASTLE_DA_ROW_CACHE_HASH_SIZE - 1);
+    lock = castle_da_row_cache_lock(cache, bucket);
+
+    spin_lock(lock);
+    entry = __castle_da_row_cache_find(cache, c_bvec->key, hash, c_bvec->version);
+    if (!entry)
+    {
+        c_bvec->row_cache_gen = cache->gens[bucket];
+        set_bit(CBV_ROW_CACHE_FILL, &c_bvec->flags);
+        spin_unlock(lock);
+        local_inc(&per_cpu_ptr(cache->stats, get_cpu())->misses);
+        put_cpu();
+        return 0;
+    }
+    /* Racy with the CLOCK hand clearing it, at worst the entry loses its second chance. */
+    entry->referenced = 1;
+    atomic_inc(&entry->ref_cnt);
+    spin_unlock(lock);
+    local_inc(&per_cpu_ptr(cache->stats, get_cpu())->hits);
+    put_cpu();
+
+    *cvt_p = entry->cvt;
+    if (CVT_INLINE(entry->cvt))
+    {
+        val = castle_malloc(entry->cvt.length, GFP_NOIO);
+        if (!val)
+        {
+            /* Do the get the normal way. */
+            castle_da_row_cache_entry_put(entry);
+            return 0;
+        }
+        memcpy(val, entry->cvt.val, entry->cvt.length);
+        cvt_p->val = val;
+    }
+    castle_da_row_cache_entry_put(entry);
+
+    return 1;
+}
+
+/**
+ * Evicts entries with the CLOCK algorithm until the cache fits in max_bytes.
+ *
+ * Bucket locks nest outside the clock lock, so entries whose bucket lock is contended
+ * are skipped.  The hand goes round the ring at most twice.
+ */
+static void castle_da_row_cache_evict(struct castle_da_row_cache *cache)
+{
+    struct castle_da_row_cache_entry *entry;
+    spinlock_t *lock;
+    uint64_t scan;
+
+    spin_lock(&cache->clock_lock);
+    for (scan = 2 * cache->entries;
+         (cache->bytes > cache->max_bytes) && (scan > 0) && !list_empty(&cache->clock);
+         scan--)
+    {
+        entry = list_first_entry(&cache->clock, struct castle_da_row_cache_entry, clock_list);
+        lock = castle_da_row_cache_lock(cache, entry->hash & (CASTLE_DA_ROW_CACHE_HASH_SIZE - 1));
+        if (entry->referenced || !spin_trylock(lock))
+        {
+            /* Second chance, advance the hand past it. */
+            entry->referenced = 0;
+            list_move_tail(&entry->clock_list, &cache->clock);
+            continue;
+        }
+        __castle_da_row_cache_entry_drop(cache, entry);
+        spin_unlock(lock);
+        cache->evictions++;
+    }
+    spin_unlock(&cache->clock_lock);
+}
+
+/**
+ * Inserts the result of a completed get into the DA's row cache, if c_bvec missed in
+ * the cache and the result is cacheable.
+ */
+static void castle_da_row_cache_fill(c_bvec_t *c_bvec, int err, c_val_tup_t cvt)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(RW_VLBA_TREE_TYPE);
+    struct castle_da_row_cache *cache;
+    struct castle_da_row_cache_entry *entry;
+    c_vl_bkey_t *key = c_bvec->key;
+    uint32_t val_len, size, bucket;
+    spinlock_t *lock;
+
+    if (!test_and_clear_bit(CBV_ROW_CACHE_FILL, &c_bvec->flags))
+        return;
+    if (err || (!CVT_INVALID(cvt) && !CVT_TOMB_STONE(cvt) && !CVT_INLINE(cvt)))
+        return;
+    /* The bit only gets set for DAs with a row cache. */
+    cache = castle_da_hash_get(c_bvec->tree->da)->row_cache;
+    BUG_ON(!cache);
+
+    val_len = CVT_INLINE_VAL_LENGTH(cvt);
+    size = sizeof(struct castle_da_row_cache_entry) + val_len + key->length + 4;
+    if (size > cache->max_bytes)
+        return;
+    entry = castle_malloc(size, GFP_NOIO);
+    if (!entry)
+        return;
+
+    atomic_set(&entry->ref_cnt, 1);
+    entry->referenced = 0;
+    entry->hash       = btree->key_hash(key, 0);
+    entry->size       = size;
+    entry->version    = c_bvec->version;
+    entry->cvt        = cvt;
+    if (CVT_INLINE(cvt))
+    {
+        memcpy(entry->data, cvt.val, val_len);
+        entry->cvt.val = entry->data;
+    }
+    entry->key = (c_vl_bkey_t *)(entry->data + val_len);
+    memcpy(entry->key, key, key->length + 4);
+    bucket = entry->hash & (CASTLE_DA_ROW_CACHE_HASH_SIZE - 1);
+    lock = castle_da_row_cache_lock(cache, bucket);
+
+    spin_lock(lock);
+    /* Don't insert if a write may have changed the result, or someone beat us to it. */
+    if ((cache->gens[bucket] != c_bvec->row_cache_gen)
+            || __castle_da_row_cache_find(cache, key, entry->hash, entry->version))
+    {
+        spin_unlock(lock);
+        castle_free(entry);
+        return;
+    }
+    list_add(&entry->hash_list, &cache->hash[bucket]);
+    spin_lock(&cache->clock_lock);
+    list_add_tail(&entry->clock_list, &cache->clock);
+    cache->bytes += size;
+    cache->entries++;
+    cache->inserts++;
+    spin_unlock(&cache->clock_lock);
+    spin_unlock(lock);
+
+    if (cache->bytes > cache->max_bytes)
+        castle_da_row_cache_evict(cache);
+}
+
+/**
+ * Drops entries for key at version and all its descendants, following a write.
+ */
+static void castle_da_row_cache_invalidate(struct castle_da_row_cache *cache,
+                                           void *key,
+                                           c_ver_t version)
+{
+    struct castle_btree_type *btree = castle_btree_type_get(RW_VLBA_TREE_TYPE);
+    struct castle_da_row_cache_entry *entry, *t;
+    uint32_t hash, bucket;
+    spinlock_t *lock;
+    int dropped = 0;
+
+    hash = btree->key_hash(key, 0);
+    bucket = hash & (CASTLE_DA_ROW_CACHE_HASH_SIZE - 1);
+    lock = castle_da_row_cache_lock(cache, bucket);
+
+    spin_lock(lock);
+    cache->gens[bucket]++;
+    list_for_each_entry_safe(entry, t, &cache->hash[bucket], hash_list)
+    {
+        if ((entry->hash != hash) || (btree->key_compare(entry->key, key) != 0))
+            continue;
+        if (!castle_version_is_ancestor(version, entry->version))
+            continue;
+        spin_lock(&cache->clock_lock);
+        __castle_da_row_cache_entry_drop(cache, entry);
+        spin_unlock(&cache->clock_lock);
+        dropped++;
+    }
+    spin_unlock(lock);
+
+    if (dropped)
+    {
+        local_add(dropped, &per_cpu_ptr(cache->stats, get_cpu())->invalidations);
+        put_cpu();
+    }
+}
+
+/**
+ * Gets row cache statistics for the DA, all zero if the DA has no row cache.
+ */
+void castle_da_row_cache_stats_get(struct castle_double_array *da, c_da_row_cache_stats_t *stats)
+{
+    struct castle_da_row_cache *cache = da->row_cache;
+    struct castle_da_row_cache_cpu_stats *cpu_stats;
+    int cpu;
+
+    memset(stats, 0, sizeof(c_da_row_cache_stats_t));
+    if (!cache)
+        return;
+
+    spin_lock(&cache->clock_lock);
+    stats->max_bytes     = cache->max_bytes;
+    stats->bytes         = cache->bytes;
+    stats->entries       = cache->entries;
+    stats->inserts       = cache->inserts;
+    stats->evictions     = cache->evictions;
+    spin_unlock(&cache->clock_lock);
+    for_each_possible_cpu(cpu)
+    {
+        cpu_stats = per_cpu_ptr(cache->stats, cpu);
+        stats->hits          += local_read(&cpu_stats->hits);
+        stats->misses        += local_read(&cpu_stats->misses);
+        stats->invalidations += local_read(&cpu_stats->invalidations);
+    }
+}
+
+/**
+ * Feed the latency of a completing bvec to the checkpoint ratelimit controller.
+ *
+ * @also castle_checkpoint_rate_adapt()
+ */
+static void castle_da_bvec_latency_record(c_bvec_t *c_bvec)
+{
+    struct timespec now;
+    int64_t ns;
+
+    getnstimeofday(&now);
+    ns = timespec_to_ns(&now) - timespec_to_ns(&c_bvec->submit_ts);
+    castle_checkpoint_latency_record(ns > 0 ? (unsigned int)min_t(int64_t, ns / 1000, UINT_MAX) : 0);
+}
+
 /**
  * This is the callback used to complete a btree read. It either:
  * - calls back to the client if the key sought for has been found
@@ -8174,6 +9268,8 @@ static void castle_da_ct_read_complete(c_bvec_t *c_bvec, int err, c_val_tup_t cv
         /* We've finished looking through all the trees. */
         if(!next_ct)
         {
+            castle_da_row_cache_fill(c_bvec, err, INVAL_VAL_TUP);
+            castle_da_bvec_latency_record(c_bvec);
             callback(c_bvec, err, INVAL_VAL_TUP);
             return;
         }
@@ -8186,11 +9282,206 @@ static void castle_da_ct_read_complete(c_bvec_t *c_bvec, int err, c_val_tup_t cv
         return;
     }
     debug_verbose("Finished with DA read, calling back.\n");
+    castle_da_row_cache_fill(c_bvec, err, cvt);
+    castle_da_bvec_latency_record(c_bvec);
 
     /* Don't release the ct reference in order to hold on to medium objects array, etc. */
     callback(c_bvec, err, cvt);
 }
 
+/**
+ * State for a get which probes all CT bloom filters up front.
+ *
+ * CTs are stored in search order (newest first), each with a reference held.  Once all
+ * probes have completed, btree lookups are issued in order on bloom-positive CTs only.
+ */
+struct castle_da_bloom_get
+{
+    c_bvec_t                           *c_bvec;
+    int                                 nr_cts;     /**< Number of CTs in cts[].                */
+    int                                 next;       /**< Next cts[] entry to look up.           */
+    int                                 truncated;  /**< More CTs exist beyond cts[].           */
+    atomic_t                            pending;    /**< Bloom probes outstanding.              */
+    struct castle_da_bloom_get_ct
+    {
+        struct castle_da_bloom_get     *get;        /**< Back pointer, for probe completions.   */
+        struct castle_component_tree   *ct;
+        int                             positive;   /**< Bloom says the key may be in ct.       */
+        c_bloom_probe_t                 probe;
+    } cts[0];
+};
+
+/**
+ * Drop references to all CTs in get except keep_ct and free it.
+ */
+static void castle_da_bloom_get_free(struct castle_da_bloom_get *get,
+                                     struct castle_component_tree *keep_ct)
+{
+    int i;
+
+    get->c_bvec->bloom_get = NULL;
+    for (i = 0; i < get->nr_cts; i++)
+        if (get->cts[i].ct != keep_ct)
+            castle_ct_put(get->cts[i].ct, 0);
+    castle_free(get);
+}
+
+/**
+ * Issue the btree lookup on the next bloom-positive CT, or finish the get.
+ *
+ * If the CT array was truncated, falls back to the sequential bloom/btree search
+ * from the last CT probed.
+ */
+static void castle_da_bloom_get_next(struct castle_da_bloom_get *get)
+{
+    c_bvec_t *c_bvec = get->c_bvec;
+    struct castle_component_tree *last_ct, *next_ct;
+
+    while (get->next < get->nr_cts && !get->cts[get->next].positive)
+        get->next++;
+
+    if (get->next < get->nr_cts)
+    {
+        c_bvec->tree = get->cts[get->next++].ct;
+        debug_verbose("Scheduling btree read in ct=%d\n", c_bvec->tree->seq);
+#ifdef CASTLE_BLOOM_FP_STATS
+        c_bvec->bloom_positive = c_bvec->tree->bloom_exists;
+#endif
+        castle_btree_submit(c_bvec);
+        return;
+    }
+
+    last_ct = get->cts[get->nr_cts - 1].ct;
+    next_ct = get->truncated ? castle_da_ct_next(last_ct) : NULL;
+    if (next_ct)
+    {
+        castle_da_bloom_get_free(get, NULL);
+        c_bvec->tree = next_ct;
+        c_bvec->submit_complete = castle_da_ct_read_complete;
+#ifdef CASTLE_BLOOM_FP_STATS
+        c_bvec->bloom_positive = 0;
+#endif
+        castle_bloom_submit(c_bvec);
+        return;
+    }
+
+    /* Not found in any CT.  Hold on to a CT reference, as for sequential gets. */
+    castle_da_bloom_get_free(get, last_ct);
+    c_bvec->tree = last_ct;
+    castle_da_row_cache_fill(c_bvec, 0, INVAL_VAL_TUP);
+    castle_da_bvec_latency_record(c_bvec);
+    c_bvec->orig_complete(c_bvec, 0, INVAL_VAL_TUP);
+}
+
+/**
+ * Btree read callback for gets with parallel bloom probes.
+ *
+ * Moves on to the next bloom-positive CT if the key wasn't found, otherwise calls
+ * back to the client holding a reference to the CT the value came from only.
+ */
+static void castle_da_bloom_get_read_complete(c_bvec_t *c_bvec, int err, c_val_tup_t cvt)
+{
+    struct castle_da_bloom_get *get = c_bvec->bloom_get;
+
+    BUG_ON(c_bvec_data_dir(c_bvec) != READ);
+    BUG_ON(atomic_read(&c_bvec->reserv_nodes));
+
+    if (CVT_INVALID(cvt) && !err)
+    {
+#ifdef CASTLE_BLOOM_FP_STATS
+        if (c_bvec->tree->bloom_exists && c_bvec->bloom_positive)
+        {
+            atomic64_inc(&c_bvec->tree->bloom.false_positives);
+            c_bvec->bloom_positive = 0;
+        }
+#endif
+        castle_da_bloom_get_next(get);
+        return;
+    }
+
+    castle_da_bloom_get_free(get, c_bvec->tree);
+    castle_da_row_cache_fill(c_bvec, err, cvt);
+    castle_da_bvec_latency_record(c_bvec);
+
+    /* Don't release the ct reference in order to hold on to medium objects array, etc. */
+    c_bvec->orig_complete(c_bvec, err, cvt);
+}
+
+/**
+ * Bloom probe completion.  The last probe to complete starts the btree lookups.
+ */
+static void castle_da_bloom_get_probe_end(c_bloom_probe_t *probe, int positive)
+{
+    struct castle_da_bloom_get_ct *get_ct = probe->private;
+    struct castle_da_bloom_get *get = get_ct->get;
+
+    get_ct->positive = positive;
+    if (atomic_dec_and_test(&get->pending))
+        castle_da_bloom_get_next(get);
+}
+
+/**
+ * Start a get by probing the bloom filters of all CTs in parallel.
+ *
+ * Takes references to all CTs in search order, starting with c_bvec->tree.
+ *
+ * @return  0       Get was started, c_bvec will be completed via orig_complete
+ * @return -ENOMEM  Couldn't allocate get state, caller should do a sequential get
+ */
+static int castle_da_bloom_get_start(struct castle_double_array *da, c_bvec_t *c_bvec)
+{
+    struct castle_da_bloom_get *get;
+    struct castle_component_tree *ct;
+    int i, max_cts;
+
+    /* Racy, but merges can only shrink the number of CTs we need.  The rest
+       get searched sequentially if there are more. */
+    max_cts = da->nr_trees + 1;
+    get = castle_malloc(sizeof(struct castle_da_bloom_get) + max_cts * sizeof(get->cts[0]),
+                        GFP_KERNEL);
+    if (!get)
+        return -ENOMEM;
+
+    get->c_bvec    = c_bvec;
+    get->next      = 0;
+    get->truncated = 0;
+    get->nr_cts    = 1;
+    get->cts[0].ct = c_bvec->tree;
+    while ((ct = castle_da_ct_next(get->cts[get->nr_cts - 1].ct)))
+    {
+        if (get->nr_cts == max_cts)
+        {
+            castle_ct_put(ct, 0);
+            get->truncated = 1;
+            break;
+        }
+        get->cts[get->nr_cts++].ct = ct;
+    }
+
+    c_bvec->bloom_get          = get;
+    c_bvec->submit_complete = castle_da_bloom_get_read_complete;
+
+    /* Extra reference on pending drops once all probes have been submitted. */
+    atomic_set(&get->pending, get->nr_cts + 1);
+    for (i = 0; i < get->nr_cts; i++)
+    {
+        c_bloom_probe_t *probe = &get->cts[i].probe;
+
+        get->cts[i].get      = get;
+        get->cts[i].positive = 0;
+        probe->ct      = get->cts[i].ct;
+        probe->key     = c_bvec->key;
+        probe->cpu     = c_bvec->cpu;
+        probe->end     = castle_da_bloom_get_probe_end;
+        probe->private = &get->cts[i];
+        castle_bloom_probe(probe);
+    }
+    if (atomic_dec_and_test(&get->pending))
+        castle_da_bloom_get_next(get);
+
+    return 0;
+}
+
 /**
  * This function implements the btree write callback. At the moment it is expected that
  * space to do the btree write was preallocated and -ENOSPC error code will never happen
@@ -8232,6 +9523,10 @@ static void castle_da_ct_write_complete(c_bvec_t *c_bvec, int err, c_val_tup_t c
     /* Release the preallocated space in the btree extent. */
     castle_double_array_unreserve(c_bvec);
     BUG_ON(CVT_MEDIUM_OBJECT(cvt) && (cvt.cep.ext_id != c_bvec->tree->data_ext_free.ext_id));
+    /* Replaces and removes change what gets see in this version and its descendants. */
+    if (da->row_cache && !err)
+        castle_da_row_cache_invalidate(da->row_cache, c_bvec->key, c_bvec->version);
+    castle_da_bvec_latency_record(c_bvec);
 
     /* Don't release the ct reference in order to hold on to medium objects array, etc. */
     callback(c_bvec, err, cvt);
@@ -8292,7 +9587,9 @@ insert:
  * Hand-off read request (bvec) to DA via bloom filter.
  *
  * - Get first CT for bvec (not necessarily a RWCT)
+ * - Complete from the DA row cache on a hit
  * - Configure callback handlers
+ * - Probe all CT bloom filters in parallel, if the DA has castle_da_parallel_blooms of them, or
  * - Pass off to the bloom layer
  *
  * @also castle_da_write_bvec_start()
@@ -8300,6 +9597,8 @@ insert:
  */
 static void castle_da_read_bvec_start(struct castle_double_array *da, c_bvec_t *c_bvec)
 {
+    c_val_tup_t cvt;
+
     debug_verbose("Doing DA read for da_id=%d\n", da_id);
     BUG_ON(c_bvec_data_dir(c_bvec) != READ);
 
@@ -8311,11 +9610,26 @@ static void castle_da_read_bvec_start(struct castle_double_array *da, c_bvec_t *
         return;
     }
 
+    /* Serve from the row cache if possible.  The CT reference is kept, as for btree gets. */
+    clear_bit(CBV_ROW_CACHE_FILL, &c_bvec->flags);
+    if (da->row_cache && castle_da_row_cache_get(da->row_cache, c_bvec, &cvt))
+    {
+        castle_da_bvec_latency_record(c_bvec);
+        c_bvec->submit_complete(c_bvec, 0, cvt);
+        return;
+    }
+
     c_bvec->orig_complete   = c_bvec->submit_complete;
     c_bvec->submit_complete = castle_da_ct_read_complete;
 
     debug_verbose("Looking up in ct=%d\n", c_bvec->tree->seq);
 
+    /* Probe all bloom filters up front if the DA has enough of them, otherwise one tree at
+       a time (gets that hit in an early CT then don't read the blooms of the rest). */
+    if (castle_da_parallel_blooms && (da->nr_bloom_trees >= castle_da_parallel_blooms) &&
+            (castle_da_bloom_get_start(da, c_bvec) == 0))
+        return;
+
     /* Submit via bloom filter. */
 #ifdef CASTLE_BLOOM_FP_STATS
     c_bvec->bloom_positive = 0;
@@ -8345,15 +9659,31 @@ void castle_double_array_submit(c_bvec_t *c_bvec)
     struct castle_double_array *da;
     c_da_t da_id;
 
+    /* Foreground request, warm cache prefetch would just get in its way. */
+    castle_cache_warm_foreground_io();
+
     down_read(&att->lock);
     /* Since the version is attached, it must be found */
     BUG_ON(castle_version_read(att->version, &da_id, NULL, NULL, NULL, NULL));
+    /* Set again by the btree walk, but row cache lookups need it before then. */
+    c_bvec->version = att->version;
     up_read(&att->lock);
 
     da = castle_da_hash_get(da_id);
     BUG_ON(!da);
     /* orig_complete should be null it is for our privte use */
     BUG_ON(c_bvec->orig_complete);
+    getnstimeofday(&c_bvec->submit_ts);
+
+    atomic64_inc(&da->accesses);
+    /* First request to an inactive DA, activate it from process context. The attachment
+       keeps the DA alive, so this can't be the last reference to it. */
+    if (unlikely(castle_da_inactive(da)))
+    {
+        castle_da_get(da);
+        if (!queue_work(castle_da_wqs[0], &da->activate_work))
+            castle_da_put(da);
+    }
 
     /* Start the read bvecs without any queueing. */
     if(c_bvec_data_dir(c_bvec) == READ)
@@ -8593,6 +9923,14 @@ void castle_double_array_merges_fini(void)
 {
     int deleted_das;
 
+    /* Stop activating DAs. */
+    if (castle_da_warmup_thread)
+    {
+        kthread_stop(castle_da_warmup_thread);
+        castle_da_warmup_thread = NULL;
+    }
+    flush_workqueue(castle_da_wqs[0]);
+
     castle_da_exiting = 1;
     del_singleshot_timer_sync(&throttle_timer);
     /* This is happening at the end of execution. No need for the hash lock. */
@@ -8656,6 +9994,9 @@ void castle_da_destroy_complete(struct castle_double_array *da)
     /* Delete the DA from the list of deleted DAs. */
     list_del(&da->hash_list);
 
+    /* Drop cache quota of the DA. */
+    castle_cache_da_partition_release(da->id);
+
     /* Dealloc the DA. */
     castle_da_dealloc(da);
 }
@@ -8713,6 +10054,10 @@ int castle_double_array_get(c_da_t da_id)
 out:
     read_unlock_irqrestore(&castle_da_hash_lock, flags);
 
+    /* Collections reattached while restoring the fs don't count as use. */
+    if (da && castle_fs_inited)
+        castle_da_activate(da);
+
     return (da == NULL ? -EINVAL : 0);
 }
 
@@ -8743,6 +10088,7 @@ int castle_double_array_compact(c_da_t da_id)
         return -EINVAL;
 
     castle_printk(LOG_USERINFO, "Marking version tree %u for compaction.\n", da_id);
+    castle_da_activate(da);
     castle_da_need_compaction_set(da);
 
     wake_up(&da->merge_waitq);
@@ -8756,6 +10102,10 @@ int castle_double_array_destroy(c_da_t da_id)
     unsigned long flags;
     int ret;
 
+    /* Holding castle_da_activate_mutex while removing the DA from the hash keeps the
+       warm-up thread from activating it after it's gone. */
+    mutex_lock(&castle_da_activate_mutex);
+
     write_lock_irqsave(&castle_da_hash_lock, flags);
     da = __castle_da_hash_get(da_id);
     /* Fail if we cannot find the da in the hash. */
@@ -8783,6 +10133,11 @@ int castle_double_array_destroy(c_da_t da_id)
 
     castle_sysfs_da_del(da);
 
+    /* Merge threads have to be running to exit and drop their references. There is no
+       point prefetching trees that are about to go away. */
+    if (castle_da_inactive(da))
+        __castle_da_merges_activate(da);
+
     castle_printk(LOG_USERINFO, "Marking DA %u for deletion\n", da_id);
     /* Set the destruction bit, which will stop further merges. */
     castle_da_deleted_set(da);
@@ -8790,6 +10145,7 @@ int castle_double_array_destroy(c_da_t da_id)
     castle_da_merge_restart(da, NULL);
     /* Add it to the list of deleted DAs. */
     list_add(&da->hash_list, &castle_deleted_das);
+    mutex_unlock(&castle_da_activate_mutex);
     /* Put the (usually) last reference to the DA. */
     castle_da_put_locked(da);
 
@@ -8797,6 +10153,7 @@ int castle_double_array_destroy(c_da_t da_id)
 
 err_out:
     write_unlock_irqrestore(&castle_da_hash_lock, flags);
+    mutex_unlock(&castle_da_activate_mutex);
     return ret;
 }
 
@@ -54,6 +54,18 @@ int  castle_ct_large_obj_remove (c_ext_id_t              ext_id,
                                  struct mutex           *mutex);
 void castle_da_version_delete   (c_da_t da_id);
 
+typedef struct castle_da_row_cache_stats {
+    uint64_t                   max_bytes;       /**< Configured size, 0 if disabled.              */
+    uint64_t                   bytes;
+    uint64_t                   entries;
+    uint64_t                   hits;
+    uint64_t                   misses;
+    uint64_t                   inserts;
+    uint64_t                   evictions;
+    uint64_t                   invalidations;   /**< Entries dropped by writes.                   */
+} c_da_row_cache_stats_t;
+void castle_da_row_cache_stats_get(struct castle_double_array *da, c_da_row_cache_stats_t *stats);
+
 uint32_t castle_da_count(void);
 void castle_da_threads_priority_set(int nice_value);
 #endif /* __CASTLE_DA_H__ */
@@ -1492,6 +1492,9 @@ static void _castle_extent_free(void *data)
     /* Drop 'extent exists' reference on c2b dirtytree. */
     castle_extent_dirtytree_put(ext->dirtytree);
 
+    /* Drop compressed copies of the extent's blocks, they can never be read again. */
+    castle_cache_ztier_extent_drop(ext_id);
+
     debug("Completed deleting ext: %lld\n", ext_id);
 
     castle_extents_sb->nr_exts--;
@@ -2997,3 +3000,19 @@ c_ext_type_t castle_extent_type_get(c_ext_id_t ext_id)
     return ext->ext_type;
 }
 
+c_da_t castle_extent_da_get(c_ext_id_t ext_id)
+{
+    c_ext_t *ext;
+    ext = castle_extents_hash_get(ext_id);
+    if(!ext) return INVAL_DA;
+    return ext->da_id;
+}
+
+c_rda_type_t castle_extent_rda_type_get(c_ext_id_t ext_id)
+{
+    c_ext_t *ext;
+    ext = castle_extents_hash_get(ext_id);
+    if(!ext) return NR_RDA_SPECS;
+    return ext->type;
+}
+
@@ -11,7 +11,8 @@
  */
 typedef struct castle_extent_dirtytree {
     c_ext_id_t          ext_id;     /**< Extent ID this dirtylist describes.        */
-    spinlock_t          lock;       /**< Protects count, rb_root.                   */
+    spinlock_t          lock;       /**< Protects nr_pages, rb_root.                */
+    int                 nr_pages;   /**< Pages in dirty c2bs in rb_root.            */
     atomic_t            ref_cnt;    /**< References to this dirtylist.              */
     struct rb_root      rb_root;    /**< RB-tree of dirty c2bs.                     */
     struct list_head    list;       /**< Position on castle_cache_extent_dirtylist. */
@@ -68,5 +69,7 @@ int                 castle_extents_slave_scan               (uint32_t uuid);
 void                castle_extent_micro_ext_update          (struct castle_slave *cs);
 signed int          castle_extent_ref_cnt_get               (c_ext_id_t);
 c_ext_type_t        castle_extent_type_get                  (c_ext_id_t);
+c_da_t              castle_extent_da_get                    (c_ext_id_t);
+c_rda_type_t        castle_extent_rda_type_get              (c_ext_id_t);
 
 #endif /* __CASTLE_EXTENT_H__ */
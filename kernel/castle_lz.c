@@ -0,0 +1,188 @@
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/errno.h>
+#include "castle.h"
+#include "castle_lz.h"
+
+/* Each sequence is: token (4 bits literal length, 4 bits match length - MIN_MATCH),
+   optional literal length bytes, literals, 2 byte LE offset, optional match length
+   bytes.  Length bytes are only present if the token field is 15, and continue
+   while they equal 255.  The last sequence consists of literals only. */
+#define CASTLE_LZ_MIN_MATCH             4
+#define CASTLE_LZ_LAST_LITERALS         5   /**< Last bytes are always literals.            */
+#define CASTLE_LZ_MFLIMIT               12  /**< No match may start in the last bytes.      */
+#define CASTLE_LZ_MAX_DISTANCE          65535
+#define CASTLE_LZ_SKIP_SHIFT            6   /**< Speed up over incompressible data.         */
+
+static inline uint32_t castle_lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t castle_lz_hash(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - CASTLE_LZ_HASH_LOG);
+}
+
+static inline uint8_t* castle_lz_len_put(uint8_t *op, int len)
+{
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+
+    return op;
+}
+
+static inline uint8_t* castle_lz_literals_put(uint8_t *op, const uint8_t *lit, int len, int mlen)
+{
+    uint8_t *token = op++;
+
+    *token = (min(len, 15) << 4) | min(mlen, 15);
+    if (len >= 15)
+        op = castle_lz_len_put(op, len - 15);
+    memcpy(op, lit, len);
+
+    return op + len;
+}
+
+/**
+ * Compress src_len bytes from src into dst.
+ *
+ * @param wrkmem    CASTLE_LZ_WRKMEM_SIZE bytes of scratch space
+ *
+ * @return Compressed length, 0 if the result doesn't fit into dst_cap bytes.
+ */
+int castle_lz_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap, void *wrkmem)
+{
+    uint32_t *table = wrkmem;
+    const uint8_t *ip = src, *anchor = src, *ref, *mstart;
+    const uint8_t *iend = src + src_len;
+    const uint8_t *mflimit = iend - CASTLE_LZ_MFLIMIT;
+    const uint8_t *mlimit = iend - CASTLE_LZ_LAST_LITERALS;
+    uint8_t *op = dst, *oend = dst + dst_cap;
+    uint32_t seq, h, off;
+    int lit, mlen;
+
+    memset(table, 0, CASTLE_LZ_WRKMEM_SIZE);
+    if (src_len > CASTLE_LZ_MFLIMIT)
+    {
+        /* First byte can't match anything. */
+        ip++;
+        while (ip < mflimit)
+        {
+            seq = castle_lz_read32(ip);
+            h = castle_lz_hash(seq);
+            ref = src + table[h];
+            table[h] = ip - src;
+            if ((ref >= ip) || (ip - ref > CASTLE_LZ_MAX_DISTANCE) ||
+                    (castle_lz_read32(ref) != seq))
+            {
+                ip += 1 + ((ip - anchor) >> CASTLE_LZ_SKIP_SHIFT);
+                continue;
+            }
+
+            /* Extend the match backwards, then forwards. */
+            while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1]))
+            {
+                ip--;
+                ref--;
+            }
+            off = ip - ref;
+            mstart = ip;
+            ip  += CASTLE_LZ_MIN_MATCH;
+            ref += CASTLE_LZ_MIN_MATCH;
+            while ((ip < mlimit) && (*ip == *ref))
+            {
+                ip++;
+                ref++;
+            }
+
+            lit  = mstart - anchor;
+            mlen = ip - mstart - CASTLE_LZ_MIN_MATCH;
+            if (op + 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 > oend)
+                return 0;
+            op = castle_lz_literals_put(op, anchor, lit, mlen);
+            *op++ = off & 0xff;
+            *op++ = off >> 8;
+            if (mlen >= 15)
+                op = castle_lz_len_put(op, mlen - 15);
+            anchor = ip;
+        }
+    }
+
+    /* Trailing literals. */
+    lit = iend - anchor;
+    if (op + 1 + lit + lit / 255 + 1 > oend)
+        return 0;
+    op = castle_lz_literals_put(op, anchor, lit, 0);
+
+    return op - dst;
+}
+
+/**
+ * Decompress src into exactly dst_len bytes at dst.
+ *
+ * All input is bounds checked, corrupt input cannot overrun dst.
+ *
+ * @return 0 on success, -EINVAL if src is corrupt or doesn't decompress to dst_len bytes
+ */
+int castle_lz_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_len)
+{
+    const uint8_t *ip = src, *iend = src + src_len;
+    uint8_t *op = dst, *oend = dst + dst_len, *ref;
+    unsigned int token, len, off, b;
+
+    while (ip < iend)
+    {
+        token = *ip++;
+
+        /* Literals. */
+        len = token >> 4;
+        if (len == 15)
+            do {
+                if (ip >= iend)
+                    return -EINVAL;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        if ((len > iend - ip) || (len > oend - op))
+            return -EINVAL;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        /* Last sequence has no match. */
+        if (ip == iend)
+            break;
+
+        /* Match. */
+        if (iend - ip < 2)
+            return -EINVAL;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((off == 0) || (off > op - dst))
+            return -EINVAL;
+        len = token & 15;
+        if (len == 15)
+            do {
+                if (ip >= iend)
+                    return -EINVAL;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        len += CASTLE_LZ_MIN_MATCH;
+        if (len > oend - op)
+            return -EINVAL;
+        /* Byte copy, the match may overlap the output. */
+        ref = op - off;
+        while (len--)
+            *op++ = *ref++;
+    }
+
+    return (op == oend) ? 0 : -EINVAL;
+}
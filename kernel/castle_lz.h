@@ -0,0 +1,14 @@
+#ifndef __CASTLE_LZ_H__
+#define __CASTLE_LZ_H__
+
+/* Fast LZ77 block compressor, using the LZ4 block layout.  Used for the compressed
+   cache tier, where compression speed matters far more than ratio. */
+#define CASTLE_LZ_HASH_LOG              12
+#define CASTLE_LZ_WRKMEM_SIZE           ((1 << CASTLE_LZ_HASH_LOG) * sizeof(uint32_t))
+/* Worst case compressed size of _len bytes. */
+#define castle_lz_bound(_len)           ((_len) + (_len) / 255 + 16)
+
+int     castle_lz_compress(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap, void *wrkmem);
+int     castle_lz_decompress(const uint8_t *src, int src_len, uint8_t *dst, int dst_len);
+
+#endif /* __CASTLE_LZ_H__ */
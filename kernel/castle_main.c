@@ -474,6 +474,72 @@ static struct castle_slave *castle_slave_ghost_add(uint32_t uuid)
 
 extern atomic_t current_rebuild_seqno;
 
+/**
+ * Filesystem restore phases, timed by castle_fs_init().
+ *
+ * Versions, doubling arrays (with their component trees, bloom filter build parameters
+ * and large objects) and stats only depend on extents, so they get restored in parallel.
+ * Attachments need versions and DAs, disk check needs everything.
+ */
+enum {
+    CASTLE_FS_PHASE_EXTENTS = 0,
+    CASTLE_FS_PHASE_VERSIONS,
+    CASTLE_FS_PHASE_DOUBLE_ARRAYS,
+    CASTLE_FS_PHASE_STATS,
+    CASTLE_FS_PHASE_ATTACHMENTS,
+    CASTLE_FS_PHASE_CHK_DISK,
+    CASTLE_FS_PHASES,
+};
+#define CASTLE_FS_PARALLEL_PHASES   (CASTLE_FS_PHASE_STATS - CASTLE_FS_PHASE_VERSIONS + 1)
+
+static struct {
+    char           *name;
+    int           (*restore)(void);     /**< Restore function, NULL if run in line.   */
+    unsigned int    msecs;              /**< Time spent in the phase at last mount.   */
+} castle_fs_phases[CASTLE_FS_PHASES] = {
+    [CASTLE_FS_PHASE_EXTENTS]       = {"extents",       NULL,                       0},
+    [CASTLE_FS_PHASE_VERSIONS]      = {"versions",      castle_versions_read,       0},
+    [CASTLE_FS_PHASE_DOUBLE_ARRAYS] = {"double_arrays", castle_double_array_read,   0},
+    [CASTLE_FS_PHASE_STATS]         = {"stats",         castle_stats_read,          0},
+    [CASTLE_FS_PHASE_ATTACHMENTS]   = {"attachments",   castle_attachments_read,    0},
+    [CASTLE_FS_PHASE_CHK_DISK]      = {"chk_disk",      castle_chk_disk,            0},
+};
+static unsigned int castle_fs_init_msecs = 0;   /**< Total castle_fs_init() time.         */
+
+static int castle_fs_phase_run(int phase, int (*fn)(void))
+{
+    unsigned long start = jiffies;
+    int ret;
+
+    ret = fn();
+    castle_fs_phases[phase].msecs += jiffies_to_msecs(jiffies - start);
+
+    return ret;
+}
+
+static int castle_fs_parallel_phase_run(int item, void *unused)
+{
+    int phase = CASTLE_FS_PHASE_VERSIONS + item;
+
+    return castle_fs_phase_run(phase, castle_fs_phases[phase].restore);
+}
+
+/**
+ * Print restore phase timings of the last castle_fs_init() into a sysfs buffer.
+ */
+ssize_t castle_fs_phases_print(char *buf)
+{
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < CASTLE_FS_PHASES; i++)
+        len += sprintf(buf + len, "%s: %u ms\n",
+                castle_fs_phases[i].name, castle_fs_phases[i].msecs);
+    len += sprintf(buf + len, "total: %u ms\n", castle_fs_init_msecs);
+
+    return len;
+}
+
 #define MAX_VERSION -1
 int castle_fs_init(void)
 {
@@ -484,6 +550,7 @@ int castle_fs_init(void)
     int      i, last;
     uint32_t slave_count=0, nr_fs_slaves=0, nr_live_slaves=0, need_rebuild=0;
     uint32_t bcv=0, max=0, last_version_checked=MAX_VERSION;
+    unsigned long start = jiffies;
 
     castle_printk(LOG_INIT, "Castle FS start.\n");
     if(castle_fs_inited)
@@ -769,8 +836,12 @@ int castle_fs_init(void)
     if(first) castle_fs_superblocks_init();
     else      castle_fs_superblocks_load(&fs_sb);
 
+    for (i = 0; i < CASTLE_FS_PHASES; i++)
+        castle_fs_phases[i].msecs = 0;
+
     /* Load extent structures of logical extents into memory */
-    ret = first ? castle_extents_create() : castle_extents_read();
+    ret = first ? castle_extents_create()
+                : castle_fs_phase_run(CASTLE_FS_PHASE_EXTENTS, castle_extents_read);
     if (ret)
     {
         if (ret == -ENOSPC)
@@ -781,7 +852,8 @@ int castle_fs_init(void)
     }
 
     /* Load all extents into memory. */
-    if (!first && (ret = castle_extents_read_complete()))
+    if (!first && (ret = castle_fs_phase_run(CASTLE_FS_PHASE_EXTENTS,
+                                             castle_extents_read_complete)))
         return ret;
 
     /* If first is still true, we've not found a single non-new cs.
@@ -847,25 +919,25 @@ int castle_fs_init(void)
     memcpy(cs_fs_sb, &fs_sb, sizeof(struct castle_fs_superblock));
     castle_fs_superblocks_put(cs_fs_sb, 1);
 
-    /* Read versions in. */
-    if (!first && (ret = castle_versions_read()))
-        return ret;
-
-    /* Read doubling arrays and component trees in. */
-    ret = first ? castle_double_array_create() : castle_double_array_read();
+    /* Read versions, doubling arrays (and component trees) and stats in, in parallel. */
+    if (!first)
+        ret = castle_parallel_run(CASTLE_FS_PARALLEL_PHASES,
+                                  CASTLE_FS_PARALLEL_PHASES,
+                                  castle_fs_parallel_phase_run,
+                                  NULL,
+                                  "castle_restore");
+    else
+        ret = castle_double_array_create();
     if (ret) return ret;
 
     /* Read Collection Attachments. */
-    if (!first && (ret = castle_attachments_read()))
-        return ret;
-
-    /* Read stats in. */
-    if (!first && (ret = castle_stats_read()))
+    if (!first && (ret = castle_fs_phase_run(CASTLE_FS_PHASE_ATTACHMENTS,
+                                             castle_attachments_read)))
         return ret;
 
     FAULT(FS_INIT_FAULT);
 
-    if (!first && (ret = castle_chk_disk()))
+    if (!first && (ret = castle_fs_phase_run(CASTLE_FS_PHASE_CHK_DISK, castle_chk_disk)))
     {
         castle_printk(LOG_ERROR, "Failed to bring-up sane FS from disks\n");
         return ret;
@@ -883,7 +955,22 @@ int castle_fs_init(void)
 
     castle_events_init();
 
-    castle_printk(LOG_INIT, "Castle FS started.\n");
+    /* Read the warm cache list before any checkpoint gets to overwrite it. */
+    if (!first)
+        castle_cache_warm_start();
+
+    castle_cache_l2_start();
+
+    castle_fs_init_msecs = jiffies_to_msecs(jiffies - start);
+    castle_printk(LOG_INIT, "Castle FS started in %ums (extents %ums, versions %ums, "
+            "double arrays %ums, stats %ums, attachments %ums, disk check %ums).\n",
+            castle_fs_init_msecs,
+            castle_fs_phases[CASTLE_FS_PHASE_EXTENTS].msecs,
+            castle_fs_phases[CASTLE_FS_PHASE_VERSIONS].msecs,
+            castle_fs_phases[CASTLE_FS_PHASE_DOUBLE_ARRAYS].msecs,
+            castle_fs_phases[CASTLE_FS_PHASE_STATS].msecs,
+            castle_fs_phases[CASTLE_FS_PHASE_ATTACHMENTS].msecs,
+            castle_fs_phases[CASTLE_FS_PHASE_CHK_DISK].msecs);
     castle_fs_inited = 1;
 
     castle_extents_rebuild_startup_check(need_rebuild);
@@ -922,7 +1009,8 @@ static int castle_slave_superblock_validate(struct castle_slave *cs,
     if(cs_sb->pub.magic1 != CASTLE_SLAVE_MAGIC1) return -1;
     if(cs_sb->pub.magic2 != CASTLE_SLAVE_MAGIC2) return -2;
     if(cs_sb->pub.magic3 != CASTLE_SLAVE_MAGIC3) return -3;
-    if(cs_sb->pub.version != CASTLE_SLAVE_VERSION) return -4;
+    if((cs_sb->pub.version < CASTLE_SLAVE_VERSION_OLDEST) ||
+       (cs_sb->pub.version > CASTLE_SLAVE_VERSION)) return -4;
     if(!(cs_sb->pub.flags & CASTLE_SLAVE_NEWDEV) && (cs_sb->fs_version == 0))
         return -5;
 
@@ -2479,6 +2567,7 @@ static void __exit castle_exit(void)
     castle_sysfs_fini();
     FAULT(FINI_FAULT);
     /* Now, make sure no more IO can be made, internally or externally generated */
+    castle_cache_warm_fini();           /* Completes warm cache prefetch i/o. */
     castle_double_array_merges_fini();  /* Completes all internal i/o - merges. */
     castle_extents_rebuild_fini();
     castle_checkpoint_fini();
@@ -283,6 +283,372 @@ int castle_object_btree_key_compare(c_vl_bkey_t *key1, c_vl_bkey_t *key2)
     return 0;
 }
 
+/**
+ * Length of the common prefix of the first dimensions of two btree keys.
+ *
+ * @return 0 if either first dimension is infinite
+ */
+uint32_t castle_object_btree_key_dim0_common(c_vl_bkey_t *key1, c_vl_bkey_t *key2)
+{
+    uint32_t len, i;
+    char *dim1, *dim2;
+
+    if ((castle_object_btree_key_dim_flags_get(key1, 0) |
+         castle_object_btree_key_dim_flags_get(key2, 0)) &
+        (KEY_DIMENSION_MINUS_INFINITY_FLAG | KEY_DIMENSION_PLUS_INFINITY_FLAG))
+        return 0;
+
+    len  = min(castle_object_btree_key_dim_length(key1, 0),
+               castle_object_btree_key_dim_length(key2, 0));
+    dim1 = castle_object_btree_key_dim_get(key1, 0);
+    dim2 = castle_object_btree_key_dim_get(key2, 0);
+    for (i = 0; (i < len) && (dim1[i] == dim2[i]); i++);
+
+    return i;
+}
+
+/**
+ * Order-preserving 64-bit prefix of a btree key, relative to a reference key.
+ *
+ * If key1 < key2 then prefix(key1) <= prefix(key2), for the same ref and skip.  Keys with
+ * a different number of dimensions than ref, or whose first dimension does not start with
+ * the first skip bytes of ref's, map to 0 or ~0.  Others map to the 7 bytes of the first
+ * dimension following those skip bytes.
+ *
+ * @param key   Key to compute the prefix of
+ * @param ref   Reference key, shares skip bytes of the first dimension with keys in a node
+ * @param skip  Number of leading bytes of the first dimension to skip
+ *
+ * @also castle_object_btree_key_compare()
+ */
+uint64_t castle_object_btree_key_prefix(c_vl_bkey_t *key, c_vl_bkey_t *ref, uint32_t skip)
+{
+    uint32_t len, flags, i;
+    uint64_t prefix;
+    uint8_t *dim;
+    int cmp;
+
+    if (key->nr_dims != ref->nr_dims)
+        return key->nr_dims < ref->nr_dims ? 0 : ~0ULL;
+
+    flags = castle_object_btree_key_dim_flags_get(key, 0);
+    if (flags & KEY_DIMENSION_PLUS_INFINITY_FLAG)
+        return ~0ULL;
+    len = (flags & KEY_DIMENSION_MINUS_INFINITY_FLAG) ?
+            0 : castle_object_btree_key_dim_length(key, 0);
+    dim = (uint8_t *)castle_object_btree_key_dim_get(key, 0);
+
+    /* Keys not sharing the skipped bytes sort before or after all those that do. */
+    cmp = memcmp(dim, castle_object_btree_key_dim_get(ref, 0), min(len, skip));
+    if ((cmp < 0) || ((cmp == 0) && (len < skip)))
+        return 0;
+    if (cmp > 0)
+        return ~0ULL;
+
+    prefix = 1;
+    for (i = skip; i < skip + 7; i++)
+        prefix = (prefix << 8) | (i < len ? dim[i] : 0);
+
+    return prefix;
+}
+
+/*
+ * Normalised keys.
+ *
+ * Btree keys are encoded into byte strings which compare (with memcmp, shorter string
+ * being smaller if it is a prefix of the other) exactly as castle_object_btree_key_compare()
+ * compares the keys:
+ *  - number of dimensions, 4 bytes big endian,
+ *  - each dimension, in order:
+ *      -inf:       00 01         (00 02 with NEXT flag)
+ *      +inf:       FF FF 01      (FF FF 02 with NEXT flag)
+ *      otherwise:  dimension bytes, with 00 escaped as 00 FF and FF as FF 00,
+ *                  terminated by 00 03 (00 04 with NEXT flag)
+ *
+ * Terminators sort before any escaped byte, so shorter dimensions sort first, and a NEXT
+ * terminator sorts after the plain one (and anything which may follow it), but before any
+ * longer dimension.
+ */
+#define NKEY_ESCAPE_LOW             (0x00)
+#define NKEY_ESCAPE_HIGH            (0xFF)
+#define NKEY_MINUS_INFINITY_TAG     (0x01)
+#define NKEY_MINUS_INFINITY_NEXT_TAG (0x02)
+#define NKEY_PLUS_INFINITY_TAG      (0x01)
+#define NKEY_PLUS_INFINITY_NEXT_TAG (0x02)
+#define NKEY_DIM_END_TAG            (0x03)
+#define NKEY_DIM_END_NEXT_TAG       (0x04)
+
+/**
+ * Writes normalised encoding of a btree key.
+ *
+ * @param key   Btree key to encode
+ * @param buf   Buffer to encode into, NULL to just work out the length
+ *
+ * @return Length of the encoding
+ */
+static uint32_t castle_object_btree_key_nkey_write(c_vl_bkey_t *key, uint8_t *buf)
+{
+    uint32_t flags, len, i, j;
+    uint8_t *dim, *p = buf;
+    uint32_t length = 0;
+
+#define NKEY_PUT(_b)    do { if (buf) *p++ = (_b); length++; } while (0)
+    NKEY_PUT((key->nr_dims >> 24) & 0xFF);
+    NKEY_PUT((key->nr_dims >> 16) & 0xFF);
+    NKEY_PUT((key->nr_dims >>  8) & 0xFF);
+    NKEY_PUT( key->nr_dims        & 0xFF);
+    for (i = 0; i < key->nr_dims; i++)
+    {
+        flags = castle_object_btree_key_dim_flags_get(key, i);
+        if (flags & KEY_DIMENSION_MINUS_INFINITY_FLAG)
+        {
+            NKEY_PUT(NKEY_ESCAPE_LOW);
+            NKEY_PUT((flags & KEY_DIMENSION_NEXT_FLAG) ? NKEY_MINUS_INFINITY_NEXT_TAG :
+                                                         NKEY_MINUS_INFINITY_TAG);
+            continue;
+        }
+        if (flags & KEY_DIMENSION_PLUS_INFINITY_FLAG)
+        {
+            NKEY_PUT(NKEY_ESCAPE_HIGH);
+            NKEY_PUT(NKEY_ESCAPE_HIGH);
+            NKEY_PUT((flags & KEY_DIMENSION_NEXT_FLAG) ? NKEY_PLUS_INFINITY_NEXT_TAG :
+                                                         NKEY_PLUS_INFINITY_TAG);
+            continue;
+        }
+
+        len = castle_object_btree_key_dim_length(key, i);
+        dim = (uint8_t *)castle_object_btree_key_dim_get(key, i);
+        BUG_ON(len == 0);
+        for (j = 0; j < len; j++)
+        {
+            NKEY_PUT(dim[j]);
+            if (dim[j] == NKEY_ESCAPE_LOW)
+                NKEY_PUT(NKEY_ESCAPE_HIGH);
+            else if (dim[j] == NKEY_ESCAPE_HIGH)
+                NKEY_PUT(NKEY_ESCAPE_LOW);
+        }
+        NKEY_PUT(NKEY_ESCAPE_LOW);
+        NKEY_PUT((flags & KEY_DIMENSION_NEXT_FLAG) ? NKEY_DIM_END_NEXT_TAG : NKEY_DIM_END_TAG);
+    }
+#undef NKEY_PUT
+
+    return length;
+}
+
+/**
+ * Encodes a btree key into a caller provided normalised key.
+ *
+ * @param key   Btree key to encode
+ * @param nkey  Normalised key to encode into
+ * @param size  Space available for nkey->key[]
+ *
+ * @return 0 on success, -EINVAL if key isn't an object key, -ENOSPC if nkey too small
+ */
+int castle_object_btree_key_normalise_buf(c_vl_bkey_t *key, c_vl_nkey_t *nkey, uint32_t size)
+{
+    uint32_t length;
+
+    /* Min/max btree keys don't have dimensions. */
+    if ((key->length == 0) || (key->length > VLBA_TREE_MAX_KEY_SIZE))
+        return -EINVAL;
+
+    /* Max sized keys always fit into NKEY_MAX_LENGTH, don't bother working out the length. */
+    if (size < NKEY_MAX_LENGTH)
+    {
+        length = castle_object_btree_key_nkey_write(key, NULL);
+        if (length > size)
+            return -ENOSPC;
+    }
+    nkey->length = castle_object_btree_key_nkey_write(key, nkey->key);
+    BUG_ON(nkey->length > NKEY_MAX_LENGTH);
+
+    return 0;
+}
+
+/**
+ * Allocates normalised encoding of a btree key.
+ *
+ * @return Normalised key, to be freed with castle_free(), or NULL on error
+ */
+c_vl_nkey_t *castle_object_btree_key_normalise(c_vl_bkey_t *key)
+{
+    c_vl_nkey_t *nkey;
+    uint32_t length;
+
+    if ((key->length == 0) || (key->length > VLBA_TREE_MAX_KEY_SIZE))
+        return NULL;
+
+    length = castle_object_btree_key_nkey_write(key, NULL);
+    nkey = castle_malloc(sizeof(c_vl_nkey_t) + length, GFP_KERNEL);
+    if (!nkey)
+        return NULL;
+    BUG_ON(castle_object_btree_key_normalise_buf(key, nkey, length));
+
+    return nkey;
+}
+
+/**
+ * Allocates normalised encoding of an object key, as used by the ring interface.
+ *
+ * Dimensions are interpreted as by castle_object_key_convert(), i.e. zero length dimensions
+ * are -inf, PLUS_INFINITY_DIM_LENGTH dimensions (and zero length dimensions following them)
+ * +inf.
+ */
+c_vl_nkey_t *castle_object_key_normalise(c_vl_okey_t *obj_key)
+{
+    c_vl_bkey_t *btree_key;
+    c_vl_nkey_t *nkey;
+
+    btree_key = castle_object_key_convert(obj_key);
+    if (!btree_key)
+        return NULL;
+    nkey = castle_object_btree_key_normalise(btree_key);
+    castle_object_bkey_free(btree_key);
+
+    return nkey;
+}
+
+/**
+ * Decodes a single dimension of a normalised key.
+ *
+ * @param p         Start of the dimension encoding
+ * @param end       End of the normalised key
+ * @param dim       Buffer for the dimension, or NULL to just work out the length
+ * @param len_p     [out] Dimension length, PLUS_INFINITY_DIM_LENGTH for +inf
+ *
+ * @return Pointer past the dimension, or NULL if the encoding is malformed, or the dimension
+ *         has NEXT flag set (no object key equivalent)
+ */
+static uint8_t *castle_object_nkey_dim_decode(uint8_t *p, uint8_t *end, uint8_t *dim,
+                                              uint32_t *len_p)
+{
+    uint32_t len = 0;
+
+    while (p + 1 < end)
+    {
+        if (*p == NKEY_ESCAPE_LOW)
+        {
+            switch (p[1])
+            {
+                case NKEY_ESCAPE_HIGH:
+                    break;
+                case NKEY_MINUS_INFINITY_TAG:
+                    if (len != 0)
+                        return NULL;
+                    *len_p = 0;
+                    return p + 2;
+                case NKEY_DIM_END_TAG:
+                    if (len == 0)
+                        return NULL;
+                    *len_p = len;
+                    return p + 2;
+                default:
+                    return NULL;
+            }
+        }
+        else if (*p == NKEY_ESCAPE_HIGH)
+        {
+            if (p[1] == NKEY_ESCAPE_HIGH)
+            {
+                if ((len != 0) || (p + 2 >= end) || (p[2] != NKEY_PLUS_INFINITY_TAG))
+                    return NULL;
+                *len_p = PLUS_INFINITY_DIM_LENGTH;
+                return p + 3;
+            }
+            if (p[1] != NKEY_ESCAPE_LOW)
+                return NULL;
+        }
+        else
+        {
+            /* Unescaped byte. */
+            if (dim)
+                dim[len] = *p;
+            len++;
+            p++;
+            continue;
+        }
+        /* Escaped 00 or FF. */
+        if (dim)
+            dim[len] = *p;
+        len++;
+        p += 2;
+    }
+
+    return NULL;
+}
+
+/**
+ * Converts a normalised key back into an object key.
+ *
+ * +inf dimensions get PLUS_INFINITY_DIM_LENGTH length, -inf zero length.
+ *
+ * @return Object key, to be freed with castle_object_okey_free(), or NULL if the nkey is
+ *         malformed, has NEXT flags (which object keys can't represent), or on ENOMEM
+ */
+c_vl_okey_t *castle_object_nkey_convert(c_vl_nkey_t *nkey)
+{
+    c_vl_okey_t *obj_key;
+    uint8_t *p, *end;
+    uint32_t nr_dims, dim_len;
+    int i;
+
+    if (nkey->length < sizeof(uint32_t))
+        return NULL;
+    p   = nkey->key;
+    end = nkey->key + nkey->length;
+    nr_dims = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    p += sizeof(uint32_t);
+    if (nr_dims > VLBA_TREE_MAX_KEY_SIZE / sizeof(uint32_t))
+        return NULL;
+
+    obj_key = castle_zalloc(sizeof(c_vl_okey_t) + sizeof(c_vl_key_t *) * nr_dims, GFP_KERNEL);
+    if (!obj_key)
+        return NULL;
+
+    obj_key->nr_dims = nr_dims;
+    for (i = 0; i < nr_dims; i++)
+    {
+        /* Work out the length first, then decode. */
+        if (!castle_object_nkey_dim_decode(p, end, NULL, &dim_len))
+            goto err_out;
+        obj_key->dims[i] = castle_malloc(sizeof(c_vl_key_t) +
+                                         (dim_len == PLUS_INFINITY_DIM_LENGTH ? 0 : dim_len),
+                                         GFP_KERNEL);
+        if (!obj_key->dims[i])
+            goto err_out;
+        obj_key->dims[i]->length = dim_len;
+        p = castle_object_nkey_dim_decode(p, end, obj_key->dims[i]->key, &dim_len);
+    }
+    if (p != end)
+        goto err_out;
+
+    return obj_key;
+
+err_out:
+    /* Dims which weren't allocated are NULL (castle_zalloc). */
+    for (i = 0; i < nr_dims; i++)
+        if (obj_key->dims[i])
+            castle_free(obj_key->dims[i]);
+    castle_free(obj_key);
+
+    return NULL;
+}
+
+/**
+ * Compares normalised keys, the result has the same sign as castle_object_btree_key_compare()
+ * of the keys they were created from.
+ */
+int castle_object_nkey_compare(c_vl_nkey_t *nkey1, c_vl_nkey_t *nkey2)
+{
+    int cmp;
+
+    cmp = memcmp(nkey1->key, nkey2->key, min(nkey1->length, nkey2->length));
+    if (cmp)
+        return cmp;
+
+    return (nkey1->length > nkey2->length) - (nkey1->length < nkey2->length);
+}
+
 static void castle_object_btree_key_dim_inc(c_vl_bkey_t *key, int dim)
 {
     uint32_t flags = KEY_DIMENSION_FLAGS(key->dim_head[dim]);
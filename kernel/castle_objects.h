@@ -8,6 +8,13 @@ c_vl_okey_t *castle_object_okey_copy         (c_vl_okey_t *obj_key);
 void         castle_object_bkey_free         (c_vl_bkey_t *btree_key);
 
 int          castle_object_btree_key_compare (c_vl_bkey_t *key1, c_vl_bkey_t *key2);
+uint32_t     castle_object_btree_key_dim0_common(c_vl_bkey_t *key1, c_vl_bkey_t *key2);
+uint64_t     castle_object_btree_key_prefix  (c_vl_bkey_t *key, c_vl_bkey_t *ref, uint32_t skip);
+int          castle_object_btree_key_normalise_buf(c_vl_bkey_t *key, c_vl_nkey_t *nkey, uint32_t size);
+c_vl_nkey_t *castle_object_btree_key_normalise(c_vl_bkey_t *key);
+c_vl_nkey_t *castle_object_key_normalise     (c_vl_okey_t *obj_key);
+c_vl_okey_t *castle_object_nkey_convert      (c_vl_nkey_t *nkey);
+int          castle_object_nkey_compare      (c_vl_nkey_t *nkey1, c_vl_nkey_t *nkey2);
 void        *castle_object_btree_key_next    (c_vl_bkey_t *key);
 void        *castle_object_btree_key_duplicate(c_vl_bkey_t *key);
 
@@ -85,6 +85,16 @@ typedef enum {
     TRACE_CACHE_WRITES_ID,              /**< Number of writes this tick.                        */
     TRACE_CACHE_RESERVE_PGS_USED_ID,    /**< Number of c2ps from reserve freelist in use.       */
     TRACE_CACHE_RESERVE_BLKS_USED_ID,   /**< Number of c2bs from reserve freelist in use.       */
+    TRACE_CACHE_BLOCK_HASH_LOCK_CYCLES_ID,  /**< Cycles block hash locks were held this tick.   */
+    TRACE_CACHE_BLOCK_HASH_LOCK_ACQS_ID,    /**< Block hash lock acquisitions this tick.        */
+    TRACE_CACHE_BLOCK_LRU_LOCK_CYCLES_ID,   /**< Cycles the cleanlist lock was held this tick.  */
+    TRACE_CACHE_BLOCK_LRU_LOCK_ACQS_ID,     /**< Cleanlist lock acquisitions this tick.         */
+    TRACE_CACHE_WB_SEGS_ID,                 /**< Writeback segments staged this tick.           */
+    TRACE_CACHE_WB_BIOS_ID,                 /**< Coalesced writeback bios submitted this tick.  */
+    TRACE_CACHE_TRICKLE_PGS_ID,             /**< Pages trickle-flushed ahead of checkpoint.     */
+    TRACE_CACHE_CHECKPOINT_MSECS_ID,        /**< Duration of the last checkpoint in ms.         */
+    TRACE_CACHE_CHECKPOINT_BYTES_ID,        /**< Bytes written by the last checkpoint.          */
+    TRACE_CACHE_CHECKPOINT_RATE_ID,         /**< Adaptive checkpoint flush rate in KB/s.        */
 } c_trc_cache_var_t;
 
 /**
@@ -545,7 +555,10 @@ struct castle_key_value_list {
 #define CASTLE_SLAVE_MAGIC1     (0x02061985)
 #define CASTLE_SLAVE_MAGIC2     (0x16071983)
 #define CASTLE_SLAVE_MAGIC3     (0x16061981)
-#define CASTLE_SLAVE_VERSION    (14)
+#define CASTLE_SLAVE_VERSION    (15)
+/* Oldest superblock version still mounted. Version 14 mstores are linked lists of nodes,
+   which can be read, and get rewritten as indexed stores by the next checkpoint. */
+#define CASTLE_SLAVE_VERSION_OLDEST (14)
 
 #define CASTLE_SLAVE_NEWDEV     (0x00000004)
 #define CASTLE_SLAVE_SSD        (0x00000008)
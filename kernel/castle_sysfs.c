@@ -13,10 +13,12 @@
 #include "castle_da.h"
 #include "castle_utils.h"
 #include "castle_btree.h"
+#include "castle_cache.h"
 
 static wait_queue_head_t castle_sysfs_kobj_release_wq;
 static struct kobject    double_arrays_kobj;
 static struct kobject    filesystem_kobj;
+static struct kobject    cache_kobj;
 struct castle_sysfs_versions {
     struct kobject kobj;
     struct list_head version_list;
@@ -239,6 +241,100 @@ static ssize_t da_compacting_show(struct kobject *kobj,
     return sprintf(buf, "%u\n", castle_da_compacting(da));
 }
 
+/* Print cache partition stats, each line prefixed with prefix. */
+static ssize_t cache_partition_stats_print(char *buf, const char *prefix, c2_partition_stats_t *stats)
+{
+    uint64_t occupancy, ratio;
+    int size = castle_cache_size_get();
+
+    /* Occupancy and hit ratio in hundredths of a percent. */
+    occupancy = size ? stats->pages * 10000 / size : 0;
+    ratio     = (stats->hits + stats->misses) ?
+                    stats->hits * 10000 / (stats->hits + stats->misses) : 0;
+
+    return sprintf(buf,
+                   "%sPages: %llu\n"
+                   "%sOccupancy: %llu.%02llu%%\n"
+                   "%sMinShare: %u%%\n"
+                   "%sMaxShare: %u%%\n"
+                   "%sHits: %llu\n"
+                   "%sMisses: %llu\n"
+                   "%sHitRatio: %llu.%02llu%%\n",
+                   prefix, stats->pages,
+                   prefix, occupancy / 100, occupancy % 100,
+                   prefix, stats->min_share,
+                   prefix, stats->max_share,
+                   prefix, stats->hits,
+                   prefix, stats->misses,
+                   prefix, ratio / 100, ratio % 100);
+}
+
+static ssize_t da_cache_partition_show(struct kobject *kobj,
+                                       struct attribute *attr,
+                                       char *buf)
+{
+    struct castle_double_array *da = container_of(kobj, struct castle_double_array, kobj);
+    c2_partition_stats_t stats;
+
+    castle_cache_da_partition_stats_get(da->id, &stats);
+
+    return cache_partition_stats_print(buf, "", &stats);
+}
+
+static ssize_t da_row_cache_show(struct kobject *kobj,
+                                 struct attribute *attr,
+                                 char *buf)
+{
+    struct castle_double_array *da = container_of(kobj, struct castle_double_array, kobj);
+    c_da_row_cache_stats_t stats;
+    uint64_t lookups;
+
+    castle_da_row_cache_stats_get(da, &stats);
+    lookups = stats.hits + stats.misses;
+
+    return sprintf(buf,
+                   "MaxBytes: %llu\n"
+                   "Bytes: %llu\n"
+                   "Entries: %llu\n"
+                   "Hits: %llu\n"
+                   "Misses: %llu\n"
+                   "HitRate: %llu%%\n"
+                   "Inserts: %llu\n"
+                   "Evictions: %llu\n"
+                   "Invalidations: %llu\n",
+                   stats.max_bytes,
+                   stats.bytes,
+                   stats.entries,
+                   stats.hits,
+                   stats.misses,
+                   lookups ? 100 * stats.hits / lookups : 0,
+                   stats.inserts,
+                   stats.evictions,
+                   stats.invalidations);
+}
+
+/* Set cache shares of the DA: "<min%> <max%>". */
+static ssize_t da_cache_partition_store(struct kobject *kobj,
+                                        struct attribute *attr,
+                                        const char *buf,
+                                        size_t count)
+{
+    struct castle_double_array *da = container_of(kobj, struct castle_double_array, kobj);
+    unsigned int min_share, max_share;
+    int ret;
+
+    if (sscanf(buf, "%u %u", &min_share, &max_share) != 2)
+        return -EINVAL;
+
+    if ((ret = castle_cache_da_partition_set(da->id, min_share, max_share)))
+        return ret;
+
+    castle_printk(LOG_USERINFO, "Cache partition of DA %u: min share %u%%, max share %u%%.\n",
+            da->id, min_share, max_share);
+
+    return count;
+}
+
 static ssize_t da_size_show(struct kobject *kobj,
                             struct attribute *attr,
                             char *buf)
@@ -460,6 +556,14 @@ static ssize_t filesystem_version_show(struct kobject *kobj,
     return sprintf(buf, "%u\n", fs_version);
 }
 
+/* Display how long each restore phase of the last filesystem start took. */
+static ssize_t filesystem_startup_show(struct kobject *kobj,
+                                       struct attribute *attr,
+                                       char *buf)
+{
+    return castle_fs_phases_print(buf);
+}
+
 /* Display the number of blocks that have been remapped. */
 extern long castle_extents_chunks_remapped;
 static ssize_t slaves_rebuild_chunks_remapped_show(struct kobject *kobj,
@@ -587,6 +691,282 @@ static ssize_t collection_name_show(struct kobject *kobj,
     return sprintf(buf, "%s\n", collection->col.name);
 }
 
+/* Display the active cache replacement policy. */
+static ssize_t cache_policy_show(struct kobject *kobj,
+                                 struct attribute *attr,
+                                 char *buf)
+{
+    return sprintf(buf, "%s\n", castle_cache_policy_name_get());
+}
+
+/* Display hit statistics of the active cache replacement policy. */
+static ssize_t cache_policy_stats_show(struct kobject *kobj,
+                                       struct attribute *attr,
+                                       char *buf)
+{
+    uint64_t hits, misses, ratio;
+    char *name;
+
+    name  = castle_cache_policy_stats_get(&hits, &misses);
+    /* Hit ratio in hundredths of a percent. */
+    ratio = (hits + misses) ? hits * 10000 / (hits + misses) : 0;
+
+    return sprintf(buf,
+                   "%s.Hits: %llu\n"
+                   "%s.Misses: %llu\n"
+                   "%s.HitRatio: %llu.%02llu%%\n",
+                   name, hits,
+                   name, misses,
+                   name, ratio / 100, ratio % 100);
+}
+
+/* Display occupancy and allocation locality of per-NUMA-node cache page pools. */
+static ssize_t cache_numa_pools_show(struct kobject *kobj,
+                                     struct attribute *attr,
+                                     char *buf)
+{
+    uint64_t allocs, remote_allocs;
+    int node, pages, free_pages;
+    ssize_t len = 0;
+
+    for_each_online_node(node)
+    {
+        if (castle_cache_node_stats_get(node, &pages, &free_pages, &allocs, &remote_allocs))
+            continue;
+        len += sprintf(buf + len,
+                       "Node%d.Pages: %d\n"
+                       "Node%d.FreePages: %d\n"
+                       "Node%d.Allocs: %llu\n"
+                       "Node%d.RemoteAllocs: %llu\n",
+                       node, pages,
+                       node, free_pages,
+                       node, allocs,
+                       node, remote_allocs);
+    }
+
+    return len;
+}
+
+/* Display compressed cache tier occupancy, compression ratio and hit counters. */
+static ssize_t cache_compressed_tier_show(struct kobject *kobj,
+                                          struct attribute *attr,
+                                          char *buf)
+{
+    c2_ztier_stats_t stats;
+    uint64_t ratio, hit_ratio;
+
+    castle_cache_ztier_stats_get(&stats);
+    /* Ratios in hundredths. */
+    ratio     = stats.bytes ? stats.raw_bytes * 100 / stats.bytes : 0;
+    hit_ratio = (stats.hits + stats.misses) ?
+                    stats.hits * 10000 / (stats.hits + stats.misses) : 0;
+
+    return sprintf(buf,
+                   "Size: %llu\n"
+                   "Used: %llu\n"
+                   "Blocks: %llu\n"
+                   "UncompressedBytes: %llu\n"
+                   "CompressionRatio: %llu.%02llu\n"
+                   "Stores: %llu\n"
+                   "Rejects: %llu\n"
+                   "Evictions: %llu\n"
+                   "Hits: %llu\n"
+                   "Misses: %llu\n"
+                   "HitRatio: %llu.%02llu%%\n",
+                   stats.max_bytes,
+                   stats.bytes,
+                   stats.blocks,
+                   stats.raw_bytes,
+                   ratio / 100, ratio % 100,
+                   stats.stores,
+                   stats.rejects,
+                   stats.evictions,
+                   stats.hits,
+                   stats.misses,
+                   hit_ratio / 100, hit_ratio % 100);
+}
+
+/* Display SSD victim cache log usage, hit ratio and write amplification.  Write
+   amplification is SSD bytes written per byte of cache misses served from the SSD. */
+static ssize_t cache_ssd_cache_show(struct kobject *kobj,
+                                    struct attribute *attr,
+                                    char *buf)
+{
+    c2_l2_stats_t stats;
+    uint64_t hit_ratio, write_amp;
+
+    castle_cache_l2_stats_get(&stats);
+    /* Ratios in hundredths. */
+    hit_ratio = (stats.hits + stats.misses) ?
+                    stats.hits * 10000 / (stats.hits + stats.misses) : 0;
+    write_amp = stats.read_bytes ? stats.written_bytes * 100 / stats.read_bytes : 0;
+
+    return sprintf(buf,
+                   "Size: %llu\n"
+                   "Used: %llu\n"
+                   "Blocks: %llu\n"
+                   "Stores: %llu\n"
+                   "Skips: %llu\n"
+                   "Rejects: %llu\n"
+                   "Invalidations: %llu\n"
+                   "BytesStored: %llu\n"
+                   "BytesWritten: %llu\n"
+                   "BytesRead: %llu\n"
+                   "WriteAmplification: %llu.%02llu\n"
+                   "Hits: %llu\n"
+                   "Misses: %llu\n"
+                   "HitRatio: %llu.%02llu%%\n",
+                   stats.size_bytes,
+                   stats.used_bytes,
+                   stats.entries,
+                   stats.stores,
+                   stats.skips,
+                   stats.rejects,
+                   stats.invalidations,
+                   stats.stored_bytes,
+                   stats.written_bytes,
+                   stats.read_bytes,
+                   write_amp / 100, write_amp % 100,
+                   stats.hits,
+                   stats.misses,
+                   hit_ratio / 100, hit_ratio % 100);
+}
+
+/* Display adaptive prefetcher efficiency, followed by each active window. */
+static ssize_t cache_prefetch_show(struct kobject *kobj,
+                                   struct attribute *attr,
+                                   char *buf)
+{
+    c2_pref_stats_t stats;
+    uint64_t total, eff;
+    ssize_t len;
+
+    castle_cache_prefetch_stats_get(&stats);
+    /* Efficiency in hundredths of a percent. */
+    total = stats.used_pages + stats.wasted_pages;
+    eff   = total ? stats.used_pages * 10000 / total : 0;
+
+    len = sprintf(buf,
+                  "MaxWindowPages: %u\n"
+                  "ActivePages: %u\n"
+                  "UsedPages: %llu\n"
+                  "WastedPages: %llu\n"
+                  "Efficiency: %llu.%02llu%%\n"
+                  "Grows: %llu\n"
+                  "Shrinks: %llu\n",
+                  stats.max_pages,
+                  stats.active_pages,
+                  stats.used_pages,
+                  stats.wasted_pages,
+                  eff / 100, eff % 100,
+                  stats.grows,
+                  stats.shrinks);
+    len += castle_cache_prefetch_windows_print(buf + len, PAGE_SIZE - len);
+
+    return len;
+}
+
+/* Display occupancy, shares and hit rates of extent type cache partitions. */
+static ssize_t cache_partitions_show(struct kobject *kobj,
+                                     struct attribute *attr,
+                                     char *buf)
+{
+    c2_partition_stats_t stats;
+    char prefix[32];
+    ssize_t len = 0;
+    int i;
+
+    for (i = 0; i < EXT_T_INVALID; i++)
+    {
+        castle_cache_type_partition_stats_get(i, &stats);
+        /* Strip the EXT_T_ prefix. */
+        snprintf(prefix, sizeof(prefix), "%s.", castle_ext_type_str[i] + strlen("EXT_T_"));
+        len += cache_partition_stats_print(buf + len, prefix, &stats);
+    }
+
+    return len;
+}
+
+/* Set shares of an extent type partition: "<type> <min%> <max%>", e.g. "LEAF_NODES 10 50". */
+static ssize_t cache_partitions_store(struct kobject *kobj,
+                                      struct attribute *attr,
+                                      const char *buf,
+                                      size_t count)
+{
+    unsigned int min_share, max_share;
+    char name[32], *type_name;
+    int i, ret;
+
+    if (sscanf(buf, "%31s %u %u", name, &min_share, &max_share) != 3)
+        return -EINVAL;
+
+    for (i = 0; i < EXT_T_INVALID; i++)
+    {
+        type_name = castle_ext_type_str[i];
+        if (strcmp(name, type_name) == 0 || strcmp(name, type_name + strlen("EXT_T_")) == 0)
+            break;
+    }
+    if (i == EXT_T_INVALID)
+        return -EINVAL;
+
+    if ((ret = castle_cache_type_partition_set(i, min_share, max_share)))
+        return ret;
+
+    castle_printk(LOG_USERINFO, "Cache partition %s: min share %u%%, max share %u%%.\n",
+            castle_ext_type_str[i], min_share, max_share);
+
+    return count;
+}
+
+/* Display state of the latency-adaptive checkpoint ratelimit. */
+static ssize_t cache_checkpoint_rate_show(struct kobject *kobj,
+                                          struct attribute *attr,
+                                          char *buf)
+{
+    c2_ckpt_rate_stats_t stats;
+
+    castle_checkpoint_rate_stats_get(&stats);
+
+    return sprintf(buf,
+                   "TargetP99Us: %u\n"
+                   "P99Us: %u\n"
+                   "Flushing: %d\n"
+                   "BaseRateKBs: %u\n"
+                   "RateKBs: %u\n"
+                   "DeadlineRateKBs: %u\n"
+                   "PagesLeft: %llu\n"
+                   "Decreases: %llu\n"
+                   "Increases: %llu\n"
+                   "DeadlineClamps: %llu\n",
+                   stats.target_p99_us,
+                   stats.p99_us,
+                   stats.flushing,
+                   stats.base_rate,
+                   stats.rate,
+                   stats.deadline_rate,
+                   stats.pages_left,
+                   stats.decreases,
+                   stats.increases,
+                   stats.deadline_clamps);
+}
+
+/* Set foreground p99 latency target in usecs, 0 disables adaptation. */
+static ssize_t cache_checkpoint_rate_store(struct kobject *kobj,
+                                           struct attribute *attr,
+                                           const char *buf,
+                                           size_t count)
+{
+    unsigned int usecs;
+
+    if (sscanf(buf, "%u", &usecs) != 1)
+        return -EINVAL;
+
+    castle_checkpoint_latency_target_set(usecs);
+    castle_printk(LOG_USERINFO, "Checkpoint p99 latency target: %uus.\n", usecs);
+
+    return count;
+}
+
 static ssize_t castle_attr_show(struct kobject *kobj,
                                 struct attribute *attr,
                                 char *page)
@@ -675,11 +1055,19 @@ __ATTR(compacting, S_IRUGO|S_IWUSR, da_compacting_show, NULL);
 static struct castle_sysfs_entry da_tree_list =
 __ATTR(component_trees, S_IRUGO|S_IWUSR, da_tree_list_show, NULL);
 
+static struct castle_sysfs_entry da_cache_partition =
+__ATTR(cache_partition, S_IRUGO|S_IWUSR, da_cache_partition_show, da_cache_partition_store);
+
+static struct castle_sysfs_entry da_row_cache =
+__ATTR(row_cache, S_IRUGO|S_IWUSR, da_row_cache_show, NULL);
+
 static struct attribute *castle_da_attrs[] = {
     &da_version.attr,
     &da_size.attr,
     &da_compacting.attr,
     &da_tree_list.attr,
+    &da_cache_partition.attr,
+    &da_row_cache.attr,
     NULL,
 };
 
@@ -831,8 +1219,12 @@ static struct kobj_type castle_collections_ktype = {
 static struct castle_sysfs_entry filesystem_version =
 __ATTR(filesystem_version, S_IRUGO|S_IWUSR, filesystem_version_show, NULL);
 
+static struct castle_sysfs_entry filesystem_startup =
+__ATTR(startup, S_IRUGO|S_IWUSR, filesystem_startup_show, NULL);
+
 static struct attribute *castle_filesystem_attrs[] = {
     &filesystem_version.attr,
+    &filesystem_startup.attr,
     NULL,
 };
 
@@ -841,6 +1233,48 @@ static struct kobj_type castle_filesystem_ktype = {
     .default_attrs  = castle_filesystem_attrs,
 };
 
+/* Definition of cache sysfs directory attributes */
+static struct castle_sysfs_entry cache_policy =
+__ATTR(policy, S_IRUGO|S_IWUSR, cache_policy_show, NULL);
+
+static struct castle_sysfs_entry cache_policy_stats =
+__ATTR(policy_stats, S_IRUGO|S_IWUSR, cache_policy_stats_show, NULL);
+
+static struct castle_sysfs_entry cache_numa_pools =
+__ATTR(numa_pools, S_IRUGO|S_IWUSR, cache_numa_pools_show, NULL);
+
+static struct castle_sysfs_entry cache_compressed_tier =
+__ATTR(compressed_tier, S_IRUGO|S_IWUSR, cache_compressed_tier_show, NULL);
+
+static struct castle_sysfs_entry cache_ssd_cache =
+__ATTR(ssd_cache, S_IRUGO|S_IWUSR, cache_ssd_cache_show, NULL);
+
+static struct castle_sysfs_entry cache_prefetch =
+__ATTR(prefetch, S_IRUGO|S_IWUSR, cache_prefetch_show, NULL);
+
+static struct castle_sysfs_entry cache_partitions =
+__ATTR(partitions, S_IRUGO|S_IWUSR, cache_partitions_show, cache_partitions_store);
+
+static struct castle_sysfs_entry cache_checkpoint_rate =
+__ATTR(checkpoint_rate, S_IRUGO|S_IWUSR, cache_checkpoint_rate_show, cache_checkpoint_rate_store);
+
+static struct attribute *castle_cache_attrs[] = {
+    &cache_policy.attr,
+    &cache_policy_stats.attr,
+    &cache_numa_pools.attr,
+    &cache_compressed_tier.attr,
+    &cache_ssd_cache.attr,
+    &cache_prefetch.attr,
+    &cache_partitions.attr,
+    &cache_checkpoint_rate.attr,
+    NULL,
+};
+
+static struct kobj_type castle_cache_ktype = {
+    .sysfs_ops      = &castle_sysfs_ops,
+    .default_attrs  = castle_cache_attrs,
+};
+
 /* Definition of each device sysfs directory attributes */
 static struct castle_sysfs_entry device_version =
 __ATTR(version, S_IRUGO|S_IWUSR, device_version_show, NULL);
@@ -1005,9 +1439,18 @@ int castle_sysfs_init(void)
                            "%s", "filesystem");
     if(ret < 0) goto out7;
 
+    memset(&cache_kobj, 0, sizeof(struct kobject));
+    ret = kobject_tree_add(&cache_kobj,
+                           &castle.kobj,
+                           &castle_cache_ktype,
+                           "%s", "cache");
+    if(ret < 0) goto out8;
+
     return 0;
 
-    kobject_remove(&filesystem_kobj); /* Unreachable */
+    kobject_remove(&cache_kobj); /* Unreachable */
+out8:
+    kobject_remove(&filesystem_kobj);
 out7:
     kobject_remove(&double_arrays_kobj);
 out6:
@@ -1027,6 +1470,7 @@ out1:
 
 void castle_sysfs_fini(void)
 {
+    kobject_remove(&cache_kobj);
     kobject_remove(&filesystem_kobj);
     kobject_remove(&double_arrays_kobj);
     kobject_remove(&castle_attachments.collections_kobj);
@@ -1,6 +1,8 @@
 #include <linux/list.h>
 #include <asm/tlbflush.h>
 #include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
 
 #include "castle_public.h"
 #include "castle_utils.h"
@@ -616,3 +618,90 @@ void list_append(struct list_head *head1, struct list_head *head2)
     head1->prev->next = head2->next;
     head1->prev       = head2->prev;
 }
+
+/**
+ * State shared between the workers of a castle_parallel_run() call.
+ */
+struct castle_parallel_run {
+    int               (*fn)(int item, void *data);
+    void               *data;
+    int                 nr_items;
+    atomic_t            next;       /**< Next item to be claimed by a worker.               */
+    atomic_t            running;    /**< Workers (including the caller) still running.      */
+    int                 err;        /**< First non-zero value returned by fn().             */
+    struct completion   done;       /**< Completed by the last worker to finish.            */
+};
+
+static void __castle_parallel_run(struct castle_parallel_run *run)
+{
+    int item, ret;
+
+    while ((item = atomic_inc_return(&run->next) - 1) < run->nr_items)
+        if ((ret = run->fn(item, run->data)))
+            cmpxchg(&run->err, 0, ret);
+}
+
+static int castle_parallel_run_thread(void *data)
+{
+    struct castle_parallel_run *run = data;
+
+    __castle_parallel_run(run);
+    if (atomic_dec_and_test(&run->running))
+        complete(&run->done);
+
+    return 0;
+}
+
+/**
+ * Call fn() for items [0, nr_items) on up to nr_threads threads, and wait for all of them.
+ *
+ * The calling thread is one of the workers, further ones are short-lived kthreads. Items
+ * are handed out in order, so earlier items start first. Fewer threads get used if the
+ * kthreads cannot be created, at worst everything runs on the caller.
+ *
+ * @param nr_items      Number of items to process
+ * @param nr_threads    Maximum number of threads to use (including the caller)
+ * @param fn            Function to call for each item, may sleep
+ * @param data          Opaque pointer passed to fn()
+ * @param name          Prefix for the kthread names
+ *
+ * @return 0 if fn() succeeded for all items, the first error returned otherwise
+ */
+int castle_parallel_run(int nr_items,
+                        int nr_threads,
+                        int (*fn)(int item, void *data),
+                        void *data,
+                        char *name)
+{
+    struct castle_parallel_run run;
+    struct task_struct *thread;
+    int i;
+
+    run.fn       = fn;
+    run.data     = data;
+    run.nr_items = nr_items;
+    run.err      = 0;
+    atomic_set(&run.next, 0);
+    atomic_set(&run.running, 1);    /* Caller's reference. */
+    init_completion(&run.done);
+
+    nr_threads = min(nr_threads, nr_items);
+    for (i = 1; i < nr_threads; i++)
+    {
+        atomic_inc(&run.running);
+        thread = kthread_run(castle_parallel_run_thread, &run, "%s-%d", name, i);
+        if (IS_ERR(thread))
+        {
+            castle_printk(LOG_WARN, "Failed to start %s-%d, continuing with %d threads.\n",
+                    name, i, i);
+            atomic_dec(&run.running);
+            break;
+        }
+    }
+
+    __castle_parallel_run(&run);
+    if (!atomic_dec_and_test(&run.running))
+        wait_for_completion(&run.done);
+
+    return run.err;
+}
@@ -349,4 +349,10 @@ int         castle_map_vm_area(void *addr_p, struct page **pages, int nr_pages,
 uint32_t    murmur_hash_32(const void *key, int len, uint32_t seed);
 uint64_t    murmur_hash_64(const void *key, int len, uint32_t seed);
 
+int         castle_parallel_run(int nr_items,
+                                int nr_threads,
+                                int (*fn)(int item, void *data),
+                                void *data,
+                                char *name);
+
 #endif /* __CASTLE_UTILS_H__ */
@@ -2,6 +2,9 @@
 #include <linux/slab.h>
 #include <linux/hardirq.h>
 #include <linux/sched.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/vmalloc.h>
 
 #include "castle_public.h"
 #include "castle_utils.h"
@@ -41,6 +44,46 @@ MODULE_PARM_DESC(castle_versions_deleted_sysfs_hide, "Hide deleted versions from
 
 LIST_HEAD(castle_versions_deleted);
 
+/**
+ * Dense copy of the version tree ordering, indexed by version number.
+ *
+ * Published with RCU by castle_versions_process(), so that castle_version_is_ancestor()
+ * and castle_version_compare() don't need castle_versions_hash_lock.  Labels of versions
+ * already in the array are updated in place (under castle_versions_order_seq) when new
+ * versions get threaded into the tree.  The array is only rebuilt when it runs out of
+ * space, or after the whole tree got relabelled.  Versions not in the array (not inited,
+ * or beyond nr_versions) have INVAL_VERSION orders, and are looked up in the hash instead.
+ */
+struct castle_versions_order {
+    c_ver_t                 nr_versions;    /**< Number of entries in orders[].             */
+    struct {
+        c_ver_t             o_order;
+        c_ver_t             r_order;
+    }                       orders[0];
+};
+static struct castle_versions_order *castle_versions_order = NULL;
+static seqcount_t castle_versions_order_seq = SEQCNT_ZERO;
+
+/**
+ * Version tree order labels.
+ *
+ * Each version gets an interval [o_order, r_order] from a sparse label space, such that
+ * intervals of all descendants nest strictly within it, and o_orders follow the DFS order
+ * of the tree.  Labels are handed out with gaps, so that a new leaf version can be given
+ * an interval without touching any of the existing versions.  Only when the gap runs out
+ * is a subtree relabelled (see castle_versions_order_insert()).
+ */
+#define CASTLE_VERSIONS_ORDER_MAX       (INVAL_VERSION - 1) /**< Largest usable label.      */
+#define CASTLE_VERSIONS_ORDER_SIB_SHIFT (4)     /**< 1/16th of a gap is left for siblings.  */
+#define CASTLE_VERSIONS_ORDER_MIN_GAP   (64)    /**< Minimum gap left after a relabel.      */
+static int castle_versions_labelled = 0;        /**< Set after first full relabel.          */
+
+#ifdef CASTLE_PERF_DEBUG
+static int castle_versions_order_bench = 0;
+module_param(castle_versions_order_bench, int, S_IRUSR);
+MODULE_PARM_DESC(castle_versions_order_bench, "Number of versions to create in the version ordering benchmark run on init (0 to disable)");
+#endif
+
 #define CV_INITED_BIT             (0)
 #define CV_INITED_MASK            (1 << CV_INITED_BIT)
 #define CV_ATTACHED_BIT           (1)
@@ -634,7 +677,7 @@ int castle_version_delete(c_ver_t version)
            - next sybling
            - parent
            This walk approximates the DFS walk to assign order numbers in
-           castle_versions_process().
+           castle_versions_order_relabel().
          */
         n = NULL;
         if(children_first)
@@ -1508,15 +1551,243 @@ static void castle_versions_drop(struct castle_version *v)
     v->next_sybling = v->parent = NULL;
 }
 
+/**
+ * Returns the next version in DFS order of the subtree rooted at root, NULL at the end.
+ */
+static struct castle_version* castle_versions_dfs_next(struct castle_version *v,
+                                                       struct castle_version *root)
+{
+    if (v->first_child)
+        return v->first_child;
+    while (v != root)
+    {
+        if (v->next_sybling)
+            return v->next_sybling;
+        v = v->parent;
+    }
+
+    return NULL;
+}
+
+/**
+ * Counts versions in the subtree rooted at root (including root itself).
+ */
+static c_ver_t castle_versions_subtree_size(struct castle_version *root)
+{
+    struct castle_version *v;
+    c_ver_t nr = 0;
+
+    for (v = root; v; v = castle_versions_dfs_next(v, root))
+        nr++;
+
+    return nr;
+}
+
+/**
+ * Relabels all descendants of a, spreading them evenly over a's interval.
+ *
+ * a keeps its own labels.  Every descendant takes one label for its o_order, followed
+ * by a gap which is left for children inserted in future.  r_order is set to the last
+ * label used by the subtree.  The tree is walked iteratively, it may be very deep.
+ *
+ * @param a         Root of the subtree to relabel
+ * @param nr_desc   Number of descendants of a
+ */
+static void castle_versions_order_relabel(struct castle_version *a, c_ver_t nr_desc)
+{
+    struct castle_version *v;
+    c_ver_t gap, cur;
+
+    BUG_ON(a->r_order - a->o_order < nr_desc);
+    gap = (a->r_order - a->o_order - nr_desc) / (nr_desc + 1);
+    cur = a->o_order + gap;
+    v = a->first_child;
+    while (v)
+    {
+        v->o_order = ++cur;
+        cur += gap;
+        if (v->first_child)
+        {
+            v = v->first_child;
+            continue;
+        }
+        /* Close v, and all ancestors it was the last descendant of. */
+        while (1)
+        {
+            v->r_order = cur;
+            if (v->next_sybling)
+            {
+                v = v->next_sybling;
+                break;
+            }
+            v = v->parent;
+            if (v == a)
+            {
+                v = NULL;
+                break;
+            }
+        }
+    }
+    BUG_ON(cur > a->r_order);
+}
+
+/**
+ * Relabels the entire tree rooted at root (version 0), using the whole label space.
+ */
+static void castle_versions_order_relabel_all(struct castle_version *root)
+{
+    BUG_ON(root->parent);
+    root->o_order = 0;
+    root->r_order = CASTLE_VERSIONS_ORDER_MAX;
+    castle_versions_order_relabel(root, castle_versions_subtree_size(root) - 1);
+}
+
+/**
+ * Labels a new leaf version, which has just been made the first child of its parent.
+ *
+ * Normally v takes the free labels between its parent's o_order and its next sybling
+ * (or the parent's r_order), leaving a fraction of them to siblings created later on.
+ * If there are no free labels, the smallest subtree around v, whose interval is sparse
+ * enough to leave CASTLE_VERSIONS_ORDER_MIN_GAP between versions, is relabelled.  Such
+ * relabel leaves wide gaps for all the versions it touched, so its cost is amortised
+ * over the many inserts needed to fill them again.  The entire tree only gets relabelled
+ * when it is (close to) filling the label space.
+ *
+ * @param v             New version, threaded into the tree as first child of its parent
+ * @param nr_relabelled [out] Number of versions that got relabelled
+ *
+ * @return Root of the relabelled subtree (labels of all its descendants have changed),
+ *         or v if only v got labelled
+ */
+static struct castle_version* castle_versions_order_insert(struct castle_version *v,
+                                                           c_ver_t *nr_relabelled)
+{
+    struct castle_version *p, *a, *s;
+    c_ver_t lo, hi;
+    uint64_t nr;
+
+    p = v->parent;
+    BUG_ON(!p || (p->first_child != v) || v->first_child);
+    lo = p->o_order + 1;
+    hi = v->next_sybling ? v->next_sybling->o_order - 1 : p->r_order;
+    if (likely(hi >= lo))
+    {
+        v->o_order = lo + ((hi - lo) >> CASTLE_VERSIONS_ORDER_SIB_SHIFT);
+        v->r_order = hi;
+        *nr_relabelled = 0;
+        return v;
+    }
+
+    /* Out of labels, find an ancestor with enough room for its subtree. */
+    a = p;
+    nr = castle_versions_subtree_size(p) - 1;
+    while (a->parent &&
+           ((uint64_t)(a->r_order - a->o_order) < nr + (nr + 1) * CASTLE_VERSIONS_ORDER_MIN_GAP))
+    {
+        /* Add a itself, and subtrees of all its syblings. */
+        nr++;
+        for (s = a->parent->first_child; s; s = s->next_sybling)
+            if (s != a)
+                nr += castle_versions_subtree_size(s);
+        a = a->parent;
+    }
+
+    if (!a->parent)
+        castle_versions_order_relabel_all(a);
+    else
+        castle_versions_order_relabel(a, nr);
+    *nr_relabelled = nr;
+
+    return a;
+}
+
+/**
+ * Copies labels of the subtree rooted at root to the published castle_versions_order.
+ *
+ * Must be called with castle_versions_hash_lock held for writing.
+ */
+static void castle_versions_order_update(struct castle_version *root)
+{
+    struct castle_versions_order *order = castle_versions_order;
+    struct castle_version *v;
+
+    if (!order)
+        return;
+
+    write_seqcount_begin(&castle_versions_order_seq);
+    for (v = root; v; v = castle_versions_dfs_next(v, root))
+    {
+        if (v->version >= order->nr_versions)
+            continue;
+        order->orders[v->version].o_order = v->o_order;
+        order->orders[v->version].r_order = v->r_order;
+    }
+    write_seqcount_end(&castle_versions_order_seq);
+}
+
+static int castle_versions_order_fill(struct castle_version *v, void *_order)
+{
+    struct castle_versions_order *order = _order;
+
+    if ((v->version < order->nr_versions) && (v->flags & CV_INITED_MASK))
+    {
+        order->orders[v->version].o_order = v->o_order;
+        order->orders[v->version].r_order = v->r_order;
+    }
+
+    return 0;
+}
+
+/**
+ * Builds and publishes a new castle_versions_order array, frees the old one.
+ *
+ * Leaves room for as many versions again as currently exist, so that new versions can be
+ * added to the array in place.
+ *
+ * Must not race with other castle_versions_process() calls.
+ */
+static void castle_versions_order_publish(void)
+{
+    struct castle_versions_order *order, *old_order;
+    c_ver_t nr_versions;
+
+    nr_versions = 2 * castle_version_max_get();
+    order = castle_vmalloc(sizeof(struct castle_versions_order) +
+                           nr_versions * sizeof(order->orders[0]));
+    if (order)
+    {
+        order->nr_versions = nr_versions;
+        memset(order->orders, 0xFF, nr_versions * sizeof(order->orders[0]));
+        read_lock_irq(&castle_versions_hash_lock);
+        __castle_versions_hash_iterate(castle_versions_order_fill, order);
+        read_unlock_irq(&castle_versions_hash_lock);
+    }
+    else
+        castle_printk(LOG_WARN, "Failed to allocate version order array for %u versions.\n",
+                nr_versions);
+
+    /* Publish NULL on failure, ancestry checks fall back to the hash then. */
+    old_order = castle_versions_order;
+    rcu_assign_pointer(castle_versions_order, order);
+    if (old_order)
+    {
+        /* Array is vmalloced, wait for readers rather than using call_rcu(). */
+        synchronize_rcu();
+        castle_vfree(old_order);
+    }
+}
+
 static int castle_versions_process(void)
 {
-    struct castle_version *v, *p, *n;
+    struct castle_version *v, *p;
     LIST_HEAD(sysfs_list);
-    c_ver_t id;
-    int children_first, ret;
+    c_ver_t nr_relabelled;
+    int relabel_all, ret;
     int err = 0;
 
     write_lock_irq(&castle_versions_hash_lock);
+    /* Versions loaded at init time are threaded in any order, label them all at the end. */
+    relabel_all = !castle_versions_labelled;
     /* Start processing elements from the init list, one at the time */
     while(!list_empty(&castle_versions_init_list))
     {
@@ -1553,6 +1824,16 @@ process_version:
         /* Insert v at the start of the sybling list. */
         castle_versions_insert(p, v);
 
+        /* New versions have the highest version number, and therefore always end up
+           as the first child.  Label them without disturbing the rest of the tree. */
+        if (!relabel_all)
+        {
+            if (p->first_child == v)
+                castle_versions_order_update(castle_versions_order_insert(v, &nr_relabelled));
+            else
+                relabel_all = 1;
+        }
+
         if (!test_bit(CV_DELETED_BIT, &v->flags))
             list_add(&v->init_list, &sysfs_list);
 
@@ -1561,58 +1842,21 @@ process_version:
     }
     debug("Done with tree init.\n");
 
-    /* Now, once the tree has been built, assign the order to the nodes
-       We assign two id's to each node. o_order is based on when is the node
-       visited first time in DFS, r_order when the node is visited last.
-       The code below implements non-recursive DFS (we don't have enough stack for
-       potentialy deep recursion */
-    v = __castle_versions_hash_get(0);
-    BUG_ON(!v);
-    BUG_ON(!(v->flags & CV_INITED_MASK));
-    BUG_ON(v->parent);
-    id = 0;
-    children_first = 1;
-
-    while(v)
+    if (relabel_all)
     {
-        debug("Looking at version: %d\n", v->version);
-        n = NULL;
-        /* If going down the tree select the next node in the following order
-           of preference:
-           - first child
-           - next sybling
-           - parent
-           On the way up select:
-           - next sybling
-           - parent
-           Note that the next sybling & parent cases are common to both cases.
-           Also, if the parent is selected, make sure 'children_first' is not set */
-        if(children_first)
-        {
-            v->o_order = ++id;
-            debug("Assigned version=%d o_order %d\n", v->version, v->o_order);
-            /* Only attempt to go to the child on the way down the tree */
-            n = v->first_child;
-            /* Special case for leaf nodes: r_order = o_order */
-            if(!n) v->r_order = v->o_order;
-        } else
-        {
-            /* Assign the r order first (the id of the last decendant) */
-            v->r_order = id;
-            debug("Assigned version=%d r_order %d\n", v->version, v->r_order);
-        }
-        children_first = 1;
-        if(!n)
-            n = v->next_sybling;
-        if(!n) {
-            n = v->parent;
-            children_first = 0;
-        }
-        if(n) debug("Next version is: %d\n", n->version);
-        v = n;
+        v = __castle_versions_hash_get(0);
+        BUG_ON(!v);
+        BUG_ON(!(v->flags & CV_INITED_MASK));
+        castle_versions_order_relabel_all(v);
+        castle_versions_labelled = 1;
     }
     write_unlock_irq(&castle_versions_hash_lock);
 
+    /* Rebuild the order array if it's stale, or if new versions don't fit in it. */
+    if (relabel_all || !castle_versions_order ||
+            (castle_versions_order->nr_versions < castle_version_max_get()))
+        castle_versions_order_publish();
+
     while(!list_empty(&sysfs_list))
     {
         v = list_first_entry(&sysfs_list,
@@ -1634,7 +1878,7 @@ process_version:
     return err;
 }
 
-int castle_version_is_ancestor(c_ver_t candidate, c_ver_t version)
+static int _castle_version_is_ancestor(c_ver_t candidate, c_ver_t version)
 {
     struct castle_version *c, *v;
     int ret;
@@ -1658,7 +1902,41 @@ int castle_version_is_ancestor(c_ver_t candidate, c_ver_t version)
     return ret;
 }
 
-int castle_version_compare(c_ver_t version1, c_ver_t version2)
+/**
+ * Is candidate an ancestor of version (or version itself)?
+ *
+ * Lock free, uses the castle_versions_order snapshot if both versions are in it.
+ */
+int castle_version_is_ancestor(c_ver_t candidate, c_ver_t version)
+{
+    struct castle_versions_order *order;
+    c_ver_t v_o_order, c_o_order, c_r_order;
+    unsigned seq;
+
+    rcu_read_lock();
+    order = rcu_dereference(castle_versions_order);
+    if (likely(order && (version < order->nr_versions) && (candidate < order->nr_versions)))
+    {
+        do {
+            seq = read_seqcount_begin(&castle_versions_order_seq);
+            v_o_order = order->orders[version].o_order;
+            c_o_order = order->orders[candidate].o_order;
+            c_r_order = order->orders[candidate].r_order;
+        } while (read_seqcount_retry(&castle_versions_order_seq, seq));
+        if (likely(!VERSION_INVAL(v_o_order) && !VERSION_INVAL(c_o_order)))
+        {
+            rcu_read_unlock();
+            /* c is an ancestor of v if v->o_order is in range c->o_order to c->r_order
+               inclusive */
+            return (v_o_order >= c_o_order) && (v_o_order <= c_r_order);
+        }
+    }
+    rcu_read_unlock();
+
+    return _castle_version_is_ancestor(candidate, version);
+}
+
+static int _castle_version_compare(c_ver_t version1, c_ver_t version2)
 {
     struct castle_version *v1, *v2;
     int ret;
@@ -1674,12 +1952,44 @@ int castle_version_compare(c_ver_t version1, c_ver_t version2)
     BUG_ON(!(v2->flags & CV_INITED_MASK));
     BUG_ON(VERSION_INVAL(v2->o_order));
 
-    ret = v1->o_order - v2->o_order;
+    /* Labels are sparse, compare rather than subtract to avoid overflows. */
+    ret = (v1->o_order > v2->o_order) - (v1->o_order < v2->o_order);
     read_unlock_irq(&castle_versions_hash_lock);
 
     return ret;
 }
 
+/**
+ * Compares versions in DFS order of the version tree.
+ *
+ * Lock free, uses the castle_versions_order snapshot if both versions are in it.
+ */
+int castle_version_compare(c_ver_t version1, c_ver_t version2)
+{
+    struct castle_versions_order *order;
+    c_ver_t o_order1, o_order2;
+    unsigned seq;
+
+    rcu_read_lock();
+    order = rcu_dereference(castle_versions_order);
+    if (likely(order && (version1 < order->nr_versions) && (version2 < order->nr_versions)))
+    {
+        do {
+            seq = read_seqcount_begin(&castle_versions_order_seq);
+            o_order1 = order->orders[version1].o_order;
+            o_order2 = order->orders[version2].o_order;
+        } while (read_seqcount_retry(&castle_versions_order_seq, seq));
+        if (likely(!VERSION_INVAL(o_order1) && !VERSION_INVAL(o_order2)))
+        {
+            rcu_read_unlock();
+            return (o_order1 > o_order2) - (o_order1 < o_order2);
+        }
+    }
+    rcu_read_unlock();
+
+    return _castle_version_compare(version1, version2);
+}
+
 /**
  * Initialise root version.
  */
@@ -1780,6 +2090,95 @@ out:
     return ret;
 }
 
+#ifdef CASTLE_PERF_DEBUG
+/**
+ * Checks that labels of the tree rooted at root nest, and follow the DFS order.
+ */
+static int castle_versions_order_check(struct castle_version *root)
+{
+    struct castle_version *v;
+
+    for (v = root; v; v = castle_versions_dfs_next(v, root))
+    {
+        if (v->o_order > v->r_order)
+            return -EINVAL;
+        if (v->parent && ((v->o_order <= v->parent->o_order) ||
+                          (v->r_order >  v->parent->r_order)))
+            return -EINVAL;
+        if (v->next_sybling && (v->next_sybling->o_order <= v->r_order))
+            return -EINVAL;
+    }
+
+    return 0;
+}
+
+/**
+ * Measures the cost of labelling nr new versions, on a private version tree.
+ *
+ * Mostly grows a chain of snapshots, with every 16th version (on average) cloned off
+ * a random older version.  Cost of the full relabel of the final tree (which is what
+ * castle_versions_process() used to do for every new version) is reported alongside.
+ */
+static void castle_versions_order_bench_run(c_ver_t nr)
+{
+    struct castle_version *vs, *v, *p;
+    struct timespec ts_start, ts_end;
+    c_ver_t i, nr_relabelled;
+    uint64_t relabels, relabelled, insert_ns, relabel_all_ns;
+    uint32_t seed = 1;
+
+    if (nr < 2)
+        return;
+    vs = castle_vmalloc(nr * sizeof(struct castle_version));
+    if (!vs)
+    {
+        castle_printk(LOG_WARN, "Failed to allocate %u versions for order benchmark.\n", nr);
+        return;
+    }
+
+    vs[0].version      = 0;
+    vs[0].parent       = NULL;
+    vs[0].first_child  = NULL;
+    vs[0].next_sybling = NULL;
+    castle_versions_order_relabel_all(&vs[0]);
+
+    relabels = relabelled = 0;
+    getnstimeofday(&ts_start);
+    for (i = 1; i < nr; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        p = ((seed >> 16) & 0xF) ? &vs[i-1] : &vs[(seed >> 8) % i];
+        v = &vs[i];
+        v->version      = i;
+        v->parent       = p;
+        v->first_child  = NULL;
+        v->next_sybling = NULL;
+        castle_versions_insert(p, v);
+        if (castle_versions_order_insert(v, &nr_relabelled) != v)
+        {
+            relabels++;
+            relabelled += nr_relabelled;
+        }
+    }
+    getnstimeofday(&ts_end);
+    insert_ns = timespec_to_ns(&ts_end) - timespec_to_ns(&ts_start);
+
+    if (castle_versions_order_check(&vs[0]))
+        castle_printk(LOG_ERROR, "Version order benchmark produced inconsistent labels.\n");
+
+    getnstimeofday(&ts_start);
+    castle_versions_order_relabel_all(&vs[0]);
+    getnstimeofday(&ts_end);
+    relabel_all_ns = timespec_to_ns(&ts_end) - timespec_to_ns(&ts_start);
+
+    castle_printk(LOG_PERF, "Version order benchmark: %u versions labelled in %llu ns "
+            "(%llu relabels, %llu versions relabelled), full relabel takes %llu ns.\n",
+            nr, insert_ns, relabels, relabelled, relabel_all_ns);
+
+    castle_vfree(vs);
+}
+#endif
+
 /***** Init/fini functions *****/
 int castle_versions_init(void)
 {
@@ -1821,6 +2220,11 @@ int castle_versions_init(void)
     }
     castle_versions_counts_hash_init();
 
+#ifdef CASTLE_PERF_DEBUG
+    if (castle_versions_order_bench > 0)
+        castle_versions_order_bench_run(castle_versions_order_bench);
+#endif
+
     return 0;
 
 err_out:
@@ -1835,6 +2239,14 @@ err_out:
 
 void castle_versions_fini(void)
 {
+    struct castle_versions_order *order = castle_versions_order;
+
+    rcu_assign_pointer(castle_versions_order, NULL);
+    if (order)
+    {
+        synchronize_rcu();
+        castle_vfree(order);
+    }
     castle_versions_hash_destroy();
     castle_versions_counts_hash_destroy();
     kmem_cache_destroy(castle_versions_cache);
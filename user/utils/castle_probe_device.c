@@ -14,7 +14,8 @@ static int castle_slave_superblock_validate(struct castle_slave_superblock_publi
     if(cs_sb->magic1 != CASTLE_SLAVE_MAGIC1) return -1;
     if(cs_sb->magic2 != CASTLE_SLAVE_MAGIC2) return -2;
     if(cs_sb->magic3 != CASTLE_SLAVE_MAGIC3) return -3;
-    if(cs_sb->version != CASTLE_SLAVE_VERSION) return -4;
+    if((cs_sb->version < CASTLE_SLAVE_VERSION_OLDEST) ||
+       (cs_sb->version > CASTLE_SLAVE_VERSION)) return -4;
 
     return 0;
 }